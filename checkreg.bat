@@ -2,8 +2,11 @@
 set KEYS=^
   hkcr\typelib\{b2137105-d2ea-422c-9e89-3b02645d2078}^
   hkcr\interface\{c981d429-dd12-4e4c-b23c-a53172fcaede}^
+  hkcr\interface\{3f0e5c52-8d0c-4c4b-a7f2-6b1d94e8c0a3}^
   hkcr\interface\{06c56a36-5f16-4580-9a48-a6b828681d4a}^
   hkcr\interface\{aac80615-1103-4539-a5b0-02b6440cd1cc}^
+  hkcr\interface\{7226ee3f-ee81-42c7-855c-c07d69158dbc}^
+  hkcr\interface\{5bc4f3c6-b008-44c1-9359-fb479f318e58}^
   hkcr\clsid\{16C324E8-4B82-4648-81A0-E76E3639005E}^
   hkcr\clsid\{766F63F7-E338-4CC4-99C3-19428426E912}^
   hkcr\clsid\{8C88319B-6BE3-4D7C-8101-93E50DAF96AE}^
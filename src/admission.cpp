@@ -0,0 +1,191 @@
+#include "admission.h"
+#include "guid.h"
+#include "log.h"
+#include <algorithm>
+#include <shlwapi.h>
+
+// Interfaces that COM calls to manage the references to remote objects
+constexpr GUID kIID_IRemUnknown =
+    GuidFromString("{00000131-0000-0000-C000-000000000046}");
+constexpr GUID kIID_IRemUnknown2 =
+    GuidFromString("{00000143-0000-0000-C000-000000000046}");
+
+// Both filters share the default behavior of COM where they don't decide
+class MessageFilterBase : public IMessageFilter {
+  ULONG mRef;
+
+public:
+  MessageFilterBase() : mRef(1) {}
+  virtual ~MessageFilterBase() = default;
+
+  // IUnknown
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppv) {
+    const QITAB QITable[] = {
+        QITABENT(MessageFilterBase, IMessageFilter),
+        {0},
+    };
+    return ::QISearch(this, QITable, riid, ppv);
+  }
+  STDMETHODIMP_(ULONG) AddRef() { return ::InterlockedIncrement(&mRef); }
+  STDMETHODIMP_(ULONG) Release() {
+    auto cref = ::InterlockedDecrement(&mRef);
+    if (cref == 0) {
+      delete this;
+    }
+    return cref;
+  }
+
+  // IMessageFilter
+  STDMETHODIMP_(DWORD)
+  HandleInComingCall(DWORD, HTASK, DWORD, LPINTERFACEINFO) {
+    return SERVERCALL_ISHANDLED;
+  }
+  STDMETHODIMP_(DWORD) RetryRejectedCall(HTASK, DWORD, DWORD) {
+    return RetryBackoff::kGiveUp;
+  }
+  STDMETHODIMP_(DWORD) MessagePending(HTASK, DWORD, DWORD) {
+    return PENDINGMSG_WAITDEFPROCESS;
+  }
+};
+
+class AdmissionFilter : public MessageFilterBase {
+  CallAdmission *mAdmission;
+
+public:
+  explicit AdmissionFilter(CallAdmission *admission)
+      : mAdmission(admission) {}
+
+  STDMETHODIMP_(DWORD)
+  HandleInComingCall(DWORD dwCallType, HTASK, DWORD,
+                     LPINTERFACEINFO lpInterfaceInfo) {
+    const bool topLevel = dwCallType == CALLTYPE_TOPLEVEL ||
+                          dwCallType == CALLTYPE_TOPLEVEL_CALLPENDING;
+    if (!mAdmission->Rejecting() || !topLevel) {
+      return SERVERCALL_ISHANDLED;
+    }
+    if (lpInterfaceInfo && (lpInterfaceInfo->iid == IID_IUnknown ||
+                            lpInterfaceInfo->iid == kIID_IRemUnknown ||
+                            lpInterfaceInfo->iid == kIID_IRemUnknown2)) {
+      return SERVERCALL_ISHANDLED;
+    }
+    mAdmission->CountRejected();
+    return SERVERCALL_RETRYLATER;
+  }
+};
+
+class BackoffFilter : public MessageFilterBase {
+  RetryBackoff mBackoff;
+
+public:
+  explicit BackoffFilter(const RetryBackoff &backoff) : mBackoff(backoff) {}
+
+  STDMETHODIMP_(DWORD)
+  RetryRejectedCall(HTASK, DWORD dwTickCount, DWORD dwRejectType) {
+    if (dwRejectType != SERVERCALL_RETRYLATER) {
+      return RetryBackoff::kGiveUp;
+    }
+    DWORD delay = mBackoff.Delay(dwTickCount);
+    if (delay == RetryBackoff::kGiveUp) {
+      return delay;
+    }
+    // COM retries at once when told less than 100 ms, so a shorter delay is
+    // waited here
+    if (delay < 100) {
+      ::Sleep(delay);
+      return 0;
+    }
+    return delay;
+  }
+};
+
+CallAdmission::CallAdmission(size_t maxQueuedCalls)
+    : mMaxQueuedCalls(maxQueuedCalls), mDepth(0), mRejected(0),
+      mRejecting(false), mPrevious(nullptr), mInstalled(false) {}
+
+HRESULT CallAdmission::Install() {
+  if (mInstalled) {
+    return S_FALSE;
+  }
+  IMessageFilter *filter = new AdmissionFilter(this);
+  HRESULT hr = ::CoRegisterMessageFilter(filter, &mPrevious);
+  filter->Release();
+  if (FAILED(hr)) {
+    Log(L"CoRegisterMessageFilter failed - %08lx\n", hr);
+    return hr;
+  }
+  mInstalled = true;
+  return S_OK;
+}
+
+void CallAdmission::Uninstall() {
+  if (!mInstalled) {
+    return;
+  }
+  IMessageFilter *filter = nullptr;
+  HRESULT hr = ::CoRegisterMessageFilter(mPrevious, &filter);
+  if (FAILED(hr)) {
+    Log(L"CoRegisterMessageFilter failed - %08lx\n", hr);
+  }
+  if (filter) {
+    filter->Release();
+  }
+  if (mPrevious) {
+    mPrevious->Release();
+    mPrevious = nullptr;
+  }
+  mInstalled = false;
+}
+
+// A message dispatched from here may pump messages again, e.g. by making an
+// outgoing call, so nothing is held across the dispatch
+void CallAdmission::Dispatch(const MSG &msg, bool reject) {
+  bool rejecting = mRejecting;
+  mRejecting = reject;
+  ::TranslateMessage(&msg);
+  ::DispatchMessageW(&msg);
+  mRejecting = rejecting;
+}
+
+size_t CallAdmission::Pump() {
+  size_t count = 0;
+  MSG msg;
+  for (;;) {
+    while (::PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE)) {
+      if (!Enabled() || mBacklog.size() < mMaxQueuedCalls) {
+        mBacklog.push_back(msg);
+        mDepth.store(static_cast<LONG>(mBacklog.size()),
+                     std::memory_order_relaxed);
+      } else {
+        Dispatch(msg, /*reject*/ true);
+        ++count;
+      }
+    }
+    if (mBacklog.empty()) {
+      return count;
+    }
+
+    msg = mBacklog.front();
+    mBacklog.pop_front();
+    mDepth.store(static_cast<LONG>(mBacklog.size()),
+                 std::memory_order_relaxed);
+    Dispatch(msg, /*reject*/ false);
+    ++count;
+  }
+}
+
+RetryBackoff::RetryBackoff(DWORD initialMs, DWORD maxMs, DWORD giveUpMs)
+    : mInitialMs(initialMs), mMaxMs(std::max(initialMs, maxMs)),
+      mGiveUpMs(giveUpMs), mRandom(::GetCurrentThreadId()) {}
+
+DWORD RetryBackoff::Delay(DWORD elapsedMs) {
+  if (elapsedMs >= mGiveUpMs) {
+    return kGiveUp;
+  }
+  DWORD delay = std::min(std::max(elapsedMs, mInitialMs), mMaxMs);
+  std::uniform_int_distribution<DWORD> jitter(delay / 2, delay);
+  return jitter(mRandom);
+}
+
+IMessageFilter *CreateBackoffFilter(const RetryBackoff &backoff) {
+  return new BackoffFilter(backoff);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <windows.h>
+
+// Admission control of an STA.  Instead of leaving the messages of the
+// thread in its queue, which grows without limit under a flood of calls,
+// Pump takes them into a backlog of at most `maxQueuedCalls` and dispatches
+// them from there in order.  A message arriving at a full backlog is
+// dispatched at once instead, and the message filter set by Install rejects
+// the call it carries with SERVERCALL_RETRYLATER, so the caller hears right
+// away that it should come back later rather than waiting behind the backlog.
+//
+// Every message counts against the depth, though under load nearly all of
+// them are calls.  Calls to IUnknown, which include the releases made by
+// COM, and calls nested in an outgoing call are never rejected.
+class CallAdmission {
+  size_t mMaxQueuedCalls;
+  std::deque<MSG> mBacklog;
+  std::atomic<LONG> mDepth;
+  std::atomic<uint64_t> mRejected;
+  bool mRejecting; // While a message arriving at a full backlog is dispatched
+  IMessageFilter *mPrevious;
+  bool mInstalled;
+
+  void Dispatch(const MSG &msg, bool reject);
+
+public:
+  // Zero `maxQueuedCalls` admits everything
+  explicit CallAdmission(size_t maxQueuedCalls);
+
+  CallAdmission(const CallAdmission &) = delete;
+  CallAdmission &operator=(const CallAdmission &) = delete;
+
+  bool Enabled() const { return mMaxQueuedCalls > 0; }
+  LONG Depth() const { return mDepth.load(std::memory_order_relaxed); }
+  uint64_t Rejected() const {
+    return mRejected.load(std::memory_order_relaxed);
+  }
+
+  // Sets and removes the message filter of the calling thread, which must be
+  // the STA, around the time it pumps messages with this
+  HRESULT Install();
+  void Uninstall();
+
+  // Takes the waiting messages and dispatches the backlog, taking the new
+  // messages in between, until both are empty.  Called by
+  // ThreadMsgWaitForSingleObject when there are messages.  Returns the
+  // number of messages dispatched.
+  size_t Pump();
+
+  // For the message filter
+  bool Rejecting() const { return mRejecting; }
+  void CountRejected() { mRejected.fetch_add(1, std::memory_order_relaxed); }
+};
+
+// Backoff of a client whose calls are rejected with retry-later.  The delay
+// is about the time the call has been retried so far, so it doubles with
+// each retry between the bounds, and is randomized so that clients rejected
+// together don't come back together.
+class RetryBackoff {
+  DWORD mInitialMs;
+  DWORD mMaxMs;
+  DWORD mGiveUpMs;
+  std::minstd_rand mRandom;
+
+public:
+  static constexpr DWORD kGiveUp = MAXDWORD;
+
+  RetryBackoff(DWORD initialMs = 1, DWORD maxMs = 100, DWORD giveUpMs = 10000);
+
+  // Milliseconds to wait before retrying a call first rejected `elapsedMs`
+  // ago, or kGiveUp
+  DWORD Delay(DWORD elapsedMs);
+};
+
+// Message filter for an STA client, which retries the calls rejected with
+// retry-later as `backoff` says.  It's registered with CoRegisterMessageFilter.
+IMessageFilter *CreateBackoffFilter(const RetryBackoff &backoff);
+
+// Makes `call` until it isn't rejected with retry-later, as `backoff` says.
+// For MTA clients, which have no message filter.
+template <typename F> HRESULT CallWithBackoff(RetryBackoff &backoff, F call) {
+  const DWORD start = ::GetTickCount();
+  for (;;) {
+    HRESULT hr = call();
+    if (hr != RPC_E_SERVERCALL_RETRYLATER) {
+      return hr;
+    }
+    DWORD delay = backoff.Delay(::GetTickCount() - start);
+    if (delay == RetryBackoff::kGiveUp) {
+      return hr;
+    }
+    ::Sleep(delay);
+  }
+}
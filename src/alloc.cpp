@@ -0,0 +1,188 @@
+#include "alloc.h"
+#include <mutex>
+#include <new>
+
+OutParamStats gOutParamStats;
+
+struct PoolFreeBlock {
+  PoolFreeBlock *mNext;
+};
+
+struct PoolThreadCache;
+
+// Precedes every block.  16 bytes to keep the user area 16-byte aligned.
+struct alignas(16) PoolBlockHeader {
+  PoolThreadCache *mOwner; // nullptr if the block doesn't belong to any cache
+  int mClass;              // kClasses if the block came directly from the heap
+};
+
+static void Bump(std::atomic<uint64_t> &counter, uint64_t delta = 1) {
+  // Only the owner thread writes, so no interlocked operation is needed
+  counter.store(counter.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+}
+
+struct PoolThreadCache {
+  PoolFreeBlock *mFree[SizeClassPool::kClasses];
+  int mFreeCount[SizeClassPool::kClasses];
+  std::atomic<PoolFreeBlock *> mRemote; // Freed by other threads
+  std::atomic<bool> mInUse;
+  PoolThreadCache *mNextCache;
+
+  std::atomic<uint64_t> mAllocs;
+  std::atomic<uint64_t> mBytes;
+  std::atomic<uint64_t> mPoolHits;
+  std::atomic<uint64_t> mHeapAllocs;
+
+  void PushLocal(PoolFreeBlock *block, int cls) {
+    if (mFreeCount[cls] >= SizeClassPool::kMaxFreePerClass) {
+      ::operator delete(reinterpret_cast<PoolBlockHeader *>(block) - 1);
+      return;
+    }
+    block->mNext = mFree[cls];
+    mFree[cls] = block;
+    ++mFreeCount[cls];
+  }
+
+  void PushRemote(PoolFreeBlock *block) {
+    PoolFreeBlock *head = mRemote.load(std::memory_order_relaxed);
+    do {
+      block->mNext = head;
+    } while (!mRemote.compare_exchange_weak(head, block,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+  }
+
+  void CollectRemote() {
+    PoolFreeBlock *block = mRemote.exchange(nullptr, std::memory_order_acquire);
+    while (block) {
+      PoolFreeBlock *next = block->mNext;
+      PoolBlockHeader *header = reinterpret_cast<PoolBlockHeader *>(block) - 1;
+      PushLocal(block, header->mClass);
+      block = next;
+    }
+  }
+};
+
+// Caches are never destroyed.  When a thread exits, its cache is released
+// and adopted by the next thread, together with any blocks still in flight.
+static std::mutex gCachesLock;
+static PoolThreadCache *gCaches = nullptr;
+
+static PoolThreadCache *AcquireCache() {
+  std::lock_guard<std::mutex> lock(gCachesLock);
+  for (PoolThreadCache *cache = gCaches; cache; cache = cache->mNextCache) {
+    if (!cache->mInUse.load(std::memory_order_relaxed)) {
+      cache->mInUse.store(true, std::memory_order_relaxed);
+      return cache;
+    }
+  }
+
+  PoolThreadCache *cache = new (std::nothrow) PoolThreadCache{};
+  if (cache) {
+    cache->mInUse.store(true, std::memory_order_relaxed);
+    cache->mNextCache = gCaches;
+    gCaches = cache;
+  }
+  return cache;
+}
+
+struct PoolCacheHolder {
+  PoolThreadCache *mCache;
+
+  PoolCacheHolder() : mCache(AcquireCache()) {}
+  ~PoolCacheHolder() {
+    if (mCache) {
+      std::lock_guard<std::mutex> lock(gCachesLock);
+      mCache->mInUse.store(false, std::memory_order_relaxed);
+      mCache = nullptr;
+    }
+  }
+};
+
+static thread_local PoolCacheHolder tCache;
+
+static int SizeClassOf(size_t size) {
+  int cls = 0;
+  for (size_t block = SizeClassPool::kMinBlock; block < size; block <<= 1) {
+    ++cls;
+  }
+  return cls;
+}
+
+void *SizeClassPool::Allocate(size_t size) {
+  PoolThreadCache *cache = tCache.mCache;
+  int cls = size <= kMaxBlock ? SizeClassOf(size) : kClasses;
+  if (cache) {
+    Bump(cache->mAllocs);
+    Bump(cache->mBytes, size);
+    if (cls < kClasses) {
+      if (!cache->mFree[cls]) {
+        cache->CollectRemote();
+      }
+      if (PoolFreeBlock *block = cache->mFree[cls]) {
+        cache->mFree[cls] = block->mNext;
+        --cache->mFreeCount[cls];
+        Bump(cache->mPoolHits);
+        return block;
+      }
+    }
+    Bump(cache->mHeapAllocs);
+  } else {
+    // The thread is exiting.  Don't pool the block.
+    cls = kClasses;
+  }
+
+  size_t blockSize = cls < kClasses ? kMinBlock << cls : size;
+  void *raw = ::operator new(sizeof(PoolBlockHeader) + blockSize, std::nothrow);
+  if (!raw) {
+    return nullptr;
+  }
+  PoolBlockHeader *header =
+      new (raw) PoolBlockHeader{cls < kClasses ? cache : nullptr, cls};
+  return header + 1;
+}
+
+void SizeClassPool::Free(void *p) {
+  if (!p) {
+    return;
+  }
+
+  PoolBlockHeader *header = reinterpret_cast<PoolBlockHeader *>(p) - 1;
+  if (!header->mOwner) {
+    ::operator delete(header);
+    return;
+  }
+
+  PoolFreeBlock *block = reinterpret_cast<PoolFreeBlock *>(p);
+  if (header->mOwner == tCache.mCache) {
+    header->mOwner->PushLocal(block, header->mClass);
+  } else {
+    header->mOwner->PushRemote(block);
+  }
+}
+
+SizeClassPool::Stats SizeClassPool::GetStats() {
+  Stats stats = {};
+  std::lock_guard<std::mutex> lock(gCachesLock);
+  for (PoolThreadCache *cache = gCaches; cache; cache = cache->mNextCache) {
+    stats.mAllocs += cache->mAllocs.load(std::memory_order_relaxed);
+    stats.mBytes += cache->mBytes.load(std::memory_order_relaxed);
+    stats.mPoolHits += cache->mPoolHits.load(std::memory_order_relaxed);
+    stats.mHeapAllocs += cache->mHeapAllocs.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+void *AllocOutParam(size_t bytes) {
+  gOutParamStats.mTaskMemAllocs.fetch_add(1, std::memory_order_relaxed);
+  gOutParamStats.mTaskMemBytes.fetch_add(bytes, std::memory_order_relaxed);
+  return ::CoTaskMemAlloc(bytes);
+}
+
+BSTR AllocOutBStr(const wchar_t *str, UINT length) {
+  gOutParamStats.mBStrAllocs.fetch_add(1, std::memory_order_relaxed);
+  gOutParamStats.mBStrBytes.fetch_add(length * sizeof(wchar_t),
+                                      std::memory_order_relaxed);
+  return ::SysAllocStringLen(str, length);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <windows.h>
+
+// Per-thread free lists of small blocks in power-of-two size classes.  A
+// block can be freed on any thread.  Blocks freed on a thread other than the
+// one that allocated them go back to the owner through a lock-free list, and
+// the owner collects them when its own free list runs dry.
+class SizeClassPool {
+public:
+  static constexpr size_t kMinBlock = 16;
+  static constexpr size_t kMaxBlock = 4096;
+  static constexpr int kClasses = 9; // 16, 32, ..., 4096
+  static constexpr int kMaxFreePerClass = 256;
+
+  struct Stats {
+    uint64_t mAllocs;     // Calls to Allocate
+    uint64_t mBytes;      // Bytes requested
+    uint64_t mPoolHits;   // Served from a free list
+    uint64_t mHeapAllocs; // Served from the general heap
+  };
+
+  static void *Allocate(size_t size);
+  static void Free(void *p);
+
+  // Sum of all threads
+  static Stats GetStats();
+};
+
+// Memory handed out through [out] parameters is owned by the caller once the
+// call returns, and the caller or the stub frees it with CoTaskMemFree or
+// SysFreeString.  It can't come from SizeClassPool, but it's counted so that
+// the cost per call stays visible.
+struct OutParamStats {
+  std::atomic<uint64_t> mTaskMemAllocs;
+  std::atomic<uint64_t> mTaskMemBytes;
+  std::atomic<uint64_t> mBStrAllocs;
+  std::atomic<uint64_t> mBStrBytes;
+};
+
+extern OutParamStats gOutParamStats;
+
+void *AllocOutParam(size_t bytes);
+BSTR AllocOutBStr(const wchar_t *str, UINT length);
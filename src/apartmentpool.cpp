@@ -0,0 +1,230 @@
+#include "apartmentpool.h"
+#include "log.h"
+#include "stats.h"
+#include <algorithm>
+#include <atlbase.h>
+#include <shlwapi.h>
+
+PoolApartment::PoolApartment(HANDLE stop, size_t maxQueuedCalls)
+    : mQueue(std::make_shared<ApartmentQueue>()), mAdmission(maxQueuedCalls),
+      mCallsInProgress(0), mThreadId(0),
+      mThread(ComThread<COINIT_APARTMENTTHREADED>, [this, stop]() {
+        mThreadId.store(::GetCurrentThreadId(), std::memory_order_release);
+        SetThreadCallCounter(&mCallsInProgress);
+        if (mAdmission.Enabled() && SUCCEEDED(mAdmission.Install())) {
+          ThreadMsgWaitForSingleObject(stop, INFINITE, mQueue.get(),
+                                       &mAdmission);
+          mAdmission.Uninstall();
+        } else {
+          ThreadMsgWaitForSingleObject(stop, INFINITE, mQueue.get());
+        }
+        mQueue->Close();
+        SetThreadCallCounter(nullptr);
+      }) {}
+
+PoolApartment::~PoolApartment() { mThread.join(); }
+
+bool ActivationGate::Enter() {
+  std::lock_guard<std::mutex> lock(mLock);
+  if (mClosed) {
+    return false;
+  }
+  ++mActive;
+  return true;
+}
+
+void ActivationGate::Leave() {
+  std::lock_guard<std::mutex> lock(mLock);
+  if (--mActive == 0) {
+    mIdle.notify_all();
+  }
+}
+
+void ActivationGate::Close() {
+  std::unique_lock<std::mutex> lock(mLock);
+  mClosed = true;
+  mIdle.wait(lock, [this]() { return mActive == 0; });
+}
+
+ApartmentPool::ApartmentPool(size_t count, ActivationPolicy policy,
+                             size_t maxQueuedCalls)
+    : mStop(::CreateEventW(/*lpEventAttributes*/ nullptr,
+                           /*bManualReset*/ TRUE,
+                           /*bInitialState*/ FALSE,
+                           /*lpName*/ nullptr)),
+      mGate(std::make_shared<ActivationGate>()), mPolicy(policy), mNext(0) {
+  if (!mStop) {
+    Log(L"CreateEventW failed - %08lx\n", ::GetLastError());
+    return;
+  }
+  count = std::min(std::max(count, size_t(1)), kMaxApartments);
+  for (size_t i = 0; i < count; ++i) {
+    mApartments.emplace_back(new PoolApartment(mStop.get(), maxQueuedCalls));
+  }
+}
+
+ApartmentPool::~ApartmentPool() {
+  // An activation waits for a task on one of the threads, so the threads
+  // keep running until the last one is done
+  mGate->Close();
+  if (mStop) {
+    ::SetEvent(mStop.get());
+  }
+  mApartments.clear();
+}
+
+size_t ApartmentPool::Pick() {
+  const uint32_t start = mNext.fetch_add(1, std::memory_order_relaxed);
+  const size_t count = mApartments.size();
+  size_t picked = start % count;
+  if (mPolicy != kActivateLeastLoaded) {
+    return picked;
+  }
+
+  // The scan starts where round-robin would go, so that apartments under
+  // the same load still take turns
+  LONG least = mApartments[picked]->Load();
+  size_t skipped = 0;
+  for (size_t i = 1; i < count && least > 0; ++i) {
+    size_t candidate = (start + i) % count;
+    LONG load = mApartments[candidate]->Load();
+    if (load < least) {
+      least = load;
+      picked = candidate;
+      skipped = i;
+    }
+  }
+
+  // Round-robin resumes after the apartment picked.  Otherwise every turn of
+  // a busy apartment would go to the one after it.  If another activation
+  // moved on meanwhile, its order is kept.
+  if (skipped) {
+    uint32_t expected = start + 1;
+    mNext.compare_exchange_strong(expected,
+                                  start + static_cast<uint32_t>(skipped) + 1,
+                                  std::memory_order_relaxed);
+  }
+  return picked;
+}
+
+HRESULT ApartmentPool::CreateInstance(IClassFactory *factory, REFIID riid,
+                                      void **ppv) {
+  if (!ppv) {
+    return E_POINTER;
+  }
+  *ppv = nullptr;
+  if (mApartments.empty()) {
+    return CO_E_SERVER_STOPPING;
+  }
+
+  PoolApartment &apartment = *mApartments[Pick()];
+  if (apartment.ThreadId() == ::GetCurrentThreadId()) {
+    // Waiting for our own queue would never end
+    return factory->CreateInstance(nullptr, riid, ppv);
+  }
+
+  std::unique_ptr<HANDLE, HandleCloser> done(::CreateEventW(
+      /*lpEventAttributes*/ nullptr,
+      /*bManualReset*/ TRUE,
+      /*bInitialState*/ FALSE,
+      /*lpName*/ nullptr));
+  if (!done) {
+    return HRESULT_FROM_WIN32(::GetLastError());
+  }
+
+  HRESULT hr = E_UNEXPECTED;
+  IStream *stream = nullptr;
+  HANDLE doneEvent = done.get();
+  bool posted = apartment.Post([factory, &riid, &hr, &stream, doneEvent]() {
+    CComPtr<IUnknown> object;
+    hr = factory->CreateInstance(nullptr, riid,
+                                 reinterpret_cast<void **>(&object));
+    if (SUCCEEDED(hr)) {
+      hr = ::CoMarshalInterThreadInterfaceInStream(riid, object, &stream);
+    }
+    ::SetEvent(doneEvent);
+  });
+  if (!posted) {
+    return CO_E_SERVER_STOPPING;
+  }
+
+  // The task refers to locals, so there is no way out but its completion.
+  // An STA caller keeps dispatching its own calls meanwhile.
+  DWORD index;
+  if (FAILED(::CoWaitForMultipleHandles(0, INFINITE, 1, &doneEvent, &index))) {
+    ::WaitForSingleObject(doneEvent, INFINITE);
+  }
+
+  if (FAILED(hr)) {
+    return hr;
+  }
+  return ::CoGetInterfaceAndReleaseStream(stream, riid, ppv);
+}
+
+class PooledClassFactory : public IClassFactory {
+  ULONG mRef;
+  ApartmentPool *mPool; // Only used inside mGate
+  std::shared_ptr<ActivationGate> mGate;
+  CComPtr<IClassFactory> mInner;
+
+public:
+  PooledClassFactory(ApartmentPool *pool, IClassFactory *inner);
+  virtual ~PooledClassFactory() = default;
+
+  // IUnknown
+  STDMETHODIMP QueryInterface(REFIID riid, void **ppv);
+  STDMETHODIMP_(ULONG) AddRef();
+  STDMETHODIMP_(ULONG) Release();
+
+  // IClassFactory
+  STDMETHODIMP CreateInstance(IUnknown *pUnkOuter, REFIID riid, void **ppv);
+  STDMETHODIMP LockServer(BOOL fLock);
+};
+
+PooledClassFactory::PooledClassFactory(ApartmentPool *pool,
+                                       IClassFactory *inner)
+    : mRef(1), mPool(pool), mGate(pool->Gate()), mInner(inner) {}
+
+STDMETHODIMP PooledClassFactory::QueryInterface(REFIID riid, void **ppv) {
+  const QITAB QITable[] = {
+      QITABENT(PooledClassFactory, IClassFactory),
+      {0},
+  };
+  return ::QISearch(this, QITable, riid, ppv);
+}
+
+STDMETHODIMP_(ULONG) PooledClassFactory::AddRef() {
+  return ::InterlockedIncrement(&mRef);
+}
+
+STDMETHODIMP_(ULONG) PooledClassFactory::Release() {
+  auto cref = ::InterlockedDecrement(&mRef);
+  if (cref == 0) {
+    delete this;
+  }
+  return cref;
+}
+
+STDMETHODIMP PooledClassFactory::CreateInstance(IUnknown *pUnkOuter,
+                                                REFIID riid, void **ppv) {
+  if (pUnkOuter) {
+    return CLASS_E_NOAGGREGATION;
+  }
+  if (!mGate->Enter()) {
+    if (ppv) {
+      *ppv = nullptr;
+    }
+    return CO_E_SERVER_STOPPING;
+  }
+  HRESULT hr = mPool->CreateInstance(mInner, riid, ppv);
+  mGate->Leave();
+  return hr;
+}
+
+STDMETHODIMP PooledClassFactory::LockServer(BOOL fLock) {
+  return mInner->LockServer(fLock);
+}
+
+IUnknown *CreatePooledFactory(ApartmentPool *pool, IClassFactory *inner) {
+  return new PooledClassFactory(pool, inner);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "admission.h"
+#include "shared.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+enum ActivationPolicy {
+  kActivateRoundRobin,
+  // The apartment with the fewest queued tasks and calls in progress
+  kActivateLeastLoaded,
+};
+
+// One STA thread of an ApartmentPool.  It runs until the stop event of the
+// pool is set, and runs the tasks posted to it in between incoming calls.
+// Its queue is closed when it stops, and may outlive it in the threads that
+// hold it.
+// With a non-zero `maxQueuedCalls`, the calls beyond that many waiting are
+// rejected with retry-later, as CallAdmission describes.
+class PoolApartment {
+  std::shared_ptr<ApartmentQueue> mQueue;
+  CallAdmission mAdmission;
+  std::atomic<LONG> mCallsInProgress;
+  std::atomic<DWORD> mThreadId;
+  std::thread mThread;
+
+public:
+  PoolApartment(HANDLE stop, size_t maxQueuedCalls);
+  ~PoolApartment();
+
+  PoolApartment(const PoolApartment &) = delete;
+  PoolApartment &operator=(const PoolApartment &) = delete;
+
+  DWORD ThreadId() const { return mThreadId.load(std::memory_order_acquire); }
+
+  // Tasks and admitted calls waiting to run plus the MainObject calls being
+  // dispatched
+  LONG Load() const {
+    return mQueue->Depth() + mAdmission.Depth() +
+           mCallsInProgress.load(std::memory_order_relaxed);
+  }
+
+  uint64_t RejectedCalls() const { return mAdmission.Rejected(); }
+  const WaitCounters &Counters() const { return mQueue->Counters(); }
+
+  bool Post(std::function<void()> task) {
+    return mQueue->Post(std::move(task));
+  }
+};
+
+// Counts the activations in progress through a pool.  The pool closes it
+// before stopping its threads, and the class factories share it so that a
+// call arriving after that fails instead of using the pool.
+class ActivationGate {
+  std::mutex mLock;
+  std::condition_variable mIdle;
+  size_t mActive;
+  bool mClosed;
+
+public:
+  ActivationGate() : mActive(0), mClosed(false) {}
+
+  // False once closed.  Otherwise the activation counts until Leave.
+  bool Enter();
+  void Leave();
+
+  // Fails every Enter from now on, and waits for the activations counted
+  void Close();
+};
+
+// A fixed set of STA threads that objects of a class are spread over.  Each
+// activation creates the object in the apartment picked by the policy, and
+// the object stays there, so its calls are serialized with the calls of the
+// other objects of that apartment only.
+class ApartmentPool {
+  std::unique_ptr<HANDLE, HandleCloser> mStop;
+  std::shared_ptr<ActivationGate> mGate;
+  std::vector<std::unique_ptr<PoolApartment>> mApartments;
+  ActivationPolicy mPolicy;
+  std::atomic<uint32_t> mNext;
+
+public:
+  static constexpr size_t kMaxApartments = 64;
+
+  // `count` is clamped to 1..kMaxApartments.  `maxQueuedCalls` is the
+  // admission limit of each apartment, and zero admits everything.
+  ApartmentPool(size_t count, ActivationPolicy policy,
+                size_t maxQueuedCalls = 0);
+  // Waits for the activations in progress through the gate, then stops and
+  // joins the threads.  The objects of the pool must have been released.
+  ~ApartmentPool();
+
+  ApartmentPool(const ApartmentPool &) = delete;
+  ApartmentPool &operator=(const ApartmentPool &) = delete;
+
+  size_t Size() const { return mApartments.size(); }
+  const std::shared_ptr<ActivationGate> &Gate() const { return mGate; }
+  PoolApartment &Apartment(size_t index) { return *mApartments[index]; }
+
+  // Index of the apartment that the next activation goes to
+  size_t Pick();
+
+  // Creates an object with `factory` in the next apartment, and returns a
+  // proxy to it unless the caller is that apartment.  The factory must be
+  // callable from any thread.  A caller that may race with the destructor
+  // must be inside the gate.
+  HRESULT CreateInstance(IClassFactory *factory, REFIID riid, void **ppv);
+};
+
+// Class factory that forwards activations to `inner` through `pool`, inside
+// the gate of the pool.  The factory may outlive the pool, and activations
+// fail with CO_E_SERVER_STOPPING once the pool is being destroyed.
+IUnknown *CreatePooledFactory(ApartmentPool *pool, IClassFactory *inner);
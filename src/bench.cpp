@@ -0,0 +1,1705 @@
+#include "admission.h"
+#include "alloc.h"
+#include "apartmentpool.h"
+#include "bench.h"
+#include "chunkstream.h"
+#include "coclient.h"
+#include "codec.h"
+#include "comthreadpool.h"
+#include "guid.h"
+#include "interfaces.h"
+#include "log.h"
+#include "manifest.h"
+#include "marshalable.h"
+#include "regutils.h"
+#include "shared.h"
+#include "sharedsection.h"
+#include "shmchannel.h"
+#include "stats.h"
+#include "typelib.h"
+#include "utf16.h"
+#include "waitengine.h"
+#include "gtest/gtest.h"
+#include <atlbase.h>
+#include <atlsafe.h>
+#include <atomic>
+#include <cstdarg>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <strsafe.h>
+#include <thread>
+
+// Log output goes to the console.  It's flushed after each test so that it
+// stays next to the test it came from.
+class ConsoleLog : public ::testing::EmptyTestEventListener {
+public:
+  ConsoleLog() { SetLogSink(new ConsoleLogSink); }
+
+  void OnTestEnd(const ::testing::TestInfo &) override { LogFlush(); }
+
+  void OnTestProgramEnd(const ::testing::UnitTest &) override {
+    // Nothing may write to stdout while the C runtime shuts down
+    LogFlush();
+    SetLogSink(nullptr);
+  }
+};
+
+static const bool gConsoleLog =
+    (::testing::UnitTest::GetInstance()->listeners().Append(new ConsoleLog),
+     true);
+
+IUnknown *CreateFactory();
+
+using Task = std::function<void()>;
+
+constexpr int kPingPongIterations = 20000;
+constexpr int kBurstIterations = 200000;
+
+// Runs the two measurements against an apartment thread that accepts tasks
+// via `post`.  Ping-pong measures enqueue-to-dispatch latency of one task at a
+// time.  Burst measures throughput when producers never wait.
+static void MeasureDispatch(const wchar_t *name,
+                            const std::function<void(Task)> &post) {
+  std::unique_ptr<HANDLE, HandleCloser> ack(
+      ::CreateEventW(nullptr, /*bManualReset*/ FALSE, FALSE, nullptr));
+  ASSERT_TRUE(ack);
+
+  LatencyStats pingpong(kPingPongIterations);
+  auto start = BenchClock::now();
+  for (int i = 0; i < kPingPongIterations; ++i) {
+    auto posted = BenchClock::now();
+    post([&pingpong, posted, &ack]() {
+      pingpong.Add(BenchClock::now() - posted);
+      ::SetEvent(ack.get());
+    });
+    ::WaitForSingleObject(ack.get(), INFINITE);
+  }
+  std::wstring label(name);
+  pingpong.Report((label + L" ping-pong").c_str(), BenchClock::now() - start);
+
+  LatencyStats burst(kBurstIterations);
+  start = BenchClock::now();
+  for (int i = 0; i < kBurstIterations; ++i) {
+    auto posted = BenchClock::now();
+    bool last = i == kBurstIterations - 1;
+    post([&burst, posted, last, &ack]() {
+      burst.Add(BenchClock::now() - posted);
+      if (last) {
+        ::SetEvent(ack.get());
+      }
+    });
+  }
+  ::WaitForSingleObject(ack.get(), INFINITE);
+  burst.Report((label + L" burst").c_str(), BenchClock::now() - start);
+}
+
+TEST(Bench, ApartmentQueue) {
+  ApartmentQueue queue;
+  std::unique_ptr<HANDLE, HandleCloser> stop(
+      ::CreateEventW(nullptr, /*bManualReset*/ TRUE, FALSE, nullptr));
+  std::thread sta(ComThread<COINIT_APARTMENTTHREADED>, [&]() {
+    ThreadMsgWaitForSingleObject(stop.get(), INFINITE, &queue);
+  });
+
+  MeasureDispatch(L"ApartmentQueue",
+                  [&queue](Task task) { queue.Post(std::move(task)); });
+
+  ::SetEvent(stop.get());
+  sta.join();
+}
+
+static LRESULT CALLBACK TaskWndProc(HWND hwnd, UINT msg, WPARAM wp,
+                                    LPARAM lp) {
+  if (msg == WM_APP) {
+    std::unique_ptr<Task> task(reinterpret_cast<Task *>(lp));
+    (*task)();
+    return 0;
+  }
+  return ::DefWindowProcW(hwnd, msg, wp, lp);
+}
+
+TEST(Bench, MessagePump) {
+  WNDCLASSW wc = {};
+  wc.lpfnWndProc = TaskWndProc;
+  wc.hInstance = ::GetModuleHandleW(nullptr);
+  wc.lpszClassName = L"BenchTaskWindow";
+  ::RegisterClassW(&wc);
+
+  std::unique_ptr<HANDLE, HandleCloser> stop(
+      ::CreateEventW(nullptr, /*bManualReset*/ TRUE, FALSE, nullptr));
+  std::unique_ptr<HANDLE, HandleCloser> ready(
+      ::CreateEventW(nullptr, /*bManualReset*/ TRUE, FALSE, nullptr));
+  HWND window = nullptr;
+  std::thread sta(ComThread<COINIT_APARTMENTTHREADED>, [&]() {
+    window = ::CreateWindowExW(0, wc.lpszClassName, nullptr, 0, 0, 0, 0, 0,
+                               HWND_MESSAGE, nullptr, wc.hInstance, nullptr);
+    ::SetEvent(ready.get());
+    if (window) {
+      ThreadMsgWaitForSingleObject(stop.get(), INFINITE);
+      ::DestroyWindow(window);
+    }
+  });
+  ::WaitForSingleObject(ready.get(), INFINITE);
+
+  if (window) {
+    MeasureDispatch(L"PostMessage", [window](Task task) {
+      ::PostMessageW(window, WM_APP, 0,
+                     reinterpret_cast<LPARAM>(new Task(std::move(task))));
+    });
+  }
+
+  ::SetEvent(stop.get());
+  sta.join();
+  ::UnregisterClassW(wc.lpszClassName, wc.hInstance);
+  ASSERT_TRUE(window);
+}
+
+constexpr int kCallIterations = 10000;
+
+template <typename Call>
+static void MeasureCalls(const std::wstring &name, Call call) {
+  LatencyStats stats(kCallIterations);
+  auto start = BenchClock::now();
+  for (int i = 0; i < kCallIterations; ++i) {
+    auto called = BenchClock::now();
+    HRESULT hr = call();
+    stats.Add(BenchClock::now() - called);
+    if (FAILED(hr)) {
+      ADD_FAILURE() << "Call failed - " << std::hex << hr;
+      return;
+    }
+  }
+  stats.Report(name.c_str(), BenchClock::now() - start);
+}
+
+static void MeasureCallPath(const wchar_t *context, REFCLSID clsId,
+                            DWORD clsContext) {
+  CComPtr<IMarshalable> comobj;
+  ASSERT_EQ(comobj.CoCreateInstance(clsId, /*pUnkOuter*/ nullptr, clsContext),
+            S_OK);
+
+  std::wstring prefix(context);
+  MeasureCalls(prefix + L" TestNumbers", [&comobj]() {
+    long b = 11;
+    int c = 12;
+    unsigned long d = 13;
+    unsigned int e = 14;
+    return comobj->TestNumbers(10, &b, &c, &d, &e);
+  });
+
+  MeasureCalls(prefix + L" TestWideStrings", [&comobj]() {
+    wchar_t strIn[] = L"Hello!";
+    wchar_t strInOut[] = L"World!";
+    wchar_t *strOut = nullptr;
+    HRESULT hr = comobj->TestWideStrings(strIn, strInOut, &strOut);
+    ::CoTaskMemFree(strOut);
+    return hr;
+  });
+
+  MeasureCalls(prefix + L" TestBStrings", [&comobj]() {
+    CComBSTR bstrIn(L"Hello!");
+    CComBSTR bstrInOut(L"World!");
+    CComBSTR bstrOut;
+    return comobj->TestBStrings(bstrIn, &bstrOut, &bstrInOut);
+  });
+}
+
+TEST(Bench, InProcSameApartment) {
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    MeasureCallPath(L"InProc STA->STA", kCLSID_ExtZ_InProc_STA,
+                    CLSCTX_INPROC_SERVER);
+  });
+  t.join();
+}
+
+TEST(Bench, InProcCrossApartment) {
+  // Objects created from the MTA live in the host STA (Apartment) or the
+  // main STA (Single), so every call goes through a proxy.
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    MeasureCallPath(L"InProc MTA->STA", kCLSID_ExtZ_InProc_STA,
+                    CLSCTX_INPROC_SERVER);
+    MeasureCallPath(L"InProc MTA->STA (Legacy)",
+                    kCLSID_ExtZ_InProc_STA_Legacy, CLSCTX_INPROC_SERVER);
+  });
+  t.join();
+}
+
+TEST(Bench, OutProc) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    MeasureCallPath(L"OutProc MTA->STA", kCLSID_ExtZ_OutProc_STA_1,
+                    CLSCTX_LOCAL_SERVER);
+  });
+  t.join();
+}
+
+TEST(Bench, OutProcSharedMemory) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+
+    ShmMarshalable shm;
+    ASSERT_EQ(shm.Connect(comobj), S_OK);
+
+    auto testNumbers = [](auto &target) {
+      long b = 11;
+      int c = 12;
+      unsigned long d = 13;
+      unsigned int e = 14;
+      return target.TestNumbers(10, &b, &c, &d, &e);
+    };
+    MeasureCalls(L"OutProc RPC TestNumbers",
+                 [&]() { return testNumbers(*comobj.p); });
+    MeasureCalls(L"OutProc SharedMemory TestNumbers",
+                 [&]() { return testNumbers(shm); });
+
+    auto testBStrings = [](auto &target) {
+      CComBSTR bstrIn(L"Hello!");
+      CComBSTR bstrInOut(L"World!");
+      CComBSTR bstrOut;
+      return target.TestBStrings(bstrIn, &bstrOut, &bstrInOut);
+    };
+    MeasureCalls(L"OutProc RPC TestBStrings",
+                 [&]() { return testBStrings(*comobj.p); });
+    MeasureCalls(L"OutProc SharedMemory TestBStrings",
+                 [&]() { return testBStrings(shm); });
+  });
+  t.join();
+}
+
+// Throughput of one client thread that keeps `depth` asynchronous calls in
+// flight over the shared-memory transport.  Depth 1 is a blocking call with
+// extra steps.
+TEST(Bench, Pipelined) {
+  constexpr int kCalls = 100000;
+
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+
+    ShmMarshalable shm;
+    ASSERT_EQ(shm.Connect(comobj), S_OK);
+
+    for (int depth = 1; depth <= 512; depth *= 2) {
+      std::vector<ShmCall> calls(depth);
+      long b = 11;
+      int c = 12;
+      unsigned long d = 13;
+      unsigned int e = 14;
+      auto start = BenchClock::now();
+      for (int i = 0; i < kCalls + depth; ++i) {
+        // A sliding window: finish the oldest call and begin the next one
+        ShmCall &call = calls[i % depth];
+        if (i >= depth) {
+          ASSERT_EQ(shm.Finish_TestNumbers(call, &c, &d, &e), S_OK);
+        }
+        if (i < kCalls) {
+          ASSERT_EQ(shm.Begin_TestNumbers(call, i, &b, &d), S_OK);
+        }
+      }
+      double sec =
+          std::chrono::duration<double>(BenchClock::now() - start).count();
+      Log(L"Pipelined TestNumbers depth %3d  %12.0f calls/s\n", depth,
+          kCalls / sec);
+    }
+  });
+  t.join();
+}
+
+// Compares K clients that each block a thread of their own on a call with K
+// coroutines sharing one STA thread, whose calls are made by K MTA workers
+TEST(Bench, Coroutine) {
+  constexpr int kCallsPerClient = 2000;
+
+  for (int clients = 1; clients <= 64; clients *= 4) {
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    auto start = BenchClock::now();
+    for (int i = 0; i < clients; ++i) {
+      threads.emplace_back(ComThread<COINIT_MULTITHREADED>, [&failures]() {
+        CComPtr<IMarshalable> comobj;
+        if (FAILED(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                           /*pUnkOuter*/ nullptr,
+                                           CLSCTX_LOCAL_SERVER))) {
+          ++failures;
+          return;
+        }
+        long b = 0;
+        int c = 0;
+        unsigned long d = 0;
+        unsigned int e = 0;
+        for (int j = 0; j < kCallsPerClient; ++j) {
+          if (FAILED(comobj->TestNumbers(j, &b, &c, &d, &e))) {
+            ++failures;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    double blocking =
+        std::chrono::duration<double>(BenchClock::now() - start).count();
+    EXPECT_EQ(failures.load(), 0);
+
+    ComThreadPool threads(1, clients);
+    double coroutine = 0;
+    std::thread t(ComThread<COINIT_APARTMENTTHREADED>, [&]() {
+      CComPtr<IMarshalable> comobj;
+      ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                        /*pUnkOuter*/ nullptr,
+                                        CLSCTX_LOCAL_SERVER),
+                S_OK);
+      CoMarshalable client(threads);
+      ASSERT_EQ(client.Attach(comobj), S_OK);
+
+      ApartmentQueue queue;
+      ApartmentScheduler scheduler(queue);
+      std::unique_ptr<HANDLE, HandleCloser> done(
+          ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+      int finished = 0;
+      auto caller = [&]() -> CoTask<> {
+        long b = 0;
+        int c = 0;
+        unsigned long d = 0;
+        unsigned int e = 0;
+        for (int j = 0; j < kCallsPerClient; ++j) {
+          if (FAILED(co_await client.TestNumbers(j, &b, &c, &d, &e))) {
+            ++failures;
+          }
+        }
+        if (++finished == clients) {
+          ::SetEvent(done.get());
+        }
+      };
+
+      auto start = BenchClock::now();
+      std::vector<CoTask<>> tasks;
+      for (int i = 0; i < clients; ++i) {
+        tasks.push_back(caller());
+        tasks.back().Start();
+      }
+      ThreadMsgWaitForSingleObject(done.get(), INFINITE, &queue);
+      coroutine =
+          std::chrono::duration<double>(BenchClock::now() - start).count();
+    });
+    t.join();
+    EXPECT_EQ(failures.load(), 0);
+
+    Log(L"%2d clients  blocking threads %10.0f calls/s  "
+        L"coroutines on one STA %10.0f calls/s\n",
+        clients, clients * kCallsPerClient / blocking,
+        coroutine ? clients * kCallsPerClient / coroutine : 0.0);
+  }
+}
+
+// Reports the cost of running a trivial task in an apartment on a new
+// ComThread<> against submitting it to a ComThreadPool, one at a time and
+// all at once
+TEST(Bench, ComThreadPool) {
+  constexpr int kTasks = 2000;
+  constexpr ApartmentKind kKinds[] = {kApartmentSTA, kApartmentMTA};
+
+  ComThreadPool pool(4, 4);
+  for (ApartmentKind kind : kKinds) {
+    const wchar_t *name = kind == kApartmentSTA ? L"STA" : L"MTA";
+    std::atomic<int> ran(0);
+    auto task = [&ran]() { ran.fetch_add(1, std::memory_order_relaxed); };
+
+    auto start = BenchClock::now();
+    for (int i = 0; i < kTasks; ++i) {
+      std::thread t(kind == kApartmentSTA ? ComThread<COINIT_APARTMENTTHREADED>
+                                          : ComThread<COINIT_MULTITHREADED>,
+                    task);
+      t.join();
+    }
+    double perThread =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        kTasks;
+
+    start = BenchClock::now();
+    for (int i = 0; i < kTasks; ++i) {
+      pool.Submit(kind, task).get();
+    }
+    double perSubmit =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        kTasks;
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(kTasks);
+    start = BenchClock::now();
+    for (int i = 0; i < kTasks; ++i) {
+      futures.push_back(pool.Submit(kind, task));
+    }
+    for (auto &future : futures) {
+      future.get();
+    }
+    double perBatched =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        kTasks;
+
+    EXPECT_EQ(ran.load(), kTasks * 3);
+    Log(L"%s  thread per task %8.2f us  pool %8.2f us  "
+        L"pool, all at once %8.2f us\n",
+        name, perThread, perSubmit, perBatched);
+  }
+}
+
+// Reports the per-element cost of TestNumbersBatch for batch sizes from 1 to
+// 64K, next to the cost of calling TestNumbers once per element.
+static void MeasureBatch(const wchar_t *context, REFCLSID clsId,
+                         DWORD clsContext) {
+  constexpr ULONG kMaxBatch = 1 << 16;
+  constexpr ULONG kMinRounds = 16;
+  constexpr ULONG kMaxRounds = 10000;
+
+  CComPtr<IMarshalable2> comobj;
+  ASSERT_EQ(comobj.CoCreateInstance(clsId, /*pUnkOuter*/ nullptr, clsContext),
+            S_OK);
+
+  auto start = BenchClock::now();
+  for (ULONG i = 0; i < kMaxRounds; ++i) {
+    long b = 11;
+    int c = 12;
+    unsigned long d = 13;
+    unsigned int e = 14;
+    ASSERT_EQ(comobj->TestNumbers(10, &b, &c, &d, &e), S_OK);
+  }
+  double individual =
+      std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+          .count() /
+      kMaxRounds;
+  Log(L"%s TestNumbers x N        %12.1f ns/element\n", context, individual);
+
+  for (ULONG batch = 1; batch <= kMaxBatch; batch *= 4) {
+    CComSafeArray<long> in(batch);
+    for (ULONG i = 0; i < batch; ++i) {
+      in[static_cast<LONG>(i)] = static_cast<long>(i);
+    }
+
+    const ULONG rounds =
+        std::min(std::max(kMaxBatch / batch, kMinRounds), kMaxRounds);
+    start = BenchClock::now();
+    for (ULONG i = 0; i < rounds; ++i) {
+      SAFEARRAY *out = nullptr;
+      ASSERT_EQ(comobj->TestNumbersBatch(in, &out), S_OK);
+      ::SafeArrayDestroy(out);
+    }
+    double perElement =
+        std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+            .count() /
+        (static_cast<double>(rounds) * batch);
+    Log(L"%s TestNumbersBatch %6lu %12.1f ns/element\n", context, batch,
+        perElement);
+  }
+}
+
+TEST(Bench, Batch) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    MeasureBatch(L"InProc MTA->STA", kCLSID_ExtZ_InProc_STA,
+                 CLSCTX_INPROC_SERVER);
+    MeasureBatch(L"OutProc MTA->STA", kCLSID_ExtZ_OutProc_STA_1,
+                 CLSCTX_LOCAL_SERVER);
+  });
+  t.join();
+}
+
+// Compares early binding with late binding through IDispatch, where the
+// client either caches the DISPID or looks it up on every call, and with
+// DispInvoke, which drives the same call from the type library.
+static void MeasureLateBinding(const wchar_t *context, REFCLSID clsId,
+                               DWORD clsContext) {
+  CComPtr<IMarshalable> comobj;
+  ASSERT_EQ(comobj.CoCreateInstance(clsId, /*pUnkOuter*/ nullptr, clsContext),
+            S_OK);
+
+  long b = 11;
+  int c = 12;
+  unsigned long d = 13;
+  unsigned int e = 14;
+  VARIANT args[4];
+  V_VT(&args[3]) = VT_I4;
+  V_I4(&args[3]) = 10;
+  V_VT(&args[2]) = VT_I4 | VT_BYREF;
+  V_I4REF(&args[2]) = &b;
+  V_VT(&args[1]) = VT_INT | VT_BYREF;
+  V_INTREF(&args[1]) = &c;
+  V_VT(&args[0]) = VT_UI4 | VT_BYREF;
+  V_UI4REF(&args[0]) = &d;
+  DISPPARAMS params = {args, nullptr, 4, 0};
+  LPOLESTR name = const_cast<LPOLESTR>(L"TestNumbers");
+
+  std::wstring prefix(context);
+  MeasureCalls(prefix + L" early-bound", [&]() {
+    return comobj->TestNumbers(10, &b, &c, &d, &e);
+  });
+
+  DISPID dispId;
+  ASSERT_EQ(comobj->GetIDsOfNames(IID_NULL, &name, 1, LOCALE_USER_DEFAULT,
+                                  &dispId),
+            S_OK);
+  MeasureCalls(prefix + L" Invoke", [&]() {
+    CComVariant result;
+    return comobj->Invoke(dispId, IID_NULL, LOCALE_USER_DEFAULT,
+                          DISPATCH_METHOD, &params, &result, nullptr, nullptr);
+  });
+
+  MeasureCalls(prefix + L" GetIDsOfNames+Invoke", [&]() {
+    DISPID id;
+    CComVariant result;
+    HRESULT hr = comobj->GetIDsOfNames(IID_NULL, &name, 1,
+                                       LOCALE_USER_DEFAULT, &id);
+    return FAILED(hr) ? hr
+                      : comobj->Invoke(id, IID_NULL, LOCALE_USER_DEFAULT,
+                                       DISPATCH_METHOD, &params, &result,
+                                       nullptr, nullptr);
+  });
+
+  if (clsContext != CLSCTX_INPROC_SERVER) {
+    return;
+  }
+
+  CComPtr<ITypeInfo> typeInfo;
+  HRESULT hr = comobj->GetTypeInfo(0, LOCALE_USER_DEFAULT, &typeInfo);
+  if (FAILED(hr)) {
+    Log(L"No type information to compare with - %08lx\n", hr);
+    return;
+  }
+  MeasureCalls(prefix + L" DispInvoke", [&]() {
+    CComVariant result;
+    return ::DispInvoke(comobj.p, typeInfo, dispId, DISPATCH_METHOD, &params,
+                        &result, nullptr, nullptr);
+  });
+  MeasureCalls(prefix + L" DispGetIDsOfNames", [&]() {
+    DISPID id;
+    return ::DispGetIDsOfNames(typeInfo, &name, 1, &id);
+  });
+}
+
+TEST(Bench, LateBinding) {
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    MeasureLateBinding(L"InProc STA->STA", kCLSID_ExtZ_InProc_STA,
+                       CLSCTX_INPROC_SERVER);
+  });
+  t.join();
+
+  t = std::thread(ComThread<COINIT_MULTITHREADED>, []() {
+    MeasureLateBinding(L"OutProc MTA->STA", kCLSID_ExtZ_OutProc_STA_1,
+                       CLSCTX_LOCAL_SERVER);
+  });
+  t.join();
+}
+
+TEST(Bench, TypeLib) {
+  constexpr int kIterations = 1000;
+
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    std::wstring subkey(L"Software\\Classes\\CLSID\\");
+    subkey += RegUtil::GuidToString(kCLSID_ExtZ_InProc_STA);
+    subkey += L"\\InprocServer32";
+    RegUtil inproc(HKEY_CURRENT_USER, subkey.c_str());
+    ASSERT_TRUE(inproc);
+    std::wstring modulePath = inproc.GetString(nullptr);
+
+    // What a late-bound caller needs: the description of one method.
+    // oleaut32 keeps a loaded library cached until its last reference is
+    // released, so each iteration releases everything to measure a load.
+    LatencyStats loaded(kIterations);
+    auto start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      auto begin = BenchClock::now();
+      CComPtr<ITypeLib> typelib;
+      ASSERT_EQ(::LoadTypeLib(modulePath.c_str(), &typelib), S_OK);
+      CComPtr<ITypeInfo> typeInfo;
+      ASSERT_EQ(typelib->GetTypeInfoOfGuid(IID_IMarshalable, &typeInfo), S_OK);
+      LPOLESTR name = const_cast<LPOLESTR>(L"TestBStrings");
+      MEMBERID memberId;
+      ASSERT_EQ(typeInfo->GetIDsOfNames(&name, 1, &memberId), S_OK);
+      loaded.Add(BenchClock::now() - begin);
+    }
+    loaded.Report(L"TypeLib LoadTypeLib+GetIDsOfNames",
+                  BenchClock::now() - start);
+
+    LatencyStats mapped(kIterations);
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      auto begin = BenchClock::now();
+      MappedTypeLib typelib;
+      ASSERT_TRUE(typelib.OpenModule(modulePath.c_str()));
+      int type = typelib.FindTypeInfo(IID_IMarshalable);
+      ASSERT_GE(type, 0);
+      ASSERT_GE(typelib.FindFunc(type, L"TestBStrings"), 0);
+      mapped.Add(BenchClock::now() - begin);
+    }
+    mapped.Report(L"TypeLib mapped+FindFunc", BenchClock::now() - start);
+
+    // Lookups once the library is open
+    CComPtr<ITypeLib> typelib;
+    ASSERT_EQ(::LoadTypeLib(modulePath.c_str(), &typelib), S_OK);
+    CComPtr<ITypeInfo> typeInfo;
+    ASSERT_EQ(typelib->GetTypeInfoOfGuid(IID_IMarshalable, &typeInfo), S_OK);
+    MappedTypeLib reader;
+    ASSERT_TRUE(reader.OpenModule(modulePath.c_str()));
+    int type = reader.FindTypeInfo(IID_IMarshalable);
+    ASSERT_GE(type, 0);
+
+    LatencyStats byName(kIterations);
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      auto begin = BenchClock::now();
+      LPOLESTR name = const_cast<LPOLESTR>(L"TestBStrings");
+      MEMBERID memberId;
+      ASSERT_EQ(typeInfo->GetIDsOfNames(&name, 1, &memberId), S_OK);
+      byName.Add(BenchClock::now() - begin);
+    }
+    byName.Report(L"TypeLib ITypeInfo::GetIDsOfNames",
+                  BenchClock::now() - start);
+
+    LatencyStats byReader(kIterations);
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      auto begin = BenchClock::now();
+      TypeLibFunc func;
+      ASSERT_TRUE(reader.GetFunc(type, reader.FindFunc(type, L"TestBStrings"),
+                                 func));
+      byReader.Add(BenchClock::now() - begin);
+    }
+    byReader.Report(L"TypeLib TypeLibView::FindFunc",
+                    BenchClock::now() - start);
+  });
+  t.join();
+}
+
+TEST(Bench, SizeClassPool) {
+  constexpr int kIterations = 1000000;
+  constexpr size_t kSizes[] = {24, 64, 200, 1000};
+
+  for (size_t size : kSizes) {
+    auto start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      void *p = ::operator new(size);
+      *reinterpret_cast<volatile char *>(p) = 0;
+      ::operator delete(p);
+    }
+    double heap =
+        std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+            .count() /
+        kIterations;
+
+    SizeClassPool::Stats before = SizeClassPool::GetStats();
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      void *p = SizeClassPool::Allocate(size);
+      *reinterpret_cast<volatile char *>(p) = 0;
+      SizeClassPool::Free(p);
+    }
+    double pool =
+        std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+            .count() /
+        kIterations;
+    SizeClassPool::Stats after = SizeClassPool::GetStats();
+
+    Log(L"%4zu bytes  heap %8.1f ns  pool %8.1f ns  heap allocs/op %.4f\n",
+        size, heap, pool,
+        static_cast<double>(after.mHeapAllocs - before.mHeapAllocs) /
+            kIterations);
+  }
+}
+
+TEST(Bench, Activation) {
+  constexpr int kActivations = 10000;
+
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    CComPtr<IUnknown> unknown;
+    unknown.Attach(CreateFactory());
+    CComQIPtr<IClassFactory> factory(unknown);
+    ASSERT_TRUE(factory);
+
+    for (size_t cap : {0, 64}) {
+      SetInstancePoolCap(cap);
+      InstancePoolStats before = GetInstancePoolStats();
+      LatencyStats stats(kActivations);
+      auto start = BenchClock::now();
+      for (int i = 0; i < kActivations; ++i) {
+        auto created = BenchClock::now();
+        CComPtr<IMarshalable> comobj;
+        ASSERT_EQ(factory->CreateInstance(nullptr, IID_PPV_ARGS(&comobj)),
+                  S_OK);
+        comobj.Release();
+        stats.Add(BenchClock::now() - created);
+      }
+      stats.Report(cap ? L"Activation pooled" : L"Activation new/delete",
+                   BenchClock::now() - start);
+
+      InstancePoolStats after = GetInstancePoolStats();
+      Log(L"  created=%llu reused=%llu destroyed=%llu\n",
+          after.mCreated - before.mCreated, after.mReused - before.mReused,
+          after.mDestroyed - before.mDestroyed);
+    }
+    SetInstancePoolCap(0);
+  });
+  t.join();
+}
+
+TEST(Bench, ManifestActivation) {
+  constexpr int kLookups = 10000;
+
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    std::wstring subkey(L"Software\\Classes\\CLSID\\");
+    subkey += RegUtil::GuidToString(kCLSID_ExtZ_InProc_STA);
+    subkey += L"\\InprocServer32";
+    RegUtil inproc(HKEY_CURRENT_USER, subkey.c_str());
+    ASSERT_TRUE(inproc);
+
+    MappedManifest manifest;
+    ASSERT_TRUE(manifest.Open(
+        ManifestPathForModule(inproc.GetString(nullptr).c_str()).c_str()));
+
+    // What activation has to find: the module path and the threading model
+    LatencyStats registry(kLookups);
+    auto start = BenchClock::now();
+    for (int i = 0; i < kLookups; ++i) {
+      auto begin = BenchClock::now();
+      std::wstring key(L"Software\\Classes\\CLSID\\");
+      key += RegUtil::GuidToString(kCLSID_ExtZ_InProc_STA);
+      key += L"\\InprocServer32";
+      RegUtil server(HKEY_CURRENT_USER, key.c_str());
+      ASSERT_FALSE(server.GetString(nullptr).empty());
+      ASSERT_FALSE(server.GetString(L"ThreadingModel").empty());
+      registry.Add(BenchClock::now() - begin);
+    }
+    registry.Report(L"Lookup registry", BenchClock::now() - start);
+
+    LatencyStats mapped(kLookups);
+    start = BenchClock::now();
+    for (int i = 0; i < kLookups; ++i) {
+      auto begin = BenchClock::now();
+      const ManifestEntry *entry = manifest.Find(kCLSID_ExtZ_InProc_STA);
+      ASSERT_NE(entry, nullptr);
+      ASSERT_NE(*manifest.String(entry->mModule), 0);
+      ASSERT_NE(*manifest.String(entry->mThreadModel), 0);
+      mapped.Add(BenchClock::now() - begin);
+    }
+    mapped.Report(L"Lookup manifest", BenchClock::now() - start);
+
+    LatencyStats coGet(kLookups);
+    start = BenchClock::now();
+    for (int i = 0; i < kLookups; ++i) {
+      auto begin = BenchClock::now();
+      CComPtr<IClassFactory> factory;
+      ASSERT_EQ(::CoGetClassObject(kCLSID_ExtZ_InProc_STA,
+                                   CLSCTX_INPROC_SERVER, nullptr,
+                                   IID_PPV_ARGS(&factory)),
+                S_OK);
+      coGet.Add(BenchClock::now() - begin);
+    }
+    coGet.Report(L"CoGetClassObject", BenchClock::now() - start);
+
+    LatencyStats manifestGet(kLookups);
+    start = BenchClock::now();
+    for (int i = 0; i < kLookups; ++i) {
+      auto begin = BenchClock::now();
+      CComPtr<IClassFactory> factory;
+      ASSERT_EQ(manifest.GetClassObject(kCLSID_ExtZ_InProc_STA,
+                                        IID_PPV_ARGS(&factory)),
+                S_OK);
+      manifestGet.Add(BenchClock::now() - begin);
+    }
+    manifestGet.Report(L"Manifest GetClassObject", BenchClock::now() - start);
+  });
+  t.join();
+}
+
+static double NanosecondsPerOp(BenchClock::time_point start, int ops) {
+  return std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+             .count() /
+         ops;
+}
+
+TEST(Bench, Guid) {
+  constexpr int kIterations = 1000000;
+  constexpr int kKeys = 64;
+
+  std::vector<GUID> guids(kKeys);
+  for (auto &guid : guids) {
+    ASSERT_EQ(::CoCreateGuid(&guid), S_OK);
+  }
+
+  auto report = [](const wchar_t *name, BenchClock::time_point start) {
+    Log(L"%-22s %8.1f ns\n", name, NanosecondsPerOp(start, kIterations));
+  };
+
+  // The implementation RegUtil::GuidToString used to have
+  wchar_t str[64];
+  auto start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    const GUID &guid = guids[i % kKeys];
+    ::StringCbPrintfW(
+        str, sizeof(str), L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+        guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1],
+        guid.Data4[2], guid.Data4[3], guid.Data4[4], guid.Data4[5],
+        guid.Data4[6], guid.Data4[7]);
+  }
+  report(L"Format printf", start);
+
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    ::StringFromGUID2(guids[i % kKeys], str, ARRAYSIZE(str));
+  }
+  report(L"Format StringFromGUID2", start);
+
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    FormatGuidScalar(guids[i % kKeys], str);
+  }
+  report(L"Format scalar", start);
+
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    FormatGuid(guids[i % kKeys], str);
+  }
+  report(L"Format SIMD", start);
+
+  std::vector<std::wstring> strings;
+  for (const auto &guid : guids) {
+    FormatGuid(guid, str);
+    strings.emplace_back(str);
+  }
+
+  GUID parsed;
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    ::IIDFromString(strings[i % kKeys].c_str(), &parsed);
+  }
+  report(L"Parse IIDFromString", start);
+
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    const std::wstring &s = strings[i % kKeys];
+    ParseGuidScalar(s.c_str(), s.size(), parsed);
+  }
+  report(L"Parse scalar", start);
+
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    const std::wstring &s = strings[i % kKeys];
+    ParseGuid(s.c_str(), s.size(), parsed);
+  }
+  report(L"Parse SIMD", start);
+
+  // Lookups in a table the size of a QI or class object table and larger
+  for (int size : {4, kKeys}) {
+    std::vector<std::pair<GUID, int>> linear;
+    std::map<GUID, int, bool (*)(const GUID &, const GUID &)> tree(
+        [](const GUID &a, const GUID &b) {
+          return memcmp(&a, &b, sizeof(GUID)) < 0;
+        });
+    GuidMap<int> map;
+    for (int i = 0; i < size; ++i) {
+      linear.emplace_back(guids[i], i);
+      tree.emplace(guids[i], i);
+      map.Insert(guids[i], i);
+    }
+
+    int found = 0;
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      const GUID &key = guids[i % size];
+      for (const auto &entry : linear) {
+        if (::IsEqualGUID(entry.first, key)) {
+          found += entry.second;
+          break;
+        }
+      }
+    }
+    double linearNs = NanosecondsPerOp(start, kIterations);
+
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      found += tree.find(guids[i % size])->second;
+    }
+    double treeNs = NanosecondsPerOp(start, kIterations);
+
+    start = BenchClock::now();
+    for (int i = 0; i < kIterations; ++i) {
+      found += *map.Find(guids[i % size]);
+    }
+    double mapNs = NanosecondsPerOp(start, kIterations);
+
+    Log(L"Lookup %2d keys  linear %6.1f ns  std::map %6.1f ns  "
+        L"GuidMap %6.1f ns (%d)\n",
+        size, linearNs, treeNs, mapNs, found);
+  }
+}
+
+// What Log() used to do on every call
+static void SyncLog(const wchar_t *format, ...) {
+  wchar_t linebuf[1024];
+  va_list v;
+  va_start(v, format);
+  ::StringCbVPrintfW(linebuf, sizeof(linebuf), format, v);
+  ::OutputDebugStringW(linebuf);
+  va_end(v);
+}
+
+// Drops the log output of code under measurement
+class NullLogSink : public LogSink {
+public:
+  void Write(const wchar_t *, size_t) override {}
+};
+
+TEST(Bench, Log) {
+  constexpr int kRecords = 100000;
+
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new NullLogSink);
+
+  void *object = &object;
+  LatencyStats sync(kRecords);
+  auto start = BenchClock::now();
+  for (int i = 0; i < kRecords; ++i) {
+    auto begin = BenchClock::now();
+    SyncLog(L"[%04x] MainObject: %p %s\n", ::GetCurrentThreadId(), object,
+            L"TestNumbers");
+    sync.Add(BenchClock::now() - begin);
+  }
+  sync.Report(L"Log printf+OutputDebugStringW", BenchClock::now() - start);
+
+  LogStats before = GetLogStats();
+  LatencyStats async(kRecords);
+  start = BenchClock::now();
+  for (int i = 0; i < kRecords; ++i) {
+    auto begin = BenchClock::now();
+    Log(L"[%04x] MainObject: %p %s\n", ::GetCurrentThreadId(), object,
+        L"TestNumbers");
+    async.Add(BenchClock::now() - begin);
+  }
+  async.Report(L"Log binary record", BenchClock::now() - start);
+  ASSERT_TRUE(LogFlush());
+  LogStats after = GetLogStats();
+
+  SetLogSink(new ConsoleLogSink);
+  Log(L"  drained=%llu dropped=%llu\n", after.mRecords - before.mRecords,
+      after.mDropped - before.mDropped);
+}
+
+// A descriptor-driven codec, which is how interpretive marshaling works: a
+// table describes each parameter, a loop moves the values through the buffer,
+// and the server makes the call with DispCallFunc.
+enum : uint32_t {
+  kParamIn = 1,
+  kParamOut = 2,
+  kParamByRef = 4,
+};
+
+struct ParamDesc {
+  uint32_t mFlags;
+  VARTYPE mVt;
+  uint32_t mSize;
+};
+
+static const ParamDesc kTestNumbersDesc[] = {
+    {kParamIn, VT_I4, sizeof(long)},
+    {kParamIn | kParamByRef, VT_I4, sizeof(long)},
+    {kParamOut | kParamByRef, VT_INT, sizeof(int)},
+    {kParamIn | kParamOut | kParamByRef, VT_UI4, sizeof(unsigned long)},
+    {kParamOut | kParamByRef, VT_UINT, sizeof(unsigned int)},
+};
+constexpr UINT kTestNumbersVtableIndex = 7; // After IUnknown and IDispatch
+
+// `args` has the address of each argument, as a stub finds them on the stack
+static void DescEncode(const ParamDesc *descs, UINT count, uint32_t direction,
+                       void *const *args, CodecWriter &w) {
+  for (UINT i = 0; i < count; ++i) {
+    if (descs[i].mFlags & direction) {
+      const void *value = descs[i].mFlags & kParamByRef
+                              ? *static_cast<void *const *>(args[i])
+                              : args[i];
+      w.Write(value, descs[i].mSize);
+    }
+  }
+}
+
+static void DescDecode(const ParamDesc *descs, UINT count, uint32_t direction,
+                       void *const *args, CodecReader &r) {
+  for (UINT i = 0; i < count; ++i) {
+    if (descs[i].mFlags & direction) {
+      void *value = descs[i].mFlags & kParamByRef
+                        ? *static_cast<void *const *>(args[i])
+                        : args[i];
+      r.Read(value, descs[i].mSize);
+    }
+  }
+}
+
+static HRESULT DescDispatch(IUnknown *object, UINT vtableIndex,
+                            const ParamDesc *descs, UINT count,
+                            CodecReader &request, CodecWriter &response) {
+  constexpr UINT kMaxParams = 8;
+  uint64_t storage[kMaxParams] = {};
+  VARIANTARG values[kMaxParams];
+  VARIANTARG *pointers[kMaxParams];
+  VARTYPE types[kMaxParams];
+  for (UINT i = 0; i < count; ++i) {
+    if (descs[i].mFlags & kParamIn) {
+      request.Read(&storage[i], descs[i].mSize);
+    }
+    if (descs[i].mFlags & kParamByRef) {
+      V_VT(&values[i]) = VT_BYREF | descs[i].mVt;
+      V_BYREF(&values[i]) = &storage[i];
+    } else {
+      V_VT(&values[i]) = descs[i].mVt;
+      V_UI8(&values[i]) = storage[i];
+    }
+    types[i] = V_VT(&values[i]);
+    pointers[i] = &values[i];
+  }
+  if (!request.Ok()) {
+    return RPC_X_BAD_STUB_DATA;
+  }
+
+  VARIANT result;
+  ::VariantInit(&result);
+  HRESULT hr =
+      ::DispCallFunc(object, vtableIndex * sizeof(void *), CC_STDCALL,
+                     VT_ERROR, count, types, pointers, &result);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  for (UINT i = 0; i < count; ++i) {
+    if (descs[i].mFlags & kParamOut) {
+      response.Write(&storage[i], descs[i].mSize);
+    }
+  }
+  return V_ERROR(&result);
+}
+
+TEST(Bench, Codec) {
+  constexpr int kIterations = 1000000;
+  using TestNumbersCodec =
+      MethodCodec<In<long>, InPtr<long>, Out<int>, InOut<unsigned long>,
+                  Out<unsigned int>>;
+
+  CComPtr<IUnknown> object;
+  object.Attach(CreateMarshalable());
+  CComQIPtr<IMarshalable> comobj = object;
+  ASSERT_TRUE(comobj);
+
+  // The method logs every call, which would be most of what's measured
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new NullLogSink);
+
+  long a = 10;
+  long b = 11;
+  int c = 12;
+  unsigned long d = 13;
+  unsigned int e = 14;
+  uint8_t buffer[ShmMessage::kPayloadSize];
+
+  auto start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    CodecWriter request(buffer, sizeof(buffer));
+    TestNumbersCodec::EncodeRequest(request, a, &b, &c, &d, &e);
+    CodecReader serverReader(buffer, request.Size());
+    CodecWriter response(buffer, sizeof(buffer));
+    HRESULT hr;
+    TestNumbersCodec::Dispatch(serverReader, response, comobj.p,
+                               &IMarshalable::TestNumbers, hr);
+    CodecReader clientReader(buffer, response.Size());
+    TestNumbersCodec::DecodeResponse(clientReader, a, &b, &c, &d, &e);
+  }
+  double templateNs = NanosecondsPerOp(start, kIterations);
+  EXPECT_EQ(e, 44u);
+
+  e = 0;
+  void *args[] = {&a, &b, &c, &d, &e};
+  const UINT count = ARRAYSIZE(kTestNumbersDesc);
+  start = BenchClock::now();
+  for (int i = 0; i < kIterations; ++i) {
+    CodecWriter request(buffer, sizeof(buffer));
+    DescEncode(kTestNumbersDesc, count, kParamIn, args, request);
+    CodecReader serverReader(buffer, request.Size());
+    CodecWriter response(buffer, sizeof(buffer));
+    DescDispatch(comobj.p, kTestNumbersVtableIndex, kTestNumbersDesc, count,
+                 serverReader, response);
+    CodecReader clientReader(buffer, response.Size());
+    DescDecode(kTestNumbersDesc, count, kParamOut, args, clientReader);
+  }
+  double descriptorNs = NanosecondsPerOp(start, kIterations);
+  EXPECT_EQ(e, 44u);
+
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new ConsoleLogSink);
+  Log(L"TestNumbers encode+dispatch+decode  template %6.1f ns  "
+      L"descriptor %6.1f ns\n",
+      templateNs, descriptorNs);
+}
+
+// Calls per second of concurrent clients against a pool of STAs of growing
+// size.  Each client activates its own object through the pooled factory and
+// calls it from the MTA, so clients whose objects share an apartment are
+// serialized with each other.
+TEST(Bench, ApartmentScaling) {
+  constexpr int kClients = 64;
+  constexpr int kCallsPerClient = 2000;
+  constexpr ActivationPolicy kPolicies[] = {kActivateRoundRobin,
+                                            kActivateLeastLoaded};
+  constexpr int kSizes = 7; // 1 to 64 apartments
+
+  CComPtr<IUnknown> unknown;
+  unknown.Attach(CreateFactory());
+  CComQIPtr<IClassFactory> inner(unknown);
+  ASSERT_TRUE(inner);
+
+  // The method logs every call, which would be most of what's measured
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new NullLogSink);
+
+  double callsPerSec[ARRAYSIZE(kPolicies)][kSizes] = {};
+  for (size_t p = 0; p < ARRAYSIZE(kPolicies); ++p) {
+    for (int s = 0; s < kSizes; ++s) {
+      ApartmentPool pool(size_t(1) << s, kPolicies[p]);
+      CComPtr<IUnknown> pooled;
+      pooled.Attach(CreatePooledFactory(&pool, inner));
+      CComQIPtr<IClassFactory> factory(pooled);
+
+      std::atomic<int> failures(0);
+      std::vector<std::thread> clients;
+      auto start = BenchClock::now();
+      for (int i = 0; i < kClients; ++i) {
+        clients.emplace_back(ComThread<COINIT_MULTITHREADED>, [&]() {
+          CComPtr<IMarshalable> comobj;
+          if (FAILED(factory->CreateInstance(nullptr,
+                                             IID_PPV_ARGS(&comobj)))) {
+            ++failures;
+            return;
+          }
+          long b = 0;
+          int c = 0;
+          unsigned long d = 0;
+          unsigned int e = 0;
+          for (int j = 0; j < kCallsPerClient; ++j) {
+            if (FAILED(comobj->TestNumbers(j, &b, &c, &d, &e))) {
+              ++failures;
+            }
+          }
+        });
+      }
+      for (auto &client : clients) {
+        client.join();
+      }
+      double sec =
+          std::chrono::duration<double>(BenchClock::now() - start).count();
+      callsPerSec[p][s] = kClients * kCallsPerClient / sec;
+      EXPECT_EQ(failures.load(), 0);
+    }
+  }
+
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new ConsoleLogSink);
+  Log(L"%d clients x %d calls   round-robin      least-loaded\n", kClients,
+      kCallsPerClient);
+  for (int s = 0; s < kSizes; ++s) {
+    Log(L"%3d apartments        %10.0f/s     %10.0f/s\n", 1 << s,
+        callsPerSec[0][s], callsPerSec[1][s]);
+  }
+}
+
+// Floods one apartment with 64 clients calling in a loop, with no limit on
+// its queue and with admission control at a few depths.  The clients retry
+// rejected calls with backoff, so a call is measured from its first attempt
+// to its answer, and an admitted attempt from being sent to its answer.
+TEST(Bench, Admission) {
+  constexpr int kClients = 64;
+  constexpr int kCallsPerClient = 500;
+  constexpr size_t kDepths[] = {0, 4, 16, 64};
+
+  CComPtr<IUnknown> unknown;
+  unknown.Attach(CreateFactory());
+  CComQIPtr<IClassFactory> inner(unknown);
+  ASSERT_TRUE(inner);
+
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new NullLogSink);
+
+  struct Result {
+    double mCallsPerSec;
+    uint64_t mRejected;
+    LatencyHistogram mCalls;
+    LatencyHistogram mAdmitted;
+  };
+  std::unique_ptr<Result[]> results(new Result[ARRAYSIZE(kDepths)]());
+  for (size_t i = 0; i < ARRAYSIZE(kDepths); ++i) {
+    ApartmentPool pool(1, kActivateRoundRobin, kDepths[i]);
+    CComPtr<IUnknown> pooled;
+    pooled.Attach(CreatePooledFactory(&pool, inner));
+    CComQIPtr<IClassFactory> factory(pooled);
+
+    std::mutex lock;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> clients;
+    auto start = BenchClock::now();
+    for (int j = 0; j < kClients; ++j) {
+      clients.emplace_back(ComThread<COINIT_MULTITHREADED>, [&]() {
+        CComPtr<IMarshalable> comobj;
+        if (FAILED(factory->CreateInstance(nullptr, IID_PPV_ARGS(&comobj)))) {
+          ++failures;
+          return;
+        }
+        std::unique_ptr<LatencyHistogram> calls(new LatencyHistogram());
+        std::unique_ptr<LatencyHistogram> admitted(new LatencyHistogram());
+        RetryBackoff backoff;
+        long b = 0;
+        int c = 0;
+        unsigned long d = 0;
+        unsigned int e = 0;
+        auto elapsedNs = [](BenchClock::time_point since) {
+          return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     BenchClock::now() - since)
+              .count();
+        };
+        for (int k = 0; k < kCallsPerClient; ++k) {
+          auto callStart = BenchClock::now();
+          HRESULT hr = CallWithBackoff(backoff, [&]() {
+            auto attemptStart = BenchClock::now();
+            HRESULT hr = comobj->TestNumbers(k, &b, &c, &d, &e);
+            if (SUCCEEDED(hr)) {
+              admitted->Record(elapsedNs(attemptStart));
+            }
+            return hr;
+          });
+          if (FAILED(hr)) {
+            ++failures;
+            continue;
+          }
+          calls->Record(elapsedNs(callStart));
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        results[i].mCalls.Merge(*calls);
+        results[i].mAdmitted.Merge(*admitted);
+      });
+    }
+    for (auto &client : clients) {
+      client.join();
+    }
+    double sec =
+        std::chrono::duration<double>(BenchClock::now() - start).count();
+    results[i].mCallsPerSec = kClients * kCallsPerClient / sec;
+    results[i].mRejected = pool.Apartment(0).RejectedCalls();
+    EXPECT_EQ(failures.load(), 0);
+  }
+
+  ASSERT_TRUE(LogFlush());
+  SetLogSink(new ConsoleLogSink);
+  Log(L"%d clients x %d calls on one STA, latency in us\n", kClients,
+      kCallsPerClient);
+  Log(L"max queued     calls/s  rejected   call p50   call p99  "
+      L"admitted p50  admitted p99\n");
+  for (size_t i = 0; i < ARRAYSIZE(kDepths); ++i) {
+    const Result &result = results[i];
+    wchar_t depth[16];
+    if (kDepths[i]) {
+      StringCchPrintfW(depth, ARRAYSIZE(depth), L"%zu", kDepths[i]);
+    } else {
+      StringCchCopyW(depth, ARRAYSIZE(depth), L"unlimited");
+    }
+    Log(L"%-10s %11.0f %9llu %10.1f %10.1f %13.1f %13.1f\n", depth,
+        result.mCallsPerSec, result.mRejected,
+        result.mCalls.Percentile(0.5) / 1000.0,
+        result.mCalls.Percentile(0.99) / 1000.0,
+        result.mAdmitted.Percentile(0.5) / 1000.0,
+        result.mAdmitted.Percentile(0.99) / 1000.0);
+  }
+}
+
+static uint64_t ProcessCpuNs() {
+  FILETIME creation, exit, kernel, user;
+  if (!::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel,
+                         &user)) {
+    return 0;
+  }
+  auto ticks = [](const FILETIME &time) {
+    return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 100;
+}
+
+// Reports the wall and CPU time per round trip of `run`, which makes
+// `rounds` of them
+static void MeasureWakeups(const wchar_t *name, int rounds,
+                           const std::function<void()> &run) {
+  const uint64_t cpuStart = ProcessCpuNs();
+  auto start = BenchClock::now();
+  run();
+  double wallNs =
+      std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+          .count();
+  double cpuNs = static_cast<double>(ProcessCpuNs() - cpuStart);
+  Log(L"%-36s %9.2f us/round trip %9.2f us CPU\n", name,
+      wallNs / rounds / 1000, cpuNs / rounds / 1000);
+}
+
+// Waits for `bell` the way WaitEngine does
+static void SpinThenWait(Doorbell &bell, AdaptiveSpinner &spinner) {
+  spinner.SpinUntil([&bell]() { return bell.Rung(); });
+  bell.Wait();
+}
+
+// Wakeup latency and CPU cost of a ping-pong between two threads, through
+// kernel events, through doorbells with and without spinning, and through
+// an ApartmentQueue served by ThreadMsgWaitForSingleObject
+TEST(Bench, WaitEngine) {
+  constexpr int kRounds = 20000;
+
+  MeasureWakeups(L"Events", kRounds, []() {
+    std::unique_ptr<HANDLE, HandleCloser> ping(
+        ::CreateEventW(nullptr, FALSE, FALSE, nullptr));
+    std::unique_ptr<HANDLE, HandleCloser> pong(
+        ::CreateEventW(nullptr, FALSE, FALSE, nullptr));
+    std::thread peer([&]() {
+      for (int i = 0; i < kRounds; ++i) {
+        ::WaitForSingleObject(ping.get(), INFINITE);
+        ::SetEvent(pong.get());
+      }
+    });
+    for (int i = 0; i < kRounds; ++i) {
+      ::SetEvent(ping.get());
+      ::WaitForSingleObject(pong.get(), INFINITE);
+    }
+    peer.join();
+  });
+
+  for (uint32_t maxSpins : {0u, AdaptiveSpinner::kDefaultMaxSpins}) {
+    auto pingPong = [maxSpins]() {
+      Doorbell ping;
+      Doorbell pong;
+      std::thread peer([&]() {
+        AdaptiveSpinner spinner(maxSpins);
+        for (int i = 0; i < kRounds; ++i) {
+          SpinThenWait(ping, spinner);
+          pong.Ring();
+        }
+      });
+      AdaptiveSpinner spinner(maxSpins);
+      for (int i = 0; i < kRounds; ++i) {
+        ping.Ring();
+        SpinThenWait(pong, spinner);
+      }
+      peer.join();
+    };
+    MeasureWakeups(maxSpins ? L"Doorbells, spin then block"
+                            : L"Doorbells, block",
+                   kRounds, pingPong);
+  }
+
+  for (uint32_t maxSpins : {0u, AdaptiveSpinner::kDefaultMaxSpins}) {
+    std::unique_ptr<HANDLE, HandleCloser> stop(
+        ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    ApartmentQueue queue;
+    queue.Spinner() = AdaptiveSpinner(maxSpins);
+    std::thread apartment([&]() {
+      ThreadMsgWaitForSingleObject(stop.get(), INFINITE, &queue);
+    });
+    auto pingPong = [&]() {
+      Doorbell pong;
+      AdaptiveSpinner spinner(maxSpins);
+      for (int i = 0; i < kRounds; ++i) {
+        queue.Post([&pong]() { pong.Ring(); });
+        SpinThenWait(pong, spinner);
+      }
+    };
+    MeasureWakeups(maxSpins ? L"ApartmentQueue, spin then block"
+                            : L"ApartmentQueue, block",
+                   kRounds, pingPong);
+    ::SetEvent(stop.get());
+    apartment.join();
+
+    const WaitCounters &counters = queue.Counters();
+    Log(L"  %llu wakes, %llu by spinning, %llu dispatched, %.1f ms idle\n",
+        counters.mWakes.load(), counters.mSpinWakes.load(),
+        counters.mDispatched.load(), counters.mIdleNs.load() / 1e6);
+  }
+}
+
+// Streams `total` bytes of the pattern from a producer thread to this one,
+// through `pipe` or IChunkedStream, and checks what arrives.  Returns MB/s.
+static double MeasureStream(uint64_t total, size_t chunkSize, size_t window,
+                            IChunkedStream *stream) {
+  std::unique_ptr<BytePipe> pipe;
+  std::thread producer;
+  ChunkSource source;
+  if (stream) {
+    if (FAILED(stream->OpenRead(static_cast<hyper>(total), 1))) {
+      return 0;
+    }
+    source = ChunkedStreamSource(stream, static_cast<unsigned long>(chunkSize));
+  } else {
+    pipe.reset(new BytePipe(chunkSize));
+    if (!pipe->Valid()) {
+      return 0;
+    }
+    source = [&pipe](uint8_t *buffer, size_t size) {
+      return pipe->Read(buffer, size);
+    };
+  }
+
+  auto start = BenchClock::now();
+  if (pipe) {
+    producer = std::thread([&]() {
+      ChunkWriter writer(
+          [&pipe](const uint8_t *data, size_t size) {
+            return pipe->Write(data, size);
+          },
+          chunkSize, window);
+      std::vector<uint8_t> buffer(chunkSize);
+      for (uint64_t offset = 0; offset < total; offset += chunkSize) {
+        size_t size =
+            static_cast<size_t>(std::min<uint64_t>(chunkSize, total - offset));
+        FillStreamPattern(1, offset, buffer.data(), size);
+        if (!writer.Write(buffer.data(), size)) {
+          break;
+        }
+      }
+      writer.Close();
+      pipe->CloseWrite();
+    });
+  }
+
+  uint64_t received = 0;
+  StreamChecksum checksum;
+  {
+    ChunkReader reader(std::move(source), chunkSize, window,
+                       ComThread<COINIT_MULTITHREADED>);
+    const uint8_t *data;
+    size_t size;
+    while (reader.Next(data, size)) {
+      checksum.Update(data, size);
+      received += size;
+    }
+    EXPECT_FALSE(reader.Failed());
+  }
+  if (producer.joinable()) {
+    producer.join();
+  }
+  double sec = std::chrono::duration<double>(BenchClock::now() - start).count();
+  EXPECT_EQ(received, total);
+  return total / sec / 1e6;
+}
+
+// Throughput of streams from 1 MB to 10 GB in 1 MB chunks, with 0, 1 and 4
+// chunks fetched ahead.  Memory in use is bounded by the chunks in flight,
+// whatever the length.  The pipe is the same on Linux, where BytePipe,
+// ChunkReader and ChunkWriter run unchanged.
+static void MeasureStreams(const wchar_t *context, IChunkedStream *stream,
+                           uint64_t maxTotal) {
+  constexpr size_t kChunkSize = 1 << 20;
+  constexpr uint64_t kTotals[] = {1ull << 20, 16ull << 20, 256ull << 20,
+                                  1ull << 30, 10ull << 30};
+  for (uint64_t total : kTotals) {
+    if (total > maxTotal) {
+      break;
+    }
+    for (size_t window : {0, 1, 4}) {
+      double mbps = MeasureStream(total, kChunkSize, window, stream);
+      Log(L"%s %6llu MB window %zu %10.0f MB/s\n", context, total >> 20,
+          window, mbps);
+    }
+  }
+}
+
+TEST(Bench, ChunkStream) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    MeasureStreams(L"Pipe            ", nullptr, 10ull << 30);
+
+    CComPtr<IChunkedStream> stream;
+    ASSERT_EQ(stream.CoCreateInstance(kCLSID_ExtZ_InProc_STA,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_INPROC_SERVER),
+              S_OK);
+    MeasureStreams(L"InProc MTA->STA ", stream, 1ull << 30);
+    stream.Release();
+    ASSERT_EQ(stream.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+    MeasureStreams(L"OutProc MTA->STA", stream, 1ull << 30);
+  });
+  t.join();
+}
+
+// Time per call to pass a buffer of each size from 4 KB to 64 MB by copying
+// it into a SAFEARRAY, by mapping a section for the call, and through a
+// section mapped beforehand.  The object checksums the buffer either way,
+// so the difference is the cost of moving it.  Mapping has a fixed cost
+// that copying overtakes at some size, which is where it pays to switch.
+static void MeasureSections(const wchar_t *context, IMarshalable2 *comobj) {
+  constexpr ULONG kMaxSize = 64 << 20;
+  constexpr uint64_t kBytesPerSize = 256 << 20;
+  constexpr int kMinRounds = 4;
+
+  std::unique_ptr<SharedSection> section = SharedSection::Create(kMaxSize);
+  ASSERT_TRUE(section);
+  FillStreamPattern(6, 0, section->Data(), kMaxSize);
+  unsigned long objectProcessId = 0;
+  ASSERT_EQ(comobj->GetProcessId(&objectProcessId), S_OK);
+  unsigned long cookie = 0;
+  ASSERT_EQ(comobj->AttachSection(section->ShareWith(objectProcessId),
+                                  kMaxSize, &cookie),
+            S_OK);
+
+  ULONG crossover = 0;
+  for (ULONG size = 4 << 10; size <= kMaxSize; size *= 4) {
+    const int rounds =
+        std::max(kMinRounds, static_cast<int>(kBytesPerSize / size));
+    unsigned long checksum = 0;
+
+    // The SAFEARRAY is filled for each call, like a payload would be
+    CComSafeArray<BYTE> buffer(size);
+    auto start = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) {
+      std::memcpy(&buffer.GetAt(0), section->Data(), size);
+      ASSERT_EQ(comobj->TestBuffer(buffer, &checksum), S_OK);
+    }
+    double copyUs =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        rounds;
+
+    start = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) {
+      ASSERT_EQ(comobj->TestSection(section->ShareWith(objectProcessId), size,
+                                    VARIANT_FALSE, &checksum),
+                S_OK);
+    }
+    double mapUs =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        rounds;
+
+    start = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) {
+      ASSERT_EQ(comobj->TestAttachedSection(cookie, 0, size, &checksum),
+                S_OK);
+    }
+    double attachedUs =
+        std::chrono::duration<double, std::micro>(BenchClock::now() - start)
+            .count() /
+        rounds;
+
+    if (!crossover && mapUs < copyUs) {
+      crossover = size;
+    }
+    Log(L"%s %8lu KB copy %10.1f us  map %10.1f us  attached %10.1f us\n",
+        context, size >> 10, copyUs, mapUs, attachedUs);
+  }
+  if (crossover) {
+    Log(L"%s mapping is faster from %lu KB\n", context, crossover >> 10);
+  } else {
+    Log(L"%s copying is faster at every size\n", context);
+  }
+  EXPECT_EQ(comobj->DetachSection(cookie), S_OK);
+}
+
+TEST(Bench, Sections) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IMarshalable2> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_InProc_STA,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_INPROC_SERVER),
+              S_OK);
+    MeasureSections(L"InProc MTA->STA ", comobj);
+    comobj.Release();
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+    MeasureSections(L"OutProc MTA->STA", comobj);
+  });
+  t.join();
+}
+
+// The string kernels against the routines of the CRT and Windows, on text
+// that is mostly ASCII with a character outside it every 64 and a pair
+// every 256, at the sizes of a name, a path, a page and a large payload
+TEST(Bench, Utf16) {
+  constexpr size_t kBytesPerSize = 256 << 20;
+
+  for (size_t length = 16; length <= (64 << 10); length *= 16) {
+    std::wstring text(length, L'a');
+    for (size_t i = 0; i < length; ++i) {
+      text[i] = static_cast<wchar_t>(L'a' + i % 26);
+      if (i % 64 == 63) {
+        text[i] = 0x00e9;
+      } else if (i % 256 == 254 && i + 1 < length) {
+        text[i] = 0xd83d;
+        text[++i] = 0xde00;
+      }
+    }
+    const wchar_t *wide = text.c_str();
+    const char16_t *str = reinterpret_cast<const char16_t *>(wide);
+    std::vector<wchar_t> wideCopy(length + 1);
+    std::vector<char16_t> copy(length + 1);
+    std::vector<char> utf8(length * kMaxUtf8PerUtf16);
+    const int rounds =
+        static_cast<int>(kBytesPerSize / (length * sizeof(wchar_t)));
+
+    // The results are summed so that the calls aren't optimized away
+    size_t total = 0;
+    auto measure = [&](const wchar_t *name, auto call) {
+      auto start = BenchClock::now();
+      for (int i = 0; i < rounds; ++i) {
+        total += call();
+      }
+      double ns = NanosecondsPerOp(start, rounds);
+      Log(L"%6zu chars %-26s %10.1f ns %8.2f GB/s\n", length, name, ns,
+          length * sizeof(wchar_t) / ns);
+    };
+
+    measure(L"Length wcslen", [&]() { return wcslen(wide); });
+    measure(L"Length scalar", [&]() { return Utf16LengthScalar(str); });
+    measure(L"Length SIMD", [&]() { return Utf16Length(str); });
+
+    measure(L"Copy StringCchCopyW", [&]() {
+      return static_cast<size_t>(
+          ::StringCchCopyW(wideCopy.data(), wideCopy.size(), wide));
+    });
+    measure(L"Copy wcslen+memcpy", [&]() {
+      size_t chars = wcslen(wide);
+      std::memcpy(wideCopy.data(), wide, (chars + 1) * sizeof(wchar_t));
+      return chars;
+    });
+    measure(L"Copy scalar", [&]() {
+      return Utf16CopyStringScalar(copy.data(), copy.size(), str);
+    });
+    measure(L"Copy SIMD", [&]() {
+      return Utf16CopyString(copy.data(), copy.size(), str);
+    });
+
+    measure(L"Validate scalar",
+            [&]() { return Utf16ValidateScalar(str, length) ? 1 : 0; });
+    measure(L"Validate SIMD",
+            [&]() { return Utf16Validate(str, length) ? 1 : 0; });
+
+    measure(L"UTF-8 WideCharToMultiByte", [&]() {
+      return static_cast<size_t>(::WideCharToMultiByte(
+          CP_UTF8, 0, wide, static_cast<int>(length), utf8.data(),
+          static_cast<int>(utf8.size()), nullptr, nullptr));
+    });
+    measure(L"UTF-8 scalar",
+            [&]() { return Utf16ToUtf8Scalar(str, length, utf8.data()); });
+    measure(L"UTF-8 SIMD",
+            [&]() { return Utf16ToUtf8(str, length, utf8.data()); });
+    EXPECT_NE(total, 0u);
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "log.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using BenchClock = std::chrono::steady_clock;
+
+// Collects per-operation latencies and reports throughput and percentiles.
+class LatencyStats {
+  std::vector<int64_t> mSamples; // nanoseconds
+
+  int64_t Percentile(double p) {
+    if (mSamples.empty()) {
+      return 0;
+    }
+    size_t index = static_cast<size_t>(p * (mSamples.size() - 1));
+    std::nth_element(mSamples.begin(), mSamples.begin() + index,
+                     mSamples.end());
+    return mSamples[index];
+  }
+
+public:
+  LatencyStats(size_t expected = 0) { mSamples.reserve(expected); }
+
+  void Add(BenchClock::duration d) {
+    mSamples.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  }
+
+  size_t Count() const { return mSamples.size(); }
+
+  void Report(const wchar_t *name, BenchClock::duration elapsed) {
+    double sec = std::chrono::duration<double>(elapsed).count();
+    int64_t p50 = Percentile(0.50);
+    int64_t p99 = Percentile(0.99);
+    Log(L"%-48s %12.0f ops/s  p50=%8lldns  p99=%8lldns\n", name,
+        sec > 0 ? mSamples.size() / sec : 0.0, p50, p99);
+  }
+};
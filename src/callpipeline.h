@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Client side of a transport that answers requests in the order they were
+// sent, with any number of calls outstanding.  Begin returns a Future at once
+// and Wait completes it, so one thread can keep hundreds of calls in flight
+// and collect their results in any order.
+//
+// There are no threads here.  The pipeline is driven by whoever waits: it
+// sends the requests that fit into the transport, collects the responses that
+// have arrived, and blocks only when the response it needs hasn't.  Requests
+// and responses share one slot per call in a ring that grows as needed, so a
+// steady stream of calls doesn't allocate.
+//
+// `Transport` needs:
+//   using Message = ...;  // With a uint32_t mSequence that is echoed back
+//   bool TrySend(const Message &request);        // False if it's full
+//   bool Receive(Message &response, bool wait);  // False if there is none,
+//                                                // or on disconnection
+//
+// A pipeline and its futures belong to one thread.
+template <typename Transport> class CallPipeline {
+public:
+  using Message = typename Transport::Message;
+
+  class Future {
+    friend class CallPipeline;
+    CallPipeline *mPipeline;
+    uint32_t mSequence;
+
+  public:
+    Future() : mPipeline(nullptr), mSequence(0) {}
+
+    bool Valid() const { return !!mPipeline; }
+
+    // True once the response has arrived.  Doesn't wait, but picks up the
+    // responses that are already there.
+    bool Ready() const { return mPipeline && mPipeline->Poll(*this); }
+  };
+
+private:
+  struct Slot {
+    Message mMessage; // The request until it's sent, then the response
+    bool mFinished;
+  };
+
+  Transport &mTransport;
+  std::vector<Slot> mSlots; // Size is a power of two
+  // Sequence numbers of the oldest unfinished call, the first request not
+  // sent yet, the first response not received yet, and the next call.
+  uint32_t mBase;
+  uint32_t mUnsent;
+  uint32_t mUnreceived;
+  uint32_t mNext;
+  bool mBroken;
+
+  Slot &At(uint32_t sequence) {
+    return mSlots[sequence & (mSlots.size() - 1)];
+  }
+
+  bool Arrived(uint32_t sequence) const {
+    return sequence - mBase < mUnreceived - mBase;
+  }
+
+  void Grow() {
+    std::vector<Slot> old(mSlots.size() * 2);
+    old.swap(mSlots);
+    for (uint32_t sequence = mBase; sequence != mNext; ++sequence) {
+      At(sequence) = old[sequence & (old.size() - 1)];
+    }
+  }
+
+  // Frees the slots of the oldest calls once they're finished
+  void Retire() {
+    while (mBase != mUnreceived && At(mBase).mFinished) {
+      ++mBase;
+    }
+  }
+
+  // Sends what fits and receives what has arrived.  With `wait`, blocks
+  // until at least one response arrives if any is outstanding.
+  bool Pump(bool wait) {
+    if (mBroken) {
+      return false;
+    }
+    for (;;) {
+      while (mUnsent != mNext && mTransport.TrySend(At(mUnsent).mMessage)) {
+        ++mUnsent;
+      }
+      if (mUnreceived == mUnsent) {
+        return true;
+      }
+
+      Message &response = At(mUnreceived).mMessage;
+      if (!mTransport.Receive(response, wait)) {
+        mBroken = wait;
+        return !wait;
+      }
+      if (response.mSequence != mUnreceived) {
+        mBroken = true;
+        return false;
+      }
+      ++mUnreceived;
+      Retire();
+      wait = false;
+    }
+  }
+
+  bool Poll(const Future &future) {
+    Pump(/*wait*/ false);
+    return Arrived(future.mSequence);
+  }
+
+public:
+  explicit CallPipeline(Transport &transport, size_t capacity = 16)
+      : mTransport(transport), mBase(0), mUnsent(0), mUnreceived(0),
+        mNext(0), mBroken(false) {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mSlots.resize(size);
+  }
+
+  CallPipeline(const CallPipeline &) = delete;
+  CallPipeline &operator=(const CallPipeline &) = delete;
+
+  // False once the transport has been disconnected or has answered out of
+  // order.  Every wait fails from then on.
+  bool Broken() const { return mBroken; }
+
+  // Calls begun and not finished
+  size_t Outstanding() const { return mNext - mBase; }
+
+  // The request of the next call, to be filled in before Begin
+  Message &NextRequest() {
+    if (mNext - mBase == mSlots.size()) {
+      Grow();
+    }
+    return At(mNext).mMessage;
+  }
+
+  // Starts the call whose request was filled in through NextRequest
+  Future Begin() {
+    Slot &slot = At(mNext);
+    slot.mMessage.mSequence = mNext;
+    slot.mFinished = false;
+    Future future;
+    future.mPipeline = this;
+    future.mSequence = mNext++;
+    Pump(/*wait*/ false);
+    return future;
+  }
+
+  // Waits for the response of `future`, which stays valid until Finish or
+  // the next NextRequest.  Null if the pipeline is broken or the future
+  // isn't one of its own.
+  const Message *Wait(const Future &future) {
+    if (future.mPipeline != this) {
+      return nullptr;
+    }
+    while (!Arrived(future.mSequence)) {
+      if (!Pump(/*wait*/ true)) {
+        return nullptr;
+      }
+    }
+    return &At(future.mSequence).mMessage;
+  }
+
+  // Releases the slot of `future`, whether or not its response was waited
+  // for, and resets the future
+  void Finish(Future &future) {
+    if (future.mPipeline == this) {
+      At(future.mSequence).mFinished = true;
+      Retire();
+    }
+    future = Future();
+  }
+
+  // Waits until every call that has begun has been answered
+  bool Drain() {
+    while (mUnreceived != mNext) {
+      if (!Pump(/*wait*/ true)) {
+        return false;
+      }
+    }
+    Retire();
+    return true;
+  }
+};
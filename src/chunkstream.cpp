@@ -0,0 +1,350 @@
+#include "chunkstream.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Fills up to a whole chunk, so that a source that returns a little at a
+// time, like a pipe, doesn't shrink the chunks
+static int64_t FillChunk(const ChunkSource &source, uint8_t *buffer,
+                         size_t size) {
+  size_t filled = 0;
+  while (filled < size) {
+    int64_t read = source(buffer + filled, size - filled);
+    if (read < 0) {
+      return read;
+    }
+    if (read == 0) {
+      break;
+    }
+    filled += static_cast<size_t>(read);
+  }
+  return static_cast<int64_t>(filled);
+}
+
+ChunkReader::ChunkReader(ChunkSource source, size_t chunkSize, size_t window,
+                         ChunkThreadWrapper wrapper)
+    : mSource(std::move(source)), mChunkSize(std::max<size_t>(chunkSize, 1)),
+      mChunks(window + 1), mFetched(0), mConsumed(0), mReleased(0),
+      mStopping(false), mFailed(false), mEnded(false) {
+  for (auto &chunk : mChunks) {
+    chunk.mData.reset(new uint8_t[mChunkSize]);
+    chunk.mSize = 0;
+  }
+  if (window == 0) {
+    return;
+  }
+  if (wrapper) {
+    mFetcher = std::thread(wrapper, [this]() { Fetch(); });
+  } else {
+    mFetcher = std::thread([this]() { Fetch(); });
+  }
+}
+
+ChunkReader::~ChunkReader() {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mStopping = true;
+  }
+  mChanged.notify_all();
+  if (mFetcher.joinable()) {
+    mFetcher.join();
+  }
+}
+
+void ChunkReader::Fetch() {
+  std::unique_lock<std::mutex> lock(mLock);
+  for (;;) {
+    mChanged.wait(lock, [this]() {
+      return mStopping || mFetched - mReleased < mChunks.size();
+    });
+    if (mStopping) {
+      return;
+    }
+    // The slot is free and only the consumer moves mReleased, so it stays
+    // free without the lock
+    Chunk &chunk = mChunks[mFetched % mChunks.size()];
+    lock.unlock();
+    int64_t size = FillChunk(mSource, chunk.mData.get(), mChunkSize);
+    lock.lock();
+    chunk.mSize = size;
+    ++mFetched;
+    mChanged.notify_all();
+    if (size <= 0) {
+      return;
+    }
+  }
+}
+
+bool ChunkReader::Next(const uint8_t *&data, size_t &size) {
+  if (mEnded) {
+    return false;
+  }
+
+  Chunk *chunk;
+  if (!mFetcher.joinable()) {
+    chunk = &mChunks[0];
+    chunk->mSize = FillChunk(mSource, chunk->mData.get(), mChunkSize);
+  } else {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (mReleased != mConsumed) {
+      ++mReleased;
+      mChanged.notify_all();
+    }
+    mChanged.wait(lock, [this]() { return mFetched != mConsumed; });
+    chunk = &mChunks[mConsumed++ % mChunks.size()];
+  }
+
+  if (chunk->mSize <= 0) {
+    mFailed = chunk->mSize < 0;
+    mEnded = true;
+    return false;
+  }
+  data = chunk->mData.get();
+  size = static_cast<size_t>(chunk->mSize);
+  return true;
+}
+
+ChunkWriter::ChunkWriter(ChunkSink sink, size_t chunkSize, size_t window,
+                         ChunkThreadWrapper wrapper)
+    : mSink(std::move(sink)), mChunkSize(std::max<size_t>(chunkSize, 1)),
+      mChunks(window + 1), mSizes(window + 1), mFill(0), mFilled(0),
+      mSent(0), mClosed(false), mFailed(false) {
+  for (auto &chunk : mChunks) {
+    chunk.reset(new uint8_t[mChunkSize]);
+  }
+  if (window == 0) {
+    return;
+  }
+  if (wrapper) {
+    mSender = std::thread(wrapper, [this]() { Send(); });
+  } else {
+    mSender = std::thread([this]() { Send(); });
+  }
+}
+
+ChunkWriter::~ChunkWriter() { Close(); }
+
+void ChunkWriter::Send() {
+  std::unique_lock<std::mutex> lock(mLock);
+  for (;;) {
+    mChanged.wait(lock, [this]() { return mClosed || mSent != mFilled; });
+    if (mSent == mFilled) {
+      return;
+    }
+    size_t slot = mSent % mChunks.size();
+    lock.unlock();
+    bool sent = mSink(mChunks[slot].get(), mSizes[slot]);
+    lock.lock();
+    if (!sent) {
+      mFailed = true;
+      mChanged.notify_all();
+      return;
+    }
+    ++mSent;
+    mChanged.notify_all();
+  }
+}
+
+// Hands the chunk being filled to the sender and waits for the next one to
+// be free
+bool ChunkWriter::Submit() {
+  size_t size = mFill;
+  mFill = 0;
+  if (mFailed) {
+    return false;
+  }
+  if (!mSender.joinable()) {
+    if (!mSink(mChunks[0].get(), size)) {
+      mFailed = true;
+    }
+    return !mFailed;
+  }
+
+  std::unique_lock<std::mutex> lock(mLock);
+  mSizes[mFilled % mChunks.size()] = size;
+  ++mFilled;
+  mChanged.notify_all();
+  mChanged.wait(lock, [this]() {
+    return mFailed || mFilled - mSent < mChunks.size();
+  });
+  return !mFailed;
+}
+
+bool ChunkWriter::Write(const uint8_t *data, size_t size) {
+  if (mClosed) {
+    return false;
+  }
+  while (size) {
+    size_t copy = std::min(size, mChunkSize - mFill);
+    std::memcpy(mChunks[mFilled % mChunks.size()].get() + mFill, data, copy);
+    mFill += copy;
+    data += copy;
+    size -= copy;
+    if (mFill == mChunkSize && !Submit()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ChunkWriter::Close() {
+  if (mClosed) {
+    return !mFailed;
+  }
+  if (mFill) {
+    Submit();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mClosed = true;
+  }
+  mChanged.notify_all();
+  if (mSender.joinable()) {
+    mSender.join();
+  }
+  return !mFailed;
+}
+
+// Every 8 bytes are a word of the offset and the seed, mixed well enough to
+// catch chunks that are dropped, repeated or swapped
+static uint64_t PatternWord(uint32_t seed, uint64_t index) {
+  uint64_t word = (index + (static_cast<uint64_t>(seed) << 32) + seed) *
+                  0x9E3779B97F4A7C15ull;
+  return word ^ (word >> 29);
+}
+
+static uint8_t PatternByte(uint32_t seed, uint64_t offset) {
+  return static_cast<uint8_t>(PatternWord(seed, offset >> 3) >>
+                              ((offset & 7) * 8));
+}
+
+void FillStreamPattern(uint32_t seed, uint64_t offset, uint8_t *buffer,
+                       size_t size) {
+  size_t i = 0;
+  for (; i < size && ((offset + i) & 7); ++i) {
+    buffer[i] = PatternByte(seed, offset + i);
+  }
+  for (; size - i >= 8; i += 8) {
+    uint64_t word = PatternWord(seed, (offset + i) >> 3);
+    for (int byte = 0; byte < 8; ++byte) {
+      buffer[i + byte] = static_cast<uint8_t>(word >> (byte * 8));
+    }
+  }
+  for (; i < size; ++i) {
+    buffer[i] = PatternByte(seed, offset + i);
+  }
+}
+
+void StreamChecksum::Update(const uint8_t *data, size_t size) {
+  constexpr uint32_t kModulus = 65521;
+  // The most bytes before mB can overflow 32 bits
+  constexpr size_t kBlock = 5552;
+
+  uint32_t a = mA;
+  uint32_t b = mB;
+  while (size) {
+    size_t block = std::min(size, kBlock);
+    size -= block;
+    for (const uint8_t *end = data + block; data != end; ++data) {
+      a += *data;
+      b += a;
+    }
+    a %= kModulus;
+    b %= kModulus;
+  }
+  mA = a;
+  mB = b;
+}
+
+BytePipe::BytePipe(size_t bufferSize) : mRead(-1), mWrite(-1) {
+#ifdef _WIN32
+  HANDLE read, write;
+  if (!::CreatePipe(&read, &write, nullptr, static_cast<DWORD>(bufferSize))) {
+    return;
+  }
+  mRead = reinterpret_cast<intptr_t>(read);
+  mWrite = reinterpret_cast<intptr_t>(write);
+#else
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC) != 0) {
+    return;
+  }
+  // Only a hint, which fails above /proc/sys/fs/pipe-max-size
+  ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(bufferSize));
+  mRead = fds[0];
+  mWrite = fds[1];
+#endif
+}
+
+BytePipe::~BytePipe() {
+  CloseWrite();
+  if (mRead != -1) {
+#ifdef _WIN32
+    ::CloseHandle(reinterpret_cast<HANDLE>(mRead));
+#else
+    ::close(static_cast<int>(mRead));
+#endif
+  }
+}
+
+int64_t BytePipe::Read(uint8_t *buffer, size_t size) {
+#ifdef _WIN32
+  DWORD read;
+  if (!::ReadFile(reinterpret_cast<HANDLE>(mRead), buffer,
+                  static_cast<DWORD>(std::min<size_t>(size, MAXDWORD)),
+                  &read, nullptr)) {
+    return ::GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+  }
+  return read;
+#else
+  for (;;) {
+    ssize_t read = ::read(static_cast<int>(mRead), buffer, size);
+    if (read >= 0 || errno != EINTR) {
+      return read;
+    }
+  }
+#endif
+}
+
+bool BytePipe::Write(const uint8_t *data, size_t size) {
+  while (size) {
+#ifdef _WIN32
+    DWORD written;
+    if (!::WriteFile(reinterpret_cast<HANDLE>(mWrite), data,
+                     static_cast<DWORD>(std::min<size_t>(size, MAXDWORD)),
+                     &written, nullptr)) {
+      return false;
+    }
+#else
+    ssize_t written = ::write(static_cast<int>(mWrite), data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+#endif
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+void BytePipe::CloseWrite() {
+  if (mWrite == -1) {
+    return;
+  }
+#ifdef _WIN32
+  ::CloseHandle(reinterpret_cast<HANDLE>(mWrite));
+#else
+  ::close(static_cast<int>(mWrite));
+#endif
+  mWrite = -1;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Streams of any length moved in fixed-size chunks, so that neither side
+// has to hold more than a few chunks of it.  ChunkReader fetches chunks
+// ahead of the consumer and ChunkWriter sends them behind the producer, each
+// on a thread of its own, so the transfer overlaps the processing.  The
+// window is the number of chunks in flight besides the one being processed,
+// and zero moves every chunk on the calling thread.
+//
+// Where the chunks come from and go to is up to the caller, e.g. the Read
+// and Write methods of IChunkedStream, or BytePipe below.  Nothing here
+// depends on Windows except the pipe behind BytePipe.
+
+// Fills `buffer` with up to `size` bytes of the stream and returns how many,
+// zero at the end of the stream, or a negative number on failure
+using ChunkSource = std::function<int64_t(uint8_t *buffer, size_t size)>;
+
+// Takes the next `size` bytes of the stream.  False on failure.
+using ChunkSink = std::function<bool(const uint8_t *data, size_t size)>;
+
+// Runs the body of the transfer thread, e.g. ComThread<> to join the
+// apartment that the source or sink belongs to
+using ChunkThreadWrapper =
+    std::function<void(const std::function<void()> &)>;
+
+class ChunkReader {
+  struct Chunk {
+    std::unique_ptr<uint8_t[]> mData;
+    int64_t mSize; // Negative on failure, zero at the end
+  };
+
+  ChunkSource mSource;
+  const size_t mChunkSize;
+  std::vector<Chunk> mChunks; // Ring of window + 1
+  std::mutex mLock;
+  std::condition_variable mChanged;
+  uint64_t mFetched;  // Chunks filled by the fetcher
+  uint64_t mConsumed; // Chunks handed out by Next
+  uint64_t mReleased; // Chunks the consumer is done with
+  bool mStopping;
+  bool mFailed; // Only the consumer sees these
+  bool mEnded;
+  std::thread mFetcher;
+
+  void Fetch();
+
+public:
+  ChunkReader(ChunkSource source, size_t chunkSize, size_t window,
+              ChunkThreadWrapper wrapper = nullptr);
+  // Stops fetching without waiting for the rest of the stream, but waits
+  // for the source to return the chunk it's working on
+  ~ChunkReader();
+
+  ChunkReader(const ChunkReader &) = delete;
+  ChunkReader &operator=(const ChunkReader &) = delete;
+
+  // The next chunk, which stays valid until the next call.  False at the
+  // end of the stream or on failure.
+  bool Next(const uint8_t *&data, size_t &size);
+
+  bool Failed() const { return mFailed; }
+};
+
+class ChunkWriter {
+  ChunkSink mSink;
+  const size_t mChunkSize;
+  std::vector<std::unique_ptr<uint8_t[]>> mChunks; // Ring of window + 1
+  std::vector<size_t> mSizes;
+  size_t mFill;  // Bytes in the chunk being filled
+  std::mutex mLock;
+  std::condition_variable mChanged;
+  uint64_t mFilled; // Chunks handed to the sender
+  uint64_t mSent;   // Chunks the sender is done with
+  bool mClosed;
+  std::atomic<bool> mFailed;
+  std::thread mSender;
+
+  void Send();
+  bool Submit();
+
+public:
+  ChunkWriter(ChunkSink sink, size_t chunkSize, size_t window,
+              ChunkThreadWrapper wrapper = nullptr);
+  // Closes the stream if Close wasn't called
+  ~ChunkWriter();
+
+  ChunkWriter(const ChunkWriter &) = delete;
+  ChunkWriter &operator=(const ChunkWriter &) = delete;
+
+  // Copies `data` into chunks, and waits when the window is full.  False
+  // once the sink has failed.
+  bool Write(const uint8_t *data, size_t size);
+
+  // Sends the last, partial chunk and waits until the sink has taken
+  // everything.  False if it failed.
+  bool Close();
+};
+
+// Deterministic contents for test streams.  The byte at `offset` depends
+// only on the offset and the seed, so any chunk can be generated or checked
+// on its own.
+void FillStreamPattern(uint32_t seed, uint64_t offset, uint8_t *buffer,
+                       size_t size);
+
+// Adler-32 of a stream, which doesn't depend on how it was chunked
+class StreamChecksum {
+  uint32_t mA;
+  uint32_t mB;
+
+public:
+  StreamChecksum() : mA(1), mB(0) {}
+
+  void Update(const uint8_t *data, size_t size);
+  uint32_t Value() const { return (mB << 16) | mA; }
+};
+
+// An anonymous pipe, as a transport that works the same on Windows and
+// Linux.  One thread writes and another reads.
+class BytePipe {
+  intptr_t mRead;
+  intptr_t mWrite;
+
+public:
+  // `bufferSize` is a hint for the capacity of the pipe
+  explicit BytePipe(size_t bufferSize = 1 << 20);
+  ~BytePipe();
+
+  BytePipe(const BytePipe &) = delete;
+  BytePipe &operator=(const BytePipe &) = delete;
+
+  bool Valid() const { return mRead != -1 && mWrite != -1; }
+
+  // Up to `size` bytes.  Zero once the write end is closed and everything
+  // has been read, and negative on failure.
+  int64_t Read(uint8_t *buffer, size_t size);
+  bool Write(const uint8_t *data, size_t size);
+  void CloseWrite();
+};
@@ -0,0 +1,134 @@
+#include "coclient.h"
+#include "log.h"
+#include <algorithm>
+#include <cstring>
+
+ApartmentScheduler::ApartmentScheduler(ApartmentQueue &queue)
+    : mQueue(queue), mPrevious(Current()) {
+  SetCurrent(this);
+}
+
+ApartmentScheduler::~ApartmentScheduler() { SetCurrent(mPrevious); }
+
+void ApartmentScheduler::Schedule(std::coroutine_handle<> handle) {
+  if (!mQueue.Post([handle]() { handle.resume(); })) {
+    Log(L"Failed to resume a coroutine in its apartment\n");
+  }
+}
+
+CoMarshalable::CoMarshalable(ComThreadPool &threads)
+    : mExecutor(threads.MtaThreads()), mStream(nullptr),
+      mUnmarshalResult(E_UNEXPECTED) {}
+
+CoMarshalable::~CoMarshalable() {
+  if (mStream) {
+    // Never unmarshaled
+    LARGE_INTEGER start = {};
+    mStream->Seek(start, STREAM_SEEK_SET, nullptr);
+    ::CoReleaseMarshalData(mStream);
+    mStream->Release();
+  }
+  if (!mObject) {
+    return;
+  }
+
+  // The proxy belongs to the MTA, so it's released there
+  std::unique_ptr<HANDLE, HandleCloser> done(::CreateEventW(
+      /*lpEventAttributes*/ nullptr,
+      /*bManualReset*/ TRUE,
+      /*bInitialState*/ FALSE,
+      /*lpName*/ nullptr));
+  if (!done) {
+    Log(L"CreateEventW failed - %08lx\n", ::GetLastError());
+    return;
+  }
+  HANDLE doneEvent = done.get();
+  mExecutor.Post([this, doneEvent]() {
+    mObject.Release();
+    ::SetEvent(doneEvent);
+  });
+  DWORD index;
+  if (FAILED(::CoWaitForMultipleHandles(0, INFINITE, 1, &doneEvent, &index))) {
+    ::WaitForSingleObject(doneEvent, INFINITE);
+  }
+}
+
+HRESULT CoMarshalable::Attach(IMarshalable *object) {
+  if (mStream || mObject) {
+    return E_UNEXPECTED;
+  }
+  return ::CoMarshalInterThreadInterfaceInStream(IID_IMarshalable, object,
+                                                 &mStream);
+}
+
+HRESULT CoMarshalable::GetMtaObject(IMarshalable **object) {
+  std::call_once(mUnmarshaled, [this]() {
+    if (!mStream) {
+      return;
+    }
+    mUnmarshalResult = ::CoGetInterfaceAndReleaseStream(
+        mStream, IID_IMarshalable, reinterpret_cast<void **>(&mObject));
+    mStream = nullptr;
+    if (FAILED(mUnmarshalResult)) {
+      Log(L"CoGetInterfaceAndReleaseStream failed - %08lx\n",
+          mUnmarshalResult);
+    }
+  });
+  if (FAILED(mUnmarshalResult)) {
+    return mUnmarshalResult;
+  }
+  return mObject.CopyTo(object);
+}
+
+ChunkSource ChunkedStreamSource(IChunkedStream *stream,
+                                unsigned long maxBytes) {
+  CComPtr<IChunkedStream> holder(stream);
+  return [holder, maxBytes](uint8_t *buffer, size_t size) -> int64_t {
+    SAFEARRAY *chunk = nullptr;
+    HRESULT hr = holder->Read(
+        static_cast<unsigned long>(std::min<size_t>(size, maxBytes)), &chunk);
+    if (FAILED(hr)) {
+      Log(L"IChunkedStream::Read failed - %08lx\n", hr);
+      return -1;
+    }
+
+    LONG upper = -1;
+    uint8_t *data = nullptr;
+    if (FAILED(hr = ::SafeArrayGetUBound(chunk, 1, &upper)) ||
+        FAILED(hr = ::SafeArrayAccessData(
+                   chunk, reinterpret_cast<void **>(&data)))) {
+      ::SafeArrayDestroy(chunk);
+      return -1;
+    }
+    size_t count = std::min<size_t>(upper + 1, size);
+    std::memcpy(buffer, data, count);
+    ::SafeArrayUnaccessData(chunk);
+    ::SafeArrayDestroy(chunk);
+    return static_cast<int64_t>(count);
+  };
+}
+
+ChunkSink ChunkedStreamSink(IChunkedStream *stream) {
+  CComPtr<IChunkedStream> holder(stream);
+  return [holder](const uint8_t *data, size_t size) {
+    SAFEARRAY *chunk =
+        ::SafeArrayCreateVector(VT_UI1, 0, static_cast<ULONG>(size));
+    if (!chunk) {
+      return false;
+    }
+    uint8_t *copy;
+    HRESULT hr =
+        ::SafeArrayAccessData(chunk, reinterpret_cast<void **>(&copy));
+    if (SUCCEEDED(hr)) {
+      std::memcpy(copy, data, size);
+      ::SafeArrayUnaccessData(chunk);
+      hr = holder->Write(chunk);
+    }
+    ::SafeArrayDestroy(chunk);
+    if (FAILED(hr)) {
+      Log(L"IChunkedStream::Write failed - %08lx\n", hr);
+      return false;
+    }
+    return true;
+  };
+}
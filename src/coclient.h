@@ -0,0 +1,112 @@
+#pragma once
+
+#include "chunkstream.h"
+#include "comthreadpool.h"
+#include "coro.h"
+#include "interfaces.h"
+#include "shared.h"
+#include "sharedsection.h"
+#include <atlbase.h>
+#include <memory>
+#include <mutex>
+#include <windows.h>
+
+// Resumes coroutines on an apartment thread by posting them to its
+// ApartmentQueue, which the thread drains in ThreadMsgWaitForSingleObject
+// between the calls it dispatches.  The constructor makes it the scheduler
+// of the calling thread, which must own the queue, until it's destroyed.
+class ApartmentScheduler : public CoScheduler {
+  ApartmentQueue &mQueue;
+  CoScheduler *mPrevious;
+
+public:
+  explicit ApartmentScheduler(ApartmentQueue &queue);
+  ~ApartmentScheduler();
+
+  ApartmentScheduler(const ApartmentScheduler &) = delete;
+  ApartmentScheduler &operator=(const ApartmentScheduler &) = delete;
+
+  void Schedule(std::coroutine_handle<> handle) override;
+};
+
+// Calls `call` with a handle to `section` given to process `processId`, for
+// the methods that take such a handle over, like TestSection.  A call that
+// was rejected, by the server's admission or by a message filter giving up,
+// never reached the object, so the handle is closed here instead of staying
+// open in that process.
+template <typename F>
+HRESULT CallWithSection(const SharedSection &section, uint32_t processId,
+                        F call) {
+  uint32_t handle = section.ShareWith(processId);
+  HRESULT hr = call(static_cast<unsigned long>(handle));
+  if (handle &&
+      (hr == RPC_E_SERVERCALL_RETRYLATER || hr == RPC_E_CALL_REJECTED)) {
+    SharedSection::Revoke(processId, handle);
+  }
+  return hr;
+}
+
+// Coroutine client of IMarshalable.  Every method returns an awaitable that
+// makes the call from an MTA thread of `threads`, so the awaiting coroutine
+// suspends instead of blocking its apartment, and is resumed in that
+// apartment with the HRESULT.  The parameters must stay valid until then,
+// which they do if they're locals of the coroutine.
+//
+// The object is unmarshaled into the MTA by the first call, and the pool
+// must outlive this client.
+class CoMarshalable {
+  ThreadExecutor &mExecutor;
+  IStream *mStream; // The object marshaled by Attach
+  std::once_flag mUnmarshaled;
+  CComPtr<IMarshalable> mObject; // In the MTA
+  HRESULT mUnmarshalResult;
+
+  // Called on the MTA threads
+  HRESULT GetMtaObject(IMarshalable **object);
+
+  template <typename F> auto Call(F call) {
+    return CoOffload(mExecutor, [this, call]() {
+      CComPtr<IMarshalable> object;
+      HRESULT hr = GetMtaObject(&object);
+      return SUCCEEDED(hr) ? call(object.p) : hr;
+    });
+  }
+
+public:
+  explicit CoMarshalable(ComThreadPool &threads);
+  ~CoMarshalable();
+
+  CoMarshalable(const CoMarshalable &) = delete;
+  CoMarshalable &operator=(const CoMarshalable &) = delete;
+
+  // Must be called once, from the apartment `object` belongs to
+  HRESULT Attach(IMarshalable *object);
+
+  auto TestNumbers(long numberIn, long *pnumberIn, int *numberOut,
+                   unsigned long *numberInOut, unsigned int *numberRetval) {
+    return Call([=](IMarshalable *object) {
+      return object->TestNumbers(numberIn, pnumberIn, numberOut, numberInOut,
+                                 numberRetval);
+    });
+  }
+
+  auto TestWideStrings(wchar_t *strIn, wchar_t *strInOut, wchar_t **strOut) {
+    return Call([=](IMarshalable *object) {
+      return object->TestWideStrings(strIn, strInOut, strOut);
+    });
+  }
+
+  auto TestBStrings(BSTR strIn, BSTR *strOut, BSTR *strInOut) {
+    return Call([=](IMarshalable *object) {
+      return object->TestBStrings(strIn, strOut, strInOut);
+    });
+  }
+};
+
+// Source and sink of ChunkReader and ChunkWriter on IChunkedStream.  The
+// transfer threads make the calls, so the stream must be usable from them,
+// e.g. a proxy in the MTA with ComThread<COINIT_MULTITHREADED> as the
+// wrapper.  Reads ask for up to `maxBytes` at a time.
+ChunkSource ChunkedStreamSource(IChunkedStream *stream,
+                                unsigned long maxBytes);
+ChunkSink ChunkedStreamSink(IChunkedStream *stream);
@@ -0,0 +1,375 @@
+#pragma once
+
+#include "utf16.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Encoders and decoders of method calls, specialized at compile time from a
+// parameter list that mirrors the IDL.  For example,
+//   HRESULT Foo([in] long a, [out] int *b, [in, out, string] wchar_t *c);
+// is encoded by
+//   MethodCodec<In<long>, Out<int>, InOutString>
+// Each parameter type moves its value through a byte buffer in both
+// directions, so a call is a fixed sequence of copies instead of a walk over
+// type descriptions.  Only the BSTR parameters depend on Windows, so the
+// rest can be built and tested anywhere.
+
+// Appends to a fixed buffer.  Once something doesn't fit, everything after
+// it is dropped and Ok() returns false.
+class CodecWriter {
+  uint8_t *mData;
+  size_t mCapacity;
+  size_t mSize;
+  bool mOverflow;
+
+public:
+  CodecWriter(void *data, size_t capacity)
+      : mData(static_cast<uint8_t *>(data)), mCapacity(capacity), mSize(0),
+        mOverflow(false) {}
+
+  size_t Size() const { return mSize; }
+  bool Ok() const { return !mOverflow; }
+
+  void Write(const void *src, size_t bytes) {
+    if (mOverflow || bytes > mCapacity - mSize) {
+      mOverflow = true;
+      return;
+    }
+    memcpy(mData + mSize, src, bytes);
+    mSize += bytes;
+  }
+
+  template <typename T> void Put(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>, "Not a plain value");
+    Write(&value, sizeof(value));
+  }
+
+  // A length followed by the characters.  nullptr is encoded as a length of
+  // kNullString, so that it's not confused with an empty string.
+  static constexpr uint32_t kNullString = 0xffffffff;
+
+  void PutString(const wchar_t *str, size_t length) {
+    if (!str) {
+      Put(kNullString);
+      return;
+    }
+    Put(static_cast<uint32_t>(length));
+    Write(str, length * sizeof(wchar_t));
+  }
+};
+
+// Reads what CodecWriter wrote.  Reading past the end makes Ok() false and
+// returns zeros.
+class CodecReader {
+  const uint8_t *mData;
+  size_t mSize;
+  size_t mPosition;
+  bool mFailed;
+
+public:
+  CodecReader(const void *data, size_t size)
+      : mData(static_cast<const uint8_t *>(data)), mSize(size), mPosition(0),
+        mFailed(false) {}
+
+  bool Ok() const { return !mFailed; }
+  void Fail() { mFailed = true; }
+
+  void Read(void *dst, size_t bytes) {
+    if (mFailed || bytes > mSize - mPosition) {
+      mFailed = true;
+      memset(dst, 0, bytes);
+      return;
+    }
+    memcpy(dst, mData + mPosition, bytes);
+    mPosition += bytes;
+  }
+
+  template <typename T> T Get() {
+    static_assert(std::is_trivially_copyable_v<T>, "Not a plain value");
+    T value;
+    Read(&value, sizeof(value));
+    return value;
+  }
+
+  // Returns false for a null string
+  bool GetString(std::wstring &str) {
+    uint32_t length = Get<uint32_t>();
+    if (length == CodecWriter::kNullString || mFailed) {
+      str.clear();
+      return false;
+    }
+    if (length > (mSize - mPosition) / sizeof(wchar_t)) {
+      mFailed = true;
+      str.clear();
+      return false;
+    }
+    str.resize(length);
+    Read(&str[0], length * sizeof(wchar_t));
+    return true;
+  }
+};
+
+// [out] strings are owned by the caller, who frees them like any other COM
+// task memory
+inline wchar_t *CodecAllocString(const std::wstring &str) {
+  size_t bytes = (str.size() + 1) * sizeof(wchar_t);
+#ifdef _WIN32
+  void *p = ::CoTaskMemAlloc(bytes);
+#else
+  void *p = malloc(bytes);
+#endif
+  if (p) {
+    memcpy(p, str.c_str(), bytes);
+  }
+  return static_cast<wchar_t *>(p);
+}
+
+inline void CodecFreeString(wchar_t *str) {
+#ifdef _WIN32
+  ::CoTaskMemFree(str);
+#else
+  free(str);
+#endif
+}
+
+// Every parameter type has the members below.  `Arg` is the type in the
+// method signature, and `Slot` holds the value on the server side for the
+// duration of the call.  The defaults do nothing, so each type only defines
+// the directions it travels in.
+template <typename ArgType, typename SlotType> struct CodecParam {
+  using Arg = ArgType;
+  using Slot = SlotType;
+
+  static void EncodeRequest(CodecWriter &, Arg) {}
+  static void DecodeRequest(CodecReader &, Slot &) {}
+  static void EncodeResponse(CodecWriter &, Slot &) {}
+  static void DecodeResponse(CodecReader &, Arg) {}
+  static void Release(Slot &) {}
+};
+
+// [in] T
+template <typename T> struct In : CodecParam<T, T> {
+  static void EncodeRequest(CodecWriter &w, T arg) { w.Put(arg); }
+  static void DecodeRequest(CodecReader &r, T &slot) { slot = r.Get<T>(); }
+  static T ServerArg(T &slot) { return slot; }
+};
+
+// [in] T *
+template <typename T> struct InPtr : CodecParam<T *, T> {
+  static void EncodeRequest(CodecWriter &w, T *arg) { w.Put(*arg); }
+  static void DecodeRequest(CodecReader &r, T &slot) { slot = r.Get<T>(); }
+  static T *ServerArg(T &slot) { return &slot; }
+};
+
+// [out] T *
+template <typename T> struct Out : CodecParam<T *, T> {
+  static T *ServerArg(T &slot) { return &slot; }
+  static void EncodeResponse(CodecWriter &w, T &slot) { w.Put(slot); }
+  static void DecodeResponse(CodecReader &r, T *arg) { *arg = r.Get<T>(); }
+};
+
+// [in, out] T *
+template <typename T> struct InOut : CodecParam<T *, T> {
+  static void EncodeRequest(CodecWriter &w, T *arg) { w.Put(*arg); }
+  static void DecodeRequest(CodecReader &r, T &slot) { slot = r.Get<T>(); }
+  static T *ServerArg(T &slot) { return &slot; }
+  static void EncodeResponse(CodecWriter &w, T &slot) { w.Put(slot); }
+  static void DecodeResponse(CodecReader &r, T *arg) { *arg = r.Get<T>(); }
+};
+
+// A string received by the server.  The method may write to it in place.
+struct CodecString {
+  std::wstring mValue;
+  bool mNull;
+
+  wchar_t *Data() { return mNull ? nullptr : &mValue[0]; }
+};
+
+// [in, string] wchar_t *
+struct InString : CodecParam<wchar_t *, CodecString> {
+  static void EncodeRequest(CodecWriter &w, wchar_t *arg) {
+    w.PutString(arg, arg ? WideLength(arg) : 0);
+  }
+  static void DecodeRequest(CodecReader &r, CodecString &slot) {
+    slot.mNull = !r.GetString(slot.mValue);
+  }
+  static wchar_t *ServerArg(CodecString &slot) { return slot.Data(); }
+};
+
+// [in, out, string] wchar_t *.  The string comes back into the caller's
+// buffer, so it's cut at the length it had.
+struct InOutString : InString {
+  static void EncodeResponse(CodecWriter &w, CodecString &slot) {
+    w.PutString(slot.Data(), slot.mNull ? 0 : WideLength(slot.Data()));
+  }
+  static void DecodeResponse(CodecReader &r, wchar_t *arg) {
+    std::wstring str;
+    if (r.GetString(str) && arg) {
+      size_t length = WideLength(arg);
+      if (str.size() < length) {
+        length = str.size();
+      }
+      memcpy(arg, str.c_str(), length * sizeof(wchar_t));
+      arg[length] = 0;
+    }
+  }
+};
+
+// [out, string] wchar_t **
+struct OutString : CodecParam<wchar_t **, wchar_t *> {
+  static wchar_t **ServerArg(wchar_t *&slot) { return &slot; }
+  static void EncodeResponse(CodecWriter &w, wchar_t *&slot) {
+    w.PutString(slot, slot ? WideLength(slot) : 0);
+  }
+  static void DecodeResponse(CodecReader &r, wchar_t **arg) {
+    std::wstring str;
+    *arg = nullptr;
+    if (r.GetString(str) && !(*arg = CodecAllocString(str))) {
+      r.Fail();
+    }
+  }
+  static void Release(wchar_t *&slot) {
+    CodecFreeString(slot);
+    slot = nullptr;
+  }
+};
+
+#ifdef _WIN32
+
+// BSTRs keep their length, including embedded nulls
+
+inline void CodecPutBstr(CodecWriter &w, BSTR str) {
+  w.PutString(str, ::SysStringLen(str));
+}
+
+inline BSTR CodecGetBstr(CodecReader &r) {
+  std::wstring str;
+  if (!r.GetString(str)) {
+    return nullptr;
+  }
+  BSTR bstr =
+      ::SysAllocStringLen(str.c_str(), static_cast<UINT>(str.size()));
+  if (!bstr) {
+    r.Fail();
+  }
+  return bstr;
+}
+
+// [in] BSTR
+struct InBstr : CodecParam<BSTR, BSTR> {
+  static void EncodeRequest(CodecWriter &w, BSTR arg) { CodecPutBstr(w, arg); }
+  static void DecodeRequest(CodecReader &r, BSTR &slot) {
+    slot = CodecGetBstr(r);
+  }
+  static BSTR ServerArg(BSTR &slot) { return slot; }
+  static void Release(BSTR &slot) {
+    ::SysFreeString(slot);
+    slot = nullptr;
+  }
+};
+
+// [out] BSTR *
+struct OutBstr : CodecParam<BSTR *, BSTR> {
+  static BSTR *ServerArg(BSTR &slot) { return &slot; }
+  static void EncodeResponse(CodecWriter &w, BSTR &slot) {
+    CodecPutBstr(w, slot);
+  }
+  static void DecodeResponse(CodecReader &r, BSTR *arg) {
+    *arg = CodecGetBstr(r);
+  }
+  static void Release(BSTR &slot) {
+    ::SysFreeString(slot);
+    slot = nullptr;
+  }
+};
+
+// [in, out] BSTR *
+struct InOutBstr : OutBstr {
+  static void EncodeRequest(CodecWriter &w, BSTR *arg) {
+    CodecPutBstr(w, *arg);
+  }
+  static void DecodeRequest(CodecReader &r, BSTR &slot) {
+    slot = CodecGetBstr(r);
+  }
+  static void DecodeResponse(CodecReader &r, BSTR *arg) {
+    ::SysFreeString(*arg);
+    *arg = CodecGetBstr(r);
+  }
+};
+
+#endif // _WIN32
+
+template <typename Method> struct CodecMethodTraits;
+
+template <typename R, typename C, typename... A>
+struct CodecMethodTraits<R (C::*)(A...)> {
+  using Args = std::tuple<A...>;
+};
+
+#if defined(_M_IX86)
+template <typename R, typename C, typename... A>
+struct CodecMethodTraits<R (__stdcall C::*)(A...)> {
+  using Args = std::tuple<A...>;
+};
+#endif
+
+template <typename... Params> struct MethodCodec {
+  using Args = std::tuple<typename Params::Arg...>;
+  using Slots = std::tuple<typename Params::Slot...>;
+
+  // True if the parameters are exactly those of `Method`, a pointer to a
+  // member function.  Use it in a static_assert next to each codec so that
+  // a change in the IDL breaks the build instead of the wire format.
+  template <typename Method>
+  static constexpr bool kMatches =
+      std::is_same_v<typename CodecMethodTraits<Method>::Args, Args>;
+
+  // Client side
+  static bool EncodeRequest(CodecWriter &w, typename Params::Arg... args) {
+    (Params::EncodeRequest(w, args), ...);
+    return w.Ok();
+  }
+
+  static bool DecodeResponse(CodecReader &r, typename Params::Arg... args) {
+    (Params::DecodeResponse(r, args), ...);
+    return r.Ok();
+  }
+
+  // Server side: decodes a request, calls `method` and encodes the response.
+  // The whole request is decoded before the method runs, so `request` and
+  // `response` may share a buffer.  Returns false if the request is
+  // malformed or the response doesn't fit.
+  template <typename Object, typename Method, typename Result>
+  static bool Dispatch(CodecReader &request, CodecWriter &response,
+                       Object *object, Method method, Result &result) {
+    return DispatchWithSlots(request, response, object, method, result,
+                             std::index_sequence_for<Params...>());
+  }
+
+private:
+  template <typename Object, typename Method, typename Result, size_t... I>
+  static bool DispatchWithSlots(CodecReader &request, CodecWriter &response,
+                                Object *object, Method method, Result &result,
+                                std::index_sequence<I...>) {
+    Slots slots{};
+    (Params::DecodeRequest(request, std::get<I>(slots)), ...);
+    bool ok = request.Ok();
+    if (ok) {
+      result = (object->*method)(Params::ServerArg(std::get<I>(slots))...);
+      (Params::EncodeResponse(response, std::get<I>(slots)), ...);
+      ok = response.Ok();
+    }
+    (Params::Release(std::get<I>(slots)), ...);
+    return ok;
+  }
+};
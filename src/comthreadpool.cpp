@@ -0,0 +1,24 @@
+#include "comthreadpool.h"
+#include "log.h"
+#include <algorithm>
+
+ComThreadPool::ComThreadPool(size_t staThreads, size_t mtaThreads)
+    : mStaThreads(staThreads, kActivateLeastLoaded),
+      mMtaThreads(std::max(mtaThreads, size_t(1)),
+                  ComThread<COINIT_MULTITHREADED>) {}
+
+bool ComThreadPool::Post(ApartmentKind kind, std::function<void()> task) {
+  if (kind == kApartmentMTA) {
+    mMtaThreads.Post(std::move(task));
+    return true;
+  }
+  if (mStaThreads.Size() == 0) {
+    Log(L"No STA thread to run a task\n");
+    return false;
+  }
+  if (!mStaThreads.Apartment(mStaThreads.Pick()).Post(std::move(task))) {
+    Log(L"Failed to post a task to an STA thread\n");
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "apartmentpool.h"
+#include "coro.h"
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+enum ApartmentKind {
+  kApartmentSTA,
+  kApartmentMTA,
+};
+
+// Long-lived threads that have joined their apartment once, for tasks that
+// would otherwise start a ComThread<> of their own and pay for the thread and
+// for CoInitializeEx every time.  STA tasks go to the least loaded of the STA
+// threads, which dispatch calls in between, and MTA tasks to whichever MTA
+// thread is free.
+//
+// A task must not wait for a later task of the same STA thread.  Tasks left
+// when the pool is destroyed may not run, and their futures then throw
+// std::future_error with broken_promise.
+class ComThreadPool {
+  ApartmentPool mStaThreads;
+  ThreadExecutor mMtaThreads;
+
+  bool Post(ApartmentKind kind, std::function<void()> task);
+
+public:
+  // At least one thread of each kind is started
+  ComThreadPool(size_t staThreads, size_t mtaThreads);
+
+  ComThreadPool(const ComThreadPool &) = delete;
+  ComThreadPool &operator=(const ComThreadPool &) = delete;
+
+  size_t StaThreads() const { return mStaThreads.Size(); }
+
+  // The MTA threads, for CoOffload and anything else that takes an executor
+  ThreadExecutor &MtaThreads() { return mMtaThreads; }
+
+  template <typename F>
+  std::future<std::invoke_result_t<F &>> Submit(ApartmentKind kind, F task) {
+    using Result = std::invoke_result_t<F &>;
+    // std::function needs a copyable target
+    auto packaged =
+        std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    std::future<Result> result = packaged->get_future();
+    Post(kind, [packaged]() { (*packaged)(); });
+    return result;
+  }
+};
@@ -0,0 +1,87 @@
+#include "coro.h"
+
+static thread_local CoScheduler *tCurrentScheduler;
+
+CoScheduler *CoScheduler::Current() { return tCurrentScheduler; }
+
+void CoScheduler::SetCurrent(CoScheduler *scheduler) {
+  tCurrentScheduler = scheduler;
+}
+
+// Notifies under the lock, because the coroutine may end the loop and the
+// scheduler with it as soon as the lock is released
+void LoopScheduler::Schedule(std::coroutine_handle<> handle) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mQueue.push_back(handle);
+  mReady.notify_one();
+}
+
+void LoopScheduler::Run() {
+  CoScheduler *previous = Current();
+  SetCurrent(this);
+  std::unique_lock<std::mutex> lock(mLock);
+  for (;;) {
+    mReady.wait(lock, [this]() { return mStopped || !mQueue.empty(); });
+    if (mQueue.empty()) {
+      break;
+    }
+    std::coroutine_handle<> handle = mQueue.front();
+    mQueue.pop_front();
+    lock.unlock();
+    handle.resume();
+    lock.lock();
+  }
+  mStopped = false;
+  SetCurrent(previous);
+}
+
+void LoopScheduler::Stop() {
+  std::lock_guard<std::mutex> lock(mLock);
+  mStopped = true;
+  mReady.notify_one();
+}
+
+ThreadExecutor::ThreadExecutor(size_t threads, ThreadWrapper wrapper)
+    : mStopping(false) {
+  for (size_t i = 0; i < threads; ++i) {
+    if (wrapper) {
+      mThreads.emplace_back(wrapper, [this]() { Work(); });
+    } else {
+      mThreads.emplace_back([this]() { Work(); });
+    }
+  }
+}
+
+ThreadExecutor::~ThreadExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mStopping = true;
+  }
+  mReady.notify_all();
+  for (auto &thread : mThreads) {
+    thread.join();
+  }
+}
+
+void ThreadExecutor::Post(std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mQueue.push_back(std::move(work));
+  }
+  mReady.notify_one();
+}
+
+void ThreadExecutor::Work() {
+  std::unique_lock<std::mutex> lock(mLock);
+  for (;;) {
+    mReady.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+    if (mQueue.empty()) {
+      return;
+    }
+    std::function<void()> work = std::move(mQueue.front());
+    mQueue.pop_front();
+    lock.unlock();
+    work();
+    lock.lock();
+  }
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Coroutines for clients that shouldn't block the thread they run on.  A
+// coroutine awaiting CoOffload suspends while the work runs on a
+// ThreadExecutor, and is resumed by the CoScheduler of the thread it was
+// running on.  On an apartment thread that is ApartmentScheduler in
+// coclient.h, so the coroutine stays in its apartment.  Nothing here depends
+// on Windows.
+
+// Resumes coroutines on the thread it belongs to
+class CoScheduler {
+public:
+  virtual ~CoScheduler() = default;
+
+  // Can be called from any thread
+  virtual void Schedule(std::coroutine_handle<> handle) = 0;
+
+  // The scheduler of the current thread, or null if it has none
+  static CoScheduler *Current();
+  static void SetCurrent(CoScheduler *scheduler);
+};
+
+// Scheduler of a thread that has nothing else to do.  Run resumes the
+// scheduled coroutines until Stop is called.
+class LoopScheduler : public CoScheduler {
+  std::mutex mLock;
+  std::condition_variable mReady;
+  std::deque<std::coroutine_handle<>> mQueue;
+  bool mStopped;
+
+public:
+  LoopScheduler() : mStopped(false) {}
+
+  void Schedule(std::coroutine_handle<> handle) override;
+
+  // Makes this the scheduler of the calling thread while it runs
+  void Run();
+  // Can be called from any thread, and from a coroutine of this scheduler
+  void Stop();
+};
+
+// A fixed set of threads running blocking work in the order it was posted.
+// `wrapper` runs the body of each thread, e.g. ComThread<> to join an
+// apartment first.  The destructor runs what's left, then joins.
+class ThreadExecutor {
+public:
+  using ThreadWrapper = std::function<void(const std::function<void()> &)>;
+
+private:
+  std::mutex mLock;
+  std::condition_variable mReady;
+  std::deque<std::function<void()>> mQueue;
+  bool mStopping;
+  std::vector<std::thread> mThreads;
+
+  void Work();
+
+public:
+  explicit ThreadExecutor(size_t threads, ThreadWrapper wrapper = nullptr);
+  ~ThreadExecutor();
+
+  ThreadExecutor(const ThreadExecutor &) = delete;
+  ThreadExecutor &operator=(const ThreadExecutor &) = delete;
+
+  void Post(std::function<void()> work);
+};
+
+// Coroutine returning T.  It starts when it's awaited, or when Start is
+// called on a top-level task, and resumes its awaiter when it's done.  The
+// object owns the coroutine, so a started top-level task must outlive it.
+template <typename T = void> class CoTask;
+
+template <typename T> struct CoPromiseBase {
+  std::coroutine_handle<> mContinuation;
+
+  // Transfers to the awaiter, if any, without growing the stack
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> handle) noexcept {
+      std::coroutine_handle<> next = handle.promise().mContinuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T> struct CoPromise : CoPromiseBase<T> {
+  std::optional<T> mValue;
+
+  CoTask<T> get_return_object();
+  void return_value(T value) { mValue.emplace(std::move(value)); }
+  T Result() { return std::move(*mValue); }
+};
+
+template <> struct CoPromise<void> : CoPromiseBase<void> {
+  CoTask<void> get_return_object();
+  void return_void() {}
+  void Result() {}
+};
+
+template <typename T> class CoTask {
+public:
+  using promise_type = CoPromise<T>;
+
+private:
+  std::coroutine_handle<promise_type> mHandle;
+
+public:
+  explicit CoTask(std::coroutine_handle<promise_type> handle)
+      : mHandle(handle) {}
+  CoTask(CoTask &&other) noexcept
+      : mHandle(std::exchange(other.mHandle, {})) {}
+  ~CoTask() {
+    if (mHandle) {
+      mHandle.destroy();
+    }
+  }
+
+  CoTask(const CoTask &) = delete;
+  CoTask &operator=(const CoTask &) = delete;
+
+  void Start() { mHandle.resume(); }
+  bool Done() const { return mHandle.done(); }
+  T Result() { return mHandle.promise().Result(); }
+
+  bool await_ready() const { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    mHandle.promise().mContinuation = awaiter;
+    return mHandle;
+  }
+  T await_resume() { return mHandle.promise().Result(); }
+};
+
+template <typename T> CoTask<T> CoPromise<T>::get_return_object() {
+  return CoTask<T>(std::coroutine_handle<CoPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoPromise<void>::get_return_object() {
+  return CoTask<void>(
+      std::coroutine_handle<CoPromise<void>>::from_promise(*this));
+}
+
+// Awaitable returned by CoOffload
+template <typename F> class CoOffloadAwaiter {
+  using Result = std::invoke_result_t<F &>;
+  static_assert(!std::is_void_v<Result>, "The work must return a value");
+
+  ThreadExecutor &mExecutor;
+  F mWork;
+  std::optional<Result> mResult;
+
+public:
+  CoOffloadAwaiter(ThreadExecutor &executor, F work)
+      : mExecutor(executor), mWork(std::move(work)) {}
+
+  // Without a scheduler to come back to, the work runs inline
+  bool await_ready() const { return !CoScheduler::Current(); }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    CoScheduler *scheduler = CoScheduler::Current();
+    mExecutor.Post([this, scheduler, handle]() {
+      mResult.emplace(mWork());
+      scheduler->Schedule(handle);
+    });
+  }
+
+  Result await_resume() { return mResult ? std::move(*mResult) : mWork(); }
+};
+
+// Runs `work` on `executor` and resumes the awaiting coroutine on the
+// scheduler of its thread with the result of the work
+template <typename F>
+CoOffloadAwaiter<F> CoOffload(ThreadExecutor &executor, F work) {
+  return CoOffloadAwaiter<F>(executor, std::move(work));
+}
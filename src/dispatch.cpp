@@ -0,0 +1,53 @@
+#include "dispatch.h"
+
+int DispNameIndexNotFound() { return -1; }
+
+#ifdef _WIN32
+
+// puArgErr is an index into rgvarg, not a position
+static void SetArgErr(const DISPPARAMS *params, UINT position, UINT *argErr) {
+  if (argErr) {
+    *argErr = params->cArgs - 1 - position;
+  }
+}
+
+HRESULT CheckDispParams(WORD flags, const DISPPARAMS *params, UINT argCount) {
+  if (!(flags & DISPATCH_METHOD)) {
+    return DISP_E_MEMBERNOTFOUND;
+  }
+  if (!params) {
+    return E_POINTER;
+  }
+  if (params->cNamedArgs) {
+    return DISP_E_NONAMEDARGS;
+  }
+  if (params->cArgs != argCount) {
+    return DISP_E_BADPARAMCOUNT;
+  }
+  return S_OK;
+}
+
+HRESULT DispGetValue(DISPPARAMS *params, UINT position, VARTYPE vt,
+                     VARIANT &value, UINT *argErr) {
+  ::VariantInit(&value);
+  HRESULT hr =
+      ::VariantChangeType(&value, &DispArg(params, position), /*wFlags*/ 0, vt);
+  if (FAILED(hr)) {
+    SetArgErr(params, position, argErr);
+    return DISP_E_TYPEMISMATCH;
+  }
+  return S_OK;
+}
+
+HRESULT DispGetRef(DISPPARAMS *params, UINT position, VARTYPE vt, void *&ref,
+                   UINT *argErr) {
+  VARIANT &arg = DispArg(params, position);
+  if (V_VT(&arg) != (vt | VT_BYREF) || !V_BYREF(&arg)) {
+    SetArgErr(params, position, argErr);
+    return DISP_E_TYPEMISMATCH;
+  }
+  ref = V_BYREF(&arg);
+  return S_OK;
+}
+
+#endif // _WIN32
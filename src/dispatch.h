@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Building blocks of a table-driven IDispatch.  An object lists its methods in
+// a constexpr table of DispMethod in DISPID order.  Names are resolved with a
+// perfect hash computed at compile time, and Invoke indexes the table with the
+// DISPID and calls an invoker that unpacks DISPPARAMS itself, so neither path
+// goes through a type library.
+//
+// The name index doesn't depend on Windows.  The rest works with OLE
+// Automation types, so it's only built on Windows.
+
+constexpr wchar_t DispFoldCase(wchar_t c) {
+  return c >= L'A' && c <= L'Z' ? static_cast<wchar_t>(c - L'A' + L'a') : c;
+}
+
+// FNV-1a.  IDispatch names are case-insensitive, so ASCII letters are folded.
+constexpr uint32_t DispNameHash(const wchar_t *name, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (; *name; ++name) {
+    hash = (hash ^ static_cast<uint32_t>(DispFoldCase(*name))) * 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+constexpr bool DispNameEquals(const wchar_t *a, const wchar_t *b) {
+  for (; *a && DispFoldCase(*a) == DispFoldCase(*b); ++a, ++b) {
+  }
+  return DispFoldCase(*a) == DispFoldCase(*b);
+}
+
+// Not constexpr on purpose.  Calling it from MakeDispNameIndex makes a table
+// without a perfect hash, e.g. one with duplicate names, a compile error.
+int DispNameIndexNotFound();
+
+template <size_t N> class DispNameIndex {
+public:
+  static constexpr size_t kSlots = N * 4 < 8 ? 8 : N * 4;
+
+  uint32_t mSeed;
+  int mSlots[kSlots]; // Index into mNames, or -1
+  const wchar_t *mNames[N];
+
+  // Returns the index of `name`, or -1 if it's not in the table
+  int Find(const wchar_t *name) const {
+    int index = mSlots[DispNameHash(name, mSeed) % kSlots];
+    return index >= 0 && DispNameEquals(name, mNames[index]) ? index : -1;
+  }
+};
+
+template <typename Entry, size_t N>
+constexpr DispNameIndex<N> MakeDispNameIndex(const Entry (&entries)[N]) {
+  DispNameIndex<N> index = {};
+  for (size_t i = 0; i < N; ++i) {
+    index.mNames[i] = entries[i].mName;
+  }
+
+  for (uint32_t seed = 0; seed < 1000; ++seed) {
+    bool collided = false;
+    for (int &slot : index.mSlots) {
+      slot = -1;
+    }
+    for (size_t i = 0; i < N && !collided; ++i) {
+      int &slot = index.mSlots[DispNameHash(entries[i].mName, seed) %
+                               DispNameIndex<N>::kSlots];
+      collided = slot >= 0;
+      slot = static_cast<int>(i);
+    }
+    if (!collided) {
+      index.mSeed = seed;
+      return index;
+    }
+  }
+  DispNameIndexNotFound();
+  return index;
+}
+
+#ifdef _WIN32
+
+// DISPID that MIDL gives to method `index` of a dual interface without [id]
+// attributes.  `depth` is the number of interfaces it derives from, e.g. 2
+// for one derived from IDispatch.  A table holds the methods of one
+// interface in declaration order, and starts at MidlDispId(depth, 0).
+constexpr DISPID MidlDispId(unsigned depth, unsigned index) {
+  return static_cast<DISPID>(0x60000000u + (depth << 16) + index);
+}
+
+template <typename T> struct DispMethod {
+  const wchar_t *mName;
+  UINT mArgCount; // Without [retval]
+  HRESULT (*mInvoke)(T *object, DISPPARAMS *params, VARIANT *result,
+                     UINT *argErr);
+};
+
+// Checks what every method has in common: it's called as a method with the
+// right number of arguments, and none of them is named.
+HRESULT CheckDispParams(WORD flags, const DISPPARAMS *params, UINT argCount);
+
+// Arguments are numbered from the left, but rgvarg holds them from the right
+inline VARIANT &DispArg(DISPPARAMS *params, UINT position) {
+  return params->rgvarg[params->cArgs - 1 - position];
+}
+
+// Converts an [in] argument passed by value or by reference to `vt`.  The
+// caller clears `value`.
+HRESULT DispGetValue(DISPPARAMS *params, UINT position, VARTYPE vt,
+                     VARIANT &value, UINT *argErr);
+
+// Gets the pointer of an [out] or [in, out] argument, which must be passed by
+// reference as exactly `vt`
+HRESULT DispGetRef(DISPPARAMS *params, UINT position, VARTYPE vt, void *&ref,
+                   UINT *argErr);
+
+template <typename T>
+HRESULT DispGetRef(DISPPARAMS *params, UINT position, VARTYPE vt, T *&ref,
+                   UINT *argErr) {
+  void *raw = nullptr;
+  HRESULT hr = DispGetRef(params, position, vt, raw, argErr);
+  ref = static_cast<T *>(raw);
+  return hr;
+}
+
+// Calls the entry of `dispId` in `methods`, whose first entry is
+// `firstDispId`
+template <typename T, size_t N>
+HRESULT DispInvokeTable(const DispMethod<T> (&methods)[N], DISPID firstDispId,
+                        T *object, DISPID dispId, REFIID riid, WORD flags,
+                        DISPPARAMS *params, VARIANT *result, UINT *argErr) {
+  if (riid != IID_NULL) {
+    return DISP_E_UNKNOWNINTERFACE;
+  }
+  if (dispId < firstDispId || dispId - firstDispId >= static_cast<LONG>(N)) {
+    return DISP_E_MEMBERNOTFOUND;
+  }
+
+  const DispMethod<T> &method = methods[dispId - firstDispId];
+  HRESULT hr = CheckDispParams(flags, params, method.mArgCount);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  if (result) {
+    ::VariantInit(result);
+  }
+  return method.mInvoke(object, params, result, argErr);
+}
+
+// Resolves the name of a method.  Parameter names aren't supported because
+// named arguments aren't.
+template <size_t N>
+HRESULT DispGetIDsOfNames(const DispNameIndex<N> &index, DISPID firstDispId,
+                          REFIID riid, LPOLESTR *names, UINT count,
+                          DISPID *dispIds) {
+  if (riid != IID_NULL) {
+    return DISP_E_UNKNOWNINTERFACE;
+  }
+  if (!names || !dispIds) {
+    return E_POINTER;
+  }
+  if (count == 0) {
+    return S_OK;
+  }
+
+  int found = names[0] ? index.Find(names[0]) : -1;
+  dispIds[0] = found >= 0 ? firstDispId + found : DISPID_UNKNOWN;
+  for (UINT i = 1; i < count; ++i) {
+    dispIds[i] = DISPID_UNKNOWN;
+  }
+  return found >= 0 && count == 1 ? S_OK : DISP_E_UNKNOWNNAME;
+}
+
+#endif // _WIN32
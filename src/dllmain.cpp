@@ -1,7 +1,8 @@
+#include "log.h"
+#include "marshalable.h"
 #include "serverinfo.h"
 #include "shared.h"
 #include <memory>
-#include <strsafe.h>
 
 static const ServerRegistrationEntry kServers[] = {
     {kCLSID_ExtZ_InProc_STA, L"Z-InProc-STA", L"Apartment"},
@@ -11,22 +12,17 @@ static const ServerRegistrationEntry kServers[] = {
 
 std::unique_ptr<ServerInfo> gSI;
 
-void Log(const wchar_t *format, ...) {
-  wchar_t linebuf[1024];
-  va_list v;
-  va_start(v, format);
-  ::StringCbVPrintfW(linebuf, sizeof(linebuf), format, v);
-  ::OutputDebugStringW(linebuf);
-  va_end(v);
-}
-
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD dwReason, LPVOID) {
   switch (dwReason) {
   case DLL_PROCESS_ATTACH:
-    gSI.reset(new ServerInfo(hModule));
+    gSI.reset(new ServerInfo(hModule, kServers));
     break;
   case DLL_PROCESS_DETACH:
     gSI.reset(nullptr);
+    // The module is pinned once something is logged, so this runs only at
+    // process exit.  The drainer may have been terminated already, and the
+    // loader lock is held, so don't wait for anything.
+    LogTryFlush();
     break;
   case DLL_THREAD_ATTACH:
   case DLL_THREAD_DETACH:
@@ -36,13 +32,14 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD dwReason, LPVOID) {
 }
 
 STDAPI DllGetClassObject(REFCLSID rclsid, REFIID riid, void **ppv) {
-  return ::IsEqualCLSID(rclsid, kCLSID_ExtZ_InProc_STA) ||
-                 ::IsEqualCLSID(rclsid, kCLSID_ExtZ_InProc_STA_Legacy)
-             ? gSI->GetClassObject(riid, ppv)
-             : CLASS_E_CLASSNOTAVAILABLE;
+  return gSI->GetClassObject(rclsid, riid, ppv);
 }
 
-STDAPI DllCanUnloadNow() { return S_OK; }
+// Objects pooled by other threads keep the module loaded until they exit
+STDAPI DllCanUnloadNow() {
+  EmptyInstancePool();
+  return ModuleLockCount() == 0 ? S_OK : S_FALSE;
+}
 
 STDAPI DllUnregisterServer() {
   return RegisterAllServers(gSI.get(), kServers, /*trueToUnregister*/ true)
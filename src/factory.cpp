@@ -1,10 +1,10 @@
 #include "interfaces.h"
+#include "log.h"
+#include "marshalable.h"
 #include "regutils.h"
+#include "shared.h"
 #include <atlbase.h>
 
-void Log(const wchar_t *format, ...);
-IUnknown *CreateMarshalable();
-
 class ClassFactory : public IClassFactory {
   ULONG mRef;
 
@@ -82,6 +82,13 @@ STDMETHODIMP ClassFactory::CreateInstance(IUnknown *pUnkOuter, REFIID riid,
   return S_OK;
 }
 
-STDMETHODIMP ClassFactory::LockServer(BOOL fLock) { return S_OK; }
+STDMETHODIMP ClassFactory::LockServer(BOOL fLock) {
+  if (fLock) {
+    LockModule();
+  } else {
+    UnlockModule();
+  }
+  return S_OK;
+}
 
 IUnknown *CreateFactory() { return new ClassFactory; }
@@ -0,0 +1,223 @@
+#include "guid.h"
+#include <cwchar>
+
+// The SIMD code widens and narrows between bytes and 16-bit characters, so it
+// also needs wchar_t to be UTF-16 as it is on Windows
+#if (defined(__SSE2__) || defined(_M_X64) ||                                  \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) &&                             \
+    WCHAR_MAX <= 0xffff
+#include <emmintrin.h>
+#define GUID_SSE2 1
+#endif
+
+// Positions of the hex digits in a string without braces
+//   xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+struct HexRun {
+  int mStringOffset;
+  int mHexOffset;
+  int mLength;
+};
+
+static constexpr HexRun kHexRuns[] = {
+    {0, 0, 8}, {9, 8, 4}, {14, 12, 4}, {19, 16, 4}, {24, 20, 12},
+};
+
+static constexpr char kHexDigits[] = "0123456789abcdef";
+
+int InvalidGuidLiteral() { return -1; }
+
+// The bytes of a GUID in the order they are printed
+static void GuidToBytes(const GUID &guid, uint8_t bytes[16]) {
+  bytes[0] = static_cast<uint8_t>(guid.Data1 >> 24);
+  bytes[1] = static_cast<uint8_t>(guid.Data1 >> 16);
+  bytes[2] = static_cast<uint8_t>(guid.Data1 >> 8);
+  bytes[3] = static_cast<uint8_t>(guid.Data1);
+  bytes[4] = static_cast<uint8_t>(guid.Data2 >> 8);
+  bytes[5] = static_cast<uint8_t>(guid.Data2);
+  bytes[6] = static_cast<uint8_t>(guid.Data3 >> 8);
+  bytes[7] = static_cast<uint8_t>(guid.Data3);
+  memcpy(bytes + 8, guid.Data4, 8);
+}
+
+static void BytesToGuid(const uint8_t bytes[16], GUID &guid) {
+  guid.Data1 = (static_cast<unsigned long>(bytes[0]) << 24) |
+               (static_cast<unsigned long>(bytes[1]) << 16) |
+               (static_cast<unsigned long>(bytes[2]) << 8) | bytes[3];
+  guid.Data2 = static_cast<unsigned short>((bytes[4] << 8) | bytes[5]);
+  guid.Data3 = static_cast<unsigned short>((bytes[6] << 8) | bytes[7]);
+  memcpy(guid.Data4, bytes + 8, 8);
+}
+
+static void PlaceHex(const wchar_t hex[32], wchar_t *out) {
+  out[0] = L'{';
+  for (const HexRun &run : kHexRuns) {
+    memcpy(out + 1 + run.mStringOffset, hex + run.mHexOffset,
+           run.mLength * sizeof(wchar_t));
+  }
+  out[9] = out[14] = out[19] = out[24] = L'-';
+  out[37] = L'}';
+  out[38] = 0;
+}
+
+// Strips the braces and checks the dashes, then gathers the 32 hex digits
+static bool GatherHex(const wchar_t *str, size_t length, wchar_t hex[32]) {
+  if (length == kGuidStringLength) {
+    if (str[0] != L'{' || str[kGuidStringLength - 1] != L'}') {
+      return false;
+    }
+    ++str;
+  } else if (length != kGuidStringLength - 2) {
+    return false;
+  }
+
+  if (str[8] != L'-' || str[13] != L'-' || str[18] != L'-' ||
+      str[23] != L'-') {
+    return false;
+  }
+
+  for (const HexRun &run : kHexRuns) {
+    memcpy(hex + run.mHexOffset, str + run.mStringOffset,
+           run.mLength * sizeof(wchar_t));
+  }
+  return true;
+}
+
+static int ScalarHexValue(wchar_t c) {
+  return c >= L'0' && c <= L'9'   ? c - L'0'
+         : c >= L'a' && c <= L'f' ? c - L'a' + 10
+         : c >= L'A' && c <= L'F' ? c - L'A' + 10
+                                  : -1;
+}
+
+void FormatGuidScalar(const GUID &guid, wchar_t *out) {
+  uint8_t bytes[16];
+  GuidToBytes(guid, bytes);
+
+  wchar_t hex[32];
+  for (int i = 0; i < 16; ++i) {
+    hex[i * 2] = kHexDigits[bytes[i] >> 4];
+    hex[i * 2 + 1] = kHexDigits[bytes[i] & 0xf];
+  }
+  PlaceHex(hex, out);
+}
+
+bool ParseGuidScalar(const wchar_t *str, size_t length, GUID &guid) {
+  wchar_t hex[32];
+  if (!str || !GatherHex(str, length, hex)) {
+    return false;
+  }
+
+  uint8_t bytes[16];
+  for (int i = 0; i < 16; ++i) {
+    int high = ScalarHexValue(hex[i * 2]);
+    int low = ScalarHexValue(hex[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    bytes[i] = static_cast<uint8_t>((high << 4) | low);
+  }
+  BytesToGuid(bytes, guid);
+  return true;
+}
+
+#ifdef GUID_SSE2
+
+// Converts 16 nibbles to lowercase ASCII hex
+static __m128i NibblesToHex(__m128i nibbles) {
+  __m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+  __m128i ascii = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+  return _mm_add_epi8(ascii,
+                      _mm_and_si128(letters, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+void FormatGuid(const GUID &guid, wchar_t *out) {
+  uint8_t bytes[16];
+  GuidToBytes(guid, bytes);
+
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+  __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+  __m128i low = _mm_and_si128(v, mask);
+
+  // Each byte becomes two digits, high nibble first
+  __m128i first = NibblesToHex(_mm_unpacklo_epi8(high, low));
+  __m128i second = NibblesToHex(_mm_unpackhi_epi8(high, low));
+
+  // Widen to UTF-16
+  __m128i zero = _mm_setzero_si128();
+  wchar_t hex[32];
+  __m128i *dst = reinterpret_cast<__m128i *>(hex);
+  _mm_storeu_si128(dst, _mm_unpacklo_epi8(first, zero));
+  _mm_storeu_si128(dst + 1, _mm_unpackhi_epi8(first, zero));
+  _mm_storeu_si128(dst + 2, _mm_unpacklo_epi8(second, zero));
+  _mm_storeu_si128(dst + 3, _mm_unpackhi_epi8(second, zero));
+  PlaceHex(hex, out);
+}
+
+// Converts 16 ASCII hex digits to nibbles.  Sets `valid` to false if any of
+// them isn't a hex digit.
+static __m128i HexToNibbles(__m128i ascii, bool &valid) {
+  // Unsigned x <= limit is min(x, limit) == x
+  __m128i digit = _mm_sub_epi8(ascii, _mm_set1_epi8('0'));
+  __m128i isDigit =
+      _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+
+  __m128i letter = _mm_sub_epi8(_mm_or_si128(ascii, _mm_set1_epi8(0x20)),
+                                _mm_set1_epi8('a'));
+  __m128i isLetter =
+      _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+  valid = _mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) == 0xffff;
+  return _mm_or_si128(
+      _mm_and_si128(isDigit, digit),
+      _mm_and_si128(isLetter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+// Combines the pairs of nibbles in each 16-bit lane into one byte value
+static __m128i CombineNibbles(__m128i nibbles) {
+  __m128i high = _mm_slli_epi16(
+      _mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+  return _mm_or_si128(high, _mm_srli_epi16(nibbles, 8));
+}
+
+bool ParseGuid(const wchar_t *str, size_t length, GUID &guid) {
+  wchar_t hex[32];
+  if (!str || !GatherHex(str, length, hex)) {
+    return false;
+  }
+
+  // Narrow to bytes.  The pack is signed, so a character from 0x100 to 0x7fff
+  // saturates to 0xff and one from 0x8000 up saturates to 0.  Neither is a
+  // hex digit, so both are rejected below.
+  const __m128i *src = reinterpret_cast<const __m128i *>(hex);
+  __m128i first = _mm_packus_epi16(_mm_loadu_si128(src),
+                                   _mm_loadu_si128(src + 1));
+  __m128i second = _mm_packus_epi16(_mm_loadu_si128(src + 2),
+                                    _mm_loadu_si128(src + 3));
+
+  bool firstValid, secondValid;
+  first = HexToNibbles(first, firstValid);
+  second = HexToNibbles(second, secondValid);
+  if (!firstValid || !secondValid) {
+    return false;
+  }
+
+  uint8_t bytes[16];
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(bytes),
+      _mm_packus_epi16(CombineNibbles(first), CombineNibbles(second)));
+  BytesToGuid(bytes, guid);
+  return true;
+}
+
+#else
+
+void FormatGuid(const GUID &guid, wchar_t *out) {
+  FormatGuidScalar(guid, out);
+}
+
+bool ParseGuid(const wchar_t *str, size_t length, GUID &guid) {
+  return ParseGuidScalar(str, length, guid);
+}
+
+#endif
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+// Same layout as the Win32 GUID, so binary files that hold GUIDs are the same
+// on every platform
+struct GUID {
+  uint32_t Data1;
+  uint16_t Data2;
+  uint16_t Data3;
+  uint8_t Data4[8];
+};
+
+inline bool operator==(const GUID &a, const GUID &b) {
+  return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+inline bool operator!=(const GUID &a, const GUID &b) { return !(a == b); }
+#endif
+
+// "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}" without the terminating null
+constexpr size_t kGuidStringLength = 38;
+
+// Writes a GUID in lowercase hex with braces and a terminating null, so
+// `out` must have room for kGuidStringLength + 1 characters.  It uses SSE2
+// where available and wchar_t is UTF-16.
+void FormatGuid(const GUID &guid, wchar_t *out);
+void FormatGuidScalar(const GUID &guid, wchar_t *out);
+
+// Parses a GUID with or without braces, in either case.  `length` is the
+// number of characters, excluding a null if any.
+bool ParseGuid(const wchar_t *str, size_t length, GUID &guid);
+bool ParseGuidScalar(const wchar_t *str, size_t length, GUID &guid);
+
+// Not constexpr on purpose.  Calling it from GuidFromString makes a bad
+// literal a compile error instead of a wrong constant.
+int InvalidGuidLiteral();
+
+constexpr int HexDigitValue(char c) {
+  return c >= '0' && c <= '9'   ? c - '0'
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                : InvalidGuidLiteral();
+}
+
+constexpr uint32_t HexLiteralValue(const char *str, size_t digits) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < digits; ++i) {
+    value = (value << 4) | static_cast<uint32_t>(HexDigitValue(str[i]));
+  }
+  return value;
+}
+
+// Converts a GUID literal at compile time, e.g.
+//   constexpr GUID kFoo =
+//       GuidFromString("{16C324E8-4B82-4648-81A0-E76E3639005E}");
+template <size_t N> constexpr GUID GuidFromString(const char (&literal)[N]) {
+  static_assert(N == kGuidStringLength + 1 || N == kGuidStringLength - 1,
+                "A GUID literal has 36 characters, or 38 with braces");
+
+  const char *str = literal;
+  if constexpr (N == kGuidStringLength + 1) {
+    if (str[0] != '{' || str[kGuidStringLength - 1] != '}') {
+      InvalidGuidLiteral();
+    }
+    ++str;
+  }
+  if (str[8] != '-' || str[13] != '-' || str[18] != '-' || str[23] != '-') {
+    InvalidGuidLiteral();
+  }
+
+  GUID guid = {};
+  guid.Data1 = HexLiteralValue(str, 8);
+  guid.Data2 = static_cast<unsigned short>(HexLiteralValue(str + 9, 4));
+  guid.Data3 = static_cast<unsigned short>(HexLiteralValue(str + 14, 4));
+  guid.Data4[0] = static_cast<unsigned char>(HexLiteralValue(str + 19, 2));
+  guid.Data4[1] = static_cast<unsigned char>(HexLiteralValue(str + 21, 2));
+  for (size_t i = 0; i < 6; ++i) {
+    guid.Data4[2 + i] =
+        static_cast<unsigned char>(HexLiteralValue(str + 24 + i * 2, 2));
+  }
+  return guid;
+}
+
+inline size_t GuidHash(const GUID &guid) {
+  uint64_t lo, hi;
+  memcpy(&lo, &guid, sizeof(lo));
+  memcpy(&hi, reinterpret_cast<const uint8_t *>(&guid) + sizeof(lo),
+         sizeof(hi));
+  uint64_t h = (lo ^ (hi * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+  return static_cast<size_t>(h ^ (h >> 32));
+}
+
+// Open-addressing hash map keyed on GUID with linear probing.  Meant for
+// small tables built once and looked up often, such as CLSID or IID
+// dispatch tables, so it has no erase.
+template <typename T> class GuidMap {
+  struct Slot {
+    GUID mKey;
+    T mValue;
+    bool mUsed;
+  };
+
+  std::vector<Slot> mSlots; // Size is zero or a power of two
+  size_t mCount;
+
+  size_t Probe(const GUID &key) const {
+    size_t mask = mSlots.size() - 1;
+    size_t i = GuidHash(key) & mask;
+    while (mSlots[i].mUsed && mSlots[i].mKey != key) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void Grow() {
+    std::vector<Slot> old(mSlots.size() ? mSlots.size() * 2 : 8);
+    old.swap(mSlots);
+    for (Slot &slot : old) {
+      if (slot.mUsed) {
+        mSlots[Probe(slot.mKey)] = std::move(slot);
+      }
+    }
+  }
+
+public:
+  GuidMap() : mCount(0) {}
+
+  size_t Size() const { return mCount; }
+
+  // Returns false without overwriting if the key is already in the map
+  bool Insert(const GUID &key, T value) {
+    // Keep the load factor at or below 1/2 so that probes stay short
+    if ((mCount + 1) * 2 > mSlots.size()) {
+      Grow();
+    }
+    Slot &slot = mSlots[Probe(key)];
+    if (slot.mUsed) {
+      return false;
+    }
+    slot = {key, std::move(value), true};
+    ++mCount;
+    return true;
+  }
+
+  const T *Find(const GUID &key) const {
+    if (!mCount) {
+      return nullptr;
+    }
+    const Slot &slot = mSlots[Probe(key)];
+    return slot.mUsed ? &slot.mValue : nullptr;
+  }
+
+  template <typename F> void ForEach(F func) const {
+    for (const Slot &slot : mSlots) {
+      if (slot.mUsed) {
+        func(slot.mKey, slot.mValue);
+      }
+    }
+  }
+};
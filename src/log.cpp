@@ -0,0 +1,600 @@
+#include "log.h"
+#include "utf16.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cwchar>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <strsafe.h>
+#endif
+
+// Bytes per thread.  A record never wraps around the end of the buffer.
+static constexpr uint32_t kRingSize = 64 * 1024;
+
+// The drainer polls at this interval if it has no wake event, because
+// CreateEventW failed or because it isn't running on Windows
+static constexpr uint32_t kDrainIntervalMs = 50;
+
+// Marks the rest of the buffer as unused when the next record doesn't fit
+static constexpr uint32_t kPaddingArgCount = 0xffffffff;
+
+struct LogRing {
+  alignas(64) std::atomic<uint64_t> mHead; // Written by the drainer
+  alignas(64) std::atomic<uint64_t> mTail; // Published by the owner
+  uint64_t mPending;                       // Tail of the record being written
+  std::atomic<bool> mInUse;
+  LogRing *mNextRing;
+  alignas(16) uint8_t mBuffer[kRingSize];
+};
+
+class Logger {
+  std::mutex mRingsLock;
+  std::atomic<LogRing *> mRings;
+  std::atomic<uint64_t> mSequence;
+  std::atomic<uint64_t> mRecords;
+  std::atomic<uint64_t> mDropped;
+
+  // Only one thread formats at a time.  It's a flag rather than a mutex so
+  // that LogFlush can give up at process exit, when the drainer may have
+  // been terminated in the middle of a drain.
+  std::atomic<bool> mDraining;
+  LogSink *mSink;
+  std::wstring mText;
+
+  // Set by the first record committed after the drainer last woke up, so
+  // the drainer is signaled once per drain rather than once per record.
+  std::atomic<bool> mWakePending;
+#ifdef _WIN32
+  HANDLE mWakeEvent;
+#endif
+  std::once_flag mDrainerStarted;
+
+  static void FormatRecord(const LogRecord::Header &header,
+                           std::wstring &text);
+  void StartDrainer();
+  void WakeDrainer();
+  void WaitForRecords();
+
+public:
+  Logger();
+
+  LogRing *AcquireRing();
+  uint8_t *Begin(LogRing *ring, uint32_t size);
+  void Commit(LogRing *ring);
+
+  // Returns false if another thread is draining
+  bool TryDrain();
+  void SetSink(LogSink *sink);
+  LogStats GetStats() const;
+};
+
+// Set once GetLogger has created the logger
+static std::atomic<Logger *> gLogger;
+
+static Logger &GetLogger() {
+  // Never destroyed.  The drainer and threads exiting late may still use it.
+  static Logger *logger = [] {
+    Logger *created = new Logger;
+    gLogger.store(created, std::memory_order_release);
+    return created;
+  }();
+  return *logger;
+}
+
+struct LogRingOwner {
+  LogRing *mRing = nullptr;
+
+  ~LogRingOwner() {
+    if (mRing) {
+      mRing->mInUse.store(false, std::memory_order_release);
+    }
+  }
+};
+
+// Rings are never destroyed.  When a thread exits, its ring is released and
+// adopted by the next thread, together with records not drained yet.
+static thread_local LogRingOwner tRingOwner;
+
+// The path in COM_PLAYGROUND_LOG, or an empty string
+static std::wstring LogPathFromEnvironment() {
+#ifdef _WIN32
+  wchar_t path[MAX_PATH];
+  DWORD length =
+      ::GetEnvironmentVariableW(L"COM_PLAYGROUND_LOG", path, ARRAYSIZE(path));
+  return length < ARRAYSIZE(path) ? std::wstring(path, length)
+                                  : std::wstring();
+#else
+  const char *narrow = getenv("COM_PLAYGROUND_LOG");
+  wchar_t path[4096];
+  size_t length = narrow ? mbstowcs(path, narrow, std::size(path)) : 0;
+  return length < std::size(path) ? std::wstring(path, length)
+                                  : std::wstring();
+#endif
+}
+
+Logger::Logger()
+    : mRings(nullptr), mSequence(0), mRecords(0), mDropped(0),
+      mDraining(false), mSink(nullptr), mWakePending(false) {
+#ifdef _WIN32
+  mWakeEvent = ::CreateEventW(/*lpEventAttributes*/ nullptr,
+                              /*bManualReset*/ FALSE,
+                              /*bInitialState*/ FALSE,
+                              /*lpName*/ nullptr);
+#endif
+
+  std::wstring path = LogPathFromEnvironment();
+  if (!path.empty()) {
+    std::unique_ptr<FileLogSink> file(new FileLogSink(path.c_str()));
+    if (*file) {
+      mSink = file.release();
+    }
+  }
+  if (!mSink) {
+    mSink = new DebugLogSink;
+  }
+}
+
+LogRing *Logger::AcquireRing() {
+  std::call_once(mDrainerStarted, [this]() { StartDrainer(); });
+
+  std::lock_guard<std::mutex> lock(mRingsLock);
+  for (LogRing *ring = mRings.load(std::memory_order_acquire); ring;
+       ring = ring->mNextRing) {
+    if (!ring->mInUse.load(std::memory_order_acquire)) {
+      ring->mInUse.store(true, std::memory_order_relaxed);
+      ring->mPending = ring->mTail.load(std::memory_order_relaxed);
+      return ring;
+    }
+  }
+
+  LogRing *ring = new (std::nothrow) LogRing;
+  if (!ring) {
+    return nullptr;
+  }
+  ring->mHead.store(0, std::memory_order_relaxed);
+  ring->mTail.store(0, std::memory_order_relaxed);
+  ring->mPending = 0;
+  ring->mInUse.store(true, std::memory_order_relaxed);
+  ring->mNextRing = mRings.load(std::memory_order_relaxed);
+  mRings.store(ring, std::memory_order_release);
+  return ring;
+}
+
+uint8_t *Logger::Begin(LogRing *ring, uint32_t size) {
+  uint64_t tail = ring->mTail.load(std::memory_order_relaxed);
+  uint64_t head = ring->mHead.load(std::memory_order_acquire);
+
+  uint32_t offset = tail % kRingSize;
+  uint32_t padding = kRingSize - offset < size ? kRingSize - offset : 0;
+  if (tail + padding + size - head > kRingSize) {
+    mDropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  // The drainer skips a gap smaller than a header without a marker
+  if (padding >= sizeof(LogRecord::Header)) {
+    LogRecord::Header *marker =
+        reinterpret_cast<LogRecord::Header *>(ring->mBuffer + offset);
+    marker->mSize = padding;
+    marker->mArgCount = kPaddingArgCount;
+  }
+  if (padding) {
+    offset = 0;
+  }
+
+  LogRecord::Header *header =
+      reinterpret_cast<LogRecord::Header *>(ring->mBuffer + offset);
+  header->mSize = size;
+  header->mSequence = mSequence.fetch_add(1, std::memory_order_relaxed);
+  ring->mPending = tail + padding + size;
+  return ring->mBuffer + offset;
+}
+
+void Logger::Commit(LogRing *ring) {
+  ring->mTail.store(ring->mPending, std::memory_order_release);
+
+  // Pairs with the fence in the drainer.  Either the drainer sees this
+  // record after clearing mWakePending, or this sees it cleared and wakes
+  // the drainer again.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!mWakePending.load(std::memory_order_relaxed) &&
+      !mWakePending.exchange(true, std::memory_order_relaxed)) {
+    WakeDrainer();
+  }
+}
+
+void Logger::WakeDrainer() {
+#ifdef _WIN32
+  if (mWakeEvent) {
+    ::SetEvent(mWakeEvent);
+  }
+#endif
+}
+
+void Logger::WaitForRecords() {
+#ifdef _WIN32
+  if (mWakeEvent) {
+    ::WaitForSingleObject(mWakeEvent, INFINITE);
+    return;
+  }
+#endif
+  std::this_thread::sleep_for(std::chrono::milliseconds(kDrainIntervalMs));
+}
+
+void Logger::StartDrainer() {
+#ifdef _WIN32
+  // The drainer runs code in this module until the process exits, so the
+  // module must not be unloaded.
+  HMODULE module;
+  ::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                           GET_MODULE_HANDLE_EX_FLAG_PIN,
+                       reinterpret_cast<LPCWSTR>(&GetLogger), &module);
+#endif
+
+  std::thread([this]() {
+    for (;;) {
+      WaitForRecords();
+
+      // Records committed from now on signal the event again
+      mWakePending.store(false, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!TryDrain()) {
+        // LogFlush or SetLogSink has it.  Records it may have missed were
+        // committed before the flag was cleared, so nobody else signals.
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }).detach();
+}
+
+// Formats one printf conversion into `buf`.  False if it doesn't fit.
+template <typename T>
+static bool PrintArg(wchar_t (&buf)[512], const std::wstring &spec,
+                     T value) {
+#ifdef _WIN32
+  return SUCCEEDED(::StringCbPrintfW(buf, sizeof(buf), spec.c_str(), value));
+#else
+  return swprintf(buf, std::size(buf), spec.c_str(), value) >= 0;
+#endif
+}
+
+// Formats one conversion at a time with the type the argument actually had,
+// so a mismatch between the format and the argument can't read garbage.
+void Logger::FormatRecord(const LogRecord::Header &header,
+                          std::wstring &text) {
+  using ArgSlot = LogRecord::ArgSlot;
+
+  const ArgSlot *arg = reinterpret_cast<const ArgSlot *>(&header + 1);
+  uint32_t argsLeft = header.mArgCount;
+  auto nextArg = [&]() -> const ArgSlot * {
+    if (!argsLeft) {
+      return nullptr;
+    }
+    const ArgSlot *current = arg;
+    --argsLeft;
+    arg += 1 + (current->mType == LogRecord::kArgString
+                    ? LogRecord::SlotsForChars(current->mSize)
+                    : 0);
+    return current;
+  };
+
+  // Integers are stored as 64 bits with the size they were passed with
+  auto signedValue = [](const ArgSlot &slot) {
+    int shift = 64 - static_cast<int>(slot.mSize) * 8;
+    return static_cast<int64_t>(slot.mBits << shift) >> shift;
+  };
+  auto unsignedValue = [](const ArgSlot &slot) {
+    int shift = 64 - static_cast<int>(slot.mSize) * 8;
+    return (slot.mBits << shift) >> shift;
+  };
+
+  wchar_t buf[512];
+  for (const wchar_t *p = header.mFormat; *p;) {
+    if (*p != L'%') {
+      const wchar_t *literal = p;
+      while (*p && *p != L'%') {
+        ++p;
+      }
+      text.append(literal, p - literal);
+      continue;
+    }
+
+    if (p[1] == L'%') {
+      text += L'%';
+      p += 2;
+      continue;
+    }
+
+    // %[flags][width][.precision][length]conversion
+    std::wstring spec(L"%");
+    ++p;
+    while (*p && wcschr(L"-+ #0", *p)) {
+      spec += *p++;
+    }
+    for (int part = 0; part < 2; ++part) {
+      if (part == 1) {
+        if (*p != L'.') {
+          break;
+        }
+        spec += *p++;
+      }
+      if (*p == L'*') {
+        const ArgSlot *star = nextArg();
+        int value = star && star->mType <= LogRecord::kArgUnsigned
+                        ? static_cast<int>(signedValue(*star))
+                        : 0;
+        spec += std::to_wstring(value);
+        ++p;
+      }
+      while (*p >= L'0' && *p <= L'9') {
+        spec += *p++;
+      }
+    }
+    while (*p && wcschr(L"hlLqjztIw", *p)) {
+      ++p;
+      while (p[-1] == L'I' && *p >= L'0' && *p <= L'9') {
+        ++p;
+      }
+    }
+
+    wchar_t conversion = *p;
+    if (!conversion) {
+      break;
+    }
+    ++p;
+
+    const ArgSlot *slot = conversion == L'n' ? nullptr : nextArg();
+    bool printed = false;
+    switch (conversion) {
+    case L'd':
+    case L'i':
+      if (slot && slot->mType <= LogRecord::kArgUnsigned) {
+        spec += L"ll";
+        spec += conversion;
+        printed =
+            PrintArg(buf, spec, static_cast<long long>(signedValue(*slot)));
+      }
+      break;
+    case L'u':
+    case L'x':
+    case L'X':
+    case L'o':
+      if (slot && slot->mType <= LogRecord::kArgUnsigned) {
+        spec += L"ll";
+        spec += conversion;
+        printed = PrintArg(
+            buf, spec, static_cast<unsigned long long>(unsignedValue(*slot)));
+      }
+      break;
+    case L'c':
+    case L'C':
+      if (slot && slot->mType <= LogRecord::kArgUnsigned) {
+        spec += L"lc";
+        printed =
+            PrintArg(buf, spec, static_cast<wint_t>(unsignedValue(*slot)));
+      }
+      break;
+    case L'e':
+    case L'E':
+    case L'f':
+    case L'F':
+    case L'g':
+    case L'G':
+    case L'a':
+    case L'A':
+      if (slot && slot->mType == LogRecord::kArgDouble) {
+        double value;
+        memcpy(&value, &slot->mBits, sizeof(value));
+        spec += conversion;
+        printed = PrintArg(buf, spec, value);
+      }
+      break;
+    case L'p':
+      if (slot && slot->mType == LogRecord::kArgPointer) {
+        spec += conversion;
+        printed = PrintArg(buf, spec, reinterpret_cast<void *>(slot->mBits));
+      }
+      break;
+    case L's':
+    case L'S':
+      if (slot && slot->mType == LogRecord::kArgString) {
+        std::wstring str(reinterpret_cast<const wchar_t *>(slot + 1),
+                         slot->mSize);
+        if (spec.size() == 1) {
+          // No width or precision.  Skip printf so that nothing is truncated.
+          text += str;
+          continue;
+        }
+        spec += L"ls";
+        printed = PrintArg(buf, spec, str.c_str());
+      }
+      break;
+    case L'n':
+      continue;
+    default:
+      text += spec;
+      text += conversion;
+      continue;
+    }
+
+    text += printed ? buf : L"<?>";
+  }
+}
+
+bool Logger::TryDrain() {
+  if (mDraining.exchange(true, std::memory_order_acquire)) {
+    return false;
+  }
+
+  struct Cursor {
+    LogRing *mRing;
+    uint64_t mHead;
+    uint64_t mTail;
+  };
+  std::vector<Cursor> cursors;
+  for (LogRing *ring = mRings.load(std::memory_order_acquire); ring;
+       ring = ring->mNextRing) {
+    cursors.push_back({ring, ring->mHead.load(std::memory_order_relaxed),
+                       ring->mTail.load(std::memory_order_acquire)});
+  }
+
+  // Merge the rings by sequence number so that lines from different threads
+  // come out in the order they were logged.
+  for (;;) {
+    Cursor *next = nullptr;
+    const LogRecord::Header *nextHeader = nullptr;
+    for (Cursor &cursor : cursors) {
+      while (cursor.mHead < cursor.mTail) {
+        uint32_t offset = cursor.mHead % kRingSize;
+        if (kRingSize - offset < sizeof(LogRecord::Header)) {
+          cursor.mHead += kRingSize - offset;
+          continue;
+        }
+        const LogRecord::Header *header =
+            reinterpret_cast<const LogRecord::Header *>(cursor.mRing->mBuffer +
+                                                        offset);
+        if (header->mArgCount == kPaddingArgCount) {
+          cursor.mHead += header->mSize;
+          continue;
+        }
+        if (!nextHeader || header->mSequence < nextHeader->mSequence) {
+          next = &cursor;
+          nextHeader = header;
+        }
+        break;
+      }
+    }
+    if (!next) {
+      break;
+    }
+
+    mText.clear();
+    FormatRecord(*nextHeader, mText);
+    if (mSink) {
+      mSink->Write(mText.c_str(), mText.size());
+    }
+    mRecords.fetch_add(1, std::memory_order_relaxed);
+
+    // The owner may reuse the space as soon as the head moves
+    next->mHead += nextHeader->mSize;
+    next->mRing->mHead.store(next->mHead, std::memory_order_release);
+  }
+
+  for (Cursor &cursor : cursors) {
+    cursor.mRing->mHead.store(cursor.mHead, std::memory_order_release);
+  }
+  if (mSink) {
+    mSink->Flush();
+  }
+
+  mDraining.store(false, std::memory_order_release);
+  return true;
+}
+
+void Logger::SetSink(LogSink *sink) {
+  while (mDraining.exchange(true, std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+  LogSink *old = mSink;
+  mSink = sink;
+  mDraining.store(false, std::memory_order_release);
+  delete old;
+}
+
+LogStats Logger::GetStats() const {
+  return {mRecords.load(std::memory_order_relaxed),
+          mDropped.load(std::memory_order_relaxed)};
+}
+
+uint8_t *LogRecord::Begin(uint32_t size) {
+  Logger &logger = GetLogger();
+  if (!tRingOwner.mRing) {
+    tRingOwner.mRing = logger.AcquireRing();
+    if (!tRingOwner.mRing) {
+      return nullptr;
+    }
+  }
+  return logger.Begin(tRingOwner.mRing, size);
+}
+
+void LogRecord::Commit() { GetLogger().Commit(tRingOwner.mRing); }
+
+void SetLogSink(LogSink *sink) { GetLogger().SetSink(sink); }
+
+bool LogFlush(uint32_t timeoutMs) {
+  auto start = std::chrono::steady_clock::now();
+  while (!GetLogger().TryDrain()) {
+    if (timeoutMs != kLogWaitForever &&
+        std::chrono::steady_clock::now() - start >
+            std::chrono::milliseconds(timeoutMs)) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+bool LogTryFlush() {
+  Logger *logger = gLogger.load(std::memory_order_acquire);
+  return !logger || logger->TryDrain();
+}
+
+LogStats GetLogStats() { return GetLogger().GetStats(); }
+
+void DebugLogSink::Write(const wchar_t *text, size_t) {
+#ifdef _WIN32
+  ::OutputDebugStringW(text);
+#else
+  fputws(text, stderr);
+#endif
+}
+
+void ConsoleLogSink::Write(const wchar_t *text, size_t) {
+  fputws(text, stdout);
+}
+
+void ConsoleLogSink::Flush() { fflush(stdout); }
+
+FileLogSink::FileLogSink(const wchar_t *path) : mFile(nullptr) {
+#ifdef _WIN32
+  if (_wfopen_s(&mFile, path, L"ab") != 0) {
+    mFile = nullptr;
+  }
+#else
+  char narrow[4096];
+  if (wcstombs(narrow, path, sizeof(narrow)) < sizeof(narrow)) {
+    mFile = fopen(narrow, "ab");
+  }
+#endif
+}
+
+FileLogSink::~FileLogSink() {
+  if (mFile) {
+    fclose(mFile);
+  }
+}
+
+// Writes UTF-8 so that the file reads the same on any platform.  Unpaired
+// surrogates become U+FFFD.
+void FileLogSink::Write(const wchar_t *text, size_t length) {
+  if (!mFile) {
+    return;
+  }
+
+  std::string utf8;
+  AppendUtf8(utf8, text, length);
+  fwrite(utf8.data(), 1, utf8.size(), mFile);
+}
+
+void FileLogSink::Flush() {
+  if (mFile) {
+    fflush(mFile);
+  }
+}
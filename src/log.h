@@ -0,0 +1,227 @@
+#pragma once
+
+#include "utf16.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Asynchronous logger shared by every binary.
+//
+// Log() doesn't format anything.  It copies the format pointer and the
+// arguments into a binary record in a ring owned by the calling thread, and
+// a background thread formats the records and writes them to the sink.  The
+// format must be a string literal because only its address is recorded.
+// Strings passed as arguments are copied, so they may be temporary.  Like
+// std::ostream, any character pointer is taken as a string, so cast it to
+// void * to log the address.
+//
+// If a ring is full, the record is dropped and counted rather than blocking
+// the caller.
+
+// Receives formatted text from the drainer thread.  `text` is terminated
+// with a null.
+class LogSink {
+public:
+  virtual ~LogSink() = default;
+  virtual void Write(const wchar_t *text, size_t length) = 0;
+  virtual void Flush() {}
+};
+
+// OutputDebugStringW, or standard error on other platforms.  This is the
+// default.
+class DebugLogSink : public LogSink {
+public:
+  void Write(const wchar_t *text, size_t length) override;
+};
+
+// Standard output
+class ConsoleLogSink : public LogSink {
+public:
+  void Write(const wchar_t *text, size_t length) override;
+  void Flush() override;
+};
+
+// Appends to a file with the C runtime, so it works on any platform.  The
+// default sink is a FileLogSink if the COM_PLAYGROUND_LOG environment
+// variable has a path.
+class FileLogSink : public LogSink {
+  FILE *mFile;
+
+public:
+  explicit FileLogSink(const wchar_t *path);
+  ~FileLogSink();
+
+  FileLogSink(const FileLogSink &) = delete;
+  FileLogSink &operator=(const FileLogSink &) = delete;
+
+  constexpr operator bool() const { return !!mFile; }
+  void Write(const wchar_t *text, size_t length) override;
+  void Flush() override;
+};
+
+// Replaces the sink.  The logger takes ownership of it.  With nullptr,
+// records are drained and discarded.
+void SetLogSink(LogSink *sink);
+
+// Waits forever, like INFINITE
+constexpr uint32_t kLogWaitForever = UINT32_MAX;
+
+// Formats and writes everything logged so far on any thread.  Gives up
+// after `timeoutMs` if another thread is writing and doesn't finish.  The
+// default is finite because that thread may be the drainer, terminated in
+// the middle of a drain at process exit.
+bool LogFlush(uint32_t timeoutMs = 10000);
+
+// Like LogFlush, but never waits and never creates the logger if nothing was
+// logged, so it can run under the loader lock.  Returns false if another
+// thread is writing, or was terminated while writing.
+bool LogTryFlush();
+
+struct LogStats {
+  uint64_t mRecords; // Written to the sink
+  uint64_t mDropped; // Lost because a ring was full
+};
+LogStats GetLogStats();
+
+// Binary record encoding used by Log()
+struct LogRecord {
+  enum ArgType : uint32_t {
+    kArgSigned,
+    kArgUnsigned,
+    kArgDouble,
+    kArgPointer,
+    kArgString, // Followed by the characters, padded to the slot size
+  };
+
+  struct ArgSlot {
+    uint32_t mType;
+    uint32_t mSize; // Bytes of an integer, or characters of a string
+    uint64_t mBits;
+  };
+
+  struct Header {
+    uint32_t mSize; // Including this header and padding
+    uint32_t mArgCount;
+    uint64_t mSequence;
+    const wchar_t *mFormat;
+  };
+
+  static constexpr size_t kMaxStringArg = 1024; // Longer ones are truncated
+
+  // Reserves `size` bytes in the ring of the current thread and fills in
+  // mSize and mSequence.  Returns nullptr and counts a drop if it's full.
+  static uint8_t *Begin(uint32_t size);
+  static void Commit();
+
+  static constexpr uint32_t SlotsForChars(size_t chars) {
+    return static_cast<uint32_t>(
+        (chars * sizeof(wchar_t) + sizeof(ArgSlot) - 1) / sizeof(ArgSlot));
+  }
+
+  template <typename Char> static size_t StringLength(const Char *str) {
+    size_t length = 0;
+    if (!str) {
+      return 6; // "(null)"
+    }
+    if constexpr (std::is_same_v<Char, wchar_t>) {
+      return WideLengthBounded(str, kMaxStringArg);
+    }
+    while (length < kMaxStringArg && str[length]) {
+      ++length;
+    }
+    return length;
+  }
+
+  template <typename Char> static uint32_t StringBytes(const Char *str) {
+    return static_cast<uint32_t>(sizeof(ArgSlot) *
+                                 (1 + SlotsForChars(StringLength(str))));
+  }
+
+  template <typename Char>
+  static uint8_t *WriteString(uint8_t *out, const Char *str) {
+    static const Char kNull[] = {'(', 'n', 'u', 'l', 'l', ')', 0};
+    const Char *source = str ? str : kNull;
+    size_t length = StringLength(str);
+
+    ArgSlot slot = {kArgString, static_cast<uint32_t>(length), 0};
+    memcpy(out, &slot, sizeof(slot));
+    out += sizeof(slot);
+
+    // Narrow strings such as __FUNCTION__ are widened here so that the
+    // drainer only deals with one kind of string.
+    wchar_t *chars = reinterpret_cast<wchar_t *>(out);
+    if constexpr (std::is_same_v<Char, wchar_t>) {
+      memcpy(chars, source, length * sizeof(wchar_t));
+      return out + sizeof(ArgSlot) * SlotsForChars(length);
+    }
+    for (size_t i = 0; i < length; ++i) {
+      chars[i] = static_cast<wchar_t>(
+          static_cast<std::make_unsigned_t<Char>>(source[i]));
+    }
+    return out + sizeof(ArgSlot) * SlotsForChars(length);
+  }
+
+  template <typename T> static uint32_t ArgBytes(const T &) {
+    return sizeof(ArgSlot);
+  }
+  static uint32_t ArgBytes(const wchar_t *str) { return StringBytes(str); }
+  static uint32_t ArgBytes(wchar_t *str) { return StringBytes(str); }
+  static uint32_t ArgBytes(const char *str) { return StringBytes(str); }
+  static uint32_t ArgBytes(char *str) { return StringBytes(str); }
+
+  template <typename T> static uint8_t *WriteArg(uint8_t *out, const T &value) {
+    ArgSlot slot = {};
+    if constexpr (std::is_floating_point_v<T>) {
+      double d = static_cast<double>(value);
+      slot = {kArgDouble, sizeof(double), 0};
+      memcpy(&slot.mBits, &d, sizeof(d));
+    } else if constexpr (std::is_pointer_v<T>) {
+      slot = {kArgPointer, sizeof(void *),
+              reinterpret_cast<uintptr_t>(static_cast<const void *>(value))};
+    } else {
+      static_assert(std::is_integral_v<T> || std::is_enum_v<T>,
+                    "Unsupported type of a log argument");
+      using Int = typename std::conditional_t<std::is_enum_v<T>,
+                                              std::underlying_type<T>,
+                                              std::common_type<T>>::type;
+      slot = {std::is_signed_v<Int> ? kArgSigned : kArgUnsigned, sizeof(Int),
+              static_cast<uint64_t>(static_cast<Int>(value))};
+    }
+    memcpy(out, &slot, sizeof(slot));
+    return out + sizeof(slot);
+  }
+  static uint8_t *WriteArg(uint8_t *out, const wchar_t *str) {
+    return WriteString(out, str);
+  }
+  static uint8_t *WriteArg(uint8_t *out, wchar_t *str) {
+    return WriteString<wchar_t>(out, str);
+  }
+  static uint8_t *WriteArg(uint8_t *out, const char *str) {
+    return WriteString(out, str);
+  }
+  static uint8_t *WriteArg(uint8_t *out, char *str) {
+    return WriteString<char>(out, str);
+  }
+};
+
+template <typename... Args> void Log(const wchar_t *format, Args... args) {
+  uint32_t size = sizeof(LogRecord::Header);
+  ((size += LogRecord::ArgBytes(args)), ...);
+
+  uint8_t *out = LogRecord::Begin(size);
+  if (!out) {
+    return;
+  }
+
+  LogRecord::Header *header = reinterpret_cast<LogRecord::Header *>(out);
+  header->mArgCount = sizeof...(args);
+  header->mFormat = format;
+  out += sizeof(LogRecord::Header);
+  ((out = LogRecord::WriteArg(out, args)), ...);
+  LogRecord::Commit();
+}
@@ -1,17 +1,48 @@
+#include "admission.h"
+#include "apartmentpool.h"
+#include "chunkstream.h"
+#include "coclient.h"
 #include "interfaces.h"
+#include "log.h"
+#include "manifest.h"
+#include "regutils.h"
 #include "shared.h"
+#include "sharedsection.h"
+#include "shmchannel.h"
+#include "stats.h"
+#include "typelib.h"
 #include "gtest/gtest.h"
 #include <atlbase.h>
-#include <cstdarg>
+#include <atlsafe.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
-void Log(const wchar_t *format, ...) {
-  va_list v;
-  va_start(v, format);
-  vwprintf(format, v);
-  va_end(v);
-}
+IUnknown *CreateFactory();
+std::wstring TestDataPath(LPCWSTR name);
+
+// Log output goes to the console.  It's flushed after each test so that it
+// stays next to the test it came from.
+class ConsoleLog : public ::testing::EmptyTestEventListener {
+public:
+  ConsoleLog() { SetLogSink(new ConsoleLogSink); }
+
+  void OnTestEnd(const ::testing::TestInfo &) override { LogFlush(); }
+
+  void OnTestProgramEnd(const ::testing::UnitTest &) override {
+    // Nothing may write to stdout while the C runtime shuts down
+    LogFlush();
+    SetLogSink(nullptr);
+  }
+};
+
+static const bool gConsoleLog =
+    (::testing::UnitTest::GetInstance()->listeners().Append(new ConsoleLog),
+     true);
 
 void TestObject(const std::vector<GUID> &clsIds) {
   CComPtr<IMarshalable> comobj;
@@ -123,6 +154,47 @@ TEST(STA, Dual) {
   t.join();
 }
 
+// Late binding through IDispatch of the out-of-proc object, whose Invoke
+// call goes through the Automation marshaler
+TEST(STA, LateBound) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IDispatch> dispatch;
+    ASSERT_EQ(dispatch.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                        /*pUnkOuter*/ nullptr,
+                                        CLSCTX_LOCAL_SERVER),
+              S_OK);
+
+    DISPID dispId;
+    ASSERT_EQ(dispatch.GetIDOfName(L"TestNumbers", &dispId), S_OK);
+
+    long b = 11;
+    int c = 12;
+    unsigned long d = 13;
+    CComVariant args[4];
+    args[3] = 10L;
+    V_VT(&args[2]) = VT_I4 | VT_BYREF;
+    V_I4REF(&args[2]) = &b;
+    V_VT(&args[1]) = VT_INT | VT_BYREF;
+    V_INTREF(&args[1]) = &c;
+    V_VT(&args[0]) = VT_UI4 | VT_BYREF;
+    V_UI4REF(&args[0]) = &d;
+    DISPPARAMS params = {args, nullptr, 4, 0};
+    CComVariant result;
+    EXPECT_EQ(dispatch->Invoke(dispId, IID_NULL, LOCALE_USER_DEFAULT,
+                               DISPATCH_METHOD, &params, &result, nullptr,
+                               nullptr),
+              S_OK);
+    EXPECT_EQ(V_VT(&result), VT_UINT);
+    EXPECT_EQ(V_UINT(&result), 44u);
+    EXPECT_EQ(c, 42);
+    EXPECT_EQ(d, 43lu);
+
+    CComPtr<ITypeInfo> typeInfo;
+    EXPECT_EQ(dispatch->GetTypeInfo(0, LOCALE_USER_DEFAULT, &typeInfo), S_OK);
+  });
+  t.join();
+}
+
 TEST(STA, Strings) {
   std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
     CComPtr<IMarshalable> comobj;
@@ -144,7 +216,7 @@ TEST(STA, Strings) {
     EXPECT_STREQ(on_stack2, L"World!\0 <HiddenPart>");
     EXPECT_STREQ(on_heap.get(), L"@orld!");
 
-    Log(L"Received buffer: %p\n", received);
+    Log(L"Received buffer: %p\n", static_cast<void *>(received));
     EXPECT_STREQ(received, L":)");
     ::CoTaskMemFree(received);
 
@@ -158,3 +230,692 @@ TEST(STA, Strings) {
   });
   t.join();
 }
+
+TEST(STA, SharedChannel) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+
+    ShmMarshalable shm;
+    ASSERT_EQ(shm.Connect(comobj), S_OK);
+
+    for (int i = 0; i < 3; ++i) {
+      long a = 10;
+      long b = 11;
+      int c = 12;
+      unsigned long d = 13;
+      unsigned int e = 14;
+      ASSERT_EQ(shm.TestNumbers(a, &b, &c, &d, &e), S_OK);
+      EXPECT_EQ(b, 11);
+      EXPECT_EQ(c, 42);
+      EXPECT_EQ(d, 43lu);
+      EXPECT_EQ(e, 44u);
+    }
+
+    // Same expectations as STA.Strings over RPC
+    wchar_t strIn[] = L"Hello!";
+    wchar_t strInOut[] = L"World!";
+    wchar_t *received = nullptr;
+    ASSERT_EQ(shm.TestWideStrings(strIn, strInOut, &received), S_OK);
+    EXPECT_STREQ(strIn, L"Hello!");
+    EXPECT_STREQ(strInOut, L"@orld!");
+    EXPECT_STREQ(received, L":)");
+    ::CoTaskMemFree(received);
+
+    CComBSTR bstrIn(L"Hello!");
+    CComBSTR bstrInOut(L"World!");
+    CComBSTR bstrOut;
+    ASSERT_EQ(shm.TestBStrings(bstrIn, &bstrOut, &bstrInOut), S_OK);
+    EXPECT_STREQ(bstrIn, L"Hello!");
+    EXPECT_STREQ(bstrOut, L":)");
+    EXPECT_STREQ(bstrInOut, L"@orld!");
+
+    // Larger than a message
+    CComBSTR huge(ShmMessage::kPayloadSize, L'x');
+    bstrOut.Empty();
+    EXPECT_EQ(shm.TestBStrings(huge, &bstrOut, &bstrInOut),
+              HRESULT_FROM_WIN32(ERROR_BUFFER_OVERFLOW));
+  });
+  t.join();
+}
+
+TEST(STA, SharedChannelPipelined) {
+  constexpr int kCalls = 500;
+
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+
+    ShmMarshalable shm;
+    ASSERT_EQ(shm.Connect(comobj), S_OK);
+
+    // More calls in flight than the ring holds, each with its own string so
+    // that a response matched with the wrong call would show
+    std::vector<ShmCall> calls(kCalls);
+    std::vector<CComBSTR> inOut(kCalls);
+    for (int i = 0; i < kCalls; ++i) {
+      inOut[i] = std::to_wstring(100000 + i).c_str();
+      ASSERT_EQ(shm.Begin_TestBStrings(calls[i], CComBSTR(L"Hello!"),
+                                       &inOut[i]),
+                S_OK);
+    }
+    EXPECT_EQ(shm.Outstanding(), size_t(kCalls));
+
+    // A blocking call doesn't disturb the outstanding ones
+    long b = 11;
+    int c = 12;
+    unsigned long d = 13;
+    unsigned int e = 14;
+    ASSERT_EQ(shm.TestNumbers(10, &b, &c, &d, &e), S_OK);
+    EXPECT_EQ(e, 44u);
+
+    // Finished backwards
+    for (int i = kCalls - 1; i >= 0; --i) {
+      CComBSTR out;
+      ASSERT_EQ(shm.Finish_TestBStrings(calls[i], &out, &inOut[i]), S_OK);
+      EXPECT_STREQ(out, L":)");
+      std::wstring expected = std::to_wstring(100000 + i);
+      expected[0] = L'@';
+      EXPECT_STREQ(inOut[i], expected.c_str());
+      EXPECT_FALSE(calls[i].Valid());
+    }
+    EXPECT_EQ(shm.Outstanding(), 0u);
+
+    ShmCall numbers;
+    d = 13;
+    ASSERT_EQ(shm.Begin_TestNumbers(numbers, 10, &b, &d), S_OK);
+    c = 0;
+    e = 0;
+    ASSERT_EQ(shm.Finish_TestNumbers(numbers, &c, &d, &e), S_OK);
+    EXPECT_EQ(c, 42);
+    EXPECT_EQ(d, 43lu);
+    EXPECT_EQ(e, 44u);
+    EXPECT_EQ(shm.Finish_TestNumbers(numbers, &c, &d, &e), E_UNEXPECTED);
+
+    // Abandoned calls are drained when the object goes away
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_EQ(shm.Begin_TestNumbers(numbers, 10, &b, &d), S_OK);
+    }
+  });
+  t.join();
+}
+
+TEST(STA, Coroutine) {
+  constexpr int kCallers = 8;
+
+  ComThreadPool threads(1, 4);
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, [&]() {
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_OutProc_STA_1,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_LOCAL_SERVER),
+              S_OK);
+    CoMarshalable client(threads);
+    ASSERT_EQ(client.Attach(comobj), S_OK);
+
+    ApartmentQueue queue;
+    ApartmentScheduler scheduler(queue);
+    std::unique_ptr<HANDLE, HandleCloser> done(
+        ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    const DWORD apartmentThread = ::GetCurrentThreadId();
+    int completed = 0;
+    bool inApartment = true;
+
+    // gtest's ASSERT_* can't be used in a coroutine, because they return
+    auto caller = [&]() -> CoTask<> {
+      for (int i = 0; i < 3; ++i) {
+        long b = 11;
+        int c = 12;
+        unsigned long d = 13;
+        unsigned int e = 14;
+        HRESULT hr = co_await client.TestNumbers(10, &b, &c, &d, &e);
+        EXPECT_EQ(hr, S_OK);
+        EXPECT_EQ(e, 44u);
+        inApartment = inApartment && ::GetCurrentThreadId() == apartmentThread;
+      }
+
+      CComBSTR bstrIn(L"Hello!");
+      CComBSTR bstrInOut(L"World!");
+      CComBSTR bstrOut;
+      HRESULT hr = co_await client.TestBStrings(bstrIn, &bstrOut, &bstrInOut);
+      EXPECT_EQ(hr, S_OK);
+      EXPECT_STREQ(bstrOut, L":)");
+      EXPECT_STREQ(bstrInOut, L"@orld!");
+      if (++completed == kCallers) {
+        ::SetEvent(done.get());
+      }
+    };
+
+    std::vector<CoTask<>> tasks;
+    for (int i = 0; i < kCallers; ++i) {
+      tasks.push_back(caller());
+      tasks.back().Start();
+    }
+    // The apartment goes on dispatching while the calls are in flight
+    ThreadMsgWaitForSingleObject(done.get(), INFINITE, &queue);
+    EXPECT_EQ(completed, kCallers);
+    EXPECT_TRUE(inApartment);
+  });
+  t.join();
+}
+
+TEST(STA, Manifest) {
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    // The manifest is written next to the module at registration
+    std::wstring subkey(L"Software\\Classes\\CLSID\\");
+    subkey += RegUtil::GuidToString(kCLSID_ExtZ_InProc_STA);
+    subkey += L"\\InprocServer32";
+    RegUtil inproc(HKEY_CURRENT_USER, subkey.c_str());
+    ASSERT_TRUE(inproc);
+    std::wstring manifestPath =
+        ManifestPathForModule(inproc.GetString(nullptr).c_str());
+
+    MappedManifest manifest;
+    ASSERT_TRUE(manifest.Open(manifestPath.c_str()));
+
+    const ManifestEntry *entry = manifest.Find(kCLSID_ExtZ_InProc_STA);
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(std::u16string_view(manifest.String(entry->mThreadModel)),
+              u"Apartment");
+    EXPECT_TRUE(::IsEqualGUID(entry->mTypelib, LIBID_COM_Playground));
+    EXPECT_EQ(manifest.Find(kCLSID_ExtZ_OutProc_STA_1), nullptr);
+
+    CComPtr<IClassFactory> factory;
+    ASSERT_EQ(manifest.GetClassObject(kCLSID_ExtZ_InProc_STA,
+                                      IID_IClassFactory,
+                                      reinterpret_cast<void **>(&factory)),
+              S_OK);
+
+    CComPtr<IMarshalable> comobj;
+    ASSERT_EQ(factory->CreateInstance(/*pUnkOuter*/ nullptr, IID_IMarshalable,
+                                      reinterpret_cast<void **>(&comobj)),
+              S_OK);
+
+    long a = 10;
+    long b = 11;
+    int c = 12;
+    unsigned long d = 13;
+    unsigned int e = 14;
+    ASSERT_EQ(comobj->TestNumbers(a, &b, &c, &d, &e), S_OK);
+    EXPECT_EQ(c, 42);
+  });
+  t.join();
+}
+
+// Checks that `reader` describes every method of the interfaces in
+// interfaces.idl the way oleaut32 does in `typelib`
+static void ExpectSameAsOle(ITypeLib *typelib, const TypeLibView &reader) {
+  for (const IID *iid :
+       {&IID_IMarshalable, &IID_IMarshalable2, &IID_IMarshalable_NoDual,
+        &IID_IMarshalable_OleAuto, &IID_ISharedChannel,
+        &IID_IChunkedStream}) {
+    CComPtr<ITypeInfo> typeInfo;
+    ASSERT_EQ(typelib->GetTypeInfoOfGuid(*iid, &typeInfo), S_OK);
+
+    // oleaut32 shows a dual interface as a dispinterface.  Its vtable is
+    // described by the interface it refers to.
+    HREFTYPE refType;
+    CComPtr<ITypeInfo> vtableInfo;
+    if (FAILED(typeInfo->GetRefTypeOfImplType(-1, &refType)) ||
+        FAILED(typeInfo->GetRefTypeInfo(refType, &vtableInfo))) {
+      vtableInfo = typeInfo;
+    }
+
+    int type = reader.FindTypeInfo(*iid);
+    ASSERT_GE(type, 0);
+    TYPEATTR *attr;
+    ASSERT_EQ(vtableInfo->GetTypeAttr(&attr), S_OK);
+    for (UINT i = 0; i < attr->cFuncs; ++i) {
+      FUNCDESC *desc;
+      ASSERT_EQ(vtableInfo->GetFuncDesc(i, &desc), S_OK);
+      CComBSTR name;
+      ASSERT_EQ(vtableInfo->GetDocumentation(desc->memid, &name, nullptr,
+                                             nullptr, nullptr),
+                S_OK);
+
+      int func = reader.FindFunc(type, name);
+      ASSERT_GE(func, 0);
+      EXPECT_EQ(reader.FindFuncByMemberId(type, desc->memid), func);
+      TypeLibFunc method;
+      ASSERT_TRUE(reader.GetFunc(type, func, method));
+      EXPECT_EQ(method.mMemberId, desc->memid);
+      EXPECT_EQ(method.mVtableSlot * sizeof(void *),
+                static_cast<size_t>(desc->oVft));
+      ASSERT_EQ(method.mParamCount, desc->cParams);
+      for (SHORT j = 0; j < desc->cParams; ++j) {
+        TypeLibParam param;
+        TypeLibType paramType;
+        ASSERT_TRUE(reader.GetParam(method, j, param));
+        ASSERT_TRUE(reader.ResolveType(param.mType, paramType));
+        EXPECT_EQ(param.mFlags,
+                  desc->lprgelemdescParam[j].paramdesc.wParamFlags);
+        EXPECT_EQ(paramType.mVarType, desc->lprgelemdescParam[j].tdesc.vt);
+      }
+      vtableInfo->ReleaseFuncDesc(desc);
+    }
+    vtableInfo->ReleaseTypeAttr(attr);
+  }
+}
+
+TEST(STA, TypeLibReader) {
+  std::thread t(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    std::wstring subkey(L"Software\\Classes\\CLSID\\");
+    subkey += RegUtil::GuidToString(kCLSID_ExtZ_InProc_STA);
+    subkey += L"\\InprocServer32";
+    RegUtil inproc(HKEY_CURRENT_USER, subkey.c_str());
+    ASSERT_TRUE(inproc);
+    std::wstring modulePath = inproc.GetString(nullptr);
+
+    CComPtr<ITypeLib> typelib;
+    ASSERT_EQ(::LoadTypeLib(modulePath.c_str(), &typelib), S_OK);
+    MappedTypeLib module;
+    ASSERT_TRUE(module.OpenModule(modulePath.c_str()));
+
+    // The checked-in fixture must be what MIDL builds from interfaces.idl,
+    // so it's held to the library embedded in the module.  If this fails
+    // after an IDL change, run `nmake testdata`.
+    MappedTypeLib fixture;
+    ASSERT_TRUE(fixture.Open(TestDataPath(L"interfaces.tlb").c_str()));
+
+    for (const MappedTypeLib *reader : {&module, &fixture}) {
+      EXPECT_EQ(reader->TypeInfoCount(), typelib->GetTypeInfoCount());
+      ExpectSameAsOle(typelib, *reader);
+    }
+  });
+  t.join();
+}
+
+TEST(STA, ApartmentPool) {
+  constexpr size_t kApartments = 4;
+  constexpr int kObjects = 8;
+
+  ResetStats();
+  ApartmentPool pool(kApartments, kActivateRoundRobin);
+  CComPtr<IUnknown> unknown;
+  unknown.Attach(CreateFactory());
+  CComQIPtr<IClassFactory> inner = unknown;
+  ASSERT_TRUE(inner);
+  CComPtr<IUnknown> pooled;
+  pooled.Attach(CreatePooledFactory(&pool, inner));
+  CComQIPtr<IClassFactory> factory = pooled;
+  ASSERT_TRUE(factory);
+
+  std::thread client(ComThread<COINIT_MULTITHREADED>, [&]() {
+    for (int i = 0; i < kObjects; ++i) {
+      CComPtr<IMarshalable> object;
+      ASSERT_EQ(factory->CreateInstance(nullptr, IID_IMarshalable,
+                                        reinterpret_cast<void **>(&object)),
+                S_OK);
+      long b = 0;
+      int c = 0;
+      unsigned long d = 0;
+      unsigned int e = 0;
+      EXPECT_EQ(object->TestNumbers(0, &b, &c, &d, &e), S_OK);
+    }
+  });
+  client.join();
+
+  // Every object was created in, and called on, an apartment of the pool
+  std::unique_ptr<StatsSnapshot> snapshot(new StatsSnapshot);
+  TakeStatsSnapshot(*snapshot);
+  for (size_t i = 0; i < kApartments; ++i) {
+    uint64_t calls = 0;
+    for (uint32_t j = 0; j < snapshot->mRowCount; ++j) {
+      const StatsRow &row = snapshot->mRows[j];
+      if (row.mApartment == APTTYPE_STA &&
+          row.mThreadId == pool.Apartment(i).ThreadId() &&
+          row.mMethod == kStatTestNumbers) {
+        calls = row.mCalls;
+      }
+    }
+    EXPECT_EQ(calls, uint64_t(kObjects / kApartments));
+  }
+}
+
+TEST(STA, ApartmentPoolStop) {
+  std::unique_ptr<ApartmentPool> pool(
+      new ApartmentPool(1, kActivateRoundRobin));
+  CComPtr<IUnknown> unknown;
+  unknown.Attach(CreateFactory());
+  CComQIPtr<IClassFactory> inner = unknown;
+  ASSERT_TRUE(inner);
+  CComPtr<IUnknown> pooled;
+  pooled.Attach(CreatePooledFactory(pool.get(), inner));
+  CComQIPtr<IClassFactory> factory = pooled;
+  ASSERT_TRUE(factory);
+
+  // Keep the apartment busy so that an activation is queued behind it
+  std::unique_ptr<HANDLE, HandleCloser> started(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  std::unique_ptr<HANDLE, HandleCloser> release(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  HANDLE startedEvent = started.get();
+  HANDLE releaseEvent = release.get();
+  ASSERT_TRUE(pool->Apartment(0).Post([startedEvent, releaseEvent]() {
+    ::SetEvent(startedEvent);
+    ::WaitForSingleObject(releaseEvent, INFINITE);
+  }));
+  ::WaitForSingleObject(startedEvent, INFINITE);
+
+  HRESULT activated = E_UNEXPECTED;
+  std::thread client(ComThread<COINIT_MULTITHREADED>, [&]() {
+    CComPtr<IMarshalable> object;
+    activated = factory->CreateInstance(nullptr, IID_IMarshalable,
+                                        reinterpret_cast<void **>(&object));
+  });
+  while (pool->Apartment(0).Load() == 0) {
+    ::Sleep(1);
+  }
+
+  // The pool is destroyed while the activation waits, and waits for it
+  std::thread destroyer([&pool]() { pool.reset(); });
+  ::Sleep(50);
+  ::SetEvent(releaseEvent);
+  client.join();
+  destroyer.join();
+  EXPECT_EQ(activated, S_OK);
+
+  // The factory outlives the pool, and refuses activations
+  CComPtr<IMarshalable> object;
+  EXPECT_EQ(factory->CreateInstance(nullptr, IID_IMarshalable,
+                                    reinterpret_cast<void **>(&object)),
+            CO_E_SERVER_STOPPING);
+  EXPECT_FALSE(object);
+}
+
+// Holds the only apartment of `pool` while each client makes one call on an
+// object of its own, then lets the calls in at once.  With `backoff`, odd
+// clients are STAs retrying through the message filter and even ones are
+// MTA threads retrying by themselves.
+static void FloodApartment(ApartmentPool &pool, IClassFactory *factory,
+                           int clients, bool backoff, int &succeeded,
+                           int &rejected) {
+  std::unique_ptr<HANDLE, HandleCloser> go(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  std::unique_ptr<HANDLE, HandleCloser> release(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  std::atomic<int> ready(0);
+  std::atomic<int> ok(0);
+  std::atomic<int> retryLater(0);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < clients; ++i) {
+    const bool sta = backoff && i % 2;
+    auto client = [&, sta]() {
+      CComPtr<IMarshalable> object;
+      HRESULT hr = factory->CreateInstance(nullptr, IID_IMarshalable,
+                                           reinterpret_cast<void **>(&object));
+      ++ready;
+      EXPECT_EQ(hr, S_OK);
+      ::WaitForSingleObject(go.get(), INFINITE);
+      if (FAILED(hr)) {
+        return;
+      }
+
+      CComPtr<IMessageFilter> previous;
+      if (sta) {
+        CComPtr<IMessageFilter> filter;
+        filter.Attach(CreateBackoffFilter(RetryBackoff()));
+        EXPECT_EQ(::CoRegisterMessageFilter(filter, &previous), S_OK);
+      }
+      long b = 0;
+      int c = 0;
+      unsigned long d = 0;
+      unsigned int e = 0;
+      if (backoff && !sta) {
+        RetryBackoff retry;
+        hr = CallWithBackoff(
+            retry, [&]() { return object->TestNumbers(0, &b, &c, &d, &e); });
+      } else {
+        hr = object->TestNumbers(0, &b, &c, &d, &e);
+      }
+      if (hr == S_OK) {
+        ++ok;
+      } else if (hr == RPC_E_SERVERCALL_RETRYLATER) {
+        ++retryLater;
+      } else {
+        ADD_FAILURE() << "TestNumbers failed - " << std::hex << hr;
+      }
+      if (sta) {
+        IMessageFilter *filter = nullptr;
+        ::CoRegisterMessageFilter(previous, &filter);
+        if (filter) {
+          filter->Release();
+        }
+      }
+    };
+    if (sta) {
+      threads.emplace_back(ComThread<COINIT_APARTMENTTHREADED>, client);
+    } else {
+      threads.emplace_back(ComThread<COINIT_MULTITHREADED>, client);
+    }
+  }
+
+  while (ready.load() < clients) {
+    ::Sleep(1);
+  }
+  HANDLE releaseEvent = release.get();
+  EXPECT_TRUE(pool.Apartment(0).Post(
+      [releaseEvent]() { ::WaitForSingleObject(releaseEvent, INFINITE); }));
+  ::SetEvent(go.get());
+  // Long enough for every call to arrive
+  ::Sleep(500);
+  ::SetEvent(release.get());
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  succeeded = ok.load();
+  rejected = retryLater.load();
+}
+
+TEST(STA, Admission) {
+  constexpr int kClients = 8;
+  constexpr size_t kMaxQueuedCalls = 2;
+
+  ApartmentPool pool(1, kActivateRoundRobin, kMaxQueuedCalls);
+  CComPtr<IUnknown> unknown;
+  unknown.Attach(CreateFactory());
+  CComQIPtr<IClassFactory> inner = unknown;
+  ASSERT_TRUE(inner);
+  CComPtr<IUnknown> pooled;
+  pooled.Attach(CreatePooledFactory(&pool, inner));
+  CComQIPtr<IClassFactory> factory = pooled;
+  ASSERT_TRUE(factory);
+
+  // The calls beyond the limit are turned away
+  int succeeded = 0;
+  int rejected = 0;
+  FloodApartment(pool, factory, kClients, /*backoff*/ false, succeeded,
+                 rejected);
+  EXPECT_EQ(succeeded + rejected, kClients);
+  EXPECT_GE(succeeded, static_cast<int>(kMaxQueuedCalls));
+  EXPECT_GT(rejected, 0);
+  EXPECT_EQ(pool.Apartment(0).RejectedCalls(), uint64_t(rejected));
+
+  // and come back later
+  const uint64_t rejectedBefore = pool.Apartment(0).RejectedCalls();
+  FloodApartment(pool, factory, kClients, /*backoff*/ true, succeeded,
+                 rejected);
+  EXPECT_EQ(succeeded, kClients);
+  EXPECT_EQ(rejected, 0);
+  EXPECT_GT(pool.Apartment(0).RejectedCalls(), rejectedBefore);
+}
+
+TEST(STA, Batch) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    for (const auto &clsId :
+         {kCLSID_ExtZ_InProc_STA, kCLSID_ExtZ_OutProc_STA_1}) {
+      CComPtr<IMarshalable2> comobj;
+      ASSERT_EQ(comobj.CoCreateInstance(
+                    clsId,
+                    /*pUnkOuter*/ nullptr,
+                    CLSCTX_LOCAL_SERVER | CLSCTX_INPROC_SERVER),
+                S_OK);
+
+      constexpr LONG kCount = 1000;
+      CComSafeArray<long> in(kCount);
+      for (LONG i = 0; i < kCount; ++i) {
+        in[i] = i;
+      }
+
+      SAFEARRAY *raw = nullptr;
+      ASSERT_EQ(comobj->TestNumbersBatch(in, &raw), S_OK);
+      CComSafeArray<long> out;
+      out.Attach(raw);
+      ASSERT_EQ(out.GetCount(), static_cast<ULONG>(kCount));
+      for (LONG i = 0; i < kCount; ++i) {
+        EXPECT_EQ(out[i], i + 42);
+      }
+
+      // Both objects are behind a proxy here, whose marshaler may reject
+      // the array before the object sees it
+      CComSafeArray<double> wrongType(1);
+      raw = nullptr;
+      EXPECT_TRUE(FAILED(comobj->TestNumbersBatch(wrongType, &raw)));
+      EXPECT_EQ(raw, nullptr);
+    }
+  });
+  t.join();
+
+  // Called directly, the object rejects it itself
+  std::thread direct(ComThread<COINIT_APARTMENTTHREADED>, []() {
+    CComPtr<IMarshalable2> comobj;
+    ASSERT_EQ(comobj.CoCreateInstance(kCLSID_ExtZ_InProc_STA,
+                                      /*pUnkOuter*/ nullptr,
+                                      CLSCTX_INPROC_SERVER),
+              S_OK);
+    CComSafeArray<double> wrongType(1);
+    SAFEARRAY *raw = nullptr;
+    EXPECT_EQ(comobj->TestNumbersBatch(wrongType, &raw), E_INVALIDARG);
+    EXPECT_EQ(raw, nullptr);
+
+    CComSafeArray<long> twoDims;
+    CComSafeArrayBound bounds[] = {CComSafeArrayBound(2),
+                                   CComSafeArrayBound(2)};
+    ASSERT_EQ(twoDims.Create(bounds, 2), S_OK);
+    EXPECT_EQ(comobj->TestNumbersBatch(twoDims, &raw), E_INVALIDARG);
+    EXPECT_EQ(raw, nullptr);
+  });
+  direct.join();
+}
+
+TEST(STA, Sections) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    constexpr uint64_t kSize = 4 << 20;
+    std::unique_ptr<SharedSection> section = SharedSection::Create(kSize);
+    ASSERT_TRUE(section);
+    FillStreamPattern(4, 0, section->Data(), kSize);
+    StreamChecksum expected;
+    expected.Update(section->Data(), kSize);
+    CComSafeArray<BYTE> buffer(static_cast<ULONG>(kSize));
+    std::memcpy(&buffer.GetAt(0), section->Data(), kSize);
+
+    for (const auto &clsId :
+         {kCLSID_ExtZ_InProc_STA, kCLSID_ExtZ_OutProc_STA_1}) {
+      CComPtr<IMarshalable2> comobj;
+      ASSERT_EQ(comobj.CoCreateInstance(
+                    clsId,
+                    /*pUnkOuter*/ nullptr,
+                    CLSCTX_LOCAL_SERVER | CLSCTX_INPROC_SERVER),
+                S_OK);
+
+      // Sections are shared with the object's process, which the caller
+      // hands the handles to
+      unsigned long objectProcessId = 0;
+      ASSERT_EQ(comobj->GetProcessId(&objectProcessId), S_OK);
+
+      // The object sees the same bytes whether they're copied or mapped
+      unsigned long checksum = 0;
+      ASSERT_EQ(comobj->TestBuffer(buffer, &checksum), S_OK);
+      EXPECT_EQ(checksum, expected.Value());
+      ASSERT_EQ(CallWithSection(*section, objectProcessId,
+                                [&](unsigned long handle) {
+                                  return comobj->TestSection(
+                                      handle, kSize, VARIANT_FALSE, &checksum);
+                                }),
+                S_OK);
+      EXPECT_EQ(checksum, expected.Value());
+
+      // Writes to a copy-on-write view stay in the object's process
+      ASSERT_EQ(comobj->TestSection(section->ShareWith(objectProcessId), kSize,
+                                    VARIANT_TRUE, &checksum),
+                S_OK);
+      EXPECT_NE(checksum, expected.Value());
+      StreamChecksum after;
+      after.Update(section->Data(), kSize);
+      EXPECT_EQ(after.Value(), expected.Value());
+
+      unsigned long cookie = 0;
+      ASSERT_EQ(comobj->AttachSection(section->ShareWith(objectProcessId),
+                                      kSize, &cookie),
+                S_OK);
+      ASSERT_EQ(comobj->TestAttachedSection(cookie, 0, kSize, &checksum),
+                S_OK);
+      EXPECT_EQ(checksum, expected.Value());
+      EXPECT_EQ(comobj->DetachSection(cookie), S_OK);
+
+      EXPECT_EQ(comobj->TestSection(section->ShareWith(objectProcessId),
+                                    kSize + 1, VARIANT_FALSE, &checksum),
+                E_INVALIDARG);
+    }
+  });
+  t.join();
+}
+
+TEST(STA, ChunkedStream) {
+  std::thread t(ComThread<COINIT_MULTITHREADED>, []() {
+    for (const auto &clsId :
+         {kCLSID_ExtZ_InProc_STA, kCLSID_ExtZ_OutProc_STA_1}) {
+      CComPtr<IChunkedStream> stream;
+      ASSERT_EQ(stream.CoCreateInstance(
+                    clsId,
+                    /*pUnkOuter*/ nullptr,
+                    CLSCTX_LOCAL_SERVER | CLSCTX_INPROC_SERVER),
+                S_OK);
+
+      // Streamed back to the object as it arrives, with both directions on
+      // transfer threads in the MTA like this one
+      constexpr hyper kTotal = 8 << 20;
+      constexpr size_t kChunkSize = 256 << 10;
+      ASSERT_EQ(stream->OpenRead(kTotal, 5), S_OK);
+      ASSERT_EQ(stream->OpenWrite(), S_OK);
+      StreamChecksum checksum;
+      {
+        ChunkReader reader(ChunkedStreamSource(stream, kChunkSize),
+                           kChunkSize, 4, ComThread<COINIT_MULTITHREADED>);
+        ChunkWriter writer(ChunkedStreamSink(stream), kChunkSize, 4,
+                           ComThread<COINIT_MULTITHREADED>);
+        const uint8_t *data;
+        size_t size;
+        while (reader.Next(data, size)) {
+          checksum.Update(data, size);
+          EXPECT_TRUE(writer.Write(data, size));
+        }
+        EXPECT_FALSE(reader.Failed());
+        EXPECT_TRUE(writer.Close());
+      }
+
+      std::vector<uint8_t> expected(kTotal);
+      FillStreamPattern(5, 0, expected.data(), expected.size());
+      StreamChecksum expectedChecksum;
+      expectedChecksum.Update(expected.data(), expected.size());
+      EXPECT_EQ(checksum.Value(), expectedChecksum.Value());
+
+      hyper written = 0;
+      unsigned long writtenChecksum = 0;
+      ASSERT_EQ(stream->GetWritten(&written, &writtenChecksum), S_OK);
+      EXPECT_EQ(written, kTotal);
+      EXPECT_EQ(writtenChecksum, expectedChecksum.Value());
+
+      CComSafeArray<long> wrongType(1);
+      EXPECT_EQ(stream->Write(wrongType), E_INVALIDARG);
+    }
+  });
+  t.join();
+}
@@ -0,0 +1,267 @@
+#include "manifest.h"
+#include <algorithm>
+#include <cstring>
+
+static uint64_t HashGuid(const GUID &guid, uint64_t seed) {
+  uint64_t lo, hi;
+  memcpy(&lo, &guid, sizeof(lo));
+  memcpy(&hi, reinterpret_cast<const uint8_t *>(&guid) + sizeof(lo),
+         sizeof(hi));
+
+  // Two rounds of the MurmurHash3 finalizer
+  uint64_t h = lo ^ (seed * 0x9e3779b97f4a7c15ull);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= hi;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static bool GuidLess(const GUID &a, const GUID &b) {
+  return memcmp(&a, &b, sizeof(GUID)) < 0;
+}
+
+// Finds a seed for every bucket so that each CLSID lands in its own slot.
+// Larger buckets go first while most slots are still free.
+static bool BuildIndex(const std::vector<GUID> &keys, uint32_t slotCount,
+                       uint32_t bucketCount, std::vector<uint32_t> &seeds,
+                       std::vector<uint32_t> &slotOfKey) {
+  constexpr uint32_t kMaxSeed = 1 << 16;
+
+  std::vector<std::vector<uint32_t>> buckets(bucketCount);
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    buckets[HashGuid(keys[i], 0) % bucketCount].push_back(i);
+  }
+
+  std::vector<uint32_t> order(bucketCount);
+  for (uint32_t i = 0; i < bucketCount; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  seeds.assign(bucketCount, 0);
+  slotOfKey.assign(keys.size(), 0);
+  std::vector<bool> occupied(slotCount);
+  std::vector<uint32_t> candidate;
+  for (uint32_t bucket : order) {
+    const std::vector<uint32_t> &members = buckets[bucket];
+    if (members.empty()) {
+      break;
+    }
+
+    bool placed = false;
+    for (uint32_t seed = 1; seed < kMaxSeed && !placed; ++seed) {
+      candidate.clear();
+      placed = true;
+      for (uint32_t key : members) {
+        uint32_t slot = HashGuid(keys[key], seed) % slotCount;
+        if (occupied[slot] || std::find(candidate.begin(), candidate.end(),
+                                        slot) != candidate.end()) {
+          placed = false;
+          break;
+        }
+        candidate.push_back(slot);
+      }
+
+      if (placed) {
+        seeds[bucket] = seed;
+        for (size_t i = 0; i < members.size(); ++i) {
+          occupied[candidate[i]] = true;
+          slotOfKey[members[i]] = candidate[i];
+        }
+      }
+    }
+
+    if (!placed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ManifestWriter::ManifestWriter() {
+  // Offset 0 is always an empty string
+  mStrings.push_back(0);
+}
+
+// wchar_t is UTF-16 on Windows and UTF-32 elsewhere
+static std::u16string ToUtf16(const wchar_t *str) {
+  std::u16string utf16;
+  for (; *str; ++str) {
+    uint32_t c = static_cast<uint32_t>(*str);
+    if (sizeof(wchar_t) > sizeof(char16_t) && c > 0xffff) {
+      c -= 0x10000;
+      utf16.push_back(static_cast<char16_t>(0xd800 + (c >> 10)));
+      utf16.push_back(static_cast<char16_t>(0xdc00 + (c & 0x3ff)));
+    } else {
+      utf16.push_back(static_cast<char16_t>(c));
+    }
+  }
+  return utf16;
+}
+
+uint32_t ManifestWriter::AddString(const wchar_t *str) {
+  if (!str || !*str) {
+    return 0;
+  }
+  auto inserted = mStringOffsets.emplace(
+      ToUtf16(str), static_cast<uint32_t>(mStrings.size()));
+  if (inserted.second) {
+    const std::u16string &utf16 = inserted.first->first;
+    mStrings.insert(mStrings.end(), utf16.c_str(),
+                    utf16.c_str() + utf16.size() + 1);
+  }
+  return inserted.first->second;
+}
+
+void ManifestWriter::Add(const GUID &clsId, const wchar_t *modulePath,
+                         const wchar_t *threadModel, const GUID &typelib) {
+  mRecords.push_back(
+      {clsId, typelib, AddString(modulePath), AddString(threadModel)});
+}
+
+bool ManifestWriter::Build(std::vector<uint8_t> &image) const {
+  std::vector<GUID> keys;
+  keys.reserve(mRecords.size());
+  for (const Record &record : mRecords) {
+    keys.push_back(record.mClsId);
+  }
+
+  std::vector<GUID> sorted(keys);
+  std::sort(sorted.begin(), sorted.end(), GuidLess);
+  if (std::adjacent_find(sorted.begin(), sorted.end(),
+                         [](const GUID &a, const GUID &b) {
+                           return !GuidLess(a, b) && !GuidLess(b, a);
+                         }) != sorted.end()) {
+    return false;
+  }
+
+  // Start with one slot per key and an average of four keys per bucket.  If
+  // no seed works, give up on minimality and add some slack.
+  uint32_t count = static_cast<uint32_t>(keys.size());
+  uint32_t slotCount = std::max<uint32_t>(count, 1);
+  uint32_t bucketCount = std::max<uint32_t>((count + 3) / 4, 1);
+  std::vector<uint32_t> seeds;
+  std::vector<uint32_t> slotOfKey;
+  while (!BuildIndex(keys, slotCount, bucketCount, seeds, slotOfKey)) {
+    slotCount += slotCount / 8 + 1;
+  }
+
+  ManifestHeader header = {};
+  header.mMagic = ManifestHeader::kMagic;
+  header.mVersion = ManifestHeader::kVersion;
+  header.mSlotCount = slotCount;
+  header.mBucketCount = bucketCount;
+  header.mSeedsOffset = sizeof(ManifestHeader);
+  header.mEntriesOffset = static_cast<uint32_t>(
+      (header.mSeedsOffset + bucketCount * sizeof(uint32_t) + 7) & ~7);
+  header.mStringsOffset = static_cast<uint32_t>(
+      header.mEntriesOffset + slotCount * sizeof(ManifestEntry));
+  header.mStringsSize =
+      static_cast<uint32_t>(mStrings.size() * sizeof(char16_t));
+
+  image.assign(header.mStringsOffset + header.mStringsSize, 0);
+  memcpy(image.data(), &header, sizeof(header));
+  memcpy(image.data() + header.mSeedsOffset, seeds.data(),
+         seeds.size() * sizeof(uint32_t));
+
+  // Unused slots keep GUID_NULL, which Find never matches
+  ManifestEntry *entries =
+      reinterpret_cast<ManifestEntry *>(image.data() + header.mEntriesOffset);
+  for (size_t i = 0; i < mRecords.size(); ++i) {
+    const Record &record = mRecords[i];
+    entries[slotOfKey[i]] = {record.mClsId, record.mTypelib, record.mModule,
+                             record.mThreadModel};
+  }
+
+  memcpy(image.data() + header.mStringsOffset, mStrings.data(),
+         header.mStringsSize);
+  return true;
+}
+
+ManifestView::ManifestView()
+    : mBase(nullptr), mHeader(nullptr), mSeeds(nullptr), mEntries(nullptr) {}
+
+bool ManifestView::Attach(const void *image, size_t size) {
+  mBase = nullptr;
+  mHeader = nullptr;
+  mEntryPoints.reset();
+
+  const uint8_t *base = reinterpret_cast<const uint8_t *>(image);
+  const ManifestHeader *header =
+      reinterpret_cast<const ManifestHeader *>(base);
+  if (!base || size < sizeof(ManifestHeader) ||
+      header->mMagic != ManifestHeader::kMagic ||
+      header->mVersion != ManifestHeader::kVersion ||
+      header->mSlotCount == 0 ||
+      header->mBucketCount == 0) {
+    return false;
+  }
+
+  uint64_t seedsEnd = uint64_t(header->mSeedsOffset) +
+                      uint64_t(header->mBucketCount) * sizeof(uint32_t);
+  uint64_t entriesEnd = uint64_t(header->mEntriesOffset) +
+                        uint64_t(header->mSlotCount) * sizeof(ManifestEntry);
+  uint64_t stringsEnd =
+      uint64_t(header->mStringsOffset) + header->mStringsSize;
+  if (header->mSeedsOffset % alignof(uint32_t) ||
+      header->mEntriesOffset % alignof(ManifestEntry) ||
+      header->mStringsOffset % alignof(char16_t) ||
+      header->mStringsSize % sizeof(char16_t) || header->mStringsSize == 0 ||
+      seedsEnd > header->mEntriesOffset ||
+      entriesEnd > header->mStringsOffset || stringsEnd > size) {
+    return false;
+  }
+
+  // Every string must be inside the area and the area must end with a null,
+  // so that String() never reads past the image.
+  const char16_t *strings =
+      reinterpret_cast<const char16_t *>(base + header->mStringsOffset);
+  uint32_t stringCount = header->mStringsSize / sizeof(char16_t);
+  if (strings[stringCount - 1] != 0) {
+    return false;
+  }
+
+  const ManifestEntry *entries =
+      reinterpret_cast<const ManifestEntry *>(base + header->mEntriesOffset);
+  for (uint32_t i = 0; i < header->mSlotCount; ++i) {
+    if (entries[i].mModule >= stringCount ||
+        entries[i].mThreadModel >= stringCount) {
+      return false;
+    }
+  }
+
+  mBase = base;
+  mHeader = header;
+  mSeeds = reinterpret_cast<const uint32_t *>(base + header->mSeedsOffset);
+  mEntries = entries;
+  mEntryPoints.reset(new std::atomic<void *>[header->mSlotCount]);
+  for (uint32_t i = 0; i < header->mSlotCount; ++i) {
+    mEntryPoints[i].store(nullptr, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+const ManifestEntry *ManifestView::Find(const GUID &clsId) const {
+  constexpr GUID kEmptyGuid = {};
+  if (!mHeader || clsId == kEmptyGuid) {
+    return nullptr;
+  }
+
+  uint32_t seed = mSeeds[HashGuid(clsId, 0) % mHeader->mBucketCount];
+  const ManifestEntry &entry =
+      mEntries[HashGuid(clsId, seed) % mHeader->mSlotCount];
+  return entry.mClsId == clsId ? &entry : nullptr;
+}
+
+const char16_t *ManifestView::String(uint32_t offset) const {
+  if (!mHeader || offset >= mHeader->mStringsSize / sizeof(char16_t)) {
+    return u"";
+  }
+  return reinterpret_cast<const char16_t *>(mBase + mHeader->mStringsOffset) +
+         offset;
+}
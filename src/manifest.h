@@ -0,0 +1,127 @@
+#pragma once
+
+#include "guid.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary activation manifest.  It maps a CLSID to the module serving it, the
+// threading model, and the typelib, without touching the registry.  The file
+// is position-independent so that it can be mapped and used in place:
+//
+//   ManifestHeader
+//   uint32_t       mSeeds[mBucketCount]
+//   ManifestEntry  mEntries[mSlotCount]
+//   char16_t       UTF-16 strings, each terminated with a null
+//
+// The entries are indexed with a minimal perfect hash (hash and displace).
+// A CLSID first selects a bucket, and the seed of the bucket selects a slot
+// with no collision, so a lookup is two hashes and one GUID compare.
+//
+// Building and reading an image is plain C++, so it works on any platform,
+// and the strings are UTF-16 whatever the size of wchar_t.  Only writing,
+// mapping and activating are Win32, in manifestloader.cpp.
+struct ManifestHeader {
+  static constexpr uint32_t kMagic = 0x464d4143; // 'CAMF'
+  static constexpr uint32_t kVersion = 2;
+
+  uint32_t mMagic;
+  uint32_t mVersion;
+  uint32_t mSlotCount;
+  uint32_t mBucketCount;
+  uint32_t mSeedsOffset;
+  uint32_t mEntriesOffset;
+  uint32_t mStringsOffset;
+  uint32_t mStringsSize; // In bytes
+};
+
+struct ManifestEntry {
+  GUID mClsId;
+  GUID mTypelib;
+  uint32_t mModule;      // Offset in the string area
+  uint32_t mThreadModel; // Empty if this is a LocalServer
+};
+
+class ManifestWriter {
+  struct Record {
+    GUID mClsId;
+    GUID mTypelib;
+    uint32_t mModule;
+    uint32_t mThreadModel;
+  };
+
+  std::vector<Record> mRecords;
+  std::vector<char16_t> mStrings;
+  std::map<std::u16string, uint32_t> mStringOffsets; // To share strings
+
+  uint32_t AddString(const wchar_t *str);
+
+public:
+  ManifestWriter();
+
+  void Add(const GUID &clsId, const wchar_t *modulePath,
+           const wchar_t *threadModel, const GUID &typelib);
+
+  // Fails if the same CLSID was added twice
+  bool Build(std::vector<uint8_t> &image) const;
+#ifdef _WIN32
+  bool Save(LPCWSTR path) const;
+#endif
+};
+
+// Read-only view of a manifest image.  It doesn't own the memory.
+class ManifestView {
+  const uint8_t *mBase;
+  const ManifestHeader *mHeader;
+  const uint32_t *mSeeds;
+  const ManifestEntry *mEntries;
+
+  // DllGetClassObject of each inproc entry, resolved on first activation
+  mutable std::unique_ptr<std::atomic<void *>[]> mEntryPoints;
+
+public:
+  ManifestView();
+
+  // Validates the image and returns false if it's not a manifest
+  bool Attach(const void *image, size_t size);
+
+  constexpr operator bool() const { return !!mHeader; }
+
+  const ManifestEntry *Find(const GUID &clsId) const;
+  const char16_t *String(uint32_t offset) const;
+
+#ifdef _WIN32
+  // Activates an inproc entry by loading its module directly.  A LocalServer
+  // entry falls back to CoGetClassObject because it needs the SCM anyway.
+  //
+  // Unlike CoGetClassObject, this doesn't check the threading model of the
+  // entry against the caller's apartment, and never creates the object in
+  // another apartment.  The class object runs on the calling thread, so the
+  // caller must be in an apartment the entry's threading model allows.
+  HRESULT GetClassObject(REFCLSID clsId, REFIID riid, void **ppv) const;
+#endif
+};
+
+#ifdef _WIN32
+class MappedManifest : public ManifestView {
+  HANDLE mMapping;
+  const void *mView;
+
+public:
+  MappedManifest();
+  ~MappedManifest();
+
+  MappedManifest(const MappedManifest &) = delete;
+  MappedManifest &operator=(const MappedManifest &) = delete;
+
+  bool Open(LPCWSTR path);
+};
+
+// Path of the manifest written next to a module
+std::wstring ManifestPathForModule(LPCWSTR modulePath);
+#endif
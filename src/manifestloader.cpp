@@ -0,0 +1,130 @@
+#include "manifest.h"
+#include "log.h"
+#include "shared.h"
+
+bool ManifestWriter::Save(LPCWSTR path) const {
+  std::vector<uint8_t> image;
+  if (!Build(image)) {
+    return false;
+  }
+
+  std::unique_ptr<void, HandleCloser> file(
+      ::CreateFileW(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, nullptr));
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+    Log(L"CreateFileW failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  DWORD written = 0;
+  if (!::WriteFile(file.get(), image.data(), static_cast<DWORD>(image.size()),
+                   &written, nullptr) ||
+      written != image.size()) {
+    Log(L"WriteFile failed - %08x\n", ::GetLastError());
+    return false;
+  }
+  return true;
+}
+
+HRESULT ManifestView::GetClassObject(REFCLSID clsId, REFIID riid,
+                                     void **ppv) const {
+  *ppv = nullptr;
+
+  const ManifestEntry *entry = Find(clsId);
+  if (!entry) {
+    return REGDB_E_CLASSNOTREG;
+  }
+
+  if (!*String(entry->mThreadModel)) {
+    return ::CoGetClassObject(clsId, CLSCTX_LOCAL_SERVER, nullptr, riid, ppv);
+  }
+
+  // Like COM, the module stays loaded once an object has been activated.
+  // The threading model isn't checked, see the declaration.
+  std::atomic<void *> &entryPoint = mEntryPoints[entry - mEntries];
+  void *proc = entryPoint.load(std::memory_order_acquire);
+  if (!proc) {
+    HMODULE module = ::LoadLibraryW(
+        reinterpret_cast<LPCWSTR>(String(entry->mModule)));
+    if (!module) {
+      return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    proc = reinterpret_cast<void *>(
+        ::GetProcAddress(module, "DllGetClassObject"));
+    if (!proc) {
+      ::FreeLibrary(module);
+      return CO_E_ERRORINDLL;
+    }
+
+    void *expected = nullptr;
+    if (!entryPoint.compare_exchange_strong(expected, proc,
+                                            std::memory_order_acq_rel)) {
+      // Another thread won.  Drop the extra reference to the module.
+      ::FreeLibrary(module);
+      proc = expected;
+    }
+  }
+
+  return reinterpret_cast<LPFNGETCLASSOBJECT>(proc)(clsId, riid, ppv);
+}
+
+MappedManifest::MappedManifest() : mMapping(nullptr), mView(nullptr) {}
+
+MappedManifest::~MappedManifest() {
+  if (mView) {
+    ::UnmapViewOfFile(mView);
+  }
+  if (mMapping) {
+    ::CloseHandle(mMapping);
+  }
+}
+
+bool MappedManifest::Open(LPCWSTR path) {
+  if (mView) {
+    return false;
+  }
+
+  std::unique_ptr<void, HandleCloser> file(::CreateFileW(
+      path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file.get(), &size) || size.QuadPart == 0 ||
+      size.QuadPart > MAXDWORD) {
+    return false;
+  }
+
+  std::unique_ptr<void, HandleCloser> mapping(::CreateFileMappingW(
+      file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+  if (!mapping) {
+    Log(L"CreateFileMappingW failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  const void *view = ::MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    Log(L"MapViewOfFile failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  if (!Attach(view, static_cast<size_t>(size.QuadPart))) {
+    ::UnmapViewOfFile(view);
+    return false;
+  }
+
+  mMapping = mapping.release();
+  mView = view;
+  return true;
+}
+
+std::wstring ManifestPathForModule(LPCWSTR modulePath) {
+  std::wstring path(modulePath);
+  path += L".clsidx";
+  return path;
+}
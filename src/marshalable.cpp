@@ -1,19 +1,61 @@
+#include "alloc.h"
+#include "chunkstream.h"
+#include "dispatch.h"
 #include "interfaces.h"
+#include "log.h"
+#include "marshalable.h"
 #include "regutils.h"
+#include "shared.h"
+#include "sharedsection.h"
+#include "shmchannel.h"
+#include "stats.h"
+#include "utf16.h"
+#include <algorithm>
 #include <atlbase.h>
+#include <atomic>
 #include <cassert>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <windows.h>
 
-void Log(const wchar_t *format, ...);
+static std::atomic<size_t> gInstancePoolCap(0);
+static std::atomic<uint64_t> gInstancesCreated(0);
+static std::atomic<uint64_t> gInstancesReused(0);
+static std::atomic<uint64_t> gInstancesPooled(0);
+static std::atomic<uint64_t> gInstancesDestroyed(0);
 
-class MainObject : public IMarshalable,
+class MainObject : public IMarshalable2,
                    public IMarshalable_NoDual,
-                   public IMarshalable_OleAuto {
+                   public IMarshalable_OleAuto,
+                   public ISharedChannel,
+                   public IChunkedStream {
   ULONG mRef;
+  MainObject *mNextFree; // Link in the instance pool
+
+  // IChunkedStream.  A stream is used by one client at a time, but the lock
+  // keeps concurrent calls from the MTA from corrupting it.
+  std::mutex mStreamLock;
+  uint32_t mReadSeed;
+  uint64_t mReadSize;
+  uint64_t mReadOffset;
+  uint64_t mWritten;
+  StreamChecksum mWriteChecksum;
+
+  // Sections mapped by AttachSection, until DetachSection or the last
+  // Release
+  std::mutex mSectionLock;
+  std::map<unsigned long, std::unique_ptr<SectionView>> mSections;
+  unsigned long mNextCookie;
+
+  friend struct InstancePool;
 
 public:
   MainObject();
-  virtual ~MainObject() = default;
+  virtual ~MainObject();
+
+  // Brings a pooled object back to the state of a newly created one
+  void Reset();
 
   STDMETHODIMP QueryInterface(REFIID riid, void **ppv);
   STDMETHODIMP_(ULONG) AddRef();
@@ -47,6 +89,38 @@ public:
       /* [out] */ BSTR *strOut,
       /* [out][in] */ BSTR *strInOut);
 
+  // IMarshalable2
+  IFACEMETHODIMP TestNumbersBatch(
+      /* [in] */ SAFEARRAY *numbersIn,
+      /* [retval][out] */ SAFEARRAY **numbersOut);
+
+  IFACEMETHODIMP TestBuffer(
+      /* [in] */ SAFEARRAY *buffer,
+      /* [retval][out] */ unsigned long *checksum);
+
+  IFACEMETHODIMP TestSection(
+      /* [in] */ unsigned long section,
+      /* [in] */ hyper size,
+      /* [in] */ VARIANT_BOOL copyOnWrite,
+      /* [retval][out] */ unsigned long *checksum);
+
+  IFACEMETHODIMP AttachSection(
+      /* [in] */ unsigned long section,
+      /* [in] */ hyper size,
+      /* [retval][out] */ unsigned long *cookie);
+
+  IFACEMETHODIMP TestAttachedSection(
+      /* [in] */ unsigned long cookie,
+      /* [in] */ hyper offset,
+      /* [in] */ hyper size,
+      /* [retval][out] */ unsigned long *checksum);
+
+  IFACEMETHODIMP DetachSection(
+      /* [in] */ unsigned long cookie);
+
+  IFACEMETHODIMP GetProcessId(
+      /* [retval][out] */ unsigned long *processId);
+
   // IMarshalable_NoDual
   IFACEMETHODIMP TestNumbers_NoDual() {
     assert(0);
@@ -63,17 +137,101 @@ public:
     return TestNumbers(numberIn, pnumberIn, numberOut, numberInOut,
                        numberRetval);
   }
+
+  // ISharedChannel
+  IFACEMETHODIMP OpenChannel(
+      /* [in] */ BSTR name,
+      /* [in] */ unsigned long clientProcessId,
+      /* [retval][out] */ unsigned long *serverProcessId);
+
+  // IChunkedStream
+  IFACEMETHODIMP OpenRead(
+      /* [in] */ hyper size,
+      /* [in] */ unsigned long seed);
+
+  IFACEMETHODIMP Read(
+      /* [in] */ unsigned long maxBytes,
+      /* [retval][out] */ SAFEARRAY **chunk);
+
+  IFACEMETHODIMP OpenWrite();
+
+  IFACEMETHODIMP Write(
+      /* [in] */ SAFEARRAY *chunk);
+
+  IFACEMETHODIMP GetWritten(
+      /* [out] */ hyper *size,
+      /* [retval][out] */ unsigned long *checksum);
+};
+
+// Free list of the current thread.  Objects left in it are destroyed when
+// the thread exits, which is safe even under the loader lock of a DLL
+// because they keep the module loaded until then.
+struct InstancePool {
+  MainObject *mHead;
+  size_t mCount;
+
+  ~InstancePool() { Clear(); }
+
+  void Clear() {
+    while (MainObject *object = Pop()) {
+      delete object;
+    }
+  }
+
+  MainObject *Pop() {
+    MainObject *object = mHead;
+    if (object) {
+      mHead = object->mNextFree;
+      --mCount;
+    }
+    return object;
+  }
+
+  bool Push(MainObject *object) {
+    if (mCount >= gInstancePoolCap.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    object->mNextFree = mHead;
+    mHead = object;
+    ++mCount;
+    return true;
+  }
 };
 
-MainObject::MainObject() : mRef(1) {
+static thread_local InstancePool tInstancePool;
+
+MainObject::MainObject()
+    : mRef(1), mNextFree(nullptr), mReadSeed(0), mReadSize(0), mReadOffset(0),
+      mWritten(0), mNextCookie(1) {
+  LockModule();
   Log(L"[%04x] MainObject: %p\n", ::GetCurrentThreadId(), this);
 }
 
+MainObject::~MainObject() {
+  gInstancesDestroyed.fetch_add(1, std::memory_order_relaxed);
+  UnlockModule();
+}
+
+void MainObject::Reset() {
+  mRef = 1;
+  mNextFree = nullptr;
+  mReadSeed = 0;
+  mReadSize = 0;
+  mReadOffset = 0;
+  mWritten = 0;
+  mWriteChecksum = StreamChecksum();
+  mNextCookie = 1;
+}
+
 STDMETHODIMP MainObject::QueryInterface(REFIID riid, void **ppv) {
   const QITAB QITable[] = {
       QITABENT(MainObject, IMarshalable),
+      QITABENT(MainObject, IMarshalable2),
+      QITABENTMULTI(MainObject, IDispatch, IMarshalable2),
       QITABENT(MainObject, IMarshalable_NoDual),
       QITABENT(MainObject, IMarshalable_OleAuto),
+      QITABENT(MainObject, ISharedChannel),
+      QITABENT(MainObject, IChunkedStream),
       {0},
   };
 
@@ -94,36 +252,317 @@ STDMETHODIMP_(ULONG) MainObject::AddRef() {
 STDMETHODIMP_(ULONG) MainObject::Release() {
   auto cref = ::InterlockedDecrement(&mRef);
   if (cref == 0) {
+    // A pooled object keeps its module lock, but not its sections
+    mSections.clear();
+    if (tInstancePool.Push(this)) {
+      gInstancesPooled.fetch_add(1, std::memory_order_relaxed);
+      return cref;
+    }
     Log(L"Destroying MainObject %p\n", this);
     delete this;
   }
   return cref;
 }
 
+// Invokers of the late-bound IMarshalable methods.  [in] arguments are
+// converted like DispInvoke does, but [out] and [in, out] ones must be passed
+// by reference as the exact type.  Strings are BSTRs because VARIANT has no
+// type for a plain wide string.
+
+static HRESULT DispTestNumbers(MainObject *object, DISPPARAMS *params,
+                               VARIANT *result, UINT *argErr) {
+  CComVariant numberIn;
+  long *pnumberIn;
+  int *numberOut;
+  unsigned long *numberInOut;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_I4, numberIn, argErr)) ||
+      FAILED(hr = DispGetRef(params, 1, VT_I4, pnumberIn, argErr)) ||
+      FAILED(hr = DispGetRef(params, 2, VT_INT, numberOut, argErr)) ||
+      FAILED(hr = DispGetRef(params, 3, VT_UI4, numberInOut, argErr))) {
+    return hr;
+  }
+
+  unsigned int numberRetval = 0;
+  hr = object->TestNumbers(V_I4(&numberIn), pnumberIn, numberOut, numberInOut,
+                           &numberRetval);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UINT;
+    V_UINT(result) = numberRetval;
+  }
+  return hr;
+}
+
+static HRESULT DispTestWideStrings(MainObject *object, DISPPARAMS *params,
+                                   VARIANT *result, UINT *argErr) {
+  CComVariant strIn;
+  BSTR *strInOut;
+  BSTR *strOut;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_BSTR, strIn, argErr)) ||
+      FAILED(hr = DispGetRef(params, 1, VT_BSTR, strInOut, argErr)) ||
+      FAILED(hr = DispGetRef(params, 2, VT_BSTR, strOut, argErr))) {
+    return hr;
+  }
+  // The method writes to the first character of both strings
+  if (!V_BSTR(&strIn) || !*strInOut) {
+    return E_POINTER;
+  }
+
+  wchar_t *out = nullptr;
+  hr = object->TestWideStrings(V_BSTR(&strIn), *strInOut, &out);
+  if (SUCCEEDED(hr)) {
+    ::SysFreeString(*strOut);
+    *strOut = ::SysAllocString(out);
+    ::CoTaskMemFree(out);
+    if (!*strOut) {
+      return E_OUTOFMEMORY;
+    }
+  }
+  return hr;
+}
+
+static HRESULT DispTestBStrings(MainObject *object, DISPPARAMS *params,
+                                VARIANT *result, UINT *argErr) {
+  CComVariant strIn;
+  BSTR *strOut;
+  BSTR *strInOut;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_BSTR, strIn, argErr)) ||
+      FAILED(hr = DispGetRef(params, 1, VT_BSTR, strOut, argErr)) ||
+      FAILED(hr = DispGetRef(params, 2, VT_BSTR, strInOut, argErr))) {
+    return hr;
+  }
+  if (!V_BSTR(&strIn) || !*strInOut) {
+    return E_POINTER;
+  }
+  return object->TestBStrings(V_BSTR(&strIn), strOut, strInOut);
+}
+
+static HRESULT DispTestNumbersBatch(MainObject *object, DISPPARAMS *params,
+                                    VARIANT *result, UINT *argErr) {
+  CComVariant numbersIn;
+  HRESULT hr =
+      DispGetValue(params, 0, VT_ARRAY | VT_I4, numbersIn, argErr);
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  SAFEARRAY *numbersOut = nullptr;
+  hr = object->TestNumbersBatch(V_ARRAY(&numbersIn), &numbersOut);
+  if (SUCCEEDED(hr)) {
+    if (result) {
+      V_VT(result) = VT_ARRAY | VT_I4;
+      V_ARRAY(result) = numbersOut;
+    } else {
+      ::SafeArrayDestroy(numbersOut);
+    }
+  }
+  return hr;
+}
+
+static HRESULT DispTestBuffer(MainObject *object, DISPPARAMS *params,
+                              VARIANT *result, UINT *argErr) {
+  CComVariant buffer;
+  HRESULT hr = DispGetValue(params, 0, VT_ARRAY | VT_UI1, buffer, argErr);
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  unsigned long checksum = 0;
+  hr = object->TestBuffer(V_ARRAY(&buffer), &checksum);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UI4;
+    V_UI4(result) = checksum;
+  }
+  return hr;
+}
+
+static HRESULT DispTestSection(MainObject *object, DISPPARAMS *params,
+                               VARIANT *result, UINT *argErr) {
+  CComVariant section;
+  CComVariant size;
+  CComVariant copyOnWrite;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_UI4, section, argErr)) ||
+      FAILED(hr = DispGetValue(params, 1, VT_I8, size, argErr)) ||
+      FAILED(hr = DispGetValue(params, 2, VT_BOOL, copyOnWrite, argErr))) {
+    return hr;
+  }
+
+  unsigned long checksum = 0;
+  hr = object->TestSection(V_UI4(&section), V_I8(&size), V_BOOL(&copyOnWrite),
+                           &checksum);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UI4;
+    V_UI4(result) = checksum;
+  }
+  return hr;
+}
+
+static HRESULT DispAttachSection(MainObject *object, DISPPARAMS *params,
+                                 VARIANT *result, UINT *argErr) {
+  CComVariant section;
+  CComVariant size;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_UI4, section, argErr)) ||
+      FAILED(hr = DispGetValue(params, 1, VT_I8, size, argErr))) {
+    return hr;
+  }
+
+  unsigned long cookie = 0;
+  hr = object->AttachSection(V_UI4(&section), V_I8(&size), &cookie);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UI4;
+    V_UI4(result) = cookie;
+  }
+  return hr;
+}
+
+static HRESULT DispTestAttachedSection(MainObject *object, DISPPARAMS *params,
+                                       VARIANT *result, UINT *argErr) {
+  CComVariant cookie;
+  CComVariant offset;
+  CComVariant size;
+  HRESULT hr;
+  if (FAILED(hr = DispGetValue(params, 0, VT_UI4, cookie, argErr)) ||
+      FAILED(hr = DispGetValue(params, 1, VT_I8, offset, argErr)) ||
+      FAILED(hr = DispGetValue(params, 2, VT_I8, size, argErr))) {
+    return hr;
+  }
+
+  unsigned long checksum = 0;
+  hr = object->TestAttachedSection(V_UI4(&cookie), V_I8(&offset), V_I8(&size),
+                                   &checksum);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UI4;
+    V_UI4(result) = checksum;
+  }
+  return hr;
+}
+
+static HRESULT DispDetachSection(MainObject *object, DISPPARAMS *params,
+                                 VARIANT *result, UINT *argErr) {
+  CComVariant cookie;
+  HRESULT hr = DispGetValue(params, 0, VT_UI4, cookie, argErr);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  return object->DetachSection(V_UI4(&cookie));
+}
+
+static HRESULT DispGetProcessId(MainObject *object, DISPPARAMS *,
+                                VARIANT *result, UINT *) {
+  unsigned long processId = 0;
+  HRESULT hr = object->GetProcessId(&processId);
+  if (SUCCEEDED(hr) && result) {
+    V_VT(result) = VT_UI4;
+    V_UI4(result) = processId;
+  }
+  return hr;
+}
+
+// The methods of IMarshalable and the ones IMarshalable2 adds, each in the
+// order of interfaces.idl, which is where their DISPIDs come from
+static constexpr DISPID kMarshalableDispId = MidlDispId(2, 0);
+static constexpr DispMethod<MainObject> kMarshalableMethods[] = {
+    {L"TestNumbers", 4, DispTestNumbers},
+    {L"TestWideStrings", 3, DispTestWideStrings},
+    {L"TestBStrings", 3, DispTestBStrings},
+};
+
+static constexpr DISPID kMarshalable2DispId = MidlDispId(3, 0);
+static constexpr DispMethod<MainObject> kMarshalable2Methods[] = {
+    {L"TestNumbersBatch", 1, DispTestNumbersBatch},
+    {L"TestBuffer", 1, DispTestBuffer},
+    {L"TestSection", 3, DispTestSection},
+    {L"AttachSection", 2, DispAttachSection},
+    {L"TestAttachedSection", 3, DispTestAttachedSection},
+    {L"DetachSection", 1, DispDetachSection},
+    {L"GetProcessId", 0, DispGetProcessId},
+};
+
+static constexpr DispNameIndex<ARRAYSIZE(kMarshalableMethods)>
+    kMarshalableNames = MakeDispNameIndex(kMarshalableMethods);
+static constexpr DispNameIndex<ARRAYSIZE(kMarshalable2Methods)>
+    kMarshalable2Names = MakeDispNameIndex(kMarshalable2Methods);
+
+// Type information is only for clients that browse the object, so it's
+// loaded from the registered type library on first use and kept until the
+// process exits.
+static std::atomic<ITypeInfo *> gTypeInfo(nullptr);
+
 STDMETHODIMP MainObject::GetTypeInfoCount(UINT *pctinfo) {
-  assert(0);
-  return E_NOTIMPL;
+  if (!pctinfo) {
+    return E_POINTER;
+  }
+  *pctinfo = 1;
+  return S_OK;
 }
 
 STDMETHODIMP MainObject::GetTypeInfo(UINT iTInfo, LCID lcid,
                                      ITypeInfo **ppTInfo) {
-  assert(0);
-  return E_NOTIMPL;
+  if (!ppTInfo) {
+    return E_POINTER;
+  }
+  *ppTInfo = nullptr;
+  if (iTInfo != 0) {
+    return DISP_E_BADINDEX;
+  }
+
+  ITypeInfo *typeInfo = gTypeInfo.load(std::memory_order_acquire);
+  if (!typeInfo) {
+    CComPtr<ITypeLib> typelib;
+    HRESULT hr = ::LoadRegTypeLib(LIBID_COM_Playground, 1, 0, lcid, &typelib);
+    if (FAILED(hr)) {
+      Log(L"LoadRegTypeLib failed - %08lx\n", hr);
+      return hr;
+    }
+    CComPtr<ITypeInfo> loaded;
+    hr = typelib->GetTypeInfoOfGuid(IID_IMarshalable2, &loaded);
+    if (FAILED(hr)) {
+      return hr;
+    }
+
+    typeInfo = loaded;
+    ITypeInfo *expected = nullptr;
+    if (gTypeInfo.compare_exchange_strong(expected, typeInfo,
+                                          std::memory_order_acq_rel)) {
+      loaded.Detach();
+    } else {
+      typeInfo = expected;
+    }
+  }
+
+  typeInfo->AddRef();
+  *ppTInfo = typeInfo;
+  return S_OK;
 }
 
 STDMETHODIMP MainObject::GetIDsOfNames(REFIID riid, LPOLESTR *rgszNames,
                                        UINT cNames, LCID lcid,
                                        DISPID *rgDispId) {
-  assert(0);
-  return E_NOTIMPL;
+  HRESULT hr = DispGetIDsOfNames(kMarshalableNames, kMarshalableDispId, riid,
+                                 rgszNames, cNames, rgDispId);
+  if (hr == DISP_E_UNKNOWNNAME && rgDispId[0] == DISPID_UNKNOWN) {
+    hr = DispGetIDsOfNames(kMarshalable2Names, kMarshalable2DispId, riid,
+                           rgszNames, cNames, rgDispId);
+  }
+  return hr;
 }
 
 STDMETHODIMP MainObject::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid,
                                 WORD wFlags, DISPPARAMS *pDispParams,
                                 VARIANT *pVarResult, EXCEPINFO *pExcepInfo,
                                 UINT *puArgErr) {
-  assert(0);
-  return E_NOTIMPL;
+  if (dispIdMember >= kMarshalable2DispId) {
+    return DispInvokeTable(kMarshalable2Methods, kMarshalable2DispId, this,
+                           dispIdMember, riid, wFlags, pDispParams, pVarResult,
+                           puArgErr);
+  }
+  return DispInvokeTable(kMarshalableMethods, kMarshalableDispId, this,
+                         dispIdMember, riid, wFlags, pDispParams, pVarResult,
+                         puArgErr);
 }
 
 STDMETHODIMP MainObject::TestNumbers(
@@ -132,6 +571,7 @@ STDMETHODIMP MainObject::TestNumbers(
     /* [out] */ int *numberOut,
     /* [out][in] */ unsigned long *numberInOut,
     /* [retval][out] */ unsigned int *numberRetval) {
+  MethodTimer timer(kStatTestNumbers);
   Log(L"%S: %ld %ld %d %ld %u\n", __FUNCTION__, numberIn, *pnumberIn,
       *numberOut, *numberInOut, *numberRetval);
   *pnumberIn = 41;
@@ -147,15 +587,27 @@ STDMETHODIMP MainObject::TestWideStrings(
     /* [string][in] */ wchar_t *strIn,
     /* [string][out][in] */ wchar_t *strInOut,
     /* [string][out] */ wchar_t **strOut) {
+  MethodTimer timer(kStatTestWideStrings);
   if (*strOut) {
     return E_POINTER;
   }
 
   Log(L"%S: %s %s\n", __FUNCTION__, strIn, strInOut);
-  strIn[0] = strInOut[0] = L'@';
+  // Overwriting the terminator of an empty string would leave strInOut
+  // unterminated for the stub to send back
+  if (WideLength(strIn)) {
+    strIn[0] = L'@';
+  }
+  if (WideLength(strInOut)) {
+    strInOut[0] = L'@';
+  }
 
-  wchar_t *buf = reinterpret_cast<wchar_t *>(::CoTaskMemAlloc(100));
-  Log(L"  Allocated buffer: %p\n", buf);
+  wchar_t *buf = reinterpret_cast<wchar_t *>(
+      AllocOutParam((kResponse.size() + 1) * sizeof(wchar_t)));
+  if (!buf) {
+    return E_OUTOFMEMORY;
+  }
+  Log(L"  Allocated buffer: %p\n", static_cast<void *>(buf));
   kResponse.copy(buf, kResponse.size());
   buf[kResponse.size()] = 0;
   *strOut = buf;
@@ -167,19 +619,391 @@ STDMETHODIMP MainObject::TestBStrings(
     /* [in] */ BSTR strIn,
     /* [out] */ BSTR *strOut,
     /* [out][in] */ BSTR *strInOut) {
+  MethodTimer timer(kStatTestBStrings);
   if (*strOut) {
     return E_POINTER;
   }
 
   Log(L"%S: %s %s\n", __FUNCTION__, strIn, *strInOut);
-  strIn[0] = (*strInOut)[0] = L'@';
+  // The length of a BSTR is in its prefix, and an empty one may be null
+  if (::SysStringLen(strIn)) {
+    strIn[0] = L'@';
+  }
+  if (::SysStringLen(*strInOut)) {
+    (*strInOut)[0] = L'@';
+  }
+
+  *strOut = AllocOutBStr(kResponse.c_str(),
+                         static_cast<UINT>(kResponse.size()));
+  if (!*strOut) {
+    return E_OUTOFMEMORY;
+  }
+
+  return S_OK;
+}
+
+// Locks the data of a vector of bytes.  The caller unlocks it with
+// SafeArrayUnaccessData.
+static HRESULT AccessBytes(SAFEARRAY *bytes, uint8_t **data, ULONG *count) {
+  if (!bytes) {
+    return E_POINTER;
+  }
+
+  VARTYPE vt;
+  HRESULT hr = ::SafeArrayGetVartype(bytes, &vt);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  if (vt != VT_UI1 || ::SafeArrayGetDim(bytes) != 1) {
+    return E_INVALIDARG;
+  }
+
+  LONG lower, upper;
+  if (FAILED(hr = ::SafeArrayGetLBound(bytes, 1, &lower)) ||
+      FAILED(hr = ::SafeArrayGetUBound(bytes, 1, &upper))) {
+    return hr;
+  }
+  *count = static_cast<ULONG>(upper - lower + 1);
+  return ::SafeArrayAccessData(bytes, reinterpret_cast<void **>(data));
+}
+
+STDMETHODIMP MainObject::TestNumbersBatch(
+    /* [in] */ SAFEARRAY *numbersIn,
+    /* [retval][out] */ SAFEARRAY **numbersOut) {
+  MethodTimer timer(kStatTestNumbersBatch);
+  if (!numbersIn || !numbersOut) {
+    return E_POINTER;
+  }
+  *numbersOut = nullptr;
+
+  VARTYPE vt;
+  HRESULT hr = ::SafeArrayGetVartype(numbersIn, &vt);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  if (vt != VT_I4 || ::SafeArrayGetDim(numbersIn) != 1) {
+    return E_INVALIDARG;
+  }
+
+  LONG lower, upper;
+  if (FAILED(hr = ::SafeArrayGetLBound(numbersIn, 1, &lower)) ||
+      FAILED(hr = ::SafeArrayGetUBound(numbersIn, 1, &upper))) {
+    return hr;
+  }
+  ULONG count = static_cast<ULONG>(upper - lower + 1);
+  Log(L"%S: %lu elements\n", __FUNCTION__, count);
+
+  SAFEARRAY *out = ::SafeArrayCreateVector(VT_I4, 0, count);
+  if (!out) {
+    return E_OUTOFMEMORY;
+  }
+
+  long *src = nullptr;
+  long *dst = nullptr;
+  if (SUCCEEDED(hr = ::SafeArrayAccessData(
+                    numbersIn, reinterpret_cast<void **>(&src)))) {
+    if (SUCCEEDED(hr = ::SafeArrayAccessData(
+                      out, reinterpret_cast<void **>(&dst)))) {
+      for (ULONG i = 0; i < count; ++i) {
+        dst[i] = src[i] + 42;
+      }
+      ::SafeArrayUnaccessData(out);
+    }
+    ::SafeArrayUnaccessData(numbersIn);
+  }
 
-  CComBSTR buf2(kResponse.c_str());
-  *strOut = buf2.Detach();
+  if (FAILED(hr)) {
+    ::SafeArrayDestroy(out);
+    return hr;
+  }
+  *numbersOut = out;
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::TestBuffer(
+    /* [in] */ SAFEARRAY *buffer,
+    /* [retval][out] */ unsigned long *checksum) {
+  MethodTimer timer(kStatTestBuffer);
+  if (!checksum) {
+    return E_POINTER;
+  }
+  uint8_t *data;
+  ULONG count;
+  HRESULT hr = AccessBytes(buffer, &data, &count);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  StreamChecksum sum;
+  sum.Update(data, count);
+  ::SafeArrayUnaccessData(buffer);
+  *checksum = sum.Value();
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::TestSection(
+    /* [in] */ unsigned long section,
+    /* [in] */ hyper size,
+    /* [in] */ VARIANT_BOOL copyOnWrite,
+    /* [retval][out] */ unsigned long *checksum) {
+  MethodTimer timer(kStatTestSection);
+
+  // Imported before anything is checked, so that a section handle is closed
+  // on every path; anything else is refused without being closed.  The view
+  // is unmapped when the call returns.
+  std::unique_ptr<SectionView> view = SectionView::Import(
+      section, size > 0 ? static_cast<uint64_t>(size) : 0,
+      copyOnWrite ? kSectionCopyOnWrite : kSectionReadOnly);
+  if (!checksum) {
+    return E_POINTER;
+  }
+  if (!view) {
+    Log(L"Failed to map section %lx\n", section);
+    return E_INVALIDARG;
+  }
+  if (uint8_t *data = view->MutableData()) {
+    for (uint64_t i = 0; i < view->Size(); ++i) {
+      ++data[i];
+    }
+  }
+  StreamChecksum sum;
+  sum.Update(view->Data(), static_cast<size_t>(view->Size()));
+  *checksum = sum.Value();
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::AttachSection(
+    /* [in] */ unsigned long section,
+    /* [in] */ hyper size,
+    /* [retval][out] */ unsigned long *cookie) {
+  // Like TestSection, the handle is taken over first
+  std::unique_ptr<SectionView> view = SectionView::Import(
+      section, size > 0 ? static_cast<uint64_t>(size) : 0, kSectionReadOnly);
+  if (!cookie) {
+    return E_POINTER;
+  }
+  *cookie = 0;
+  if (!view) {
+    Log(L"Failed to map section %lx\n", section);
+    return E_INVALIDARG;
+  }
+  std::lock_guard<std::mutex> lock(mSectionLock);
+  *cookie = mNextCookie++;
+  mSections[*cookie] = std::move(view);
+  return S_OK;
+}
 
+STDMETHODIMP MainObject::TestAttachedSection(
+    /* [in] */ unsigned long cookie,
+    /* [in] */ hyper offset,
+    /* [in] */ hyper size,
+    /* [retval][out] */ unsigned long *checksum) {
+  MethodTimer timer(kStatTestSection);
+  if (!checksum) {
+    return E_POINTER;
+  }
+
+  std::lock_guard<std::mutex> lock(mSectionLock);
+  auto found = mSections.find(cookie);
+  if (found == mSections.end()) {
+    return E_INVALIDARG;
+  }
+  const SectionView &view = *found->second;
+  if (offset < 0 || size < 0 ||
+      static_cast<uint64_t>(offset) > view.Size() ||
+      static_cast<uint64_t>(size) > view.Size() - offset) {
+    return E_INVALIDARG;
+  }
+  StreamChecksum sum;
+  sum.Update(view.Data() + offset, static_cast<size_t>(size));
+  *checksum = sum.Value();
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::DetachSection(
+    /* [in] */ unsigned long cookie) {
+  std::lock_guard<std::mutex> lock(mSectionLock);
+  return mSections.erase(cookie) ? S_OK : E_INVALIDARG;
+}
+
+STDMETHODIMP MainObject::GetProcessId(
+    /* [retval][out] */ unsigned long *processId) {
+  if (!processId) {
+    return E_POINTER;
+  }
+  *processId = ::GetCurrentProcessId();
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::OpenChannel(
+    /* [in] */ BSTR name,
+    /* [in] */ unsigned long clientProcessId,
+    /* [retval][out] */ unsigned long *serverProcessId) {
+  MethodTimer timer(kStatOpenChannel);
+  if (!name || !serverProcessId) {
+    return E_POINTER;
+  }
+
+  // An STA object is called in its apartment, through the queue of the
+  // thread that runs it, and an MTA object from the channel thread, which
+  // joins the MTA.  Other apartments can't be served.
+  APTTYPE type;
+  APTTYPEQUALIFIER qualifier;
+  HRESULT hr = ::CoGetApartmentType(&type, &qualifier);
+  if (FAILED(hr)) {
+    Log(L"CoGetApartmentType failed - %08lx\n", hr);
+    return hr;
+  }
+  // The channel thread holds the queue of an STA, which it can only do if
+  // the queue is shared
+  std::shared_ptr<ApartmentQueue> apartment;
+  if (type == APTTYPE_STA || type == APTTYPE_MAINSTA) {
+    ApartmentQueue *queue = CurrentApartmentQueue();
+    if (queue) {
+      apartment = queue->weak_from_this().lock();
+    }
+    if (!apartment) {
+      return E_NOTIMPL;
+    }
+  } else if (type != APTTYPE_MTA) {
+    return E_NOTIMPL;
+  }
+
+  // Only the sections of the client's own channels, which are named after it
+  if (!IsShmChannelName(name, clientProcessId)) {
+    return E_INVALIDARG;
+  }
+  std::unique_ptr<ShmChannel> channel = ShmChannel::Open(name);
+  if (!channel || !channel->SetPeer(clientProcessId)) {
+    return E_FAIL;
+  }
+
+  // The channel thread keeps this object and the module alive until the
+  // client closes the channel or exits.  The object is released in its
+  // apartment, since that's where it was created.
+  AddRef();
+  LockModule();
+  std::shared_ptr<ShmChannel> served(std::move(channel));
+  std::thread([this, apartment, served]() {
+    ComThread<COINIT_MULTITHREADED>([this, apartment, served]() {
+      ServeMarshalable(*served, this, apartment);
+    });
+    if (!apartment || !apartment->Post([this]() { Release(); })) {
+      Release();
+    }
+    UnlockModule();
+  }).detach();
+
+  *serverProcessId = ::GetCurrentProcessId();
+  return S_OK;
+}
+
+// Bounds what a server allocates for one Read
+constexpr unsigned long kMaxChunkBytes = 16 << 20;
+
+STDMETHODIMP MainObject::OpenRead(
+    /* [in] */ hyper size,
+    /* [in] */ unsigned long seed) {
+  if (size < 0) {
+    return E_INVALIDARG;
+  }
+  std::lock_guard<std::mutex> lock(mStreamLock);
+  mReadSeed = seed;
+  mReadSize = static_cast<uint64_t>(size);
+  mReadOffset = 0;
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::Read(
+    /* [in] */ unsigned long maxBytes,
+    /* [retval][out] */ SAFEARRAY **chunk) {
+  MethodTimer timer(kStatRead);
+  if (!chunk) {
+    return E_POINTER;
+  }
+  *chunk = nullptr;
+
+  std::lock_guard<std::mutex> lock(mStreamLock);
+  ULONG count = static_cast<ULONG>(std::min<uint64_t>(
+      std::min(maxBytes, kMaxChunkBytes), mReadSize - mReadOffset));
+  SAFEARRAY *out = ::SafeArrayCreateVector(VT_UI1, 0, count);
+  if (!out) {
+    return E_OUTOFMEMORY;
+  }
+  if (count) {
+    uint8_t *data;
+    HRESULT hr =
+        ::SafeArrayAccessData(out, reinterpret_cast<void **>(&data));
+    if (FAILED(hr)) {
+      ::SafeArrayDestroy(out);
+      return hr;
+    }
+    FillStreamPattern(mReadSeed, mReadOffset, data, count);
+    ::SafeArrayUnaccessData(out);
+    mReadOffset += count;
+  }
+  *chunk = out;
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::OpenWrite() {
+  std::lock_guard<std::mutex> lock(mStreamLock);
+  mWritten = 0;
+  mWriteChecksum = StreamChecksum();
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::Write(
+    /* [in] */ SAFEARRAY *chunk) {
+  MethodTimer timer(kStatWrite);
+  uint8_t *data;
+  ULONG count;
+  HRESULT hr = AccessBytes(chunk, &data, &count);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mStreamLock);
+    mWriteChecksum.Update(data, count);
+    mWritten += count;
+  }
+  ::SafeArrayUnaccessData(chunk);
+  return S_OK;
+}
+
+STDMETHODIMP MainObject::GetWritten(
+    /* [out] */ hyper *size,
+    /* [retval][out] */ unsigned long *checksum) {
+  if (!size || !checksum) {
+    return E_POINTER;
+  }
+  std::lock_guard<std::mutex> lock(mStreamLock);
+  *size = static_cast<hyper>(mWritten);
+  *checksum = mWriteChecksum.Value();
   return S_OK;
 }
 
 IUnknown *CreateMarshalable() {
+  if (MainObject *object = tInstancePool.Pop()) {
+    object->Reset();
+    gInstancesReused.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<IMarshalable *>(object);
+  }
+
+  gInstancesCreated.fetch_add(1, std::memory_order_relaxed);
   return static_cast<IMarshalable *>(new MainObject);
 }
+
+void EmptyInstancePool() { tInstancePool.Clear(); }
+
+void SetInstancePoolCap(size_t cap) {
+  gInstancePoolCap.store(cap, std::memory_order_relaxed);
+}
+
+InstancePoolStats GetInstancePoolStats() {
+  return {
+      gInstancesCreated.load(std::memory_order_relaxed),
+      gInstancesReused.load(std::memory_order_relaxed),
+      gInstancesPooled.load(std::memory_order_relaxed),
+      gInstancesDestroyed.load(std::memory_order_relaxed),
+  };
+}
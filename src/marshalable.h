@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <windows.h>
+
+IUnknown *CreateMarshalable();
+
+// Opt-in pooling of MainObject instances.  When the cap is non-zero, an
+// object whose last reference is released goes back to a free list of the
+// thread releasing it, which is the object's apartment for STA objects, and
+// the next activation on that thread reuses it.  Pooled objects keep the
+// module locked, so that it isn't unloaded under them.
+struct InstancePoolStats {
+  uint64_t mCreated;   // Allocated with new
+  uint64_t mReused;    // Taken from a free list
+  uint64_t mPooled;    // Returned to a free list
+  uint64_t mDestroyed; // Freed with delete
+};
+
+void SetInstancePoolCap(size_t cap);
+InstancePoolStats GetInstancePoolStats();
+
+// Destroys the objects pooled by the current thread.  Whatever a thread
+// still pools when it exits is destroyed then.
+void EmptyInstancePool();
@@ -0,0 +1,696 @@
+// Tests of the code that doesn't depend on Windows.  They're part of t.exe,
+// and CMakeLists.txt builds them on their own on other platforms.
+#include "codec.h"
+#include "coro.h"
+#include "dispatch.h"
+#include "guid.h"
+#include "log.h"
+#include "manifest.h"
+#include "utf16.h"
+#include "waitengine.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Plays the role of an object behind a transport.  It doesn't depend on COM
+// so that the generic parts of the codecs are tested as they'd be anywhere.
+struct CodecTarget {
+  int32_t Numbers(long numberIn, long *pnumberIn, int *numberOut,
+                  unsigned long *numberInOut, unsigned int *numberRetval) {
+    *pnumberIn = 41;
+    *numberOut = static_cast<int>(numberIn + 1);
+    *numberInOut *= 2;
+    *numberRetval = 44;
+    return 1;
+  }
+
+  int32_t Strings(wchar_t *strIn, wchar_t *strInOut, wchar_t **strOut) {
+    mReceived = strIn ? strIn : L"(null)";
+    strIn[0] = strInOut[0] = L'@';
+    *strOut = CodecAllocString(L"reply");
+    return 0;
+  }
+
+  std::wstring mReceived;
+};
+
+using NumbersCodec = MethodCodec<In<long>, InPtr<long>, Out<int>,
+                                 InOut<unsigned long>, Out<unsigned int>>;
+using StringsCodec = MethodCodec<InString, InOutString, OutString>;
+
+static_assert(NumbersCodec::kMatches<decltype(&CodecTarget::Numbers)>, "");
+static_assert(StringsCodec::kMatches<decltype(&CodecTarget::Strings)>, "");
+static_assert(!StringsCodec::kMatches<decltype(&CodecTarget::Numbers)>, "");
+
+// Runs a call through a buffer the way a transport would, using the same
+// buffer for the request and the response
+template <typename Codec, typename Method, typename... Args>
+static int32_t CodecRoundTrip(CodecTarget &target, Method method,
+                              Args... args) {
+  uint8_t buffer[256];
+  CodecWriter request(buffer, sizeof(buffer));
+  EXPECT_TRUE(Codec::EncodeRequest(request, args...));
+
+  int32_t result = -1;
+  CodecReader serverReader(buffer, request.Size());
+  CodecWriter response(buffer, sizeof(buffer));
+  EXPECT_TRUE(
+      Codec::Dispatch(serverReader, response, &target, method, result));
+
+  CodecReader clientReader(buffer, response.Size());
+  EXPECT_TRUE(Codec::DecodeResponse(clientReader, args...));
+  return result;
+}
+
+TEST(Codec, RoundTrip) {
+  CodecTarget target;
+
+  long b = 11;
+  int c = 12;
+  unsigned long d = 13;
+  unsigned int e = 14;
+  EXPECT_EQ(CodecRoundTrip<NumbersCodec>(target, &CodecTarget::Numbers, 10L,
+                                         &b, &c, &d, &e),
+            1);
+  EXPECT_EQ(b, 11); // [in] only
+  EXPECT_EQ(c, 11);
+  EXPECT_EQ(d, 26lu);
+  EXPECT_EQ(e, 44u);
+
+  wchar_t strIn[] = L"Hello";
+  wchar_t strInOut[] = L"World";
+  wchar_t *strOut = nullptr;
+  EXPECT_EQ(CodecRoundTrip<StringsCodec>(target, &CodecTarget::Strings, strIn,
+                                         strInOut, &strOut),
+            0);
+  EXPECT_EQ(target.mReceived, L"Hello");
+  EXPECT_STREQ(strIn, L"Hello");
+  EXPECT_STREQ(strInOut, L"@orld");
+  EXPECT_STREQ(strOut, L"reply");
+  CodecFreeString(strOut);
+}
+
+TEST(Codec, Errors) {
+  CodecTarget target;
+  wchar_t strIn[] = L"Hello";
+  wchar_t strInOut[] = L"World";
+  wchar_t *strOut = nullptr;
+
+  uint8_t buffer[64];
+  CodecWriter small(buffer, 8);
+  EXPECT_FALSE(StringsCodec::EncodeRequest(small, strIn, strInOut, &strOut));
+
+  // A truncated request is rejected without calling the method
+  CodecWriter request(buffer, sizeof(buffer));
+  ASSERT_TRUE(StringsCodec::EncodeRequest(request, strIn, strInOut, &strOut));
+  CodecReader truncated(buffer, request.Size() - 1);
+  uint8_t responseBuffer[64];
+  CodecWriter response(responseBuffer, sizeof(responseBuffer));
+  int32_t result = -1;
+  EXPECT_FALSE(StringsCodec::Dispatch(truncated, response, &target,
+                                      &CodecTarget::Strings, result));
+  EXPECT_EQ(result, -1);
+  EXPECT_TRUE(target.mReceived.empty());
+}
+
+static CoTask<std::thread::id> OffloadedThread(ThreadExecutor &workers) {
+  co_return co_await CoOffload(workers,
+                               []() { return std::this_thread::get_id(); });
+}
+
+TEST(Coroutine, Offload) {
+  constexpr int kCoroutines = 100;
+
+  ThreadExecutor workers(4);
+  LoopScheduler scheduler;
+  std::thread::id loopThread;
+  int done = 0;
+  bool resumedOnLoop = true;
+  bool ranOnWorker = true;
+
+  auto client = [&]() -> CoTask<> {
+    for (int i = 0; i < 10; ++i) {
+      std::thread::id worker = co_await OffloadedThread(workers);
+      ranOnWorker = ranOnWorker && worker != loopThread;
+      resumedOnLoop =
+          resumedOnLoop && std::this_thread::get_id() == loopThread;
+    }
+    if (++done == kCoroutines) {
+      scheduler.Stop();
+    }
+  };
+
+  std::vector<CoTask<>> tasks;
+  std::thread loop([&]() {
+    loopThread = std::this_thread::get_id();
+    CoScheduler::SetCurrent(&scheduler);
+    for (int i = 0; i < kCoroutines; ++i) {
+      tasks.push_back(client());
+      tasks.back().Start();
+    }
+    scheduler.Run();
+  });
+  loop.join();
+
+  EXPECT_EQ(done, kCoroutines);
+  EXPECT_TRUE(resumedOnLoop);
+  EXPECT_TRUE(ranOnWorker);
+  for (auto &task : tasks) {
+    EXPECT_TRUE(task.Done());
+  }
+}
+
+TEST(Coroutine, NoScheduler) {
+  // Without a scheduler the work runs inline, so the task completes in Start
+  ThreadExecutor workers(1);
+  CoTask<std::thread::id> task = OffloadedThread(workers);
+  task.Start();
+  ASSERT_TRUE(task.Done());
+  EXPECT_EQ(task.Result(), std::this_thread::get_id());
+}
+
+struct NamedEntry {
+  const wchar_t *mName;
+};
+
+TEST(Dispatch, NameIndex) {
+  static constexpr NamedEntry kEntries[] = {
+      {L"Alpha"}, {L"Beta"}, {L"Gamma"}, {L"Delta"}, {L"Epsilon"},
+  };
+  static constexpr DispNameIndex<std::size(kEntries)> kIndex =
+      MakeDispNameIndex(kEntries);
+
+  // Resolved at compile time
+  static_assert(DispNameEquals(L"gAMMA", L"Gamma"), "");
+  static_assert(!DispNameEquals(L"Gamm", L"Gamma"), "");
+  static_assert(kIndex.mSlots[DispNameHash(L"DELTA", kIndex.mSeed) %
+                              kIndex.kSlots] == 3,
+                "");
+
+  for (int i = 0; i < static_cast<int>(std::size(kEntries)); ++i) {
+    EXPECT_EQ(kIndex.Find(kEntries[i].mName), i);
+  }
+  EXPECT_EQ(kIndex.Find(L"EPSILON"), 4);
+  EXPECT_EQ(kIndex.Find(L"Zeta"), -1);
+  EXPECT_EQ(kIndex.Find(L""), -1);
+}
+
+TEST(Guid, FormatParse) {
+  constexpr GUID kLegacy =
+      GuidFromString("{766F63F7-E338-4CC4-99C3-19428426E912}");
+  static_assert(kLegacy.Data1 == 0x766f63f7 && kLegacy.Data4[7] == 0x12,
+                "GuidFromString must work at compile time");
+  EXPECT_TRUE(kLegacy ==
+              GuidFromString("766f63f7-e338-4cc4-99c3-19428426e912"));
+
+  wchar_t legacy[kGuidStringLength + 1];
+  FormatGuid(kLegacy, legacy);
+  EXPECT_STREQ(legacy, L"{766f63f7-e338-4cc4-99c3-19428426e912}");
+
+  std::mt19937 rng(42);
+  for (int i = 0; i < 1000; ++i) {
+    GUID guid;
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(&guid);
+    for (size_t j = 0; j < sizeof(guid); ++j) {
+      bytes[j] = static_cast<uint8_t>(rng());
+    }
+
+    wchar_t simd[kGuidStringLength + 1];
+    wchar_t scalar[kGuidStringLength + 1];
+    FormatGuid(guid, simd);
+    FormatGuidScalar(guid, scalar);
+    ASSERT_STREQ(simd, scalar);
+
+    // Uppercase parses the same
+    wchar_t upper[kGuidStringLength + 1];
+    for (size_t j = 0; j <= kGuidStringLength; ++j) {
+      upper[j] = simd[j] >= L'a' && simd[j] <= L'f'
+                     ? static_cast<wchar_t>(simd[j] - L'a' + L'A')
+                     : simd[j];
+    }
+
+    GUID parsed;
+    ASSERT_TRUE(ParseGuid(upper, kGuidStringLength, parsed));
+    EXPECT_TRUE(parsed == guid);
+    ASSERT_TRUE(ParseGuidScalar(simd + 1, kGuidStringLength - 2, parsed));
+    EXPECT_TRUE(parsed == guid);
+  }
+
+  GUID parsed;
+  const wchar_t kBad[][kGuidStringLength + 1] = {
+      L"{766f63f7-e338-4cc4-99c3-19428426e91g}",
+      L"{766f63f7-e338-4cc4-99c3-19428426e912)",
+      L"{766f63f7+e338-4cc4-99c3-19428426e912}",
+      // Characters that narrow to 0xff and to 0
+      L"{766f63f7-e338-4cc4-99c3-19428426e91\u0131}",
+      L"{766f63f7-e338-4cc4-99c3-19428426e91\uff10}",
+  };
+  for (const auto &bad : kBad) {
+    EXPECT_FALSE(ParseGuid(bad, wcslen(bad), parsed));
+    EXPECT_FALSE(ParseGuidScalar(bad, wcslen(bad), parsed));
+  }
+  EXPECT_FALSE(ParseGuid(L"{766f63f7}", 10, parsed));
+}
+
+TEST(Guid, Map) {
+  constexpr GUID kBase =
+      GuidFromString("{2ef1d7b4-6c1a-4f5e-9b3d-0a8c7e6f5d41}");
+  GuidMap<int> map;
+  EXPECT_EQ(map.Find(kBase), nullptr);
+
+  for (int i = 0; i < 1000; ++i) {
+    GUID key = kBase;
+    key.Data1 += i;
+    ASSERT_TRUE(map.Insert(key, i));
+  }
+  EXPECT_EQ(map.Size(), 1000u);
+  EXPECT_FALSE(map.Insert(kBase, -1));
+
+  for (int i = 0; i < 1000; ++i) {
+    GUID key = kBase;
+    key.Data1 += i;
+    const int *value = map.Find(key);
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(*value, i);
+  }
+  GUID missing = kBase;
+  missing.Data4[7] ^= 1;
+  EXPECT_EQ(map.Find(missing), nullptr);
+
+  int sum = 0;
+  map.ForEach([&sum](const GUID &, int value) { sum += value; });
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+}
+
+TEST(Log, Format) {
+  class CaptureLogSink : public LogSink {
+    std::wstring &mText;
+
+  public:
+    explicit CaptureLogSink(std::wstring &text) : mText(text) {}
+    void Write(const wchar_t *text, size_t length) override {
+      mText.append(text, length);
+    }
+  };
+
+  ASSERT_TRUE(LogFlush());
+  std::wstring text;
+  SetLogSink(new CaptureLogSink(text));
+
+  std::wstring temporary(L"copied");
+  Log(L"%08lx %lu %d %zu|%-4s|%S %s %.2f %%\n", 0x80004005u, 0xfffffffful,
+      -5, size_t(42), L"ab", "narrow", temporary.c_str(), 3.14159);
+  temporary.clear();
+  // Missing and mismatched arguments
+  Log(L"%d %s\n");
+  Log(L"%d\n", L"string");
+  Log(L"%*d|\n", 4, 7);
+  ASSERT_TRUE(LogFlush());
+
+  SetLogSink(new ConsoleLogSink);
+  EXPECT_STREQ(text.c_str(), L"80004005 4294967295 -5 42|ab  |"
+                             L"narrow copied 3.14 %\n"
+                             L"<?> <?>\n"
+                             L"<?>\n"
+                             L"   7|\n");
+}
+
+TEST(Log, Threads) {
+  constexpr int kThreads = 4;
+  constexpr int kRecordsPerThread = 1000;
+
+  class CountLogSink : public LogSink {
+    std::vector<int> &mLast;
+    bool &mInOrder;
+
+  public:
+    CountLogSink(std::vector<int> &last, bool &inOrder)
+        : mLast(last), mInOrder(inOrder) {}
+    void Write(const wchar_t *text, size_t) override {
+      wchar_t *end;
+      long thread = wcstol(text, &end, 10);
+      if (end == text || *end != L' ' || thread < 0 ||
+          thread >= static_cast<long>(mLast.size())) {
+        return;
+      }
+      int record = static_cast<int>(wcstol(end + 1, nullptr, 10));
+
+      // Records from the same thread must come out in order
+      mInOrder = mInOrder && record > mLast[thread];
+      mLast[thread] = record;
+    }
+  };
+
+  ASSERT_TRUE(LogFlush());
+  std::vector<int> last(kThreads, -1);
+  bool inOrder = true;
+  SetLogSink(new CountLogSink(last, inOrder));
+  LogStats before = GetLogStats();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([i]() {
+      for (int j = 0; j < kRecordsPerThread; ++j) {
+        Log(L"%d %d\n", i, j);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_TRUE(LogFlush());
+
+  SetLogSink(new ConsoleLogSink);
+  LogStats after = GetLogStats();
+  EXPECT_TRUE(inOrder);
+  EXPECT_EQ(after.mRecords - before.mRecords + after.mDropped - before.mDropped,
+            static_cast<uint64_t>(kThreads * kRecordsPerThread));
+}
+
+TEST(Manifest, Index) {
+  constexpr int kServers = 1000;
+  const GUID kTypelib = {
+      0xb2137105,
+      0xd2ea,
+      0x422c,
+      {0x9e, 0x89, 0x3b, 0x2, 0x64, 0x5d, 0x20, 0x78}};
+
+  auto makeClsId = [](int i) {
+    GUID clsId = {static_cast<uint32_t>(i + 1) * 2654435761u,
+                  static_cast<unsigned short>(i), 0x4000, {0x80}};
+    return clsId;
+  };
+
+  ManifestWriter writer;
+  for (int i = 0; i < kServers; ++i) {
+    writer.Add(makeClsId(i), L"C:\\z.dll", i % 2 ? L"Apartment" : nullptr,
+               kTypelib);
+  }
+
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(writer.Build(image));
+
+  ManifestView view;
+  ASSERT_TRUE(view.Attach(image.data(), image.size()));
+  for (int i = 0; i < kServers; ++i) {
+    const ManifestEntry *entry = view.Find(makeClsId(i));
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(std::u16string_view(view.String(entry->mModule)), u"C:\\z.dll");
+    EXPECT_EQ(std::u16string_view(view.String(entry->mThreadModel)),
+              i % 2 ? u"Apartment" : u"");
+    EXPECT_TRUE(entry->mTypelib == kTypelib);
+  }
+
+  EXPECT_EQ(view.Find(makeClsId(kServers)), nullptr);
+  EXPECT_EQ(view.Find(GUID{}), nullptr);
+
+  // A truncated image is rejected instead of being read out of bounds
+  ManifestView truncated;
+  EXPECT_FALSE(truncated.Attach(image.data(), image.size() - 1));
+  EXPECT_FALSE(truncated);
+
+  ManifestWriter duplicate;
+  duplicate.Add(makeClsId(0), L"a.dll", L"Apartment", kTypelib);
+  duplicate.Add(makeClsId(0), L"b.dll", L"Apartment", kTypelib);
+  EXPECT_FALSE(duplicate.Build(image));
+}
+
+// Random text with ASCII, other characters of the BMP and surrogates, paired
+// or not, so that every kernel meets each of them at every position of a
+// block
+static std::vector<char16_t> RandomUtf16(std::mt19937 &random,
+                                         size_t length) {
+  static const char16_t kChars[] = {u'a',    u'z',    0x7f,   0x80,  0x7ff,
+                                    0x800,   0xd7ff,  0xd800, 0xdbff, 0xdc00,
+                                    0xdfff,  0xe000,  0xfffd, 0xffff};
+  std::vector<char16_t> text(length);
+  for (auto &c : text) {
+    c = random() % 4 ? static_cast<char16_t>(u'a' + random() % 26)
+                     : kChars[random() % std::size(kChars)];
+  }
+  return text;
+}
+
+TEST(Utf16, Length) {
+  // Every alignment of the start and of the terminator within a block
+  alignas(16) char16_t buffer[64];
+  for (size_t offset = 0; offset < 16; ++offset) {
+    for (size_t length = 0; offset + length < std::size(buffer); ++length) {
+      std::fill(std::begin(buffer), std::end(buffer), u'x');
+      buffer[offset + length] = 0;
+      const char16_t *str = buffer + offset;
+      EXPECT_EQ(Utf16Length(str), length);
+      EXPECT_EQ(Utf16LengthScalar(str), length);
+      for (size_t maxLength = 0; maxLength < length + 12; ++maxLength) {
+        EXPECT_EQ(Utf16LengthBounded(str, maxLength),
+                  std::min(length, maxLength));
+      }
+    }
+  }
+
+  // A character of any value but zero doesn't end the string
+  std::u16string text(u"\xffff\x8000\xd800\x0100\x0001");
+  EXPECT_EQ(Utf16Length(text.c_str()), text.size());
+
+  const wchar_t *wide = L"wide string";
+  EXPECT_EQ(WideLength(wide), wcslen(wide));
+  EXPECT_EQ(WideLengthBounded(wide, 4), 4u);
+}
+
+TEST(Utf16, Validate) {
+  EXPECT_TRUE(Utf16Validate(u"", 0));
+  EXPECT_TRUE(Utf16Validate(u"\xd83d\xde00", 2));
+  EXPECT_FALSE(Utf16Validate(u"\xd83d", 1));
+  EXPECT_FALSE(Utf16Validate(u"\xde00\xd83d", 2));
+  EXPECT_FALSE(Utf16Validate(u"\xd83d\xd83d\xde00", 3));
+
+  // A pair across the end of a block, and one cut off by the length
+  std::u16string text(7, u'a');
+  text += u"\xd83d\xde00";
+  text += std::u16string(7, u'a');
+  EXPECT_TRUE(Utf16Validate(text.c_str(), text.size()));
+  EXPECT_FALSE(Utf16Validate(text.c_str(), 8));
+
+  std::mt19937 random(1);
+  for (int i = 0; i < 10000; ++i) {
+    std::vector<char16_t> text = RandomUtf16(random, random() % 80);
+    ASSERT_EQ(Utf16Validate(text.data(), text.size()),
+              Utf16ValidateScalar(text.data(), text.size()));
+  }
+}
+
+TEST(Utf16, CopyString) {
+  alignas(16) char16_t source[64];
+  for (size_t offset = 0; offset < 16; ++offset) {
+    for (size_t length = 0; offset + length < std::size(source); ++length) {
+      for (size_t i = 0; i < std::size(source); ++i) {
+        source[i] = u'a' + i % 26;
+      }
+      source[offset + length] = 0;
+      const char16_t *str = source + offset;
+      for (size_t capacity = 0; capacity < length + 12; ++capacity) {
+        char16_t copy[80];
+        char16_t expected[80];
+        std::fill(std::begin(copy), std::end(copy), u'#');
+        std::fill(std::begin(expected), std::end(expected), u'#');
+        size_t copied = Utf16CopyString(copy, capacity, str);
+        ASSERT_EQ(copied, Utf16CopyStringScalar(expected, capacity, str));
+        ASSERT_EQ(copied, capacity ? std::min(length, capacity - 1) : 0);
+        // Nothing is written past the capacity
+        ASSERT_EQ(std::memcmp(copy, expected, sizeof(copy)), 0);
+      }
+    }
+  }
+}
+
+TEST(Utf16, ToUtf8) {
+  struct {
+    std::u16string mText;
+    std::string mUtf8;
+  } cases[] = {
+      {u"", ""},
+      {u"plain ASCII text", "plain ASCII text"},
+      {u"\x00e9t\x00e9", "\xc3\xa9t\xc3\xa9"},
+      {u"\x20ac", "\xe2\x82\xac"},
+      {u"\xd83d\xde00", "\xf0\x9f\x98\x80"},
+      {u"lone \xd83d high", "lone \xef\xbf\xbd high"},
+      {u"lone \xde00 low", "lone \xef\xbf\xbd low"},
+      {u"cut \xd83d", "cut \xef\xbf\xbd"},
+      // The pair crosses the end of the first block
+      {u"1234567\xd83d\xde00" u"89", "1234567\xf0\x9f\x98\x80" "89"},
+  };
+  for (const auto &c : cases) {
+    std::string utf8;
+    AppendUtf8(utf8, c.mText.c_str(), c.mText.size());
+    EXPECT_EQ(utf8, c.mUtf8);
+  }
+
+  std::string appended("prefix ");
+  AppendUtf8(appended, u"and more", 8);
+  EXPECT_EQ(appended, "prefix and more");
+
+  // wchar_t is UTF-16 or UTF-32, and the result is the same either way
+  std::string wide;
+  AppendUtf8(wide, L"\x00e9\x20ac\U0001f600.", 4 + (sizeof(wchar_t) == 2));
+  EXPECT_EQ(wide, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80.");
+
+  std::mt19937 random(1);
+  for (int i = 0; i < 10000; ++i) {
+    std::vector<char16_t> text = RandomUtf16(random, random() % 80);
+    std::vector<char> utf8(text.size() * kMaxUtf8PerUtf16 + 1);
+    std::vector<char> expected(utf8.size());
+    size_t size = Utf16ToUtf8(text.data(), text.size(), utf8.data());
+    ASSERT_EQ(size,
+              Utf16ToUtf8Scalar(text.data(), text.size(), expected.data()));
+    ASSERT_LE(size, text.size() * kMaxUtf8PerUtf16);
+    ASSERT_EQ(std::memcmp(utf8.data(), expected.data(), size), 0);
+  }
+}
+
+TEST(Utf16, Bstr) {
+  Utf16Bstr str = Utf16BstrAlloc(u"nul\0inside", 10);
+  ASSERT_TRUE(str);
+  EXPECT_EQ(Utf16BstrLength(str), 10u);
+  EXPECT_EQ(Utf16Length(str), 3u);
+  EXPECT_EQ(std::memcmp(str, u"nul\0inside", 11 * sizeof(char16_t)), 0);
+  Utf16BstrFree(str);
+
+  str = Utf16BstrAlloc(nullptr, 5);
+  ASSERT_TRUE(str);
+  EXPECT_EQ(Utf16BstrLength(str), 5u);
+  EXPECT_EQ(str[5], 0);
+  Utf16BstrFree(str);
+
+  str = Utf16BstrAlloc(u"", 0);
+  ASSERT_TRUE(str);
+  EXPECT_EQ(Utf16BstrLength(str), 0u);
+  EXPECT_EQ(str[0], 0);
+  Utf16BstrFree(str);
+
+  EXPECT_EQ(Utf16BstrLength(nullptr), 0u);
+  Utf16BstrFree(nullptr);
+
+#ifdef _WIN32
+  // They're BSTRs
+  BSTR bstr = ::SysAllocString(L"from Windows");
+  EXPECT_EQ(Utf16BstrLength(reinterpret_cast<char16_t *>(bstr)), 12u);
+  ::SysFreeString(bstr);
+#endif
+}
+
+TEST(Doorbell, RingAndWait) {
+  Doorbell bell;
+  EXPECT_FALSE(bell.Rung());
+  EXPECT_FALSE(bell.Wait(0));
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(bell.Wait(20));
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(19));
+
+  // A ring is kept until it's taken, and taken once
+  bell.Ring();
+  bell.Ring();
+  EXPECT_TRUE(bell.Rung());
+  EXPECT_TRUE(bell.Wait(0));
+  EXPECT_FALSE(bell.Wait(0));
+
+  std::thread ringer([&bell]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    bell.Ring();
+  });
+  EXPECT_TRUE(bell.Wait());
+  ringer.join();
+}
+
+TEST(WaitEngine, Run) {
+  constexpr int kProducers = 4;
+  constexpr int kTasksPerProducer = 10000;
+
+  for (uint32_t maxSpins : {0u, AdaptiveSpinner::kDefaultMaxSpins}) {
+    WaitEngine engine(maxSpins);
+    std::mutex lock;
+    std::vector<int> tasks;
+    int finished = 0;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+      producers.emplace_back([&]() {
+        for (int i = 0; i < kTasksPerProducer; ++i) {
+          {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(i);
+          }
+          engine.Wake();
+          if (i % 1000 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        }
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          ++finished;
+        }
+        engine.Wake();
+      });
+    }
+
+    size_t total = 0;
+    engine.Run(
+        [&]() {
+          std::vector<int> batch;
+          {
+            std::lock_guard<std::mutex> guard(lock);
+            batch.swap(tasks);
+          }
+          total += batch.size();
+          return batch.size();
+        },
+        [&]() {
+          std::lock_guard<std::mutex> guard(lock);
+          return finished == kProducers && tasks.empty();
+        });
+    for (auto &producer : producers) {
+      producer.join();
+    }
+
+    EXPECT_EQ(total, size_t(kProducers * kTasksPerProducer));
+    const WaitCounters &counters = engine.Counters();
+    EXPECT_EQ(counters.mDispatched.load(), uint64_t(total));
+    if (!maxSpins) {
+      EXPECT_EQ(counters.mSpinWakes.load(), 0u);
+      EXPECT_EQ(engine.SpinBudget(), 0u);
+    }
+  }
+}
+
+TEST(AdaptiveSpinner, Budget) {
+  AdaptiveSpinner spinner(1024);
+  EXPECT_EQ(spinner.Budget(), AdaptiveSpinner::kMinSpins);
+
+  // Work found at the end of the budget makes it grow, up to the maximum
+  for (int i = 0; i < 100; ++i) {
+    uint32_t spins = 0;
+    const uint32_t budget = spinner.Budget();
+    EXPECT_TRUE(spinner.SpinUntil([&]() { return ++spins == budget; }));
+  }
+  EXPECT_GT(spinner.Budget(), AdaptiveSpinner::kMinSpins * 4);
+  EXPECT_LE(spinner.Budget(), 1024u);
+
+  // and running out makes it shrink to the minimum
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_FALSE(spinner.SpinUntil([]() { return false; }));
+  }
+  EXPECT_EQ(spinner.Budget(), AdaptiveSpinner::kMinSpins);
+
+  AdaptiveSpinner never(0);
+  EXPECT_FALSE(never.SpinUntil([]() { return true; }));
+}
@@ -0,0 +1,225 @@
+#include "regbackend.h"
+#include <cwchar>
+
+bool MemoryRegBackend::NameLess::operator()(const std::wstring &a,
+                                            const std::wstring &b) const {
+#ifdef _WIN32
+  return _wcsicmp(a.c_str(), b.c_str()) < 0;
+#else
+  return wcscasecmp(a.c_str(), b.c_str()) < 0;
+#endif
+}
+
+// Handles of predefined keys such as kRegCurrentUser have the bit 31 set.
+// Handles issued by MemoryRegBackend are small numbers.
+static bool IsPredefinedKey(RegKey key) {
+  return (reinterpret_cast<uintptr_t>(key) & 0x80000000) != 0;
+}
+
+MemoryRegBackend::MemoryRegBackend() : mNextHandle(0x1000) {}
+
+std::shared_ptr<MemoryRegBackend::Node> MemoryRegBackend::Resolve(RegKey key) {
+  auto handle = mHandles.find(key);
+  if (handle != mHandles.end()) {
+    return handle->second;
+  }
+  if (!IsPredefinedKey(key)) {
+    return nullptr;
+  }
+
+  std::shared_ptr<Node> &root = mRoots[key];
+  if (!root) {
+    root = std::make_shared<Node>();
+  }
+  return root;
+}
+
+// Follows `path` from `node`.  Missing keys are created if `create` is true,
+// otherwise nullptr is returned.
+std::shared_ptr<MemoryRegBackend::Node>
+MemoryRegBackend::Find(std::shared_ptr<Node> node, const std::wstring &path,
+                       bool create) {
+  for (size_t start = 0; node && start < path.size();) {
+    size_t end = path.find(L'\\', start);
+    if (end == std::wstring::npos) {
+      end = path.size();
+    }
+    if (end > start) {
+      std::wstring name = path.substr(start, end - start);
+      auto child = node->mChildren.find(name);
+      if (child != node->mChildren.end()) {
+        node = child->second;
+      } else if (create) {
+        node = node->mChildren[name] = std::make_shared<Node>();
+      } else {
+        node = nullptr;
+      }
+    }
+    start = end + 1;
+  }
+  return node;
+}
+
+void MemoryRegBackend::MarkDeleted(Node &node) {
+  node.mDeleted = true;
+  for (auto &child : node.mChildren) {
+    MarkDeleted(*child.second);
+  }
+}
+
+RegStatus MemoryRegBackend::Walk(RegKey root, const wchar_t *subkey,
+                                 bool create, RegKey *result) {
+  std::lock_guard<std::mutex> lock(mLock);
+  std::shared_ptr<Node> node = Resolve(root);
+  if (!node) {
+    return kRegInvalidHandle;
+  }
+  if (node->mDeleted) {
+    return kRegKeyDeleted;
+  }
+
+  node = Find(node, subkey ? subkey : L"", create);
+  if (!node) {
+    return kRegNotFound;
+  }
+
+  *result = reinterpret_cast<RegKey>(mNextHandle);
+  mNextHandle += sizeof(void *);
+  mHandles[*result] = node;
+  return kRegSuccess;
+}
+
+RegStatus MemoryRegBackend::OpenKey(RegKey root, const wchar_t *subkey,
+                                    RegKey *result) {
+  return Walk(root, subkey, /*create*/ false, result);
+}
+
+RegStatus MemoryRegBackend::CreateKey(RegKey root, const wchar_t *subkey,
+                                      RegKey *result) {
+  return Walk(root, subkey, /*create*/ true, result);
+}
+
+RegStatus MemoryRegBackend::CloseKey(RegKey key) {
+  std::lock_guard<std::mutex> lock(mLock);
+  if (IsPredefinedKey(key)) {
+    return kRegSuccess;
+  }
+  return mHandles.erase(key) ? kRegSuccess : kRegInvalidHandle;
+}
+
+RegStatus MemoryRegBackend::DeleteTree(RegKey root, const wchar_t *subkey) {
+  std::lock_guard<std::mutex> lock(mLock);
+  std::shared_ptr<Node> parent = Resolve(root);
+  if (!parent) {
+    return kRegInvalidHandle;
+  }
+
+  std::wstring path(subkey ? subkey : L"");
+  while (!path.empty() && path.back() == L'\\') {
+    path.pop_back();
+  }
+  if (path.empty()) {
+    // Same as RegDeleteTreeW: remove all subkeys and values of the key
+    for (auto &child : parent->mChildren) {
+      MarkDeleted(*child.second);
+    }
+    parent->mChildren.clear();
+    parent->mValues.clear();
+    return kRegSuccess;
+  }
+
+  std::wstring name = path;
+  size_t lastSeparator = path.rfind(L'\\');
+  if (lastSeparator != std::wstring::npos) {
+    parent = Find(parent, path.substr(0, lastSeparator), /*create*/ false);
+    name = path.substr(lastSeparator + 1);
+    if (!parent) {
+      return kRegNotFound;
+    }
+  }
+
+  auto target = parent->mChildren.find(name);
+  if (target == parent->mChildren.end()) {
+    return kRegNotFound;
+  }
+
+  MarkDeleted(*target->second);
+  parent->mChildren.erase(target);
+  return kRegSuccess;
+}
+
+RegStatus MemoryRegBackend::GetString(RegKey key, const wchar_t *valueName,
+                                      std::wstring &valueData) {
+  std::lock_guard<std::mutex> lock(mLock);
+  std::shared_ptr<Node> node = Resolve(key);
+  if (!node) {
+    return kRegInvalidHandle;
+  }
+  if (node->mDeleted) {
+    return kRegKeyDeleted;
+  }
+
+  auto value = node->mValues.find(valueName ? valueName : L"");
+  if (value == node->mValues.end()) {
+    return kRegNotFound;
+  }
+  valueData = value->second;
+  return kRegSuccess;
+}
+
+RegStatus MemoryRegBackend::SetString(RegKey key, const wchar_t *valueName,
+                                      const wchar_t *valueData,
+                                      RegSize valueDataLength) {
+  std::lock_guard<std::mutex> lock(mLock);
+  std::shared_ptr<Node> node = Resolve(key);
+  if (!node) {
+    return kRegInvalidHandle;
+  }
+  if (node->mDeleted) {
+    return kRegKeyDeleted;
+  }
+
+  const size_t maxChars = valueDataLength / sizeof(wchar_t);
+  node->mValues[valueName ? valueName : L""] =
+      valueData ? std::wstring(valueData, wcsnlen(valueData, maxChars))
+                : std::wstring();
+  return kRegSuccess;
+}
+
+RegStatus MemoryRegBackend::CommitNode(const Node &node,
+                                       RegBackend &target, RegKey key) {
+  for (const auto &value : node.mValues) {
+    RegStatus ls = target.SetString(
+        key, value.first.empty() ? nullptr : value.first.c_str(),
+        value.second.c_str(),
+        static_cast<RegSize>((value.second.size() + 1) * sizeof(wchar_t)));
+    if (ls != kRegSuccess) {
+      return ls;
+    }
+  }
+
+  for (const auto &child : node.mChildren) {
+    RegKey childKey;
+    RegStatus ls = target.CreateKey(key, child.first.c_str(), &childKey);
+    if (ls != kRegSuccess) {
+      return ls;
+    }
+    ls = CommitNode(*child.second, target, childKey);
+    target.CloseKey(childKey);
+    if (ls != kRegSuccess) {
+      return ls;
+    }
+  }
+  return kRegSuccess;
+}
+
+RegStatus MemoryRegBackend::Commit(RegBackend &target) {
+  std::lock_guard<std::mutex> lock(mLock);
+  for (const auto &root : mRoots) {
+    RegStatus ls = CommitNode(*root.second, target, root.first);
+    if (ls != kRegSuccess) {
+      return ls;
+    }
+  }
+  return kRegSuccess;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Types of the registry API that backends implement.  On Windows they are the
+// Win32 types, so the Win32 backend passes them straight through.  Elsewhere
+// only MemoryRegBackend exists, and they are stand-ins with the same values.
+#ifdef _WIN32
+using RegKey = HKEY;
+using RegStatus = LSTATUS;
+using RegSize = DWORD;
+
+inline const RegKey kRegClassesRoot = HKEY_CLASSES_ROOT;
+inline const RegKey kRegCurrentUser = HKEY_CURRENT_USER;
+inline const RegKey kRegLocalMachine = HKEY_LOCAL_MACHINE;
+
+constexpr RegStatus kRegSuccess = ERROR_SUCCESS;
+constexpr RegStatus kRegNotFound = ERROR_FILE_NOT_FOUND;
+constexpr RegStatus kRegInvalidHandle = ERROR_INVALID_HANDLE;
+constexpr RegStatus kRegKeyDeleted = ERROR_KEY_DELETED;
+#else
+using RegKey = struct RegKeyOpaque *;
+using RegStatus = long;
+using RegSize = uint32_t;
+
+inline const RegKey kRegClassesRoot = reinterpret_cast<RegKey>(0x80000000);
+inline const RegKey kRegCurrentUser = reinterpret_cast<RegKey>(0x80000001);
+inline const RegKey kRegLocalMachine = reinterpret_cast<RegKey>(0x80000002);
+
+constexpr RegStatus kRegSuccess = 0;
+constexpr RegStatus kRegNotFound = 2;
+constexpr RegStatus kRegInvalidHandle = 6;
+constexpr RegStatus kRegKeyDeleted = 1018;
+#endif
+
+// Storage behind RegUtil.  Keys are handles issued by the backend and are only
+// meaningful to the backend that issued them.
+class RegBackend {
+public:
+  virtual ~RegBackend() = default;
+
+  virtual RegStatus OpenKey(RegKey root, const wchar_t *subkey,
+                            RegKey *result) = 0;
+  virtual RegStatus CreateKey(RegKey root, const wchar_t *subkey,
+                              RegKey *result) = 0;
+  virtual RegStatus CloseKey(RegKey key) = 0;
+  virtual RegStatus DeleteTree(RegKey root, const wchar_t *subkey) = 0;
+  virtual RegStatus GetString(RegKey key, const wchar_t *valueName,
+                              std::wstring &valueData) = 0;
+  virtual RegStatus SetString(RegKey key, const wchar_t *valueName,
+                              const wchar_t *valueData,
+                              RegSize valueDataLength) = 0;
+
+#ifdef _WIN32
+  // The real registry, used by default
+  static RegBackend &Win32();
+#endif
+};
+
+// An in-memory hive.  It's used to stage a batch of changes which are then
+// written to another backend with Commit, so discarding a failed batch costs
+// nothing.  Only string values are supported.  It doesn't depend on Win32,
+// so it works the same on any platform.
+class MemoryRegBackend : public RegBackend {
+  struct NameLess {
+    bool operator()(const std::wstring &a, const std::wstring &b) const;
+  };
+
+  struct Node {
+    std::map<std::wstring, std::shared_ptr<Node>, NameLess> mChildren;
+    std::map<std::wstring, std::wstring, NameLess> mValues;
+    bool mDeleted = false;
+  };
+
+  std::mutex mLock;
+  std::map<RegKey, std::shared_ptr<Node>> mRoots;   // Predefined keys
+  std::map<RegKey, std::shared_ptr<Node>> mHandles; // Open keys
+  uintptr_t mNextHandle;
+
+  std::shared_ptr<Node> Resolve(RegKey key);
+  static std::shared_ptr<Node> Find(std::shared_ptr<Node> node,
+                                    const std::wstring &path, bool create);
+  static void MarkDeleted(Node &node);
+  RegStatus Walk(RegKey root, const wchar_t *subkey, bool create,
+                 RegKey *result);
+  static RegStatus CommitNode(const Node &node, RegBackend &target,
+                              RegKey key);
+
+public:
+  MemoryRegBackend();
+
+  RegStatus OpenKey(RegKey root, const wchar_t *subkey,
+                    RegKey *result) override;
+  RegStatus CreateKey(RegKey root, const wchar_t *subkey,
+                      RegKey *result) override;
+  RegStatus CloseKey(RegKey key) override;
+  RegStatus DeleteTree(RegKey root, const wchar_t *subkey) override;
+  RegStatus GetString(RegKey key, const wchar_t *valueName,
+                      std::wstring &valueData) override;
+  RegStatus SetString(RegKey key, const wchar_t *valueName,
+                      const wchar_t *valueData,
+                      RegSize valueDataLength) override;
+
+  // Writes every key and value of this hive to `target`
+  RegStatus Commit(RegBackend &target);
+};
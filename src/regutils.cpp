@@ -1,71 +1,191 @@
 #include "regutils.h"
-#include <memory>
-#include <strsafe.h>
-
-void Log(const wchar_t *format, ...);
+#include "guid.h"
+#include "log.h"
+#include "utf16.h"
+#include <ktmw32.h>
 
 std::wstring RegUtil::GuidToString(const GUID &guid) {
-  wchar_t guidStr[64];
-  HRESULT hr = ::StringCbPrintfW(
-      guidStr, sizeof(guidStr),
-      L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}", guid.Data1,
-      guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2],
-      guid.Data4[3], guid.Data4[4], guid.Data4[5], guid.Data4[6],
-      guid.Data4[7]);
-  if (FAILED(hr)) {
-    Log(L"StringCbPrintfW failed - %08lx\n", hr);
-    return L"";
+  wchar_t guidStr[kGuidStringLength + 1];
+  FormatGuid(guid, guidStr);
+  return std::wstring(guidStr, kGuidStringLength);
+}
+
+RegBackend &RegBackend::Win32() {
+  static Win32RegBackend backend;
+  return backend;
+}
+
+LSTATUS Win32RegBackend::OpenKey(HKEY root, LPCWSTR subkey, HKEY *result) {
+  return mTransaction
+             ? ::RegOpenKeyTransactedW(root, subkey, /*ulOptions*/ 0,
+                                       KEY_ALL_ACCESS, result, mTransaction,
+                                       /*pExtendedParameter*/ nullptr)
+             : ::RegOpenKeyExW(root, subkey, /*ulOptions*/ 0, KEY_ALL_ACCESS,
+                               result);
+}
+
+LSTATUS Win32RegBackend::CreateKey(HKEY root, LPCWSTR subkey, HKEY *result) {
+  DWORD dispo;
+  return mTransaction
+             ? ::RegCreateKeyTransactedW(
+                   root, subkey ? subkey : L"",
+                   /*Reserved*/ 0,
+                   /*lpClass*/ nullptr,
+                   /*dwOptions*/ 0, KEY_ALL_ACCESS,
+                   /*lpSecurityAttributes*/ nullptr, result, &dispo,
+                   mTransaction, /*pExtendedParameter*/ nullptr)
+             : ::RegCreateKeyExW(root, subkey ? subkey : L"",
+                                 /*Reserved*/ 0,
+                                 /*lpClass*/ nullptr,
+                                 /*dwOptions*/ 0, KEY_ALL_ACCESS,
+                                 /*lpSecurityAttributes*/ nullptr, result,
+                                 &dispo);
+}
+
+LSTATUS Win32RegBackend::CloseKey(HKEY key) { return ::RegCloseKey(key); }
+
+LSTATUS Win32RegBackend::DeleteTree(HKEY root, LPCWSTR subkey) {
+  if (!mTransaction) {
+    return ::RegDeleteTreeW(root, subkey);
+  }
+
+  // RegDeleteTreeW has no transacted version.  Empty the key through a
+  // transacted handle, and then delete the key itself.
+  HKEY key;
+  LSTATUS ls = OpenKey(root, subkey, &key);
+  if (ls != ERROR_SUCCESS) {
+    return ls;
   }
-  return guidStr;
+  ls = ::RegDeleteTreeW(key, nullptr);
+  ::RegCloseKey(key);
+  if (ls != ERROR_SUCCESS || !subkey || !*subkey) {
+    return ls;
+  }
+  return ::RegDeleteKeyTransactedW(root, subkey, /*samDesired*/ 0,
+                                   /*Reserved*/ 0, mTransaction,
+                                   /*pExtendedParameter*/ nullptr);
 }
 
-bool RegUtil::SetStringInternal(LPCWSTR valueName, LPCWSTR valueData,
-                                DWORD valueDataLength) const {
-  if (!mKey) {
+LSTATUS Win32RegBackend::GetString(HKEY key, LPCWSTR valueName,
+                                   std::wstring &valueData) {
+  DWORD type;
+  for (DWORD len = 1;; len *= 2) {
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[len]);
+    LSTATUS status = ::RegGetValueW(key, nullptr, valueName, RRF_RT_REG_SZ,
+                                    &type, buf.get(), &len);
+    if (status == ERROR_SUCCESS) {
+      // `len` counts the terminator, which RegGetValueW guarantees
+      const wchar_t *chars = reinterpret_cast<wchar_t *>(buf.get());
+      valueData.assign(chars, WideLengthBounded(chars, len / sizeof(wchar_t)));
+      return status;
+    } else if (status != ERROR_MORE_DATA) {
+      return status;
+    }
+  }
+}
+
+LSTATUS Win32RegBackend::SetString(HKEY key, LPCWSTR valueName,
+                                   LPCWSTR valueData, DWORD valueDataLength) {
+  return ::RegSetValueExW(key, valueName,
+                          /*Reserved*/ 0, REG_SZ,
+                          reinterpret_cast<const BYTE *>(valueData),
+                          valueDataLength);
+}
+
+RegTransaction::RegTransaction()
+    : mTransaction(::CreateTransaction(
+          /*lpTransactionAttributes*/ nullptr, /*UOW*/ nullptr,
+          /*CreateOptions*/ 0, /*IsolationLevel*/ 0, /*IsolationFlags*/ 0,
+          /*Timeout*/ 0, /*Description*/ nullptr)),
+      mBackend(mTransaction) {
+  if (mTransaction == INVALID_HANDLE_VALUE) {
+    Log(L"CreateTransaction failed - %08lx\n", ::GetLastError());
+  }
+}
+
+RegTransaction::~RegTransaction() {
+  // Closing a transaction that has not been committed rolls it back
+  if (mTransaction != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(mTransaction);
+  }
+}
+
+bool RegTransaction::Commit(MemoryRegBackend &staging) {
+  if (mTransaction == INVALID_HANDLE_VALUE) {
     return false;
   }
 
-  LSTATUS ls = ::RegSetValueExW(mKey, valueName,
-                                /*Reserved*/ 0, REG_SZ,
-                                reinterpret_cast<const BYTE *>(valueData),
-                                valueDataLength);
+  LSTATUS ls = staging.Commit(mBackend);
   if (ls != ERROR_SUCCESS) {
-    Log(L"RegSetValueExW failed - %08x\n", ls);
+    Log(L"Writing staged registry changes failed - %08lx\n", ls);
+    return false;
+  }
+  if (!::CommitTransaction(mTransaction)) {
+    Log(L"CommitTransaction failed - %08lx\n", ::GetLastError());
     return false;
   }
   return true;
 }
 
-RegUtil::RegUtil() : mKey(nullptr) {}
-
-RegUtil::RegUtil(HKEY root, LPCWSTR subkey, bool createIfNotExist)
-    : mKey(nullptr) {
+void RegUtil::Open(HKEY root, LPCWSTR subkey, bool createIfNotExist) {
   if (createIfNotExist) {
-    DWORD dispo;
-    LSTATUS ls =
-        ::RegCreateKeyExW(root, subkey ? subkey : L"",
-                          /*Reserved*/ 0,
-                          /*lpClass*/ nullptr,
-                          /*dwOptions*/ 0, KEY_ALL_ACCESS,
-                          /*lpSecurityAttributes*/ nullptr, &mKey, &dispo);
+    LSTATUS ls = mBackend->CreateKey(root, subkey, &mKey);
     if (ls != ERROR_SUCCESS) {
       Log(L"RegCreateKeyExW failed - %08lx\n", ls);
-      return;
+      mKey = nullptr;
     }
   } else {
-    LSTATUS ls = ::RegOpenKeyExW(root, subkey,
-                                 /*ulOptions*/ 0, KEY_ALL_ACCESS, &mKey);
-    if (ls != ERROR_FILE_NOT_FOUND && ls != ERROR_SUCCESS) {
-      Log(L"RegOpenKeyExW failed - %08lx\n", ls);
-      return;
+    LSTATUS ls = mBackend->OpenKey(root, subkey, &mKey);
+    if (ls != ERROR_SUCCESS) {
+      if (ls != ERROR_FILE_NOT_FOUND) {
+        Log(L"RegOpenKeyExW failed - %08lx\n", ls);
+      }
+      mKey = nullptr;
     }
   }
 }
 
-RegUtil::RegUtil(RegUtil &&other) : mKey(other.mKey) { other.mKey = nullptr; }
+bool RegUtil::SetStringInternal(LPCWSTR valueName, LPCWSTR valueData,
+                                DWORD valueDataLength) const {
+  if (!mKey) {
+    return false;
+  }
+
+  LSTATUS ls =
+      mBackend->SetString(mKey, valueName, valueData, valueDataLength);
+  if (ls != ERROR_SUCCESS) {
+    Log(L"RegSetValueExW failed - %08x\n", ls);
+    return false;
+  }
+  return true;
+}
+
+RegUtil::RegUtil() : mBackend(&RegBackend::Win32()), mKey(nullptr) {}
+
+RegUtil::RegUtil(HKEY root, LPCWSTR subkey, bool createIfNotExist)
+    : mBackend(&RegBackend::Win32()), mKey(nullptr) {
+  Open(root, subkey, createIfNotExist);
+}
+
+RegUtil::RegUtil(RegBackend &backend, HKEY root, LPCWSTR subkey,
+                 bool createIfNotExist)
+    : mBackend(&backend), mKey(nullptr) {
+  Open(root, subkey, createIfNotExist);
+}
+
+RegUtil::RegUtil(const RegUtil &parent, LPCWSTR subkey, bool createIfNotExist)
+    : mBackend(parent.mBackend), mKey(nullptr) {
+  Open(parent.mKey, subkey, createIfNotExist);
+}
+
+RegUtil::RegUtil(RegUtil &&other)
+    : mBackend(other.mBackend), mKey(other.mKey) {
+  other.mKey = nullptr;
+}
 
 RegUtil &RegUtil::operator=(RegUtil &&other) {
   if (this != &other) {
+    mBackend = other.mBackend;
     mKey = other.mKey;
     other.mKey = nullptr;
   }
@@ -77,34 +197,28 @@ RegUtil::~RegUtil() {
     return;
   }
 
-  LSTATUS ls = ::RegCloseKey(mKey);
+  LSTATUS ls = mBackend->CloseKey(mKey);
   if (ls != ERROR_SUCCESS) {
     Log(L"RegCloseKey failed - %08lx\n", ls);
   }
 }
 
 std::wstring RegUtil::GetString(LPCWSTR valueName) const {
-  DWORD type;
-  for (DWORD len = 1;; len *= 2) {
-    std::unique_ptr<uint8_t[]> buf(new uint8_t[len]);
-    LSTATUS status = ::RegGetValueW(mKey, nullptr, valueName, RRF_RT_REG_SZ,
-                                    &type, buf.get(), &len);
-    if (status == ERROR_SUCCESS) {
-      return std::wstring(reinterpret_cast<wchar_t *>(buf.get()));
-    } else if (status == ERROR_FILE_NOT_FOUND) {
-      return L"";
-    } else if (status != ERROR_MORE_DATA) {
-      Log(L"RegGetValueW failed - %08x\n", status);
-      return L"";
-    }
+  std::wstring data;
+  LSTATUS status = mBackend->GetString(mKey, valueName, data);
+  if (status != ERROR_SUCCESS && status != ERROR_FILE_NOT_FOUND) {
+    Log(L"RegGetValueW failed - %08x\n", status);
+    return L"";
   }
+  return data;
 }
 
 bool RegUtil::SetString(LPCWSTR valueName, LPCWSTR valueData) const {
   return SetStringInternal(
       valueName, valueData,
-      valueData ? static_cast<DWORD>((wcslen(valueData) + 1) * sizeof(wchar_t))
-                : 0);
+      valueData
+          ? static_cast<DWORD>((WideLength(valueData) + 1) * sizeof(wchar_t))
+          : 0);
 }
 
 bool RegUtil::SetString(LPCWSTR valueName,
@@ -1,11 +1,57 @@
 #pragma once
 
+#include "regbackend.h"
 #include <string>
 #include <windows.h>
 
+// The Win32 registry.  If a KTM transaction is given, every key is opened or
+// created as part of it, so nothing is visible until the transaction commits.
+class Win32RegBackend : public RegBackend {
+  HANDLE mTransaction;
+
+public:
+  explicit Win32RegBackend(HANDLE transaction = nullptr)
+      : mTransaction(transaction) {}
+
+  LSTATUS OpenKey(HKEY root, LPCWSTR subkey, HKEY *result) override;
+  LSTATUS CreateKey(HKEY root, LPCWSTR subkey, HKEY *result) override;
+  LSTATUS CloseKey(HKEY key) override;
+  LSTATUS DeleteTree(HKEY root, LPCWSTR subkey) override;
+  LSTATUS GetString(HKEY key, LPCWSTR valueName,
+                    std::wstring &valueData) override;
+  LSTATUS SetString(HKEY key, LPCWSTR valueName, LPCWSTR valueData,
+                    DWORD valueDataLength) override;
+};
+
+// A KTM transaction on the Win32 registry.  Keys opened through Backend() see
+// the changes made in the transaction, and nobody else sees any of them until
+// Commit succeeds.  Destroying it without committing rolls everything back.
+class RegTransaction {
+  HANDLE mTransaction;
+  Win32RegBackend mBackend;
+
+public:
+  RegTransaction();
+  ~RegTransaction();
+
+  RegTransaction(const RegTransaction &) = delete;
+  RegTransaction &operator=(const RegTransaction &) = delete;
+
+  explicit operator bool() const {
+    return mTransaction != INVALID_HANDLE_VALUE;
+  }
+  RegBackend &Backend() { return mBackend; }
+
+  // Writes everything staged in `staging` and commits.  Either all of it
+  // becomes visible, or none of it.
+  bool Commit(MemoryRegBackend &staging);
+};
+
 class RegUtil {
+  RegBackend *mBackend;
   HKEY mKey;
 
+  void Open(HKEY root, LPCWSTR subkey, bool createIfNotExist);
   bool SetStringInternal(LPCWSTR valueName, LPCWSTR valueData,
                          DWORD valueDataLength) const;
 
@@ -14,6 +60,10 @@ public:
 
   RegUtil();
   RegUtil(HKEY root, LPCWSTR subkey, bool createIfNotExist = false);
+  RegUtil(RegBackend &backend, HKEY root, LPCWSTR subkey,
+          bool createIfNotExist = false);
+  RegUtil(const RegUtil &parent, LPCWSTR subkey,
+          bool createIfNotExist = false);
   ~RegUtil();
 
   RegUtil(const RegUtil &) = delete;
@@ -1,36 +1,56 @@
 #include "serverinfo.h"
 #include "interfaces.h"
+#include "log.h"
+#include "manifest.h"
 #include "regutils.h"
 #include <atlbase.h>
+#include <strsafe.h>
 
 const wchar_t kUserClassRoot[] = L"Software\\Classes\\";
 const wchar_t kDirClsId[] = L"CLSID\\";
 const wchar_t kDirTypelib[] = L"Typelib\\";
+const wchar_t kDirInterface[] = L"Interface\\";
 IUnknown *CreateFactory();
 
-void Log(const wchar_t *format, ...);
-
-ServerInfo::ServerInfo(HMODULE module) {
+ServerInfo::ServerInfo(HMODULE module,
+                       const ServerRegistrationEntry servers[]) {
   if (!::GetModuleFileNameW(module, mModulePath, ARRAYSIZE(mModulePath))) {
     mModulePath[0] = 0;
   }
+
+  constexpr GUID kEmptyGuid = {};
+  for (const ServerRegistrationEntry *server = servers;
+       server->mGuid != kEmptyGuid; ++server) {
+    IUnknown *factory = CreateFactory();
+    if (factory && !mClassObjects.Insert(server->mGuid, factory)) {
+      factory->Release();
+    }
+  }
+}
+
+ServerInfo::~ServerInfo() {
+  mClassObjects.ForEach(
+      [](const GUID &, IUnknown *factory) { factory->Release(); });
 }
 
 bool ServerInfo::RegisterServer(LPCWSTR clsId, LPCWSTR friendlyName,
-                                LPCWSTR threadModel) const {
+                                LPCWSTR threadModel, RegBackend &registry,
+                                RegBackend &backend) const {
   std::wstring subkey(kUserClassRoot);
   subkey += kDirClsId;
   subkey += clsId;
 
-  RegUtil server_test(HKEY_CURRENT_USER, subkey.c_str());
+  // Check the registry the staged keys are committed to, not the staging hive
+  RegUtil server_test(registry, HKEY_CURRENT_USER, subkey.c_str());
   if (server_test) {
     // Key already exist.  No override.
     return false;
   }
 
-  RegUtil server(HKEY_CURRENT_USER, subkey.c_str(), /*createIfNotExist*/ true);
+  RegUtil server(backend, HKEY_CURRENT_USER, subkey.c_str(),
+                 /*createIfNotExist*/ true);
   if (!server || !server.SetString(nullptr, friendlyName)) {
-    UnregisterServer(clsId);
+    backend.DeleteTree(HKEY_CURRENT_USER, subkey.c_str());
     return false;
   }
 
@@ -45,7 +65,7 @@ bool ServerInfo::RegisterServer(LPCWSTR clsId, LPCWSTR friendlyName,
   }
 
   if (!ok) {
-    UnregisterServer(clsId);
+    backend.DeleteTree(HKEY_CURRENT_USER, subkey.c_str());
   }
   return ok;
 }
@@ -63,20 +83,105 @@ bool ServerInfo::UnregisterServer(LPCWSTR clsId) const {
   return true;
 }
 
-bool ServerInfo::RegisterTypelib() const {
+// The keys RegisterTypeLibForUser would write, written to `backend` instead
+// so they can be staged with the servers and committed in the same
+// transaction.  UnRegisterTypeLibForUser removes them as usual.
+bool ServerInfo::RegisterTypelib(RegBackend &backend) const {
   CComPtr<ITypeLib> tlb;
-  HRESULT hr = ::LoadTypeLib(mModulePath, &tlb);
+  HRESULT hr = ::LoadTypeLibEx(mModulePath, REGKIND_NONE, &tlb);
   if (FAILED(hr)) {
-    Log(L"LoadTypeLib failed - %08lx\n", hr);
+    Log(L"LoadTypeLibEx failed - %08lx\n", hr);
     return false;
   }
 
-  CComBSTR copied(mModulePath);
-  hr = ::RegisterTypeLibForUser(tlb, copied, nullptr);
+  TLIBATTR *libAttr;
+  hr = tlb->GetLibAttr(&libAttr);
   if (FAILED(hr)) {
-    Log(L"RegisterTypeLibForUser failed - %08lx\n", hr);
+    Log(L"ITypeLib::GetLibAttr failed - %08lx\n", hr);
     return false;
   }
+  const std::wstring libId = RegUtil::GuidToString(libAttr->guid);
+  const LCID lcid = libAttr->lcid;
+  const SYSKIND sys = libAttr->syskind;
+  wchar_t version[16];
+  StringCchPrintfW(version, ARRAYSIZE(version), L"%x.%x",
+                   libAttr->wMajorVerNum, libAttr->wMinorVerNum);
+  tlb->ReleaseTLibAttr(libAttr);
+
+  wchar_t platform[32];
+  StringCchPrintfW(platform, ARRAYSIZE(platform), L"%lx\\%s", lcid,
+                   sys == SYS_WIN64 ? L"win64" : L"win32");
+  std::wstring helpDir(mModulePath);
+  helpDir.resize(helpDir.find_last_of(L'\\') + 1);
+
+  std::wstring subkey(kUserClassRoot);
+  subkey += kDirTypelib;
+  subkey += libId;
+  subkey += L'\\';
+  subkey += version;
+
+  CComBSTR libName;
+  tlb->GetDocumentation(MEMBERID_NIL, /*pBstrName*/ nullptr, &libName,
+                        /*pdwHelpContext*/ nullptr,
+                        /*pBstrHelpFile*/ nullptr);
+  RegUtil typelib(backend, HKEY_CURRENT_USER, subkey.c_str(),
+                  /*createIfNotExist*/ true);
+  RegUtil path(typelib, platform, /*createIfNotExist*/ true);
+  RegUtil flags(typelib, L"FLAGS", /*createIfNotExist*/ true);
+  RegUtil help(typelib, L"HELPDIR", /*createIfNotExist*/ true);
+  if (!typelib || !typelib.SetString(nullptr, libName.m_str) || !path ||
+      !path.SetString(nullptr, mModulePath) || !flags ||
+      !flags.SetString(nullptr, L"0") || !help ||
+      !help.SetString(nullptr, helpDir)) {
+    return false;
+  }
+
+  // Interfaces marshaled by the typelib marshaler.  Those that are neither
+  // dual nor [oleautomation] need their own proxy/stub and are skipped.
+  constexpr wchar_t kPSDispatch[] = L"{00020420-0000-0000-C000-000000000046}";
+  constexpr wchar_t kPSOAInterface[] =
+      L"{00020424-0000-0000-C000-000000000046}";
+  for (UINT i = 0; i < tlb->GetTypeInfoCount(); ++i) {
+    CComPtr<ITypeInfo> info;
+    TYPEATTR *attr;
+    if (FAILED(tlb->GetTypeInfo(i, &info)) ||
+        FAILED(info->GetTypeAttr(&attr))) {
+      return false;
+    }
+    const GUID iid = attr->guid;
+    const wchar_t *proxyStub = nullptr;
+    if (attr->wTypeFlags & TYPEFLAG_FDUAL) {
+      proxyStub = kPSOAInterface;
+    } else if (attr->typekind == TKIND_DISPATCH) {
+      proxyStub = kPSDispatch;
+    } else if (attr->typekind == TKIND_INTERFACE &&
+               (attr->wTypeFlags & TYPEFLAG_FOLEAUTOMATION)) {
+      proxyStub = kPSOAInterface;
+    }
+    info->ReleaseTypeAttr(attr);
+    if (!proxyStub) {
+      continue;
+    }
+
+    CComBSTR name;
+    tlb->GetDocumentation(i, &name, /*pBstrDocString*/ nullptr,
+                          /*pdwHelpContext*/ nullptr,
+                          /*pBstrHelpFile*/ nullptr);
+    std::wstring interfaceKey(kUserClassRoot);
+    interfaceKey += kDirInterface;
+    interfaceKey += RegUtil::GuidToString(iid);
+    RegUtil iface(backend, HKEY_CURRENT_USER, interfaceKey.c_str(),
+                  /*createIfNotExist*/ true);
+    RegUtil ps32(iface, L"ProxyStubClsid32", /*createIfNotExist*/ true);
+    RegUtil ps(iface, L"ProxyStubClsid", /*createIfNotExist*/ true);
+    RegUtil lib(iface, L"TypeLib", /*createIfNotExist*/ true);
+    if (!iface || !iface.SetString(nullptr, name.m_str) || !ps32 ||
+        !ps32.SetString(nullptr, proxyStub) || !ps ||
+        !ps.SetString(nullptr, proxyStub) || !lib ||
+        !lib.SetString(nullptr, libId) || !lib.SetString(L"Version", version)) {
+      return false;
+    }
+  }
   return true;
 }
 
@@ -102,12 +207,30 @@ bool ServerInfo::UnregisterTypelib() const {
   return true;
 }
 
-HRESULT ServerInfo::GetClassObject(REFIID riid, void **ppv) const {
+bool ServerInfo::SaveManifest(const ServerRegistrationEntry servers[]) const {
+  constexpr GUID kEmptyGuid = {};
+  ManifestWriter writer;
+  for (const ServerRegistrationEntry *server = servers;
+       server->mGuid != kEmptyGuid; ++server) {
+    writer.Add(server->mGuid, mModulePath, server->mThreadModel,
+               LIBID_COM_Playground);
+  }
+  return writer.Save(ManifestPathForModule(mModulePath).c_str());
+}
+
+bool ServerInfo::DeleteManifest() const {
+  std::wstring path = ManifestPathForModule(mModulePath);
+  return ::DeleteFileW(path.c_str()) ||
+         ::GetLastError() == ERROR_FILE_NOT_FOUND;
+}
+
+HRESULT ServerInfo::GetClassObject(REFCLSID rclsid, REFIID riid,
+                                   void **ppv) const {
   *ppv = nullptr;
 
-  CComPtr<IUnknown> factory;
-  factory.Attach(CreateFactory());
-  return factory ? factory->QueryInterface(riid, ppv) : E_OUTOFMEMORY;
+  IUnknown *const *factory = mClassObjects.Find(rclsid);
+  return factory ? (*factory)->QueryInterface(riid, ppv)
+                 : CLASS_E_CLASSNOTAVAILABLE;
 }
 
 bool RegisterAllServers(const ServerInfo *si,
@@ -115,6 +238,12 @@ bool RegisterAllServers(const ServerInfo *si,
                         bool trueToUnregister) {
   constexpr GUID kEmptyGuid = {};
   bool ok = true;
+
+  // Servers and the typelib are registered in memory first and written to the
+  // registry in one transaction, so a failure in the middle leaves nothing
+  // behind.
+  RegTransaction transaction;
+  MemoryRegBackend staging;
   for (const ServerRegistrationEntry *server = servers;
        server->mGuid != kEmptyGuid; ++server) {
     std::wstring clsId = RegUtil::GuidToString(server->mGuid);
@@ -126,8 +255,10 @@ bool RegisterAllServers(const ServerInfo *si,
       continue;
     }
 
-    if (!si->RegisterServer(clsId.c_str(), server->mFriendlyName,
-                            server->mThreadModel)) {
+    if (!transaction ||
+        !si->RegisterServer(clsId.c_str(), server->mFriendlyName,
+                            server->mThreadModel, transaction.Backend(),
+                            staging)) {
       // Stop registering servers
       ok = false;
       break;
@@ -138,10 +269,17 @@ bool RegisterAllServers(const ServerInfo *si,
     if (!si->UnregisterTypelib()) {
       ok = false;
     }
-  } else {
-    if (!si->RegisterTypelib()) {
-      ok = false;
-    }
+  } else if (!ok || !si->RegisterTypelib(staging) ||
+             !transaction.Commit(staging)) {
+    ok = false;
+  }
+
+  // The manifest is only an optimization.  The registry stays the source of
+  // truth, so failing to write it next to the module is not an error.
+  if (trueToUnregister || !ok) {
+    si->DeleteManifest();
+  } else if (!si->SaveManifest(servers)) {
+    Log(L"Failed to save the activation manifest\n");
   }
 
   return ok;
@@ -1,28 +1,44 @@
 #pragma once
 
+#include "guid.h"
 #include <windows.h>
 
+class RegBackend;
+
+struct ServerRegistrationEntry {
+  GUID mGuid;
+  LPCWSTR mFriendlyName;
+  LPCWSTR mThreadModel; // LocalServer if this is null
+};
+
 class ServerInfo {
   wchar_t mModulePath[MAX_PATH];
 
+  // Class objects are created in the constructor and never change after that,
+  // so GetClassObject can be called from any thread without a lock.
+  GuidMap<IUnknown *> mClassObjects;
+
 public:
-  ServerInfo(HMODULE module);
-  ~ServerInfo() = default;
+  ServerInfo(HMODULE module, const ServerRegistrationEntry servers[]);
+  ~ServerInfo();
+
+  ServerInfo(const ServerInfo &) = delete;
+  ServerInfo &operator=(const ServerInfo &) = delete;
 
+  // Writes the server's keys to `backend` unless `registry` already has them
   bool RegisterServer(LPCWSTR clsId, LPCWSTR friendlyName,
-                      LPCWSTR threadModel) const;
+                      LPCWSTR threadModel, RegBackend &registry,
+                      RegBackend &backend) const;
   bool UnregisterServer(LPCWSTR clsId) const;
 
-  bool RegisterTypelib() const;
+  bool RegisterTypelib(RegBackend &backend) const;
   bool UnregisterTypelib() const;
 
-  HRESULT GetClassObject(REFIID riid, void **ppv) const;
-};
+  // Registration-free activation manifest next to the module
+  bool SaveManifest(const ServerRegistrationEntry servers[]) const;
+  bool DeleteManifest() const;
 
-struct ServerRegistrationEntry {
-  GUID mGuid;
-  LPCWSTR mFriendlyName;
-  LPCWSTR mThreadModel; // LocalServer if this is null
+  HRESULT GetClassObject(REFCLSID rclsid, REFIID riid, void **ppv) const;
 };
 
 bool RegisterAllServers(const ServerInfo *si,
@@ -1,8 +1,16 @@
+#include "apartmentpool.h"
+#include "log.h"
+#include "marshalable.h"
 #include "regutils.h"
 #include "serverinfo.h"
 #include "shared.h"
+#include "stats.h"
+#include <algorithm>
 #include <atlbase.h>
+#include <fstream>
 #include <memory>
+#include <shellapi.h>
+#include <string>
 #include <strsafe.h>
 #include <thread>
 #include <vector>
@@ -16,49 +24,52 @@ static const ServerRegistrationEntry kServers[] = {
 
 std::unique_ptr<ServerInfo> gSI;
 
-struct HandleCloser {
-  typedef HANDLE pointer;
-  void operator()(HANDLE h) {
-    if (h) {
-      ::CloseHandle(h);
-    }
-  }
-};
-
-void Log(const wchar_t *format, ...) {
-  wchar_t linebuf[1024];
-  va_list v;
-  va_start(v, format);
-  ::StringCbVPrintfW(linebuf, sizeof(linebuf), format, v);
-  ::OutputDebugStringW(linebuf);
-  va_end(v);
-}
+// Number of classes this server registers
+constexpr size_t kServerCount = ARRAYSIZE(kServers) - 1;
 
 class ComServerClass {
   CComPtr<IUnknown> mFactory;
   DWORD mCookie;
 
-public:
-  ComServerClass(GUID clsId) : mCookie(0) {
-    IUnknown *raw;
-    HRESULT hr =
-        gSI->GetClassObject(IID_IUnknown, reinterpret_cast<void **>(&raw));
+  static CComPtr<IUnknown> ClassObject(GUID clsId) {
+    CComPtr<IUnknown> factory;
+    HRESULT hr = gSI->GetClassObject(clsId, IID_IUnknown,
+                                     reinterpret_cast<void **>(&factory));
     if (FAILED(hr)) {
       Log(L"Failed to create a factory object - %08lx\n", hr);
-      return;
     }
-    mFactory.Attach(raw);
+    return factory;
+  }
 
-    hr = ::CoRegisterClassObject(clsId, mFactory, CLSCTX_LOCAL_SERVER,
-                                 REGCLS_MULTIPLEUSE | REGCLS_SUSPENDED,
-                                 &mCookie);
+  void Register(GUID clsId) {
+    if (!mFactory) {
+      return;
+    }
+    HRESULT hr = ::CoRegisterClassObject(clsId, mFactory, CLSCTX_LOCAL_SERVER,
+                                         REGCLS_MULTIPLEUSE | REGCLS_SUSPENDED,
+                                         &mCookie);
     if (FAILED(hr)) {
       Log(L"CoRegisterClassObject failed - %08lx\n", hr);
       mFactory.Release();
-      return;
     }
   }
 
+public:
+  ComServerClass(GUID clsId) : mFactory(ClassObject(clsId)), mCookie(0) {
+    Register(clsId);
+  }
+
+  // Objects are created in the apartments of `pool`.  The pool waits for
+  // the activations still in progress when it's destroyed, and fails the
+  // ones after that.
+  ComServerClass(GUID clsId, ApartmentPool *pool) : mCookie(0) {
+    CComQIPtr<IClassFactory> inner(ClassObject(clsId));
+    if (inner) {
+      mFactory.Attach(CreatePooledFactory(pool, inner));
+    }
+    Register(clsId);
+  }
+
   ~ComServerClass() {
     if (mFactory) {
       ::CoRevokeClassObject(mCookie);
@@ -66,8 +77,49 @@ public:
   }
 };
 
-void ServerMain(HANDLE event, GUID clsId) {
-  ComServerClass class_sta(clsId);
+struct ServerOptions {
+  bool mMta;
+  size_t mInstancePoolCap;
+  // STA apartments per class.  Zero in mClassApartments means mApartments.
+  size_t mApartments;
+  size_t mClassApartments[kServerCount];
+  ActivationPolicy mBalance;
+  // Calls each apartment lets wait before rejecting more.  Zero is no limit.
+  size_t mMaxQueuedCalls;
+};
+
+// Every class gets a pool of its own STAs, and objects are spread over them
+// by activation.  The class objects are registered in the MTA so that an
+// activation doesn't wait behind the calls of any apartment.
+void PooledServerMain(HANDLE event, const ServerOptions &options) {
+  // Declared first so that the classes are revoked before the pools stop
+  std::vector<std::unique_ptr<ApartmentPool>> pools;
+  std::vector<std::unique_ptr<ComServerClass>> classes;
+  for (size_t i = 0; i < kServerCount; ++i) {
+    size_t count = options.mClassApartments[i] ? options.mClassApartments[i]
+                                               : options.mApartments;
+    pools.emplace_back(
+        new ApartmentPool(count, options.mBalance, options.mMaxQueuedCalls));
+    classes.emplace_back(
+        new ComServerClass(kServers[i].mGuid, pools.back().get()));
+  }
+
+  HRESULT hr = ::CoResumeClassObjects();
+  if (FAILED(hr)) {
+    Log(L"CoResumeClassObjects failed - %08lx\n", hr);
+    return;
+  }
+
+  ::WaitForSingleObject(event, INFINITE);
+  ::CoSuspendClassObjects();
+}
+
+// All classes are registered in the MTA, where incoming calls are dispatched
+// on the RPC runtime's worker threads instead of being serialized on one
+// apartment thread.
+void MtaServerMain(HANDLE event) {
+  ComServerClass class_1(kCLSID_ExtZ_OutProc_STA_1);
+  ComServerClass class_2(kCLSID_ExtZ_OutProc_STA_2);
 
   HRESULT hr = ::CoResumeClassObjects();
   if (FAILED(hr)) {
@@ -75,7 +127,248 @@ void ServerMain(HANDLE event, GUID clsId) {
     return;
   }
 
-  ThreadMsgWaitForSingleObject(event, INFINITE);
+  ::WaitForSingleObject(event, INFINITE);
+}
+
+// The named event that keeps a single instance running.  Setting it stops
+// the server, and the names of the --stats channel are derived from it.
+#define SERVER_CHANNEL L"COMServer-a16109f3-64af-49bc-80d7-5a7c1a837cae"
+
+static constexpr wchar_t kServerChannel[] = SERVER_CHANNEL;
+static constexpr wchar_t kStatsRequest[] = SERVER_CHANNEL L"-stats";
+static constexpr wchar_t kStatsReady[] = SERVER_CHANNEL L"-stats-ready";
+static constexpr wchar_t kStatsSection[] = SERVER_CHANNEL L"-stats-data";
+static constexpr wchar_t kStatsLock[] = SERVER_CHANNEL L"-stats-lock";
+constexpr DWORD kStatsTimeoutMs = 5000;
+
+// Answers --stats requests of other processes until `stop` is signaled.
+// This is a plain thread so that it never waits behind an apartment.
+static void ServeStats(HANDLE stop) {
+  std::unique_ptr<HANDLE, HandleCloser> request(::CreateEventW(
+      /*lpEventAttributes*/ nullptr,
+      /*bManualReset*/ FALSE,
+      /*bInitialState*/ FALSE, kStatsRequest));
+  std::unique_ptr<HANDLE, HandleCloser> ready(::CreateEventW(
+      /*lpEventAttributes*/ nullptr,
+      /*bManualReset*/ FALSE,
+      /*bInitialState*/ FALSE, kStatsReady));
+  std::unique_ptr<HANDLE, HandleCloser> section(::CreateFileMappingW(
+      INVALID_HANDLE_VALUE, /*lpFileMappingAttributes*/ nullptr,
+      PAGE_READWRITE, /*dwMaximumSizeHigh*/ 0, sizeof(StatsSnapshot),
+      kStatsSection));
+  if (!request || !ready || !section) {
+    Log(L"Failed to create the stats channel - %08lx\n", ::GetLastError());
+    return;
+  }
+
+  StatsSnapshot *snapshot = reinterpret_cast<StatsSnapshot *>(::MapViewOfFile(
+      section.get(), FILE_MAP_WRITE, 0, 0, sizeof(StatsSnapshot)));
+  if (!snapshot) {
+    Log(L"MapViewOfFile failed - %08lx\n", ::GetLastError());
+    return;
+  }
+
+  HANDLE handles[] = {stop, request.get()};
+  while (::WaitForMultipleObjects(ARRAYSIZE(handles), handles,
+                                  /*bWaitAll*/ FALSE,
+                                  INFINITE) == WAIT_OBJECT_0 + 1) {
+    TakeStatsSnapshot(*snapshot);
+    ::SetEvent(ready.get());
+  }
+  ::UnmapViewOfFile(snapshot);
+}
+
+// Writes to the standard output of the process that started this one, which
+// has no console of its own.  Redirected output is written as UTF-8.
+static void WriteStdout(const std::wstring &text) {
+  ::AttachConsole(ATTACH_PARENT_PROCESS);
+  HANDLE out = ::GetStdHandle(STD_OUTPUT_HANDLE);
+  if (!out || out == INVALID_HANDLE_VALUE) {
+    ::OutputDebugStringW(text.c_str());
+    return;
+  }
+
+  DWORD mode, written;
+  if (::GetConsoleMode(out, &mode)) {
+    ::WriteConsoleW(out, text.c_str(), static_cast<DWORD>(text.size()),
+                    &written, nullptr);
+    return;
+  }
+
+  int bytes = ::WideCharToMultiByte(CP_UTF8, 0, text.c_str(),
+                                    static_cast<int>(text.size()), nullptr, 0,
+                                    nullptr, nullptr);
+  std::string utf8(bytes, '\0');
+  ::WideCharToMultiByte(CP_UTF8, 0, text.c_str(),
+                        static_cast<int>(text.size()), &utf8[0], bytes,
+                        nullptr, nullptr);
+  ::WriteFile(out, utf8.data(), bytes, &written, nullptr);
+}
+
+// Asks the running server for a snapshot of its statistics and prints it
+static int QueryStats() {
+  // One query at a time, because there is only one section
+  std::unique_ptr<HANDLE, HandleCloser> lock(
+      ::CreateMutexW(/*lpMutexAttributes*/ nullptr,
+                     /*bInitialOwner*/ FALSE, kStatsLock));
+  std::unique_ptr<HANDLE, HandleCloser> request(
+      ::OpenEventW(EVENT_MODIFY_STATE, FALSE, kStatsRequest));
+  std::unique_ptr<HANDLE, HandleCloser> ready(
+      ::OpenEventW(SYNCHRONIZE, FALSE, kStatsReady));
+  std::unique_ptr<HANDLE, HandleCloser> section(
+      ::OpenFileMappingW(FILE_MAP_READ, FALSE, kStatsSection));
+  if (!lock || !request || !ready || !section) {
+    WriteStdout(L"The server doesn't serve statistics.\n");
+    return 1;
+  }
+
+  DWORD status = ::WaitForSingleObject(lock.get(), kStatsTimeoutMs);
+  if (status != WAIT_OBJECT_0 && status != WAIT_ABANDONED) {
+    WriteStdout(L"Another query is in progress.\n");
+    return 1;
+  }
+
+  int result = 1;
+  ::SetEvent(request.get());
+  if (::WaitForSingleObject(ready.get(), kStatsTimeoutMs) == WAIT_OBJECT_0) {
+    const StatsSnapshot *snapshot =
+        reinterpret_cast<const StatsSnapshot *>(::MapViewOfFile(
+            section.get(), FILE_MAP_READ, 0, 0, sizeof(StatsSnapshot)));
+    if (snapshot) {
+      WriteStdout(FormatStatsSnapshot(*snapshot));
+      ::UnmapViewOfFile(snapshot);
+      result = 0;
+    }
+  } else {
+    WriteStdout(L"The server didn't respond.\n");
+  }
+  ::ReleaseMutex(lock.get());
+  return result;
+}
+
+static constexpr wchar_t kConfig[] = L"--config=";
+
+// The value of `arg` if it starts with `prefix`, or null
+template <size_t N>
+static const wchar_t *OptionValue(const wchar_t *arg,
+                                  const wchar_t (&prefix)[N]) {
+  return wcsncmp(arg, prefix, N - 1) == 0 ? arg + N - 1 : nullptr;
+}
+
+// Parses an apartment count, which is clamped to the limit of a pool.  Zero
+// and garbage count as one.
+static size_t ParseApartmentCount(const wchar_t *value) {
+  size_t count = wcstoul(value, nullptr, 10);
+  return std::min(std::max(count, size_t(1)), ApartmentPool::kMaxApartments);
+}
+
+// Applies one option of the run mode.  Returns false if `arg` isn't one.
+static bool ApplyServerOption(const wchar_t *arg, ServerOptions &options) {
+  constexpr wchar_t kInstancePool[] = L"--instance-pool=";
+  constexpr wchar_t kApartments[] = L"--apartments=";
+  constexpr wchar_t kClassApartments[] = L"--apartments.";
+  constexpr wchar_t kBalance[] = L"--balance=";
+  constexpr wchar_t kMaxQueuedCalls[] = L"--max-queued-calls=";
+
+  const wchar_t *value;
+  if (wcscmp(arg, L"--mta") == 0) {
+    options.mMta = true;
+  } else if ((value = OptionValue(arg, kInstancePool))) {
+    options.mInstancePoolCap = wcstoul(value, nullptr, 10);
+  } else if ((value = OptionValue(arg, kApartments))) {
+    options.mApartments = ParseApartmentCount(value);
+  } else if ((value = OptionValue(arg, kClassApartments))) {
+    // --apartments.{CLSID}=N
+    const wchar_t *equals = wcschr(value, L'=');
+    GUID clsId;
+    if (!equals ||
+        !ParseGuid(value, static_cast<size_t>(equals - value), clsId)) {
+      return false;
+    }
+    size_t i = 0;
+    while (i < kServerCount && kServers[i].mGuid != clsId) {
+      ++i;
+    }
+    if (i == kServerCount) {
+      return false;
+    }
+    options.mClassApartments[i] = ParseApartmentCount(equals + 1);
+  } else if ((value = OptionValue(arg, kBalance))) {
+    if (wcscmp(value, L"round-robin") == 0) {
+      options.mBalance = kActivateRoundRobin;
+    } else if (wcscmp(value, L"least-loaded") == 0) {
+      options.mBalance = kActivateLeastLoaded;
+    } else {
+      return false;
+    }
+  } else if ((value = OptionValue(arg, kMaxQueuedCalls))) {
+    options.mMaxQueuedCalls = wcstoul(value, nullptr, 10);
+  } else if (!OptionValue(arg, kConfig)) {
+    return false;
+  }
+  return true;
+}
+
+// Applies a config file in UTF-8 with one option per line, with or without
+// the leading dashes, e.g. "balance=least-loaded".  Blank lines and lines
+// starting with # are skipped.
+static void LoadServerConfig(const wchar_t *path, ServerOptions &options) {
+  std::ifstream file(path);
+  if (!file) {
+    Log(L"Failed to open %s\n", path);
+    return;
+  }
+
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t first = line.find_first_not_of(" \t");
+    size_t last = line.find_last_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') {
+      continue;
+    }
+
+    int length = static_cast<int>(last - first + 1);
+    int chars = ::MultiByteToWideChar(CP_UTF8, 0, line.data() + first, length,
+                                      nullptr, 0);
+    std::wstring option(chars, L'\0');
+    ::MultiByteToWideChar(CP_UTF8, 0, line.data() + first, length, &option[0],
+                          chars);
+    if (option.compare(0, 2, L"--") != 0) {
+      option.insert(0, L"--");
+    }
+    if (!ApplyServerOption(option.c_str(), options)) {
+      Log(L"Unknown option in %s: %s\n", path, option.c_str());
+    }
+  }
+}
+
+// Parses the options of the run mode, e.g. "--mta --instance-pool=64" or
+// "--apartments=8 --balance=least-loaded --max-queued-calls=32".  The file
+// given by --config is applied first, wherever it is, so that the command
+// line overrides it.  Unknown arguments such as -Embedding passed by COM are
+// ignored.
+static ServerOptions ParseServerOptions() {
+  ServerOptions options = {};
+  options.mApartments = 1;
+  options.mBalance = kActivateRoundRobin;
+  int argc = 0;
+  LPWSTR *argv = ::CommandLineToArgvW(::GetCommandLineW(), &argc);
+  if (!argv) {
+    Log(L"CommandLineToArgvW failed - %08lx\n", ::GetLastError());
+    return options;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    if (const wchar_t *path = OptionValue(argv[i], kConfig)) {
+      LoadServerConfig(path, options);
+    }
+  }
+  for (int i = 1; i < argc; ++i) {
+    ApplyServerOption(argv[i], options);
+  }
+
+  ::LocalFree(argv);
+  return options;
 }
 
 int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, PWSTR cmd, int) {
@@ -84,19 +377,27 @@ int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, PWSTR cmd, int) {
       /*lpEventAttributes*/ nullptr,
       /*bManualReset*/ TRUE,
       /*bInitialState*/ FALSE,
-      L"COMServer-a16109f3-64af-49bc-80d7-5a7c1a837cae"));
+      kServerChannel));
   if (!event) {
     return 1;
   }
+  bool running = ::GetLastError() == ERROR_ALREADY_EXISTS;
   if (wcscmp(cmd, L"--stop") == 0) {
-    if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+    if (running) {
       // Signal the running server to exit
       ::SetEvent(event.get());
     }
     return 0;
   }
+  if (wcscmp(cmd, L"--stats") == 0) {
+    if (!running) {
+      WriteStdout(L"The server is not running.\n");
+      return 1;
+    }
+    return QueryStats();
+  }
 
-  gSI.reset(new ServerInfo(inst));
+  gSI.reset(new ServerInfo(inst, kServers));
 
   if (wcscmp(cmd, L"--register") == 0) {
     if (!RegisterAllServers(gSI.get(), kServers)) {
@@ -105,18 +406,25 @@ int WINAPI wWinMain(HINSTANCE inst, HINSTANCE, PWSTR cmd, int) {
   } else if (wcscmp(cmd, L"--unregister") == 0) {
     RegisterAllServers(gSI.get(), kServers, /*trueToUnregister*/ true);
   } else {
+    ServerOptions options = ParseServerOptions();
+    SetInstancePoolCap(options.mInstancePoolCap);
+
     std::vector<std::thread> threads;
-    threads.emplace_back(ComThread<COINIT_APARTMENTTHREADED>, [&event]() {
-      ServerMain(event.get(), kCLSID_ExtZ_OutProc_STA_1);
-    });
-    threads.emplace_back(ComThread<COINIT_APARTMENTTHREADED>, [&event]() {
-      ServerMain(event.get(), kCLSID_ExtZ_OutProc_STA_2);
-    });
+    threads.emplace_back(ServeStats, event.get());
+    if (options.mMta) {
+      threads.emplace_back(ComThread<COINIT_MULTITHREADED>,
+                           [&event]() { MtaServerMain(event.get()); });
+    } else {
+      threads.emplace_back(ComThread<COINIT_MULTITHREADED>, [&]() {
+        PooledServerMain(event.get(), options);
+      });
+    }
     for (auto &thread : threads) {
       thread.join();
     }
   }
 
   gSI.reset(nullptr);
+  LogFlush();
   return 0;
 }
@@ -1,25 +1,240 @@
 #include "shared.h"
+#include "admission.h"
+#include "alloc.h"
+#include "log.h"
+#include <chrono>
+#include <new>
 
-void Log(const wchar_t *format, ...);
+static std::atomic<LONG> gModuleLocks(0);
 
-void ThreadMsgWaitForSingleObject(HANDLE handle, DWORD dwMilliseconds) {
+void LockModule() { gModuleLocks.fetch_add(1, std::memory_order_relaxed); }
+
+void UnlockModule() { gModuleLocks.fetch_sub(1, std::memory_order_relaxed); }
+
+LONG ModuleLockCount() { return gModuleLocks.load(std::memory_order_relaxed); }
+
+void *ApartmentQueue::Node::operator new(size_t size) {
+  void *p = SizeClassPool::Allocate(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void ApartmentQueue::Node::operator delete(void *p) { SizeClassPool::Free(p); }
+
+ApartmentQueue::ApartmentQueue()
+    : mHead(&mStub), mTail(&mStub), mDepth(0), mClosed(false),
+      mWakeEvent(::CreateEventW(/*lpEventAttributes*/ nullptr,
+                                /*bManualReset*/ FALSE,
+                                /*bInitialState*/ FALSE,
+                                /*lpName*/ nullptr)),
+      mSleeping(true) {
+  mStub.mNext.store(nullptr, std::memory_order_relaxed);
+  if (!mWakeEvent) {
+    Log(L"CreateEventW failed - %08lx\n", ::GetLastError());
+  }
+}
+
+ApartmentQueue::~ApartmentQueue() {
+  // Pending tasks are discarded without being run
+  while (mDepth.load(std::memory_order_acquire) > 0) {
+    if (Node *node = Pop()) {
+      mDepth.fetch_sub(1, std::memory_order_release);
+      delete node;
+    }
+  }
+  if (mWakeEvent) {
+    ::CloseHandle(mWakeEvent);
+  }
+}
+
+void ApartmentQueue::Push(Node *node) {
+  node->mNext.store(nullptr, std::memory_order_relaxed);
+  Node *prev = mHead.exchange(node, std::memory_order_acq_rel);
+  prev->mNext.store(node, std::memory_order_release);
+}
+
+// Returns nullptr if the queue is empty or a producer is in the middle of
+// Push.  The latter is temporary and Drain spins until it's done.
+ApartmentQueue::Node *ApartmentQueue::Pop() {
+  Node *tail = mTail;
+  Node *next = tail->mNext.load(std::memory_order_acquire);
+  if (tail == &mStub) {
+    if (!next) {
+      return nullptr;
+    }
+    mTail = next;
+    tail = next;
+    next = next->mNext.load(std::memory_order_acquire);
+  }
+
+  if (next) {
+    mTail = next;
+    return tail;
+  }
+
+  if (tail != mHead.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+
+  Push(&mStub);
+  next = tail->mNext.load(std::memory_order_acquire);
+  if (next) {
+    mTail = next;
+    return tail;
+  }
+  return nullptr;
+}
+
+bool ApartmentQueue::Post(std::function<void()> task) {
+  if (!mWakeEvent) {
+    return false;
+  }
+
+  Node *node = new Node;
+  node->mTask = std::move(task);
+
+  // Only the producer that makes the queue non-empty needs to wake up the
+  // consumer, and only if it's asleep.  Drain keeps running until the depth
+  // drops to zero, and a consumer about to block checks the depth after it
+  // says it's asleep, so one of the two sees the other.
+  LONG prevDepth = mDepth.fetch_add(1, std::memory_order_seq_cst);
+  // Close drains while the depth is above zero after it sets the flag, so a
+  // task counted before the flag was seen is run, and one counted after is
+  // taken back
+  if (mClosed.load(std::memory_order_seq_cst)) {
+    mDepth.fetch_sub(1, std::memory_order_release);
+    delete node;
+    return false;
+  }
+  Push(node);
+  if (prevDepth == 0 && mSleeping.load(std::memory_order_seq_cst)) {
+    ::SetEvent(mWakeEvent);
+  }
+  return true;
+}
+
+size_t ApartmentQueue::Drain() {
+  size_t count = 0;
+  while (mDepth.load(std::memory_order_acquire) > 0) {
+    Node *node = Pop();
+    if (!node) {
+      ::YieldProcessor();
+      continue;
+    }
+
+    std::function<void()> task = std::move(node->mTask);
+    delete node;
+    mDepth.fetch_sub(1, std::memory_order_release);
+
+    task();
+    ++count;
+  }
+  return count;
+}
+
+void ApartmentQueue::Close() {
+  mClosed.store(true, std::memory_order_seq_cst);
+  Drain();
+}
+
+// Dispatches every message waiting for the thread
+static size_t DispatchMessages(CallAdmission *admission) {
+  if (admission) {
+    return admission->Pump();
+  }
+  size_t count = 0;
+  MSG msg;
+  while (::PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE)) {
+    ::TranslateMessage(&msg);
+    ::DispatchMessageW(&msg);
+    ++count;
+  }
+  return count;
+}
+
+// Spins until the queue has tasks or the thread has messages.  Messages can
+// only be seen through a system call, so they're looked for every so often.
+static bool SpinForWork(ApartmentQueue &queue) {
+  uint32_t spins = 0;
+  return queue.Spinner().SpinUntil([&queue, &spins]() {
+    return queue.Depth() > 0 ||
+           (++spins % 64 == 0 &&
+            HIWORD(::GetQueueStatus(QS_SENDMESSAGE | QS_POSTMESSAGE)));
+  });
+}
+
+static thread_local ApartmentQueue *tCurrentQueue;
+
+ApartmentQueue *CurrentApartmentQueue() { return tCurrentQueue; }
+
+void ThreadMsgWaitForSingleObject(HANDLE handle, DWORD dwMilliseconds,
+                                  ApartmentQueue *queue,
+                                  CallAdmission *admission) {
+  HANDLE handles[] = {handle, queue ? queue->WakeEvent() : nullptr};
+  const DWORD numHandles = queue ? 2 : 1;
+  bool idle = false; // The last look found nothing to do
+  ApartmentQueue *previousQueue = tCurrentQueue;
+  if (queue) {
+    queue->SetSleeping(false);
+    tCurrentQueue = queue;
+  }
   for (;;) {
+    // Look without blocking first, then spin, and block only after both
+    // came up empty
+    bool block = false;
+    if (idle && queue) {
+      if (SpinForWork(*queue)) {
+        WaitCounters::Add(queue->Counters().mSpinWakes, 1);
+      } else {
+        block = queue->PrepareToSleep();
+      }
+    } else if (idle) {
+      block = true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
     DWORD status = ::MsgWaitForMultipleObjectsEx(
-        1, &handle, dwMilliseconds, QS_SENDMESSAGE | QS_POSTMESSAGE,
-        MWMO_INPUTAVAILABLE);
-    if (status == WAIT_OBJECT_0) {
-      return;
+        numHandles, handles, block ? dwMilliseconds : 0,
+        QS_SENDMESSAGE | QS_POSTMESSAGE, MWMO_INPUTAVAILABLE);
+    if (block && queue) {
+      queue->SetSleeping(false);
+      WaitCounters &counters = queue->Counters();
+      WaitCounters::Add(counters.mWakes, 1);
+      WaitCounters::Add(
+          counters.mIdleNs,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count());
     }
 
-    if (status != WAIT_OBJECT_0 + 1) {
+    if (status == WAIT_OBJECT_0) {
+      break;
+    }
+    // A look can time out with tasks in the queue, because nobody sets the
+    // event while the thread is awake
+    const bool looked = status == WAIT_TIMEOUT && !block;
+    if (!looked && status != WAIT_OBJECT_0 + numHandles &&
+        !(queue && status == WAIT_OBJECT_0 + 1)) {
       Log(L"MsgWaitForMultipleObjectsEx returned - %08lx\n", status);
-      return;
+      break;
     }
 
-    MSG msg;
-    while (::PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE)) {
-      ::TranslateMessage(&msg);
-      ::DispatchMessageW(&msg);
+    // Whichever woke us up, take everything there is in one go
+    size_t dispatched = queue ? queue->Drain() : 0;
+    if (!looked) {
+      dispatched += DispatchMessages(admission);
     }
+    if (queue) {
+      WaitCounters::Add(queue->Counters().mDispatched, dispatched);
+    }
+    idle = dispatched == 0;
+  }
+
+  if (queue) {
+    // Whoever waits on the queue next may not know to look for tasks
+    queue->SetSleeping(true);
   }
+  tCurrentQueue = previousQueue;
 }
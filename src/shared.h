@@ -1,32 +1,39 @@
 #pragma once
 
+#include "guid.h"
+#include "log.h"
+#include "waitengine.h"
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <windows.h>
 
-// {16C324E8-4B82-4648-81A0-E76E3639005E}
-const GUID kCLSID_ExtZ_InProc_STA = {
-    0x16c324e8,
-    0x4b82,
-    0x4648,
-    {0x81, 0xa0, 0xe7, 0x6e, 0x36, 0x39, 0x0, 0x5e}};
-
-// {766F63F7-E338-4CC4-99C3-19428426E912}
-const GUID kCLSID_ExtZ_InProc_STA_Legacy = {
-    0x766f63f7,
-    0xe338,
-    0x4cc4,
-    {0x99, 0xc3, 0x19, 0x42, 0x84, 0x26, 0xe9, 0x12}};
-
-// {8C88319B-6BE3-4D7C-8101-93E50DAF96AE}
-const GUID kCLSID_ExtZ_OutProc_STA_1 = {
-    0x8c88319b, 0x6be3, 0x4d7c, {0x81, 0x1, 0x93, 0xe5, 0xd, 0xaf, 0x96, 0xae}};
-
-// {51A5A35B-9266-4D80-9CB6-FD345FF5A0CC}
-const GUID kCLSID_ExtZ_OutProc_STA_2 = {
-    0x51a5a35b,
-    0x9266,
-    0x4d80,
-    {0x9c, 0xb6, 0xfd, 0x34, 0x5f, 0xf5, 0xa0, 0xcc}};
+constexpr GUID kCLSID_ExtZ_InProc_STA =
+    GuidFromString("{16C324E8-4B82-4648-81A0-E76E3639005E}");
+
+constexpr GUID kCLSID_ExtZ_InProc_STA_Legacy =
+    GuidFromString("{766F63F7-E338-4CC4-99C3-19428426E912}");
+
+constexpr GUID kCLSID_ExtZ_OutProc_STA_1 =
+    GuidFromString("{8C88319B-6BE3-4D7C-8101-93E50DAF96AE}");
+
+constexpr GUID kCLSID_ExtZ_OutProc_STA_2 =
+    GuidFromString("{51A5A35B-9266-4D80-9CB6-FD345FF5A0CC}");
+
+struct HandleCloser {
+  typedef HANDLE pointer;
+  void operator()(HANDLE h) {
+    if (h) {
+      ::CloseHandle(h);
+    }
+  }
+};
+
+// Number of live objects and outstanding LockServer(TRUE) calls in this
+// module.  DllCanUnloadNow succeeds only when it's zero.
+void LockModule();
+void UnlockModule();
+LONG ModuleLockCount();
 
 template <DWORD CoInit> void ComThread(const std::function<void()> &func) {
   HRESULT hr = ::CoInitializeEx(nullptr, CoInit);
@@ -38,4 +45,91 @@ template <DWORD CoInit> void ComThread(const std::function<void()> &func) {
   ::CoUninitialize();
 }
 
-void ThreadMsgWaitForSingleObject(HANDLE handle, DWORD dwMilliseconds);
+// Lock-free multi-producer single-consumer queue of tasks for an apartment.
+// Any thread can post a task, and the thread owning the apartment runs them
+// from ThreadMsgWaitForSingleObject without going through window messages.
+// A queue that threads outside the apartment keep posting to should be owned
+// by a shared_ptr, so that they can hold it after the apartment is gone.
+class ApartmentQueue : public std::enable_shared_from_this<ApartmentQueue> {
+  struct Node {
+    std::atomic<Node *> mNext;
+    std::function<void()> mTask;
+
+    // Nodes are allocated by producers and freed by the consumer on every
+    // post, so they come from SizeClassPool instead of the general heap.
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+  };
+
+  std::atomic<Node *> mHead; // Producers push here
+  Node *mTail;               // The consumer pops from here
+  Node mStub;
+  std::atomic<LONG> mDepth;
+  std::atomic<bool> mClosed;
+  HANDLE mWakeEvent;
+  // False while the consumer is awake and will find new tasks by itself, so
+  // producers don't need to set the event
+  std::atomic<bool> mSleeping;
+  AdaptiveSpinner mSpinner;
+  WaitCounters mCounters;
+
+  void Push(Node *node);
+  Node *Pop();
+
+public:
+  ApartmentQueue();
+  ~ApartmentQueue();
+
+  ApartmentQueue(const ApartmentQueue &) = delete;
+  ApartmentQueue &operator=(const ApartmentQueue &) = delete;
+
+  HANDLE WakeEvent() const { return mWakeEvent; }
+  LONG Depth() const { return mDepth.load(std::memory_order_relaxed); }
+
+  // Can be called from any thread.  Fails once the queue is closed.
+  bool Post(std::function<void()> task);
+
+  // Must be called only from the owner thread, when it stops running the
+  // apartment.  Posts fail from then on, and the tasks already posted are run
+  // now, so that nobody waits for them forever.
+  void Close();
+
+  // Must be called only from the owner thread.  Returns the number of tasks
+  // that have been run.
+  size_t Drain();
+
+  // For ThreadMsgWaitForSingleObject, on the owner thread.  PrepareToSleep
+  // says the consumer is about to block on the event, unless there are tasks
+  // after all, in which case it stays awake and returns false.
+  void SetSleeping(bool sleeping) {
+    mSleeping.store(sleeping, std::memory_order_seq_cst);
+  }
+  bool PrepareToSleep() {
+    mSleeping.store(true, std::memory_order_seq_cst);
+    if (mDepth.load(std::memory_order_seq_cst) == 0) {
+      return true;
+    }
+    mSleeping.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  AdaptiveSpinner &Spinner() { return mSpinner; }
+  WaitCounters &Counters() { return mCounters; }
+  const WaitCounters &Counters() const { return mCounters; }
+};
+
+class CallAdmission;
+
+// Waits for `handle` while dispatching the messages of the thread and the
+// tasks of `queue`.  With `admission`, the messages go through its backlog.
+// Each wakeup dispatches all the tasks and messages there are, and with a
+// queue, the thread spins on it for a while before it blocks again, as
+// `queue->Spinner()` decides, and counts what it does in
+// `queue->Counters()`.
+void ThreadMsgWaitForSingleObject(HANDLE handle, DWORD dwMilliseconds,
+                                  ApartmentQueue *queue = nullptr,
+                                  CallAdmission *admission = nullptr);
+
+// The queue that the current thread runs tasks of in
+// ThreadMsgWaitForSingleObject, or null.  Code called in an STA can post
+// work back to its apartment through it.
+ApartmentQueue *CurrentApartmentQueue();
@@ -0,0 +1,222 @@
+#include "sharedsection.h"
+
+#ifdef _WIN32
+#include <cstring>
+#include <windows.h>
+#include <winternl.h>
+#else
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+static const intptr_t kNoHandle = 0;
+
+static void CloseSection(intptr_t handle) {
+  ::CloseHandle(reinterpret_cast<HANDLE>(handle));
+}
+
+static void Unmap(uint8_t *data, uint64_t) { ::UnmapViewOfFile(data); }
+#else
+static const intptr_t kNoHandle = -1;
+
+// A section can't be resized once it's created
+static const int kSizeSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+static void CloseSection(intptr_t handle) { ::close(static_cast<int>(handle)); }
+
+static void Unmap(uint8_t *data, uint64_t size) {
+  ::munmap(data, static_cast<size_t>(size));
+}
+#endif
+
+SharedSection::SharedSection() : mHandle(kNoHandle), mData(nullptr), mSize(0) {}
+
+SharedSection::~SharedSection() {
+  if (mData) {
+    Unmap(mData, mSize);
+  }
+  if (mHandle != kNoHandle) {
+    CloseSection(mHandle);
+  }
+}
+
+std::unique_ptr<SharedSection> SharedSection::Create(uint64_t size) {
+  if (size == 0 || size > SIZE_MAX) {
+    return nullptr;
+  }
+
+  std::unique_ptr<SharedSection> section(new SharedSection);
+  section->mSize = size;
+#ifdef _WIN32
+  HANDLE mapping = ::CreateFileMappingW(
+      INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+      static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+  if (!mapping) {
+    return nullptr;
+  }
+  section->mHandle = reinterpret_cast<intptr_t>(mapping);
+  section->mData = static_cast<uint8_t *>(
+      ::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+#else
+  int fd = ::memfd_create("shared-section", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return nullptr;
+  }
+  section->mHandle = fd;
+  if (::ftruncate(fd, static_cast<off_t>(size)) != 0 ||
+      ::fcntl(fd, F_ADD_SEALS, kSizeSeals | F_SEAL_SEAL) != 0) {
+    return nullptr;
+  }
+  void *data = ::mmap(nullptr, static_cast<size_t>(size),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  section->mData = data == MAP_FAILED ? nullptr : static_cast<uint8_t *>(data);
+#endif
+  return section->mData ? std::move(section) : nullptr;
+}
+
+uint32_t SharedSection::ProcessId() {
+#ifdef _WIN32
+  return ::GetCurrentProcessId();
+#else
+  return static_cast<uint32_t>(::getpid());
+#endif
+}
+
+#ifdef _WIN32
+uint32_t SharedSection::ShareWith(uint32_t processId) const {
+  HANDLE process = ::OpenProcess(PROCESS_DUP_HANDLE, FALSE, processId);
+  if (!process) {
+    return 0;
+  }
+  // Read access is all a copy-on-write view needs
+  HANDLE duplicate = nullptr;
+  BOOL duplicated = ::DuplicateHandle(
+      ::GetCurrentProcess(), reinterpret_cast<HANDLE>(mHandle), process,
+      &duplicate, FILE_MAP_READ, FALSE, 0);
+  ::CloseHandle(process);
+  return duplicated ? static_cast<uint32_t>(
+                          reinterpret_cast<uintptr_t>(duplicate))
+                    : 0;
+}
+
+void SharedSection::Revoke(uint32_t processId, uint32_t handle) {
+  HANDLE process = ::OpenProcess(PROCESS_DUP_HANDLE, FALSE, processId);
+  if (!process) {
+    return;
+  }
+  ::DuplicateHandle(process, reinterpret_cast<HANDLE>(uintptr_t(handle)),
+                    nullptr, nullptr, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+  ::CloseHandle(process);
+}
+
+// True if `handle` is what ShareWith gives: a section with read access and
+// nothing else.  The handles this process opens for itself are of another
+// type or have more access, so a caller naming one of them can't make
+// Import close it.
+static bool IsSharedSectionHandle(HANDLE handle) {
+  PUBLIC_OBJECT_BASIC_INFORMATION basic;
+  if (::NtQueryObject(handle, ObjectBasicInformation, &basic, sizeof(basic),
+                      nullptr) < 0 ||
+      basic.GrantedAccess != FILE_MAP_READ) {
+    return false;
+  }
+
+  DWORD flags;
+  if (!::GetHandleInformation(handle, &flags) ||
+      (flags & HANDLE_FLAG_PROTECT_FROM_CLOSE)) {
+    return false;
+  }
+
+  // The name follows the structure
+  static const wchar_t kSection[] = L"Section";
+  alignas(PUBLIC_OBJECT_TYPE_INFORMATION) uint8_t buffer[256];
+  auto *type = reinterpret_cast<PUBLIC_OBJECT_TYPE_INFORMATION *>(buffer);
+  return ::NtQueryObject(handle, ObjectTypeInformation, type, sizeof(buffer),
+                         nullptr) >= 0 &&
+         type->TypeName.Length == sizeof(kSection) - sizeof(wchar_t) &&
+         memcmp(type->TypeName.Buffer, kSection, type->TypeName.Length) == 0;
+}
+#endif
+
+SectionView::SectionView()
+    : mHandle(kNoHandle), mData(nullptr), mSize(0),
+      mAccess(kSectionReadOnly) {}
+
+SectionView::~SectionView() {
+  if (mData) {
+    Unmap(mData, mSize);
+  }
+  if (mHandle != kNoHandle) {
+    CloseSection(mHandle);
+  }
+}
+
+#ifdef _WIN32
+std::unique_ptr<SectionView> SectionView::Import(uint32_t handle,
+                                                 uint64_t size,
+                                                 SectionAccess access) {
+  HANDLE section = reinterpret_cast<HANDLE>(uintptr_t(handle));
+  if (!handle || !IsSharedSectionHandle(section)) {
+    return nullptr;
+  }
+
+  // The view doesn't need the handle once it's mapped.  Closing it right
+  // away leaves no handle of this kind for another caller to name.
+  std::unique_ptr<SectionView> view(new SectionView);
+  view->mSize = size;
+  view->mAccess = access;
+  if (size > 0 && size <= SIZE_MAX) {
+    // Fails if the section is smaller than the view
+    view->mData = static_cast<uint8_t *>(::MapViewOfFile(
+        section, access == kSectionCopyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ,
+        0, 0, static_cast<SIZE_T>(size)));
+  }
+  CloseSection(reinterpret_cast<intptr_t>(section));
+  return view->mData ? std::move(view) : nullptr;
+}
+#else
+std::unique_ptr<SectionView> SectionView::Import(uint32_t processId,
+                                                 uint32_t handle,
+                                                 uint64_t size,
+                                                 SectionAccess access) {
+  if (size == 0 || size > SIZE_MAX) {
+    return nullptr;
+  }
+
+  std::unique_ptr<SectionView> view(new SectionView);
+  view->mSize = size;
+  view->mAccess = access;
+
+  // Opening the descriptor through /proc gives a new, read-only open file
+  // description, and needs the same permissions as reading the process'
+  // memory
+  std::string path = "/proc/" + std::to_string(processId) + "/fd/" +
+                     std::to_string(handle);
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  view->mHandle = fd;
+
+  // Touching a page past the end of the file would raise SIGBUS, so the size
+  // is only checked once the sender can no longer shrink the file
+  int seals = ::fcntl(fd, F_GET_SEALS);
+  struct stat info;
+  if (seals < 0 || (seals & kSizeSeals) != kSizeSeals ||
+      ::fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < size) {
+    return nullptr;
+  }
+  void *data =
+      access == kSectionCopyOnWrite
+          ? ::mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fd, 0)
+          : ::mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED,
+                   fd, 0);
+  view->mData = data == MAP_FAILED ? nullptr : static_cast<uint8_t *>(data);
+  return view->mData ? std::move(view) : nullptr;
+}
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+// Large buffers passed between processes as a handle to a section of shared
+// memory instead of a copy.  The sender creates a SharedSection and fills it,
+// then passes a handle, which fits in any call.  The receiver imports the
+// handle into a SectionView of its own, which maps the same pages without
+// copying them.
+//
+// On Windows the section is a pagefile-backed file mapping.  The sender
+// duplicates the handle into the receiver with ShareWith, so the receiver
+// never opens another process.  On Linux it's a memfd sealed against
+// resizing, which the receiver opens through the sender's process id, and
+// which can't shrink under the receiver's mapping.
+//
+// The receiver only ever gets read access to the section.  A read-only view
+// sees the sender's pages, and a copy-on-write view gets private copies of
+// the pages it writes to, so the sender's buffer is never modified.  The
+// sender must not modify the buffer while the receiver may be reading it,
+// like any buffer passed by reference.
+
+enum SectionAccess : uint32_t {
+  kSectionReadOnly,
+  kSectionCopyOnWrite,
+};
+
+class SharedSection {
+  intptr_t mHandle;
+  uint8_t *mData;
+  uint64_t mSize;
+
+  SharedSection();
+
+public:
+  // A zero-filled section of `size` bytes mapped for writing, or null
+  static std::unique_ptr<SharedSection> Create(uint64_t size);
+  ~SharedSection();
+
+  SharedSection(const SharedSection &) = delete;
+  SharedSection &operator=(const SharedSection &) = delete;
+
+  uint8_t *Data() const { return mData; }
+  uint64_t Size() const { return mSize; }
+
+  // The handle in this process, valid as long as this object is.  On Linux,
+  // it's passed with ProcessId().  Handles of both platforms fit in 32 bits.
+  uint32_t Handle() const { return static_cast<uint32_t>(mHandle); }
+  static uint32_t ProcessId();
+
+#ifdef _WIN32
+  // A read-only duplicate of the handle in process `processId`, or zero.  It
+  // belongs to that process, which must pass it to SectionView::Import once.
+  uint32_t ShareWith(uint32_t processId) const;
+
+  // Closes a handle that ShareWith gave to process `processId`, which is
+  // known not to have imported it, e.g. because the call carrying it was
+  // rejected before it ran
+  static void Revoke(uint32_t processId, uint32_t handle);
+#endif
+};
+
+class SectionView {
+  intptr_t mHandle;
+  uint8_t *mData;
+  uint64_t mSize;
+  SectionAccess mAccess;
+
+  SectionView();
+
+public:
+#ifdef _WIN32
+  // Maps the first `size` bytes of the section that `handle` refers to, as
+  // given by SharedSection::ShareWith.  Returns null without touching the
+  // handle unless it's a section with exactly the access ShareWith grants,
+  // so that a caller can't make this process close one of its own handles.
+  // Otherwise the handle is taken over and closed before this returns,
+  // also when the section is smaller than `size`.
+  static std::unique_ptr<SectionView> Import(uint32_t handle, uint64_t size,
+                                             SectionAccess access);
+#else
+  // Maps the first `size` bytes of the section that `handle` refers to in
+  // process `processId`, which may be this one.  Null if the handle can't be
+  // opened, if the section isn't sealed against resizing, or if it's smaller
+  // than `size`.
+  static std::unique_ptr<SectionView> Import(uint32_t processId,
+                                             uint32_t handle, uint64_t size,
+                                             SectionAccess access);
+#endif
+  ~SectionView();
+
+  SectionView(const SectionView &) = delete;
+  SectionView &operator=(const SectionView &) = delete;
+
+  const uint8_t *Data() const { return mData; }
+  uint64_t Size() const { return mSize; }
+
+  // Writable only through a copy-on-write view, and null otherwise
+  uint8_t *MutableData() const {
+    return mAccess == kSectionCopyOnWrite ? mData : nullptr;
+  }
+};
@@ -0,0 +1,508 @@
+#include "shmchannel.h"
+#include "codec.h"
+#include "interfaces.h"
+#include "log.h"
+#include "shared.h"
+#include <atlbase.h>
+#include <cstddef>
+#include <strsafe.h>
+
+constexpr int kSpinCount = 4000;
+
+// The parameter lists of interfaces.idl
+using TestNumbersCodec =
+    MethodCodec<In<long>, InPtr<long>, Out<int>, InOut<unsigned long>,
+                Out<unsigned int>>;
+using TestWideStringsCodec = MethodCodec<InString, InOutString, OutString>;
+using TestBStringsCodec = MethodCodec<InBstr, OutBstr, InOutBstr>;
+
+static_assert(
+    TestNumbersCodec::kMatches<decltype(&IMarshalable::TestNumbers)>,
+    "TestNumbersCodec doesn't match IMarshalable::TestNumbers");
+static_assert(
+    TestWideStringsCodec::kMatches<decltype(&IMarshalable::TestWideStrings)>,
+    "TestWideStringsCodec doesn't match IMarshalable::TestWideStrings");
+static_assert(
+    TestBStringsCodec::kMatches<decltype(&IMarshalable::TestBStrings)>,
+    "TestBStringsCodec doesn't match IMarshalable::TestBStrings");
+
+static void CopyMessage(ShmMessage &dst, const ShmMessage &src) {
+  uint32_t size = src.mSize < ShmMessage::kPayloadSize
+                      ? src.mSize
+                      : ShmMessage::kPayloadSize;
+  memcpy(&dst, &src, offsetof(ShmMessage, mPayload) + size);
+}
+
+bool ShmRing::TryPush(const ShmMessage &msg) {
+  uint32_t head = mHead.load(std::memory_order_relaxed);
+  if (head - mTail.load(std::memory_order_acquire) == kSlots) {
+    return false;
+  }
+  CopyMessage(mSlots[head % kSlots], msg);
+  mHead.store(head + 1, std::memory_order_seq_cst);
+  return true;
+}
+
+bool ShmRing::TryPop(ShmMessage &msg) {
+  uint32_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail == mHead.load(std::memory_order_seq_cst)) {
+    return false;
+  }
+  CopyMessage(msg, mSlots[tail % kSlots]);
+  mTail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+ShmChannel::ShmChannel()
+    : mMapping(nullptr), mLayout(nullptr), mRequestEvent(nullptr),
+      mResponseEvent(nullptr), mPeer(nullptr) {}
+
+ShmChannel::~ShmChannel() {
+  if (mLayout) {
+    ::UnmapViewOfFile(mLayout);
+  }
+  for (HANDLE h : {mMapping, mRequestEvent, mResponseEvent, mPeer}) {
+    if (h) {
+      ::CloseHandle(h);
+    }
+  }
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Create(const std::wstring &name) {
+  std::unique_ptr<ShmChannel> channel(new ShmChannel);
+  channel->mMapping = ::CreateFileMappingW(
+      INVALID_HANDLE_VALUE, /*lpFileMappingAttributes*/ nullptr,
+      PAGE_READWRITE, /*dwMaximumSizeHigh*/ 0, sizeof(Layout), name.c_str());
+  if (!channel->mMapping || ::GetLastError() == ERROR_ALREADY_EXISTS) {
+    Log(L"CreateFileMappingW failed - %08lx\n", ::GetLastError());
+    return nullptr;
+  }
+
+  // A new section is zero-filled, which is the initial state of both rings
+  channel->mLayout = reinterpret_cast<Layout *>(::MapViewOfFile(
+      channel->mMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Layout)));
+  channel->mRequestEvent =
+      ::CreateEventW(nullptr, /*bManualReset*/ FALSE, /*bInitialState*/ FALSE,
+                     (name + L"-req").c_str());
+  channel->mResponseEvent =
+      ::CreateEventW(nullptr, /*bManualReset*/ FALSE, /*bInitialState*/ FALSE,
+                     (name + L"-rsp").c_str());
+  if (!channel->mLayout || !channel->mRequestEvent ||
+      !channel->mResponseEvent) {
+    Log(L"Failed to create a shared channel - %08lx\n", ::GetLastError());
+    return nullptr;
+  }
+  return channel;
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Open(const std::wstring &name) {
+  std::unique_ptr<ShmChannel> channel(new ShmChannel);
+  channel->mMapping =
+      ::OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+  if (!channel->mMapping) {
+    Log(L"OpenFileMappingW failed - %08lx\n", ::GetLastError());
+    return nullptr;
+  }
+
+  channel->mLayout = reinterpret_cast<Layout *>(::MapViewOfFile(
+      channel->mMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Layout)));
+  channel->mRequestEvent = ::OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE,
+                                        FALSE, (name + L"-req").c_str());
+  channel->mResponseEvent = ::OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE,
+                                         FALSE, (name + L"-rsp").c_str());
+  if (!channel->mLayout || !channel->mRequestEvent ||
+      !channel->mResponseEvent) {
+    Log(L"Failed to open a shared channel - %08lx\n", ::GetLastError());
+    return nullptr;
+  }
+  return channel;
+}
+
+bool ShmChannel::SetPeer(DWORD processId) {
+  if (mPeer) {
+    ::CloseHandle(mPeer);
+  }
+  mPeer = ::OpenProcess(SYNCHRONIZE, FALSE, processId);
+  if (!mPeer) {
+    Log(L"OpenProcess failed - %08lx\n", ::GetLastError());
+    return false;
+  }
+  return true;
+}
+
+// A full ring empties only while the peer is alive to take messages off it
+bool ShmChannel::Send(ShmRing &ring, HANDLE event,
+                      const ShmMessage &msg) const {
+  while (!ring.TryPush(msg)) {
+    if (mPeer && ::WaitForSingleObject(mPeer, 0) == WAIT_OBJECT_0) {
+      return false;
+    }
+    ::SwitchToThread();
+  }
+  if (ring.mSleeping.load(std::memory_order_seq_cst)) {
+    ::SetEvent(event);
+  }
+  return true;
+}
+
+bool ShmChannel::Receive(ShmRing &ring, HANDLE event, ShmMessage &msg) const {
+  for (int i = 0; i < kSpinCount; ++i) {
+    if (ring.TryPop(msg)) {
+      return true;
+    }
+    ::YieldProcessor();
+  }
+
+  HANDLE handles[] = {event, mPeer};
+  const DWORD numHandles = mPeer ? 2 : 1;
+  for (;;) {
+    // Announce that we're going to sleep before checking the ring for the
+    // last time.  Send checks the flag after publishing a message, so one
+    // of the two sides always sees the other.
+    ring.mSleeping.store(1, std::memory_order_seq_cst);
+    if (ring.TryPop(msg)) {
+      ring.mSleeping.store(0, std::memory_order_relaxed);
+      return true;
+    }
+
+    DWORD status = ::WaitForMultipleObjects(numHandles, handles,
+                                            /*bWaitAll*/ FALSE, INFINITE);
+    ring.mSleeping.store(0, std::memory_order_relaxed);
+    if (status != WAIT_OBJECT_0) {
+      // The peer has exited or the wait failed
+      return false;
+    }
+    if (ring.TryPop(msg)) {
+      return true;
+    }
+  }
+}
+
+bool ShmChannel::Call(ShmMessage &msg) {
+  return Send(mLayout->mRequests, mRequestEvent, msg) &&
+         Receive(mLayout->mResponses, mResponseEvent, msg);
+}
+
+bool ShmChannel::TrySend(const ShmMessage &msg) {
+  ShmRing &ring = mLayout->mRequests;
+  if (!ring.TryPush(msg)) {
+    return false;
+  }
+  if (ring.mSleeping.load(std::memory_order_seq_cst)) {
+    ::SetEvent(mRequestEvent);
+  }
+  return true;
+}
+
+bool ShmChannel::Receive(ShmMessage &msg, bool wait) {
+  return wait ? Receive(mLayout->mResponses, mResponseEvent, msg)
+              : mLayout->mResponses.TryPop(msg);
+}
+
+void ShmChannel::Close() {
+  ShmMessage msg;
+  msg.mMethod = kShmClose;
+  msg.mSize = 0;
+  Send(mLayout->mRequests, mRequestEvent, msg);
+}
+
+void ShmChannel::Serve(const std::function<void(ShmMessage &)> &handler) {
+  ShmMessage msg;
+  while (Receive(mLayout->mRequests, mRequestEvent, msg)) {
+    if (msg.mMethod == kShmClose) {
+      break;
+    }
+    handler(msg);
+    if (!Send(mLayout->mResponses, mResponseEvent, msg)) {
+      break;
+    }
+  }
+}
+
+// The response overwrites the request in `msg`
+template <typename Codec, typename Method>
+static void ServeCall(ShmMessage &msg, IMarshalable *object, Method method) {
+  CodecReader request(msg.mPayload, msg.mSize);
+  CodecWriter response(msg.mPayload, sizeof(msg.mPayload));
+  HRESULT hr = E_FAIL;
+  msg.mResult = Codec::Dispatch(request, response, object, method, hr)
+                    ? hr
+                    : RPC_X_BAD_STUB_DATA;
+  msg.mSize = static_cast<uint32_t>(response.Size());
+}
+
+static void ServeRequest(ShmMessage &msg, IMarshalable *object) {
+  switch (msg.mMethod) {
+  case kShmTestNumbers:
+    ServeCall<TestNumbersCodec>(msg, object, &IMarshalable::TestNumbers);
+    break;
+  case kShmTestWideStrings:
+    ServeCall<TestWideStringsCodec>(msg, object,
+                                    &IMarshalable::TestWideStrings);
+    break;
+  case kShmTestBStrings:
+    ServeCall<TestBStringsCodec>(msg, object, &IMarshalable::TestBStrings);
+    break;
+  default:
+    msg.mResult = E_NOTIMPL;
+    msg.mSize = 0;
+    break;
+  }
+}
+
+std::wstring ShmChannelName(DWORD processId, uint32_t sequence) {
+  wchar_t name[64];
+  ::StringCbPrintfW(name, sizeof(name), L"Local\\COMShm-%lu-%lu", processId,
+                    static_cast<unsigned long>(sequence));
+  return name;
+}
+
+bool IsShmChannelName(const wchar_t *name, DWORD processId) {
+  // Built back from the number, so nothing but the digits can vary
+  std::wstring prefix = ShmChannelName(processId, 0);
+  prefix.pop_back();
+  if (wcsncmp(name, prefix.c_str(), prefix.size()) != 0) {
+    return false;
+  }
+  const wchar_t *digits = name + prefix.size();
+  if (*digits < L'0' || *digits > L'9') {
+    return false;
+  }
+  unsigned long sequence = wcstoul(digits, nullptr, 10);
+  return sequence <= UINT32_MAX &&
+         ShmChannelName(processId, static_cast<uint32_t>(sequence)) == name;
+}
+
+// A call on its way through the apartment.  The serving thread gives up on
+// it if the client exits first, so the task owns it, not the thread.
+struct PostedCall {
+  ShmMessage mMessage;
+  std::unique_ptr<HANDLE, HandleCloser> mDone;
+};
+
+void ServeMarshalable(ShmChannel &channel, IMarshalable *object,
+                      std::shared_ptr<ApartmentQueue> apartment) {
+  if (!apartment) {
+    channel.Serve([object](ShmMessage &msg) { ServeRequest(msg, object); });
+    return;
+  }
+
+  auto call = std::make_shared<PostedCall>();
+  call->mDone.reset(::CreateEventW(
+      /*lpEventAttributes*/ nullptr,
+      /*bManualReset*/ FALSE,
+      /*bInitialState*/ FALSE,
+      /*lpName*/ nullptr));
+  if (!call->mDone) {
+    Log(L"CreateEventW failed - %08lx\n", ::GetLastError());
+  }
+  HANDLE handles[] = {call->mDone.get(), channel.Peer()};
+  const DWORD numHandles = channel.Peer() ? 2 : 1;
+  bool abandoned = false;
+  channel.Serve([object, &apartment, &call, &handles, numHandles,
+                 &abandoned](ShmMessage &msg) {
+    if (abandoned || !call->mDone) {
+      msg.mResult = abandoned ? RPC_E_DISCONNECTED : E_OUTOFMEMORY;
+      msg.mSize = 0;
+      return;
+    }
+    CopyMessage(call->mMessage, msg);
+    // The task holds the object too, for a call that outlives the channel
+    CComPtr<IMarshalable> target(object);
+    if (!apartment->Post([call, target]() {
+          ServeRequest(call->mMessage, target);
+          ::SetEvent(call->mDone.get());
+        })) {
+      msg.mResult = RPC_E_DISCONNECTED;
+      msg.mSize = 0;
+      return;
+    }
+    if (::WaitForMultipleObjects(numHandles, handles, /*bWaitAll*/ FALSE,
+                                 INFINITE) != WAIT_OBJECT_0) {
+      // The client is gone, and the call may still run after this returns
+      abandoned = true;
+      msg.mResult = RPC_E_DISCONNECTED;
+      msg.mSize = 0;
+      return;
+    }
+    CopyMessage(msg, call->mMessage);
+  });
+}
+
+ShmMarshalable::~ShmMarshalable() { Disconnect(); }
+
+void ShmMarshalable::Disconnect() {
+  if (mPipeline) {
+    // The server answers every request before it sees the close, which it
+    // can't do while its responses fill up the ring
+    mPipeline->Drain();
+    mPipeline.reset();
+  }
+  if (mChannel) {
+    mChannel->Close();
+    mChannel.reset();
+  }
+}
+
+HRESULT ShmMarshalable::Connect(IUnknown *object) {
+  CComQIPtr<ISharedChannel> shared(object);
+  if (!shared) {
+    return E_NOINTERFACE;
+  }
+
+  static std::atomic<uint32_t> sequence(0);
+  std::wstring name = ShmChannelName(::GetCurrentProcessId(), ++sequence);
+
+  std::unique_ptr<ShmChannel> channel = ShmChannel::Create(name);
+  if (!channel) {
+    return E_FAIL;
+  }
+
+  CComBSTR nameBstr(name.c_str());
+  unsigned long serverProcessId = 0;
+  HRESULT hr =
+      shared->OpenChannel(nameBstr, ::GetCurrentProcessId(), &serverProcessId);
+  if (FAILED(hr)) {
+    Log(L"OpenChannel failed - %08lx\n", hr);
+    return hr;
+  }
+  if (!channel->SetPeer(serverProcessId)) {
+    channel->Close();
+    return E_FAIL;
+  }
+
+  Disconnect();
+  mChannel = std::move(channel);
+  mPipeline.reset(new ShmPipeline(*mChannel, ShmRing::kSlots));
+  return S_OK;
+}
+
+template <typename Codec, typename... Args>
+HRESULT ShmMarshalable::BeginCall(ShmCall &call, ShmMethod method,
+                                  Args... args) {
+  if (!mPipeline) {
+    return E_UNEXPECTED;
+  }
+
+  ShmMessage &msg = mPipeline->NextRequest();
+  msg.mMethod = method;
+  CodecWriter request(msg.mPayload, sizeof(msg.mPayload));
+  if (!Codec::EncodeRequest(request, args...)) {
+    return HRESULT_FROM_WIN32(ERROR_BUFFER_OVERFLOW);
+  }
+  msg.mSize = static_cast<uint32_t>(request.Size());
+  call = mPipeline->Begin();
+  return S_OK;
+}
+
+template <typename Codec, typename... Args>
+HRESULT ShmMarshalable::FinishCall(ShmCall &call, Args... args) {
+  if (!mPipeline || !call.Valid()) {
+    return E_UNEXPECTED;
+  }
+
+  // Null for a call begun before the last Connect, too
+  const ShmMessage *msg = mPipeline->Wait(call);
+  HRESULT hr;
+  if (!msg) {
+    hr = RPC_E_DISCONNECTED;
+  } else if (FAILED(msg->mResult)) {
+    // [out] parameters are only valid when the call succeeds
+    hr = msg->mResult;
+  } else {
+    CodecReader response(msg->mPayload, msg->mSize);
+    hr = Codec::DecodeResponse(response, args...) ? msg->mResult
+                                                  : RPC_X_BAD_STUB_DATA;
+  }
+  mPipeline->Finish(call);
+  return hr;
+}
+
+template <typename Codec, typename... Args>
+HRESULT ShmMarshalable::Call(ShmMethod method, Args... args) {
+  ShmCall call;
+  HRESULT hr = BeginCall<Codec>(call, method, args...);
+  return SUCCEEDED(hr) ? FinishCall<Codec>(call, args...) : hr;
+}
+
+HRESULT ShmMarshalable::TestNumbers(long numberIn, long *pnumberIn,
+                                    int *numberOut, unsigned long *numberInOut,
+                                    unsigned int *numberRetval) {
+  if (!pnumberIn || !numberOut || !numberInOut || !numberRetval) {
+    return E_POINTER;
+  }
+  return Call<TestNumbersCodec>(kShmTestNumbers, numberIn, pnumberIn,
+                                numberOut, numberInOut, numberRetval);
+}
+
+HRESULT ShmMarshalable::TestWideStrings(wchar_t *strIn, wchar_t *strInOut,
+                                        wchar_t **strOut) {
+  if (!strIn || !strInOut || !strOut) {
+    return E_POINTER;
+  }
+  return Call<TestWideStringsCodec>(kShmTestWideStrings, strIn, strInOut,
+                                    strOut);
+}
+
+HRESULT ShmMarshalable::TestBStrings(BSTR strIn, BSTR *strOut,
+                                     BSTR *strInOut) {
+  if (!strOut || !strInOut) {
+    return E_POINTER;
+  }
+  return Call<TestBStringsCodec>(kShmTestBStrings, strIn, strOut, strInOut);
+}
+
+HRESULT ShmMarshalable::Begin_TestNumbers(ShmCall &call, long numberIn,
+                                          long *pnumberIn,
+                                          unsigned long *numberInOut) {
+  if (!pnumberIn || !numberInOut) {
+    return E_POINTER;
+  }
+  return BeginCall<TestNumbersCodec>(call, kShmTestNumbers, numberIn,
+                                     pnumberIn, nullptr, numberInOut, nullptr);
+}
+
+HRESULT ShmMarshalable::Finish_TestNumbers(ShmCall &call, int *numberOut,
+                                           unsigned long *numberInOut,
+                                           unsigned int *numberRetval) {
+  if (!numberOut || !numberInOut || !numberRetval) {
+    return E_POINTER;
+  }
+  return FinishCall<TestNumbersCodec>(call, 0, nullptr, numberOut,
+                                      numberInOut, numberRetval);
+}
+
+HRESULT ShmMarshalable::Begin_TestWideStrings(ShmCall &call, wchar_t *strIn,
+                                              wchar_t *strInOut) {
+  if (!strIn || !strInOut) {
+    return E_POINTER;
+  }
+  return BeginCall<TestWideStringsCodec>(call, kShmTestWideStrings, strIn,
+                                         strInOut, nullptr);
+}
+
+HRESULT ShmMarshalable::Finish_TestWideStrings(ShmCall &call,
+                                               wchar_t *strInOut,
+                                               wchar_t **strOut) {
+  if (!strInOut || !strOut) {
+    return E_POINTER;
+  }
+  return FinishCall<TestWideStringsCodec>(call, nullptr, strInOut, strOut);
+}
+
+HRESULT ShmMarshalable::Begin_TestBStrings(ShmCall &call, BSTR strIn,
+                                           BSTR *strInOut) {
+  if (!strInOut) {
+    return E_POINTER;
+  }
+  return BeginCall<TestBStringsCodec>(call, kShmTestBStrings, strIn, nullptr,
+                                      strInOut);
+}
+
+HRESULT ShmMarshalable::Finish_TestBStrings(ShmCall &call, BSTR *strOut,
+                                            BSTR *strInOut) {
+  if (!strOut || !strInOut) {
+    return E_POINTER;
+  }
+  return FinishCall<TestBStringsCodec>(call, nullptr, strOut, strInOut);
+}
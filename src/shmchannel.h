@@ -0,0 +1,170 @@
+#pragma once
+
+#include "callpipeline.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <windows.h>
+
+struct IMarshalable;
+
+enum ShmMethod : uint32_t {
+  kShmClose = 0,
+  kShmTestNumbers = 1,
+  kShmTestWideStrings = 2,
+  kShmTestBStrings = 3,
+};
+
+// Arguments and results are encoded in mPayload by the codecs in codec.h.
+// Only the used part of the payload is copied in and out of a ring.
+struct ShmMessage {
+  static constexpr uint32_t kPayloadSize = 496;
+
+  uint32_t mMethod;
+  int32_t mResult;
+  uint32_t mSize;     // Bytes used in mPayload
+  uint32_t mSequence; // Set by the client and echoed by the server
+  uint8_t mPayload[kPayloadSize];
+};
+
+// Single-producer single-consumer ring of fixed-size messages.  It lives in
+// a section shared by two processes, so it must not contain pointers.
+struct ShmRing {
+  static constexpr uint32_t kSlots = 64;
+
+  alignas(64) std::atomic<uint32_t> mHead; // Written by the producer
+  alignas(64) std::atomic<uint32_t> mTail; // Written by the consumer
+  alignas(64) std::atomic<uint32_t> mSleeping; // The consumer is blocked
+  ShmMessage mSlots[kSlots];
+
+  bool TryPush(const ShmMessage &msg);
+  bool TryPop(ShmMessage &msg);
+};
+
+// A pair of rings between a client and the object it talks to.  Both sides
+// spin briefly before blocking on an event, and the event is signaled only
+// when the other side is actually blocked.
+class ShmChannel {
+  struct Layout {
+    ShmRing mRequests;
+    ShmRing mResponses;
+  };
+
+  HANDLE mMapping;
+  Layout *mLayout;
+  HANDLE mRequestEvent;
+  HANDLE mResponseEvent;
+  HANDLE mPeer;
+
+  ShmChannel();
+  bool Send(ShmRing &ring, HANDLE event, const ShmMessage &msg) const;
+  bool Receive(ShmRing &ring, HANDLE event, ShmMessage &msg) const;
+
+public:
+  using Message = ShmMessage;
+
+  static std::unique_ptr<ShmChannel> Create(const std::wstring &name);
+  static std::unique_ptr<ShmChannel> Open(const std::wstring &name);
+  ~ShmChannel();
+
+  ShmChannel(const ShmChannel &) = delete;
+  ShmChannel &operator=(const ShmChannel &) = delete;
+
+  // Stop waiting when the process at the other end exits
+  bool SetPeer(DWORD processId);
+  // Signaled when the peer exits, or null if there is none
+  HANDLE Peer() const { return mPeer; }
+
+  // Client side: sends a request and overwrites `msg` with the response
+  bool Call(ShmMessage &msg);
+
+  // Client side, for pipelined calls: queues a request unless the ring is
+  // full, and takes the next response if there is one or `wait` is true.
+  // Receive returns false without `wait` if there is no response yet, and
+  // with it if the server has exited.
+  bool TrySend(const ShmMessage &msg);
+  bool Receive(ShmMessage &msg, bool wait);
+
+  // Client side: tells the server to stop serving this channel
+  void Close();
+
+  // Server side: runs `handler` for each request until the client closes
+  // the channel or exits
+  void Serve(const std::function<void(ShmMessage &)> &handler);
+};
+
+// Name of the section of channel `sequence` created by process `processId`.
+// Servers only open names of this form for the client they serve.
+std::wstring ShmChannelName(DWORD processId, uint32_t sequence);
+// True if `name` is ShmChannelName(processId, n) for some n
+bool IsShmChannelName(const wchar_t *name, DWORD processId);
+
+class ApartmentQueue;
+
+// Serves IMarshalable calls arriving on `channel` by calling `object`.  With
+// `apartment`, each call is posted to it and made on its thread, which is
+// where an STA object must be called, while the serving thread waits for it
+// or for the client to exit.  Once the apartment is closed, the calls fail
+// with RPC_E_DISCONNECTED.  Without an apartment, the calls are made on the
+// serving thread, which must be in the apartment of `object`.
+void ServeMarshalable(ShmChannel &channel, IMarshalable *object,
+                      std::shared_ptr<ApartmentQueue> apartment = nullptr);
+
+using ShmPipeline = CallPipeline<ShmChannel>;
+using ShmCall = ShmPipeline::Future;
+
+// Opt-in client of the shared-memory transport.  Calls made through this
+// object bypass the RPC channel of the proxy it was connected with.
+//
+// Besides the blocking methods, each method has an asynchronous pair in the
+// style of the AsyncIMarshalable that MIDL generates for [async_uuid]:
+// Begin_ takes the [in] and [in, out] parameters and returns as soon as the
+// request is queued, and Finish_ waits for the response and fills in the
+// [out] and [in, out] parameters.  Any number of calls can be outstanding,
+// they can be finished in any order, and blocking calls can be made in
+// between.  A call that is never finished is abandoned by Connect or by the
+// destructor.  Pointers passed to Begin_ aren't kept.
+class ShmMarshalable {
+  std::unique_ptr<ShmChannel> mChannel;
+  std::unique_ptr<ShmPipeline> mPipeline;
+
+  void Disconnect();
+
+public:
+  ShmMarshalable() = default;
+  ~ShmMarshalable();
+
+  HRESULT Connect(IUnknown *object);
+
+  // Calls begun and not finished
+  size_t Outstanding() const {
+    return mPipeline ? mPipeline->Outstanding() : 0;
+  }
+
+  HRESULT TestNumbers(long numberIn, long *pnumberIn, int *numberOut,
+                      unsigned long *numberInOut, unsigned int *numberRetval);
+  HRESULT TestWideStrings(wchar_t *strIn, wchar_t *strInOut, wchar_t **strOut);
+  HRESULT TestBStrings(BSTR strIn, BSTR *strOut, BSTR *strInOut);
+
+  HRESULT Begin_TestNumbers(ShmCall &call, long numberIn, long *pnumberIn,
+                            unsigned long *numberInOut);
+  HRESULT Finish_TestNumbers(ShmCall &call, int *numberOut,
+                             unsigned long *numberInOut,
+                             unsigned int *numberRetval);
+  HRESULT Begin_TestWideStrings(ShmCall &call, wchar_t *strIn,
+                                wchar_t *strInOut);
+  HRESULT Finish_TestWideStrings(ShmCall &call, wchar_t *strInOut,
+                                 wchar_t **strOut);
+  HRESULT Begin_TestBStrings(ShmCall &call, BSTR strIn, BSTR *strInOut);
+  HRESULT Finish_TestBStrings(ShmCall &call, BSTR *strOut, BSTR *strInOut);
+
+private:
+  template <typename Codec, typename... Args>
+  HRESULT Call(ShmMethod method, Args... args);
+  template <typename Codec, typename... Args>
+  HRESULT BeginCall(ShmCall &call, ShmMethod method, Args... args);
+  template <typename Codec, typename... Args>
+  HRESULT FinishCall(ShmCall &call, Args... args);
+};
@@ -0,0 +1,322 @@
+#include "stats.h"
+#include <atomic>
+#include <cwchar>
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+static const wchar_t *const kMethodNames[] = {
+    L"TestNumbers",      L"TestWideStrings", L"TestBStrings",
+    L"TestNumbersBatch", L"OpenChannel",     L"Read",
+    L"Write",            L"TestBuffer",      L"TestSection",
+};
+static_assert(ARRAYSIZE(kMethodNames) == kStatMethodCount,
+              "Every StatMethod needs a name");
+
+const wchar_t *StatMethodName(uint32_t method) {
+  return method < kStatMethodCount ? kMethodNames[method] : L"?";
+}
+
+static int FloorLog2(uint64_t value) {
+  int log = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    if (value >> shift) {
+      value >>= shift;
+      log += shift;
+    }
+  }
+  return log;
+}
+
+int LatencyHistogram::BucketOf(uint64_t ns) {
+  if (ns < kSubBuckets) {
+    return static_cast<int>(ns);
+  }
+  int log = FloorLog2(ns);
+  if (log >= kValueBits) {
+    return kBuckets - 1;
+  }
+  int shift = log - kSubBucketBits;
+  return (shift + 1) * kSubBuckets +
+         static_cast<int>((ns >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::BucketLowerBound(int bucket) {
+  int group = bucket / kSubBuckets;
+  uint64_t sub = bucket % kSubBuckets;
+  return group == 0 ? sub : (kSubBuckets + sub) << (group - 1);
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(int bucket) {
+  return bucket >= kBuckets - 1 ? UINT64_MAX
+                                : BucketLowerBound(bucket + 1) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns) {
+  ++mCounts[BucketOf(ns)];
+  ++mTotal;
+  mSumNs += ns;
+  if (ns > mMaxNs) {
+    mMaxNs = ns;
+  }
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (int i = 0; i < kBuckets; ++i) {
+    mCounts[i] += other.mCounts[i];
+  }
+  mTotal += other.mTotal;
+  mSumNs += other.mSumNs;
+  if (other.mMaxNs > mMaxNs) {
+    mMaxNs = other.mMaxNs;
+  }
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (!mTotal) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(p * mTotal + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += mCounts[i];
+    if (seen >= rank) {
+      uint64_t upper = BucketUpperBound(i);
+      return upper < mMaxNs ? upper : mMaxNs;
+    }
+  }
+  return mMaxNs;
+}
+
+static void Bump(std::atomic<uint64_t> &counter, uint64_t delta = 1) {
+  // Only the owner thread writes, so no interlocked operation is needed
+  counter.store(counter.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+}
+
+// Storage of one thread, laid out like LatencyHistogram but with atomics so
+// that a snapshot can read it while the owner writes
+struct StatsThreadSlot {
+  std::atomic<uint64_t> mCounts[kStatMethodCount][LatencyHistogram::kBuckets];
+  std::atomic<uint64_t> mSumNs[kStatMethodCount];
+  std::atomic<uint64_t> mMaxNs[kStatMethodCount];
+  std::atomic<bool> mInUse;
+  int32_t mApartment; // Guarded by gSlotsLock
+  DWORD mThreadId;    // Guarded by gSlotsLock
+  StatsThreadSlot *mNextSlot;
+
+  void Record(StatMethod method, uint64_t ns) {
+    Bump(mCounts[method][LatencyHistogram::BucketOf(ns)]);
+    Bump(mSumNs[method], ns);
+    if (ns > mMaxNs[method].load(std::memory_order_relaxed)) {
+      mMaxNs[method].store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  void CopyTo(uint32_t method, LatencyHistogram &histogram) const {
+    for (int i = 0; i < LatencyHistogram::kBuckets; ++i) {
+      histogram.mCounts[i] = mCounts[method][i].load(std::memory_order_relaxed);
+      histogram.mTotal += histogram.mCounts[i];
+    }
+    histogram.mSumNs = mSumNs[method].load(std::memory_order_relaxed);
+    histogram.mMaxNs = mMaxNs[method].load(std::memory_order_relaxed);
+  }
+
+  void Clear() {
+    for (uint32_t method = 0; method < kStatMethodCount; ++method) {
+      for (auto &count : mCounts[method]) {
+        count.store(0, std::memory_order_relaxed);
+      }
+      mSumNs[method].store(0, std::memory_order_relaxed);
+      mMaxNs[method].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+static int32_t CurrentApartment() {
+  APTTYPE type;
+  APTTYPEQUALIFIER qualifier;
+  return SUCCEEDED(::CoGetApartmentType(&type, &qualifier))
+             ? static_cast<int32_t>(type)
+             : kStatsNoApartment;
+}
+
+static bool IsSta(int32_t apartment) {
+  return apartment == APTTYPE_STA || apartment == APTTYPE_MAINSTA;
+}
+
+// Slots are never destroyed.  When a thread exits, its slot is released and
+// adopted by the next thread in the same kind of apartment, so the history of
+// RPC worker threads coming and going isn't lost.
+static std::mutex gSlotsLock;
+static StatsThreadSlot *gSlots = nullptr;
+
+static StatsThreadSlot *AcquireSlot() {
+  int32_t apartment = CurrentApartment();
+  std::lock_guard<std::mutex> lock(gSlotsLock);
+  for (StatsThreadSlot *slot = gSlots; slot; slot = slot->mNextSlot) {
+    if (!slot->mInUse.load(std::memory_order_relaxed) &&
+        slot->mApartment == apartment) {
+      slot->mInUse.store(true, std::memory_order_relaxed);
+      slot->mThreadId = ::GetCurrentThreadId();
+      return slot;
+    }
+  }
+
+  StatsThreadSlot *slot = new (std::nothrow) StatsThreadSlot{};
+  if (slot) {
+    slot->mInUse.store(true, std::memory_order_relaxed);
+    slot->mApartment = apartment;
+    slot->mThreadId = ::GetCurrentThreadId();
+    slot->mNextSlot = gSlots;
+    gSlots = slot;
+  }
+  return slot;
+}
+
+struct StatsSlotHolder {
+  StatsThreadSlot *mSlot;
+
+  StatsSlotHolder() : mSlot(AcquireSlot()) {}
+  ~StatsSlotHolder() {
+    if (mSlot) {
+      std::lock_guard<std::mutex> lock(gSlotsLock);
+      mSlot->mInUse.store(false, std::memory_order_relaxed);
+      mSlot = nullptr;
+    }
+  }
+};
+
+static thread_local StatsSlotHolder tSlot;
+
+void RecordMethodCall(StatMethod method, uint64_t ns) {
+  if (StatsThreadSlot *slot = tSlot.mSlot) {
+    slot->Record(method, ns);
+  }
+}
+
+static thread_local std::atomic<LONG> *tCallCounter;
+
+void SetThreadCallCounter(std::atomic<LONG> *counter) {
+  tCallCounter = counter;
+}
+
+std::atomic<LONG> *ThreadCallCounter() { return tCallCounter; }
+
+static void AddRow(StatsSnapshot &snapshot, int32_t apartment, DWORD threadId,
+                   uint32_t method, const LatencyHistogram &histogram) {
+  if (!histogram.mTotal) {
+    return;
+  }
+  if (snapshot.mRowCount == StatsSnapshot::kMaxRows) {
+    snapshot.mTruncated = 1;
+    return;
+  }
+
+  StatsRow &row = snapshot.mRows[snapshot.mRowCount++];
+  row = {};
+  row.mApartment = apartment;
+  row.mThreadId = threadId;
+  row.mMethod = method;
+  row.mCalls = histogram.mTotal;
+  row.mMeanNs = histogram.mSumNs / histogram.mTotal;
+  row.mP50Ns = histogram.Percentile(0.5);
+  row.mP90Ns = histogram.Percentile(0.9);
+  row.mP99Ns = histogram.Percentile(0.99);
+  row.mP999Ns = histogram.Percentile(0.999);
+  row.mMaxNs = histogram.mMaxNs;
+}
+
+void TakeStatsSnapshot(StatsSnapshot &snapshot) {
+  using Histograms = std::vector<LatencyHistogram>;
+  std::map<std::pair<int32_t, DWORD>, Histograms> apartments;
+  Histograms all(kStatMethodCount);
+
+  {
+    std::lock_guard<std::mutex> lock(gSlotsLock);
+    for (StatsThreadSlot *slot = gSlots; slot; slot = slot->mNextSlot) {
+      DWORD threadId = IsSta(slot->mApartment) ? slot->mThreadId : 0;
+      Histograms &merged = apartments[{slot->mApartment, threadId}];
+      merged.resize(kStatMethodCount);
+      for (uint32_t method = 0; method < kStatMethodCount; ++method) {
+        LatencyHistogram histogram = {};
+        slot->CopyTo(method, histogram);
+        merged[method].Merge(histogram);
+        all[method].Merge(histogram);
+      }
+    }
+  }
+
+  snapshot.mProcessId = ::GetCurrentProcessId();
+  snapshot.mRowCount = 0;
+  snapshot.mTruncated = 0;
+  for (uint32_t method = 0; method < kStatMethodCount; ++method) {
+    AddRow(snapshot, kStatsAllApartments, 0, method, all[method]);
+  }
+  for (const auto &apartment : apartments) {
+    for (uint32_t method = 0; method < kStatMethodCount; ++method) {
+      AddRow(snapshot, apartment.first.first, apartment.first.second, method,
+             apartment.second[method]);
+    }
+  }
+}
+
+static const wchar_t *ApartmentName(int32_t apartment) {
+  switch (apartment) {
+  case kStatsAllApartments:
+    return L"All";
+  case kStatsNoApartment:
+    return L"None";
+  case APTTYPE_STA:
+    return L"STA";
+  case APTTYPE_MTA:
+    return L"MTA";
+  case APTTYPE_NA:
+    return L"NA";
+  case APTTYPE_MAINSTA:
+    return L"MainSTA";
+  default:
+    return L"?";
+  }
+}
+
+std::wstring FormatStatsSnapshot(const StatsSnapshot &snapshot) {
+  wchar_t line[256];
+  swprintf(line, ARRAYSIZE(line), L"Process %u, latencies in ns\n",
+           snapshot.mProcessId);
+  std::wstring text(line);
+  swprintf(line, ARRAYSIZE(line),
+           L"%-8ls %6ls %-20ls %10ls %9ls %9ls %9ls %9ls %9ls %9ls\n", L"Apt",
+           L"Thread", L"Method", L"Calls", L"Mean", L"p50", L"p90", L"p99",
+           L"p99.9", L"Max");
+  text += line;
+
+  uint32_t count = snapshot.mRowCount < StatsSnapshot::kMaxRows
+                       ? snapshot.mRowCount
+                       : StatsSnapshot::kMaxRows;
+  for (uint32_t i = 0; i < count; ++i) {
+    const StatsRow &row = snapshot.mRows[i];
+    swprintf(line, ARRAYSIZE(line),
+             L"%-8ls %6x %-20ls %10llu %9llu %9llu %9llu %9llu %9llu %9llu\n",
+             ApartmentName(row.mApartment), row.mThreadId,
+             StatMethodName(row.mMethod), row.mCalls, row.mMeanNs, row.mP50Ns,
+             row.mP90Ns, row.mP99Ns, row.mP999Ns, row.mMaxNs);
+    text += line;
+  }
+  if (snapshot.mTruncated) {
+    text += L"(more rows didn't fit)\n";
+  }
+  return text;
+}
+
+void ResetStats() {
+  std::lock_guard<std::mutex> lock(gSlotsLock);
+  for (StatsThreadSlot *slot = gSlots; slot; slot = slot->mNextSlot) {
+    slot->Clear();
+  }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <windows.h>
+
+// Per-method call statistics of MainObject.  Each thread records into its
+// own storage without locks, and a snapshot sums them up per apartment.
+
+// TestNumbers_OleAuto forwards to TestNumbers and is counted as such, and
+// TestAttachedSection is counted as TestSection.
+enum StatMethod : uint32_t {
+  kStatTestNumbers,
+  kStatTestWideStrings,
+  kStatTestBStrings,
+  kStatTestNumbersBatch,
+  kStatOpenChannel,
+  kStatRead,
+  kStatWrite,
+  kStatTestBuffer,
+  kStatTestSection,
+  kStatMethodCount,
+};
+
+const wchar_t *StatMethodName(uint32_t method);
+
+// HDR-style histogram of latencies in nanoseconds.  Each power of two is
+// split into kSubBuckets linear buckets, so a value is known to within
+// 1/kSubBuckets of itself at any magnitude.
+struct LatencyHistogram {
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kValueBits = 36; // About 69 seconds.  Longer is clamped.
+  static constexpr int kBuckets =
+      (kValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+  static int BucketOf(uint64_t ns);
+  static uint64_t BucketLowerBound(int bucket);
+  static uint64_t BucketUpperBound(int bucket);
+
+  uint64_t mCounts[kBuckets];
+  uint64_t mTotal;
+  uint64_t mSumNs;
+  uint64_t mMaxNs;
+
+  void Record(uint64_t ns);
+  void Merge(const LatencyHistogram &other);
+
+  // Upper bound of the bucket containing the given fraction of the values,
+  // but never more than the maximum.  `p` is between 0 and 1.
+  uint64_t Percentile(double p) const;
+};
+
+// Adds one call to the statistics of the current thread
+void RecordMethodCall(StatMethod method, uint64_t ns);
+
+// Counter of the calls in progress on the current thread, or null to count
+// nothing, which is the default.  ApartmentPool reads it as part of the load
+// of an apartment.
+void SetThreadCallCounter(std::atomic<LONG> *counter);
+std::atomic<LONG> *ThreadCallCounter();
+
+// Measures the scope it lives in as one call of `method`, and counts it as in
+// progress meanwhile
+class MethodTimer {
+  StatMethod mMethod;
+  std::atomic<LONG> *mCounter;
+  std::chrono::steady_clock::time_point mStart;
+
+public:
+  explicit MethodTimer(StatMethod method)
+      : mMethod(method), mCounter(ThreadCallCounter()),
+        mStart(std::chrono::steady_clock::now()) {
+    if (mCounter) {
+      mCounter->fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  ~MethodTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - mStart;
+    if (mCounter) {
+      mCounter->fetch_sub(1, std::memory_order_relaxed);
+    }
+    RecordMethodCall(
+        mMethod,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+
+  MethodTimer(const MethodTimer &) = delete;
+  MethodTimer &operator=(const MethodTimer &) = delete;
+};
+
+// Values of StatsRow::mApartment besides APTTYPE
+constexpr int32_t kStatsNoApartment = -1;   // The thread didn't join COM
+constexpr int32_t kStatsAllApartments = -2; // Sum of every apartment
+
+// Summary of one method in one apartment.  Calls in an STA are reported per
+// thread, and calls in the MTA or outside COM are summed up per kind.
+struct StatsRow {
+  int32_t mApartment; // APTTYPE or one of the values above
+  uint32_t mThreadId; // Zero unless mApartment is an STA
+  uint32_t mMethod;
+  uint32_t mReserved;
+  uint64_t mCalls;
+  uint64_t mMeanNs;
+  uint64_t mP50Ns;
+  uint64_t mP90Ns;
+  uint64_t mP99Ns;
+  uint64_t mP999Ns;
+  uint64_t mMaxNs;
+};
+
+// Plain data so that it can be handed to another process through a section
+struct StatsSnapshot {
+  static constexpr uint32_t kMaxRows = 256;
+
+  uint32_t mProcessId;
+  uint32_t mRowCount;
+  uint32_t mTruncated; // Non-zero if some rows didn't fit
+  uint32_t mReserved;
+  StatsRow mRows[kMaxRows];
+};
+
+void TakeStatsSnapshot(StatsSnapshot &snapshot);
+std::wstring FormatStatsSnapshot(const StatsSnapshot &snapshot);
+
+// Forgets everything recorded so far.  For tests only; a thread recording at
+// the same time may keep part of a call.
+void ResetStats();
@@ -1,7 +1,40 @@
+#include "admission.h"
+#include "alloc.h"
+#include "apartmentpool.h"
+#include "callpipeline.h"
+#include "chunkstream.h"
+#include "coclient.h"
+#include "codec.h"
+#include "comthreadpool.h"
+#include "coro.h"
+#include "dispatch.h"
+#include "guid.h"
+#include "interfaces.h"
+#include "log.h"
+#include "marshalable.h"
 #include "regutils.h"
+#include "shared.h"
+#include "sharedsection.h"
+#include "shmchannel.h"
+#include "stats.h"
+#include "typelib.h"
+#include "waitengine.h"
 #include "gtest/gtest.h"
-
-void Log(const wchar_t *format, ...);
+#include <algorithm>
+#include <atlbase.h>
+#include <atlsafe.h>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
 
 TEST(RegUtils, ctor) {
   RegUtil reg;
@@ -89,3 +122,1180 @@ TEST(RegUtils, guid) {
     EXPECT_STREQ(actual.c_str(), testCase.mExpected);
   }
 }
+
+// The portable tests of guid.h are in portabletests.cpp.  This one checks
+// against OLE.
+TEST(Guid, Ole) {
+  std::mt19937 rng(42);
+  for (int i = 0; i < 1000; ++i) {
+    GUID guid;
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(&guid);
+    for (size_t j = 0; j < sizeof(guid); ++j) {
+      bytes[j] = static_cast<uint8_t>(rng());
+    }
+
+    wchar_t formatted[kGuidStringLength + 1];
+    FormatGuid(guid, formatted);
+
+    wchar_t ole[kGuidStringLength + 1];
+    ASSERT_EQ(::StringFromGUID2(guid, ole, ARRAYSIZE(ole)),
+              static_cast<int>(kGuidStringLength + 1));
+    EXPECT_EQ(_wcsicmp(formatted, ole), 0);
+
+    // StringFromGUID2 prints uppercase
+    GUID parsed;
+    ASSERT_TRUE(ParseGuid(ole, kGuidStringLength, parsed));
+    EXPECT_TRUE(::IsEqualGUID(parsed, guid));
+  }
+}
+
+TEST(RegUtils, memory) {
+  const wchar_t kSubkey[] = L"Software\\Classes\\CLSID\\{test}";
+
+  MemoryRegBackend hive;
+  RegUtil reg_nonexistent(hive, HKEY_CURRENT_USER, kSubkey);
+  EXPECT_FALSE(reg_nonexistent);
+
+  RegUtil reg_test(hive, HKEY_CURRENT_USER, kSubkey,
+                   /*createIfNotExist*/ true);
+  ASSERT_TRUE(reg_test);
+  EXPECT_TRUE(reg_test.SetString(nullptr, L"Default"));
+
+  RegUtil reg_child(reg_test, L"InprocServer32", /*createIfNotExist*/ true);
+  ASSERT_TRUE(reg_child);
+  EXPECT_TRUE(reg_child.SetString(L"ThreadingModel", L"Apartment"));
+
+  // Key and value names are case-insensitive like the real registry
+  RegUtil reg_upper(hive, HKEY_CURRENT_USER,
+                    L"SOFTWARE\\classes\\clsid\\{TEST}\\inprocserver32");
+  ASSERT_TRUE(reg_upper);
+  std::wstring data = reg_upper.GetString(L"threadingmodel");
+  EXPECT_STREQ(data.c_str(), L"Apartment");
+
+  // Nothing leaks into another root
+  RegUtil reg_hklm(hive, HKEY_LOCAL_MACHINE, kSubkey);
+  EXPECT_FALSE(reg_hklm);
+
+  // Commit the whole hive into another one
+  MemoryRegBackend target;
+  EXPECT_EQ(hive.Commit(target), kRegSuccess);
+  RegUtil reg_copy(target, HKEY_CURRENT_USER, kSubkey);
+  ASSERT_TRUE(reg_copy);
+  data = reg_copy.GetString(nullptr);
+  EXPECT_STREQ(data.c_str(), L"Default");
+
+  // Deleting a tree invalidates handles opened under it
+  EXPECT_EQ(hive.DeleteTree(HKEY_CURRENT_USER, kSubkey), kRegSuccess);
+  EXPECT_FALSE(reg_child.SetString(nullptr, L"x"));
+  RegUtil reg_deleted(hive, HKEY_CURRENT_USER, kSubkey);
+  EXPECT_FALSE(reg_deleted);
+  EXPECT_EQ(hive.DeleteTree(HKEY_CURRENT_USER, kSubkey), kRegNotFound);
+}
+
+TEST(ApartmentQueue, PostAndDrain) {
+  constexpr int kProducers = 4;
+  constexpr int kTasksPerProducer = 10000;
+
+  ApartmentQueue queue;
+  EXPECT_EQ(queue.Depth(), 0);
+  EXPECT_EQ(queue.Drain(), 0u);
+
+  int total = 0;
+  bool inOrder = true;
+  std::vector<int> lastSeen(kProducers, -1);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p]() {
+      for (int i = 0; i < kTasksPerProducer; ++i) {
+        queue.Post([&, p, i]() {
+          // Tasks from the same producer must run in FIFO order
+          inOrder = inOrder && lastSeen[p] + 1 == i;
+          lastSeen[p] = i;
+          ++total;
+        });
+      }
+    });
+  }
+
+  while (total < kProducers * kTasksPerProducer) {
+    ASSERT_EQ(::WaitForSingleObject(queue.WakeEvent(), 5000), WAIT_OBJECT_0);
+    queue.Drain();
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  EXPECT_TRUE(inOrder);
+  EXPECT_EQ(queue.Depth(), 0);
+  EXPECT_EQ(total, kProducers * kTasksPerProducer);
+}
+
+TEST(ApartmentQueue, SpinThenBlock) {
+  constexpr int kTasks = 1000;
+
+  for (uint32_t maxSpins : {0u, AdaptiveSpinner::kDefaultMaxSpins}) {
+    std::unique_ptr<HANDLE, HandleCloser> stop(
+        ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    ApartmentQueue queue;
+    queue.Spinner() = AdaptiveSpinner(maxSpins);
+    std::thread consumer([&]() {
+      ThreadMsgWaitForSingleObject(stop.get(), INFINITE, &queue);
+    });
+
+    std::atomic<int> ran(0);
+    for (int i = 0; i < kTasks; ++i) {
+      ASSERT_TRUE(queue.Post([&ran]() { ++ran; }));
+      if (i % 100 == 0) {
+        // Long enough for the consumer to block
+        ::Sleep(10);
+      }
+    }
+    while (ran.load() < kTasks) {
+      ::Sleep(1);
+    }
+    ::SetEvent(stop.get());
+    consumer.join();
+
+    const WaitCounters &counters = queue.Counters();
+    EXPECT_EQ(counters.mDispatched.load(), uint64_t(kTasks));
+    EXPECT_GT(counters.mWakes.load(), 0u);
+    if (!maxSpins) {
+      EXPECT_EQ(counters.mSpinWakes.load(), 0u);
+    }
+  }
+}
+
+TEST(ApartmentQueue, Close) {
+  ApartmentQueue queue;
+  int ran = 0;
+  ASSERT_TRUE(queue.Post([&ran]() { ++ran; }));
+  ASSERT_TRUE(queue.Post([&ran]() { ++ran; }));
+
+  // What was posted runs, and nothing can be posted after
+  queue.Close();
+  EXPECT_EQ(ran, 2);
+  EXPECT_FALSE(queue.Post([&ran]() { ++ran; }));
+  EXPECT_EQ(queue.Depth(), 0);
+  EXPECT_EQ(queue.Drain(), 0u);
+  EXPECT_EQ(ran, 2);
+}
+
+TEST(ShmChannel, Name) {
+  std::wstring name = ShmChannelName(1234, 7);
+  EXPECT_EQ(name, L"Local\\COMShm-1234-7");
+  EXPECT_TRUE(IsShmChannelName(name.c_str(), 1234));
+  EXPECT_FALSE(IsShmChannelName(name.c_str(), 123));
+  EXPECT_FALSE(IsShmChannelName(name.c_str(), 12345));
+  for (const wchar_t *other :
+       {L"Local\\COMShm-1234-", L"Local\\COMShm-1234-07",
+        L"Local\\COMShm-1234-7x", L"Local\\COMShm-1234--7",
+        L"Local\\COMShm-1234- 7", L"Local\\COMShm-1234-99999999999",
+        L"Global\\COMShm-1234-7", L"Local\\COMServer-a16109f3"}) {
+    EXPECT_FALSE(IsShmChannelName(other, 1234)) << other;
+  }
+}
+
+TEST(SizeClassPool, Reuse) {
+  // Run on a new thread to get a cache that nobody else is using
+  std::thread t([]() {
+    void *first = SizeClassPool::Allocate(40);
+    ASSERT_NE(first, nullptr);
+    SizeClassPool::Free(first);
+
+    SizeClassPool::Stats before = SizeClassPool::GetStats();
+    for (int i = 0; i < 1000; ++i) {
+      // Any size in the same class reuses the block just freed
+      void *p = SizeClassPool::Allocate(33 + i % 32);
+      EXPECT_EQ(p, first);
+      SizeClassPool::Free(p);
+    }
+    SizeClassPool::Stats after = SizeClassPool::GetStats();
+    EXPECT_EQ(after.mHeapAllocs, before.mHeapAllocs);
+    EXPECT_GE(after.mPoolHits - before.mPoolHits, 1000u);
+
+    void *large = SizeClassPool::Allocate(SizeClassPool::kMaxBlock + 1);
+    ASSERT_NE(large, nullptr);
+    SizeClassPool::Free(large);
+  });
+  t.join();
+}
+
+TEST(SizeClassPool, RemoteFree) {
+  std::thread t([]() {
+    void *block = SizeClassPool::Allocate(100);
+    ASSERT_NE(block, nullptr);
+    std::thread other([block]() { SizeClassPool::Free(block); });
+    other.join();
+
+    // The block freed on the other thread comes back to this thread
+    void *p = SizeClassPool::Allocate(100);
+    EXPECT_EQ(p, block);
+    SizeClassPool::Free(p);
+  });
+  t.join();
+}
+
+TEST(InstancePool, Reuse) {
+  std::thread t([]() {
+    InstancePoolStats before = GetInstancePoolStats();
+
+    // Pooling is off by default
+    IUnknown *first = CreateMarshalable();
+    ASSERT_NE(first, nullptr);
+    first->Release();
+    IUnknown *second = CreateMarshalable();
+    ASSERT_NE(second, nullptr);
+    second->Release();
+    InstancePoolStats after = GetInstancePoolStats();
+    EXPECT_EQ(after.mCreated - before.mCreated, 2u);
+    EXPECT_EQ(after.mDestroyed - before.mDestroyed, 2u);
+    EXPECT_EQ(after.mReused, before.mReused);
+
+    SetInstancePoolCap(1);
+    before = after;
+    CComPtr<IUnknown> a;
+    CComPtr<IUnknown> b;
+    a.Attach(CreateMarshalable());
+    b.Attach(CreateMarshalable());
+    IUnknown *rawA = a;
+    a.Release();
+    b.Release(); // Exceeds the cap and is destroyed
+
+    CComPtr<IUnknown> c;
+    c.Attach(CreateMarshalable());
+    EXPECT_EQ(c.p, rawA);
+
+    // A reused object hands out cookies from the start again
+    constexpr uint64_t kSize = 4096;
+    std::unique_ptr<SharedSection> section = SharedSection::Create(kSize);
+    ASSERT_TRUE(section);
+    const uint32_t self = SharedSection::ProcessId();
+    CComQIPtr<IMarshalable2> object(c);
+    unsigned long cookie = 0;
+    ASSERT_EQ(object->AttachSection(section->ShareWith(self), kSize, &cookie),
+              S_OK);
+    EXPECT_EQ(cookie, 1u);
+    object.Release();
+
+    // A pooled object keeps the module locked until the pool is emptied
+    const LONG locks = ModuleLockCount();
+    c.Release();
+    EXPECT_EQ(ModuleLockCount(), locks);
+    c.Attach(CreateMarshalable());
+    EXPECT_EQ(c.p, rawA);
+    object = c;
+    ASSERT_EQ(object->AttachSection(section->ShareWith(self), kSize, &cookie),
+              S_OK);
+    EXPECT_EQ(cookie, 1u);
+    object.Release();
+    c.Release();
+    EXPECT_EQ(ModuleLockCount(), locks);
+    EmptyInstancePool();
+    EXPECT_EQ(ModuleLockCount(), locks - 1);
+
+    after = GetInstancePoolStats();
+    EXPECT_EQ(after.mCreated - before.mCreated, 2u);
+    EXPECT_EQ(after.mReused - before.mReused, 2u);
+    EXPECT_EQ(after.mPooled - before.mPooled, 3u);
+    EXPECT_EQ(after.mDestroyed - before.mDestroyed, 2u);
+    SetInstancePoolCap(0);
+  });
+  t.join();
+}
+
+TEST(ModuleLock, Objects) {
+  LONG before = ModuleLockCount();
+
+  CComPtr<IUnknown> object;
+  object.Attach(CreateMarshalable());
+  ASSERT_TRUE(object);
+  EXPECT_EQ(ModuleLockCount(), before + 1);
+
+  object.Release();
+  EXPECT_EQ(ModuleLockCount(), before);
+}
+
+TEST(Stats, Histogram) {
+  for (int i = 0; i < LatencyHistogram::kBuckets; ++i) {
+    uint64_t lower = LatencyHistogram::BucketLowerBound(i);
+    uint64_t upper = LatencyHistogram::BucketUpperBound(i);
+    EXPECT_EQ(LatencyHistogram::BucketOf(lower), i);
+    EXPECT_LE(lower, upper);
+    if (i + 1 < LatencyHistogram::kBuckets) {
+      EXPECT_EQ(LatencyHistogram::BucketOf(upper), i);
+      // Relative error stays within one sub-bucket
+      EXPECT_LE((upper - lower) * LatencyHistogram::kSubBuckets, lower + 1);
+    }
+  }
+  EXPECT_EQ(LatencyHistogram::BucketOf(UINT64_MAX),
+            LatencyHistogram::kBuckets - 1);
+
+  std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram{});
+  for (uint64_t ns = 1; ns <= 10000; ++ns) {
+    histogram->Record(ns * 100);
+  }
+  EXPECT_EQ(histogram->mTotal, 10000u);
+  EXPECT_EQ(histogram->mMaxNs, 1000000u);
+  EXPECT_EQ(histogram->Percentile(1.0), 1000000u);
+  for (double p : {0.5, 0.9, 0.99}) {
+    double exact = p * 1000000;
+    EXPECT_GE(histogram->Percentile(p), exact);
+    EXPECT_LE(histogram->Percentile(p),
+              exact * (1 + 1.0 / LatencyHistogram::kSubBuckets));
+  }
+}
+
+static const StatsRow *FindStatsRow(const StatsSnapshot &snapshot,
+                                    int32_t apartment, DWORD threadId,
+                                    StatMethod method) {
+  for (uint32_t i = 0; i < snapshot.mRowCount; ++i) {
+    const StatsRow &row = snapshot.mRows[i];
+    if (row.mApartment == apartment && row.mThreadId == threadId &&
+        row.mMethod == method) {
+      return &row;
+    }
+  }
+  return nullptr;
+}
+
+TEST(Stats, Apartments) {
+  ResetStats();
+
+  auto call = [](int times) {
+    CComPtr<IUnknown> object;
+    object.Attach(CreateMarshalable());
+    CComQIPtr<IMarshalable> marshalable = object;
+    ASSERT_TRUE(marshalable);
+    for (int i = 0; i < times; ++i) {
+      long b = 0;
+      int c = 0;
+      unsigned long d = 0;
+      unsigned int e = 0;
+      EXPECT_EQ(marshalable->TestNumbers(0, &b, &c, &d, &e), S_OK);
+    }
+  };
+
+  DWORD staThreadId = 0;
+  std::thread sta(ComThread<COINIT_APARTMENTTHREADED>, [&]() {
+    staThreadId = ::GetCurrentThreadId();
+    call(3);
+  });
+  sta.join();
+  std::thread mta1(ComThread<COINIT_MULTITHREADED>, [&]() { call(2); });
+  mta1.join();
+  std::thread mta2(ComThread<COINIT_MULTITHREADED>, [&]() { call(4); });
+  mta2.join();
+
+  std::unique_ptr<StatsSnapshot> snapshot(new StatsSnapshot);
+  TakeStatsSnapshot(*snapshot);
+  EXPECT_EQ(snapshot->mTruncated, 0u);
+
+  // Each STA has its own row, and the MTA threads share one
+  const StatsRow *row =
+      FindStatsRow(*snapshot, APTTYPE_STA, staThreadId, kStatTestNumbers);
+  ASSERT_NE(row, nullptr);
+  EXPECT_EQ(row->mCalls, 3u);
+  row = FindStatsRow(*snapshot, APTTYPE_MTA, 0, kStatTestNumbers);
+  ASSERT_NE(row, nullptr);
+  EXPECT_EQ(row->mCalls, 6u);
+  row = FindStatsRow(*snapshot, kStatsAllApartments, 0, kStatTestNumbers);
+  ASSERT_NE(row, nullptr);
+  EXPECT_EQ(row->mCalls, 9u);
+  EXPECT_LE(row->mP50Ns, row->mP99Ns);
+  EXPECT_LE(row->mP99Ns, row->mMaxNs);
+  EXPECT_EQ(FindStatsRow(*snapshot, kStatsAllApartments, 0, kStatOpenChannel),
+            nullptr);
+
+  Log(L"%s", FormatStatsSnapshot(*snapshot).c_str());
+}
+
+TEST(ApartmentPool, Pick) {
+  ApartmentPool roundRobin(3, kActivateRoundRobin);
+  ASSERT_EQ(roundRobin.Size(), 3u);
+  for (size_t i = 0; i < 6; ++i) {
+    EXPECT_EQ(roundRobin.Pick(), i % 3);
+  }
+
+  EXPECT_EQ(ApartmentPool(0, kActivateRoundRobin).Size(), 1u);
+  EXPECT_EQ(ApartmentPool(1000, kActivateRoundRobin).Size(),
+            ApartmentPool::kMaxApartments);
+
+  // Keep the first apartment busy with one task and another one queued.
+  // The events outlive the pool, whose threads may still be using them.
+  std::unique_ptr<HANDLE, HandleCloser> started(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  std::unique_ptr<HANDLE, HandleCloser> release(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  ApartmentPool leastLoaded(3, kActivateLeastLoaded);
+  PoolApartment &busy = leastLoaded.Apartment(0);
+  ASSERT_TRUE(busy.Post([&]() {
+    ::SetEvent(started.get());
+    ::WaitForSingleObject(release.get(), INFINITE);
+  }));
+  ASSERT_EQ(::WaitForSingleObject(started.get(), 5000), WAIT_OBJECT_0);
+  ASSERT_TRUE(busy.Post([]() {}));
+  EXPECT_EQ(busy.Load(), 1);
+
+  // The idle ones still take turns, and share the turns of the busy one
+  // instead of the next one getting them all
+  size_t picks[3] = {};
+  for (int i = 0; i < 6; ++i) {
+    ++picks[leastLoaded.Pick()];
+  }
+  EXPECT_EQ(picks[0], 0u);
+  EXPECT_EQ(picks[1], 3u);
+  EXPECT_EQ(picks[2], 3u);
+  ::SetEvent(release.get());
+}
+
+TEST(RetryBackoff, Delay) {
+  RetryBackoff backoff(/*initialMs*/ 4, /*maxMs*/ 64, /*giveUpMs*/ 1000);
+  for (int i = 0; i < 100; ++i) {
+    DWORD delay = backoff.Delay(0);
+    EXPECT_GE(delay, 2u);
+    EXPECT_LE(delay, 4u);
+
+    // About as long as the call has been retried
+    delay = backoff.Delay(20);
+    EXPECT_GE(delay, 10u);
+    EXPECT_LE(delay, 20u);
+
+    delay = backoff.Delay(500);
+    EXPECT_GE(delay, 32u);
+    EXPECT_LE(delay, 64u);
+  }
+  EXPECT_EQ(backoff.Delay(1000), RetryBackoff::kGiveUp);
+}
+
+static APTTYPE CurrentApartmentType() {
+  APTTYPE type;
+  APTTYPEQUALIFIER qualifier;
+  return SUCCEEDED(::CoGetApartmentType(&type, &qualifier)) ? type
+                                                            : APTTYPE_CURRENT;
+}
+
+TEST(ComThreadPool, Submit) {
+  constexpr int kTasks = 100;
+
+  ComThreadPool pool(2, 3);
+  ASSERT_EQ(pool.StaThreads(), 2u);
+
+  std::vector<std::future<DWORD>> sta;
+  std::vector<std::future<DWORD>> mta;
+  for (int i = 0; i < kTasks; ++i) {
+    sta.push_back(pool.Submit(kApartmentSTA, []() {
+      EXPECT_EQ(CurrentApartmentType(), APTTYPE_STA);
+      return ::GetCurrentThreadId();
+    }));
+    mta.push_back(pool.Submit(kApartmentMTA, []() {
+      EXPECT_EQ(CurrentApartmentType(), APTTYPE_MTA);
+      return ::GetCurrentThreadId();
+    }));
+  }
+
+  // The tasks share the threads of the pool
+  std::set<DWORD> staThreads;
+  std::set<DWORD> mtaThreads;
+  for (int i = 0; i < kTasks; ++i) {
+    staThreads.insert(sta[i].get());
+    mtaThreads.insert(mta[i].get());
+  }
+  EXPECT_LE(staThreads.size(), 2u);
+  EXPECT_LE(mtaThreads.size(), 3u);
+  for (DWORD thread : staThreads) {
+    EXPECT_EQ(mtaThreads.count(thread), 0u);
+  }
+
+  std::future<void> done = pool.Submit(kApartmentSTA, []() {});
+  EXPECT_EQ(done.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+}
+
+struct LoopbackMessage {
+  uint32_t mSequence;
+  int mValue;
+};
+
+// Answers each request with twice its value, and holds at most mCapacity
+// requests.  It disconnects after mResponsesLeft responses.  A lazy one
+// answers only callers that wait, like a server that hasn't caught up.
+class LoopbackTransport {
+  std::deque<LoopbackMessage> mRequests;
+
+public:
+  using Message = LoopbackMessage;
+
+  size_t mCapacity = 4;
+  int mResponsesLeft = INT_MAX;
+  bool mLazy = false;
+
+  bool TrySend(const Message &request) {
+    if (mRequests.size() == mCapacity) {
+      return false;
+    }
+    mRequests.push_back(request);
+    return true;
+  }
+
+  bool Receive(Message &response, bool wait) {
+    if (mRequests.empty() || !mResponsesLeft || (mLazy && !wait)) {
+      return false;
+    }
+    response = mRequests.front();
+    response.mValue *= 2;
+    mRequests.pop_front();
+    --mResponsesLeft;
+    return true;
+  }
+};
+
+using LoopbackPipeline = CallPipeline<LoopbackTransport>;
+
+TEST(CallPipeline, ManyOutstanding) {
+  constexpr int kCalls = 300;
+
+  LoopbackTransport transport;
+  transport.mLazy = true;
+  LoopbackPipeline pipeline(transport);
+  std::vector<LoopbackPipeline::Future> futures;
+  for (int i = 0; i < kCalls; ++i) {
+    pipeline.NextRequest().mValue = i;
+    futures.push_back(pipeline.Begin());
+  }
+  EXPECT_EQ(pipeline.Outstanding(), size_t(kCalls));
+  EXPECT_FALSE(futures[0].Ready());
+
+  // Finished in any order, with one abandoned without waiting
+  std::mt19937 random(1);
+  std::shuffle(futures.begin(), futures.end(), random);
+  pipeline.Finish(futures.back());
+  futures.pop_back();
+  for (auto &future : futures) {
+    const LoopbackMessage *response = pipeline.Wait(future);
+    ASSERT_NE(response, nullptr);
+    EXPECT_TRUE(future.Ready());
+    EXPECT_EQ(response->mValue, 2 * static_cast<int>(response->mSequence));
+    pipeline.Finish(future);
+    EXPECT_FALSE(future.Valid());
+  }
+  EXPECT_EQ(pipeline.Outstanding(), 0u);
+  EXPECT_TRUE(pipeline.Drain());
+  EXPECT_FALSE(pipeline.Broken());
+
+  // A future of another pipeline
+  LoopbackTransport otherTransport;
+  LoopbackPipeline other(otherTransport);
+  other.NextRequest().mValue = 1;
+  LoopbackPipeline::Future foreign = other.Begin();
+  EXPECT_EQ(pipeline.Wait(foreign), nullptr);
+}
+
+TEST(CallPipeline, Disconnect) {
+  LoopbackTransport transport;
+  transport.mResponsesLeft = 2;
+  LoopbackPipeline pipeline(transport);
+  LoopbackPipeline::Future futures[5];
+  for (auto &future : futures) {
+    pipeline.NextRequest().mValue = 1;
+    future = pipeline.Begin();
+  }
+  EXPECT_NE(pipeline.Wait(futures[1]), nullptr);
+  EXPECT_NE(pipeline.Wait(futures[0]), nullptr);
+  EXPECT_EQ(pipeline.Wait(futures[2]), nullptr);
+  EXPECT_TRUE(pipeline.Broken());
+  EXPECT_FALSE(pipeline.Drain());
+  for (auto &future : futures) {
+    pipeline.Finish(future);
+  }
+}
+
+TEST(ChunkStream, Pattern) {
+  // Any piece of the pattern can be generated on its own
+  uint8_t whole[64];
+  FillStreamPattern(3, 5, whole, sizeof(whole));
+  for (size_t offset = 0; offset < sizeof(whole); ++offset) {
+    uint8_t part[64];
+    FillStreamPattern(3, 5 + offset, part, sizeof(whole) - offset);
+    EXPECT_EQ(std::memcmp(whole + offset, part, sizeof(whole) - offset), 0);
+  }
+  uint8_t other[64];
+  FillStreamPattern(4, 5, other, sizeof(other));
+  EXPECT_NE(std::memcmp(whole, other, sizeof(whole)), 0);
+
+  StreamChecksum checksum;
+  checksum.Update(reinterpret_cast<const uint8_t *>("Wikipedia"), 9);
+  EXPECT_EQ(checksum.Value(), 0x11e60398u);
+}
+
+TEST(ChunkStream, RoundTrip) {
+  constexpr size_t kChunkSize = 4096;
+  for (size_t window : {0, 1, 4}) {
+    for (uint64_t total : {0, 1, 4095, 4096, 100003}) {
+      // The source returns a little at a time, like a pipe
+      uint64_t produced = 0;
+      ChunkReader reader(
+          [&](uint8_t *buffer, size_t size) -> int64_t {
+            size_t count = static_cast<size_t>(
+                std::min<uint64_t>({size, 777, total - produced}));
+            FillStreamPattern(7, produced, buffer, count);
+            produced += count;
+            return count;
+          },
+          kChunkSize, window);
+
+      std::vector<uint8_t> written;
+      ChunkWriter writer(
+          [&](const uint8_t *data, size_t size) {
+            EXPECT_LE(size, kChunkSize);
+            written.insert(written.end(), data, data + size);
+            return true;
+          },
+          kChunkSize, window);
+
+      const uint8_t *data;
+      size_t size;
+      StreamChecksum checksum;
+      while (reader.Next(data, size)) {
+        EXPECT_LE(size, kChunkSize);
+        checksum.Update(data, size);
+        EXPECT_TRUE(writer.Write(data, size));
+      }
+      EXPECT_FALSE(reader.Failed());
+      EXPECT_TRUE(writer.Close());
+
+      std::vector<uint8_t> expected(static_cast<size_t>(total));
+      FillStreamPattern(7, 0, expected.data(), expected.size());
+      EXPECT_EQ(written, expected);
+      StreamChecksum expectedChecksum;
+      expectedChecksum.Update(expected.data(), expected.size());
+      EXPECT_EQ(checksum.Value(), expectedChecksum.Value());
+    }
+  }
+}
+
+TEST(ChunkStream, Failures) {
+  for (size_t window : {0, 2}) {
+    int reads = 0;
+    ChunkReader reader(
+        [&](uint8_t *, size_t size) -> int64_t {
+          return ++reads > 3 ? -1 : static_cast<int64_t>(size);
+        },
+        16, window);
+    const uint8_t *data;
+    size_t size;
+    int chunks = 0;
+    while (reader.Next(data, size)) {
+      ++chunks;
+    }
+    EXPECT_EQ(chunks, 3);
+    EXPECT_TRUE(reader.Failed());
+    EXPECT_FALSE(reader.Next(data, size));
+
+    int sends = 0;
+    ChunkWriter writer([&](const uint8_t *, size_t) { return ++sends < 2; },
+                       16, window);
+    uint8_t chunk[16] = {};
+    bool written = true;
+    for (int i = 0; i < 10 && written; ++i) {
+      written = writer.Write(chunk, sizeof(chunk));
+    }
+    EXPECT_FALSE(written);
+    EXPECT_FALSE(writer.Close());
+    EXPECT_EQ(sends, 2);
+  }
+
+  // A reader can be dropped before the end of an endless stream
+  ChunkReader endless([](uint8_t *, size_t size) -> int64_t { return size; },
+                      16, 3);
+  const uint8_t *data;
+  size_t size;
+  EXPECT_TRUE(endless.Next(data, size));
+}
+
+TEST(ChunkStream, Pipe) {
+  constexpr uint64_t kTotal = 1 << 20;
+  BytePipe pipe(1 << 16);
+  ASSERT_TRUE(pipe.Valid());
+
+  std::thread producer([&]() {
+    ChunkWriter writer(
+        [&](const uint8_t *data, size_t size) {
+          return pipe.Write(data, size);
+        },
+        1 << 14, 2);
+    uint8_t buffer[5000];
+    for (uint64_t offset = 0; offset < kTotal; offset += sizeof(buffer)) {
+      size_t size = static_cast<size_t>(
+          std::min<uint64_t>(sizeof(buffer), kTotal - offset));
+      FillStreamPattern(9, offset, buffer, size);
+      EXPECT_TRUE(writer.Write(buffer, size));
+    }
+    EXPECT_TRUE(writer.Close());
+    pipe.CloseWrite();
+  });
+
+  ChunkReader reader(
+      [&](uint8_t *buffer, size_t size) { return pipe.Read(buffer, size); },
+      1 << 14, 2);
+  const uint8_t *data;
+  size_t size;
+  uint64_t offset = 0;
+  std::vector<uint8_t> expected;
+  while (reader.Next(data, size)) {
+    expected.resize(size);
+    FillStreamPattern(9, offset, expected.data(), size);
+    EXPECT_EQ(std::memcmp(data, expected.data(), size), 0);
+    offset += size;
+  }
+  producer.join();
+  EXPECT_FALSE(reader.Failed());
+  EXPECT_EQ(offset, kTotal);
+}
+
+TEST(ChunkStream, Object) {
+  // MainObject in-process, with the transfer threads calling it directly
+  CComPtr<IUnknown> object;
+  object.Attach(CreateMarshalable());
+  CComQIPtr<IChunkedStream> stream(object);
+  ASSERT_TRUE(stream);
+
+  constexpr uint64_t kTotal = 300001;
+  ASSERT_EQ(stream->OpenRead(kTotal, 11), S_OK);
+  ASSERT_EQ(stream->OpenWrite(), S_OK);
+  {
+    ChunkReader reader(ChunkedStreamSource(stream, 1 << 12), 1 << 14, 2);
+    ChunkWriter writer(ChunkedStreamSink(stream), 1 << 13, 2);
+    const uint8_t *data;
+    size_t size;
+    while (reader.Next(data, size)) {
+      EXPECT_TRUE(writer.Write(data, size));
+    }
+    EXPECT_FALSE(reader.Failed());
+    EXPECT_TRUE(writer.Close());
+  }
+
+  std::vector<uint8_t> expected(static_cast<size_t>(kTotal));
+  FillStreamPattern(11, 0, expected.data(), expected.size());
+  StreamChecksum checksum;
+  checksum.Update(expected.data(), expected.size());
+  hyper written = 0;
+  unsigned long writtenChecksum = 0;
+  ASSERT_EQ(stream->GetWritten(&written, &writtenChecksum), S_OK);
+  EXPECT_EQ(static_cast<uint64_t>(written), kTotal);
+  EXPECT_EQ(writtenChecksum, checksum.Value());
+
+  // The end of the stream is an empty chunk
+  SAFEARRAY *raw = nullptr;
+  ASSERT_EQ(stream->Read(100, &raw), S_OK);
+  CComSafeArray<BYTE> chunk;
+  chunk.Attach(raw);
+  EXPECT_EQ(chunk.GetCount(), 0u);
+  EXPECT_EQ(stream->OpenRead(-1, 0), E_INVALIDARG);
+}
+
+TEST(SharedSection, Views) {
+  constexpr uint64_t kSize = 1 << 20;
+  std::unique_ptr<SharedSection> section = SharedSection::Create(kSize);
+  ASSERT_TRUE(section);
+  FillStreamPattern(2, 0, section->Data(), kSize);
+
+  // Each import takes over a handle shared with this process
+  const uint32_t self = SharedSection::ProcessId();
+  std::unique_ptr<SectionView> readOnly = SectionView::Import(
+      section->ShareWith(self), kSize, kSectionReadOnly);
+  ASSERT_TRUE(readOnly);
+  EXPECT_EQ(readOnly->MutableData(), nullptr);
+  EXPECT_EQ(std::memcmp(readOnly->Data(), section->Data(), kSize), 0);
+
+  // A read-only view shares the pages, and a copy-on-write view copies the
+  // ones it writes to
+  std::unique_ptr<SectionView> copyOnWrite = SectionView::Import(
+      section->ShareWith(self), kSize, kSectionCopyOnWrite);
+  ASSERT_TRUE(copyOnWrite);
+  uint8_t original = section->Data()[5];
+  copyOnWrite->MutableData()[5] = original + 1;
+  section->Data()[7] = 42;
+  EXPECT_EQ(section->Data()[5], original);
+  EXPECT_EQ(readOnly->Data()[5], original);
+  EXPECT_EQ(readOnly->Data()[7], 42);
+
+  // Views can't be larger than the section
+  EXPECT_FALSE(SectionView::Import(section->ShareWith(self), kSize + 1,
+                                   kSectionReadOnly));
+  EXPECT_FALSE(SectionView::Import(0, kSize, kSectionReadOnly));
+  EXPECT_FALSE(SharedSection::Create(0));
+
+  // A handle that isn't what ShareWith gives is refused, and left open
+  std::unique_ptr<HANDLE, HandleCloser> event(
+      ::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  ASSERT_TRUE(event);
+  const uint32_t eventHandle =
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(event.get()));
+  EXPECT_FALSE(SectionView::Import(eventHandle, kSize, kSectionReadOnly));
+  EXPECT_FALSE(
+      SectionView::Import(section->Handle(), kSize, kSectionReadOnly));
+  DWORD flags;
+  EXPECT_TRUE(::GetHandleInformation(event.get(), &flags));
+  EXPECT_TRUE(::GetHandleInformation(
+      reinterpret_cast<HANDLE>(uintptr_t(section->Handle())), &flags));
+
+  // A handle that was never imported can be taken back
+  const uint32_t unused = section->ShareWith(self);
+  ASSERT_NE(unused, 0u);
+  SharedSection::Revoke(self, unused);
+  EXPECT_FALSE(
+      ::GetHandleInformation(reinterpret_cast<HANDLE>(uintptr_t(unused)),
+                             &flags));
+}
+
+TEST(SharedSection, Object) {
+  CComPtr<IMarshalable2> object;
+  object.Attach(static_cast<IMarshalable2 *>(CreateMarshalable()));
+  ASSERT_TRUE(object);
+
+  constexpr uint64_t kSize = 300001;
+  std::unique_ptr<SharedSection> section = SharedSection::Create(kSize);
+  ASSERT_TRUE(section);
+  FillStreamPattern(3, 0, section->Data(), kSize);
+  StreamChecksum expected;
+  expected.Update(section->Data(), kSize);
+  std::vector<uint8_t> incremented(section->Data(), section->Data() + kSize);
+  for (uint8_t &byte : incremented) {
+    ++byte;
+  }
+  StreamChecksum expectedIncremented;
+  expectedIncremented.Update(incremented.data(), incremented.size());
+
+  unsigned long objectProcessId = 0;
+  ASSERT_EQ(object->GetProcessId(&objectProcessId), S_OK);
+  EXPECT_EQ(objectProcessId, SharedSection::ProcessId());
+
+  unsigned long checksum = 0;
+  ASSERT_EQ(object->TestSection(section->ShareWith(objectProcessId), kSize,
+                                VARIANT_FALSE, &checksum),
+            S_OK);
+  EXPECT_EQ(checksum, expected.Value());
+  ASSERT_EQ(object->TestSection(section->ShareWith(objectProcessId), kSize,
+                                VARIANT_TRUE, &checksum),
+            S_OK);
+  EXPECT_EQ(checksum, expectedIncremented.Value());
+  std::vector<uint8_t> pattern(kSize);
+  FillStreamPattern(3, 0, pattern.data(), kSize);
+  EXPECT_EQ(std::memcmp(section->Data(), pattern.data(), kSize), 0);
+  EXPECT_EQ(object->TestSection(section->ShareWith(objectProcessId),
+                                kSize + 1, VARIANT_FALSE, &checksum),
+            E_INVALIDARG);
+
+  CComSafeArray<BYTE> buffer(static_cast<ULONG>(kSize));
+  std::memcpy(&buffer.GetAt(0), section->Data(), kSize);
+  ASSERT_EQ(object->TestBuffer(buffer, &checksum), S_OK);
+  EXPECT_EQ(checksum, expected.Value());
+
+  // An attached section outlives the call and the section it came from
+  unsigned long cookie = 0;
+  ASSERT_EQ(object->AttachSection(section->ShareWith(objectProcessId), kSize,
+                                  &cookie),
+            S_OK);
+  section.reset();
+  ASSERT_EQ(object->TestAttachedSection(cookie, 0, kSize, &checksum), S_OK);
+  EXPECT_EQ(checksum, expected.Value());
+  StreamChecksum part;
+  part.Update(pattern.data() + 1000, 10);
+  ASSERT_EQ(object->TestAttachedSection(cookie, 1000, 10, &checksum), S_OK);
+  EXPECT_EQ(checksum, part.Value());
+  EXPECT_EQ(object->TestAttachedSection(cookie, kSize, 1, &checksum),
+            E_INVALIDARG);
+  EXPECT_EQ(object->DetachSection(cookie), S_OK);
+  EXPECT_EQ(object->DetachSection(cookie), E_INVALIDARG);
+  EXPECT_EQ(object->TestAttachedSection(cookie, 0, 1, &checksum),
+            E_INVALIDARG);
+}
+
+TEST(Dispatch, Invoke) {
+  CComPtr<IUnknown> object;
+  object.Attach(CreateMarshalable());
+  CComQIPtr<IDispatch> dispatch = object;
+  ASSERT_TRUE(dispatch);
+
+  UINT count = 0;
+  EXPECT_EQ(dispatch->GetTypeInfoCount(&count), S_OK);
+  EXPECT_EQ(count, 1u);
+
+  LPOLESTR names[] = {const_cast<LPOLESTR>(L"testnumbers")};
+  DISPID dispId = DISPID_UNKNOWN;
+  ASSERT_EQ(dispatch->GetIDsOfNames(IID_NULL, names, 1, LOCALE_USER_DEFAULT,
+                                    &dispId),
+            S_OK);
+  EXPECT_EQ(dispId, MidlDispId(2, 0));
+  names[0] = const_cast<LPOLESTR>(L"TestNumbersBatch");
+  ASSERT_EQ(dispatch->GetIDsOfNames(IID_NULL, names, 1, LOCALE_USER_DEFAULT,
+                                    &dispId),
+            S_OK);
+  EXPECT_EQ(dispId, MidlDispId(3, 0));
+  names[0] = const_cast<LPOLESTR>(L"Unknown");
+  EXPECT_EQ(dispatch->GetIDsOfNames(IID_NULL, names, 1, LOCALE_USER_DEFAULT,
+                                    &dispId),
+            DISP_E_UNKNOWNNAME);
+  EXPECT_EQ(dispId, DISPID_UNKNOWN);
+
+  // TestNumbers(10, &b, &c, &d).  rgvarg is in reverse order, and the first
+  // argument is a string to check that it's converted.
+  long b = 11;
+  int c = 12;
+  unsigned long d = 13;
+  VARIANT args[4];
+  V_VT(&args[3]) = VT_BSTR;
+  V_BSTR(&args[3]) = ::SysAllocString(L"10");
+  V_VT(&args[2]) = VT_I4 | VT_BYREF;
+  V_I4REF(&args[2]) = &b;
+  V_VT(&args[1]) = VT_INT | VT_BYREF;
+  V_INTREF(&args[1]) = &c;
+  V_VT(&args[0]) = VT_UI4 | VT_BYREF;
+  V_UI4REF(&args[0]) = &d;
+  DISPPARAMS params = {args, nullptr, 4, 0};
+  CComVariant result;
+  UINT argErr = 0;
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(2, 0), IID_NULL,
+                             LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params,
+                             &result, nullptr, &argErr),
+            S_OK);
+  EXPECT_EQ(V_VT(&result), VT_UINT);
+  EXPECT_EQ(V_UINT(&result), 44u);
+  EXPECT_EQ(b, 41);
+  EXPECT_EQ(c, 42);
+  EXPECT_EQ(d, 43u);
+  ::SysFreeString(V_BSTR(&args[3]));
+
+  // An [out] argument passed by value
+  V_VT(&args[3]) = VT_I4;
+  V_I4(&args[3]) = 10;
+  V_VT(&args[1]) = VT_INT;
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(2, 0), IID_NULL,
+                             LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params,
+                             nullptr, nullptr, &argErr),
+            DISP_E_TYPEMISMATCH);
+  EXPECT_EQ(argErr, 1u);
+
+  params.cArgs = 3;
+  params.rgvarg = args + 1;
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(2, 0), IID_NULL,
+                             LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params,
+                             nullptr, nullptr, &argErr),
+            DISP_E_BADPARAMCOUNT);
+  // Far past the last method, so that adding methods doesn't change this
+  EXPECT_EQ(dispatch->Invoke(100, IID_NULL, LOCALE_USER_DEFAULT,
+                             DISPATCH_METHOD, &params, nullptr, nullptr,
+                             &argErr),
+            DISP_E_MEMBERNOTFOUND);
+  // Past the methods of IMarshalable, and of IMarshalable2
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(2, 3), IID_NULL, LOCALE_USER_DEFAULT,
+                             DISPATCH_METHOD, &params, nullptr, nullptr,
+                             &argErr),
+            DISP_E_MEMBERNOTFOUND);
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(3, 7), IID_NULL, LOCALE_USER_DEFAULT,
+                             DISPATCH_METHOD, &params, nullptr, nullptr,
+                             &argErr),
+            DISP_E_MEMBERNOTFOUND);
+
+  // TestBStrings(L"Hello", &out, &inOut)
+  CComBSTR strOut;
+  CComBSTR strInOut(L"World");
+  V_VT(&args[2]) = VT_BSTR;
+  V_BSTR(&args[2]) = ::SysAllocString(L"Hello");
+  V_VT(&args[1]) = VT_BSTR | VT_BYREF;
+  V_BSTRREF(&args[1]) = &strOut;
+  V_VT(&args[0]) = VT_BSTR | VT_BYREF;
+  V_BSTRREF(&args[0]) = &strInOut;
+  params.rgvarg = args;
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(2, 2), IID_NULL,
+                             LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params,
+                             nullptr, nullptr, &argErr),
+            S_OK);
+  ::SysFreeString(V_BSTR(&args[2]));
+  EXPECT_STREQ(strInOut, L"@orld");
+  EXPECT_STREQ(strOut, L":)");
+
+  // TestNumbersBatch({1, 2, 3})
+  CComSafeArray<LONG> numbers(3);
+  for (LONG i = 0; i < 3; ++i) {
+    numbers[i] = i + 1;
+  }
+  VARIANT batch;
+  V_VT(&batch) = VT_ARRAY | VT_I4;
+  V_ARRAY(&batch) = numbers;
+  params = {&batch, nullptr, 1, 0};
+  result.Clear();
+  EXPECT_EQ(dispatch->Invoke(MidlDispId(3, 0), IID_NULL,
+                             LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params,
+                             &result, nullptr, &argErr),
+            S_OK);
+  ASSERT_EQ(V_VT(&result), VT_ARRAY | VT_I4);
+  CComSafeArray<LONG> out;
+  out.Attach(V_ARRAY(&result));
+  V_VT(&result) = VT_EMPTY;
+  ASSERT_EQ(out.GetCount(), 3u);
+  EXPECT_EQ(out[0], 43);
+  EXPECT_EQ(out[2], 45);
+}
+
+// The portable codec tests are in portabletests.cpp.  BSTRs need OLE.
+TEST(Codec, BStrings) {
+  // Embedded nulls survive
+  CComBSTR in(5, L"ab\0cd");
+  uint8_t buffer[64];
+  CodecWriter writer(buffer, sizeof(buffer));
+  InBstr::EncodeRequest(writer, in);
+
+  CodecReader reader(buffer, writer.Size());
+  BSTR slot = nullptr;
+  InBstr::DecodeRequest(reader, slot);
+  ASSERT_TRUE(reader.Ok());
+  EXPECT_EQ(::SysStringLen(slot), 5u);
+  EXPECT_EQ(memcmp(slot, in.m_str, 5 * sizeof(wchar_t)), 0);
+  InBstr::Release(slot);
+  EXPECT_EQ(slot, nullptr);
+
+  // So does a null BSTR, which is different from an empty one
+  CodecWriter nullWriter(buffer, sizeof(buffer));
+  InBstr::EncodeRequest(nullWriter, nullptr);
+  CodecReader nullReader(buffer, nullWriter.Size());
+  InBstr::DecodeRequest(nullReader, slot);
+  EXPECT_TRUE(nullReader.Ok());
+  EXPECT_EQ(slot, nullptr);
+}
+
+// The fixtures are in src\testdata, and the tests run from bin\<arch>
+std::wstring TestDataPath(LPCWSTR name) {
+  wchar_t modulePath[MAX_PATH];
+  DWORD length =
+      ::GetModuleFileNameW(nullptr, modulePath, ARRAYSIZE(modulePath));
+  std::wstring path(modulePath, length);
+  for (int i = 0; i < 3 && path.find_last_of(L'\\') != std::wstring::npos;
+       ++i) {
+    path.resize(path.find_last_of(L'\\'));
+  }
+  return path + L"\\src\\testdata\\" + name;
+}
+
+TEST(TypeLib, Fixture) {
+  MappedTypeLib typelib;
+  ASSERT_TRUE(typelib.Open(TestDataPath(L"interfaces.tlb").c_str()));
+
+  TypeLibAttr lib;
+  ASSERT_TRUE(typelib.GetLibAttr(lib));
+  EXPECT_TRUE(::IsEqualGUID(lib.mLibId, LIBID_COM_Playground));
+  EXPECT_TRUE(lib.mName.Equals(L"COM_Playground"));
+  EXPECT_EQ(lib.mMajorVersion, 1);
+  EXPECT_EQ(lib.mMinorVersion, 0);
+  EXPECT_EQ(typelib.TypeInfoCount(), 6u);
+
+  int type = typelib.FindTypeInfo(IID_IMarshalable);
+  ASSERT_GE(type, 0);
+  EXPECT_EQ(typelib.FindTypeInfo(L"imarshalable"), type);
+  EXPECT_EQ(typelib.FindTypeInfo(L"IMarshalable_"), -1);
+  EXPECT_EQ(typelib.FindTypeInfo(IID_IUnknown), -1);
+
+  TypeInfoAttr attr;
+  ASSERT_TRUE(typelib.GetTypeInfoAttr(type, attr));
+  EXPECT_EQ(attr.mTypeKind, TKIND_DISPATCH);
+  EXPECT_TRUE(attr.mTypeFlags & TYPEFLAG_FDUAL);
+  EXPECT_EQ(attr.mFuncCount, 3);
+  EXPECT_EQ(attr.mVtableSlots, 10);
+  EXPECT_TRUE(attr.mDocString.Equals(L"IMarshalable interface"));
+
+  // Methods are found by name or by DISPID
+  int func = typelib.FindFunc(type, L"TESTBSTRINGS");
+  ASSERT_GE(func, 0);
+  EXPECT_EQ(typelib.FindFuncByMemberId(type, MidlDispId(2, 2)), func);
+  EXPECT_EQ(typelib.FindFuncByMemberId(type, MidlDispId(2, 3)), -1);
+  EXPECT_EQ(typelib.FindFunc(type, L"TestBString"), -1);
+
+  TypeLibFunc method;
+  ASSERT_TRUE(typelib.GetFunc(type, func, method));
+  EXPECT_TRUE(method.mName.Equals(L"TestBStrings"));
+  EXPECT_EQ(method.mMemberId, MidlDispId(2, 2));
+  EXPECT_EQ(method.mVtableSlot, 9);
+  EXPECT_EQ(method.mInvokeKind, INVOKE_FUNC);
+  EXPECT_EQ(method.mCallConv, CC_STDCALL);
+  ASSERT_EQ(method.mParamCount, 3);
+
+  TypeLibType returned;
+  ASSERT_TRUE(typelib.ResolveType(method.mReturnType, returned));
+  EXPECT_EQ(returned.mVarType, VT_HRESULT);
+
+  // [out] BSTR* strOut
+  TypeLibParam param;
+  ASSERT_TRUE(typelib.GetParam(method, 1, param));
+  EXPECT_TRUE(param.mName.Equals(L"strOut"));
+  EXPECT_EQ(param.mFlags, PARAMFLAG_FOUT);
+  TypeLibType pointer;
+  ASSERT_TRUE(typelib.ResolveType(param.mType, pointer));
+  EXPECT_EQ(pointer.mVarType, VT_PTR);
+  TypeLibType pointee;
+  ASSERT_TRUE(typelib.ResolveType(pointer.mInner, pointee));
+  EXPECT_EQ(pointee.mVarType, VT_BSTR);
+  EXPECT_FALSE(typelib.GetParam(method, 3, param));
+
+  // The derived interface only has its own methods, after the inherited slots
+  type = typelib.FindTypeInfo(IID_IMarshalable2);
+  ASSERT_GE(type, 0);
+  ASSERT_TRUE(typelib.GetTypeInfoAttr(type, attr));
+  EXPECT_EQ(attr.mFuncCount, 7);
+  EXPECT_EQ(attr.mVtableSlots, 17);
+  EXPECT_EQ(typelib.FindFunc(type, L"TestBStrings"), -1);
+  func = typelib.FindFunc(type, L"GetProcessId");
+  ASSERT_GE(func, 0);
+  ASSERT_TRUE(typelib.GetFunc(type, func, method));
+  EXPECT_EQ(method.mMemberId, MidlDispId(3, 6));
+  EXPECT_EQ(method.mVtableSlot, 16);
+
+  type = typelib.FindTypeInfo(IID_IChunkedStream);
+  ASSERT_GE(type, 0);
+  ASSERT_TRUE(typelib.GetTypeInfoAttr(type, attr));
+  EXPECT_EQ(attr.mTypeKind, TKIND_INTERFACE);
+  EXPECT_EQ(attr.mFuncCount, 5);
+}
+
+TEST(TypeLib, Corrupt) {
+  std::ifstream file(TestDataPath(L"interfaces.tlb"), std::ios::binary);
+  std::vector<uint8_t> image((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+  ASSERT_FALSE(image.empty());
+
+  // Reads everything there is.  Only the bounds checks matter here, so the
+  // results are ignored.
+  auto walk = [](const std::vector<uint8_t> &bytes) {
+    TypeLibView view;
+    if (!view.Attach(bytes.data(), bytes.size())) {
+      return;
+    }
+    for (uint32_t i = 0; i < view.TypeInfoCount(); ++i) {
+      TypeInfoAttr attr;
+      if (view.GetTypeInfoAttr(i, attr)) {
+        view.FindTypeInfo(attr.mGuid);
+        view.FindFunc(i, L"TestNumbers");
+        for (uint32_t j = 0; j < attr.mFuncCount; ++j) {
+          TypeLibFunc func;
+          TypeLibParam param;
+          TypeLibType type;
+          if (view.GetFunc(i, j, func) && view.GetParam(func, 0, param)) {
+            view.ResolveType(param.mType, type);
+          }
+        }
+      }
+    }
+  };
+
+  for (size_t size = 0; size < image.size(); ++size) {
+    walk(std::vector<uint8_t>(image.begin(), image.begin() + size));
+  }
+  std::mt19937 random(1);
+  for (int i = 0; i < 10000; ++i) {
+    std::vector<uint8_t> mutated(image);
+    mutated[random() % mutated.size()] = static_cast<uint8_t>(random());
+    walk(mutated);
+  }
+
+  TypeLibView view;
+  EXPECT_FALSE(view.Attach(image.data(), 16));
+  EXPECT_TRUE(view.Attach(image.data(), image.size()));
+}
@@ -0,0 +1,699 @@
+#include "typelib.h"
+#include <algorithm>
+#include <cstring>
+#include <cwchar>
+#include <type_traits>
+#include <utility>
+#ifdef _WIN32
+#include "log.h"
+#include "shared.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The records below mirror the file, which is little-endian with natural
+// alignment, so they are read with a plain memcpy.
+struct TlbTypeInfo {
+  uint32_t mTypeKind;     // TYPEKIND in the low nibble
+  int32_t mMembersOffset; // Of the member records, from the start of the file
+  uint32_t mReserved1[4];
+  uint32_t mElementCount; // Functions in the low word, variables in the high
+  uint32_t mReserved2[4];
+  int32_t mGuidOffset;
+  uint32_t mTypeFlags;
+  int32_t mNameOffset;
+  uint32_t mVersion; // Major in the low word
+  int32_t mDocString;
+  uint32_t mHelpStringContext;
+  uint32_t mHelpContext;
+  int32_t mCustomData;
+  uint16_t mImplTypeCount;
+  uint16_t mVtableSize; // In bytes, with the pointer size of the library
+  uint32_t mSize;
+  int32_t mDataType1;
+  int32_t mDataType2;
+  uint32_t mReserved3[2];
+};
+static_assert(sizeof(TlbTypeInfo) == 0x64, "Must match the file");
+
+// Followed by optional attributes and then one TlbParamRecord per parameter
+struct TlbFuncRecord {
+  uint32_t mInfo; // Size of the record in the low word
+  int32_t mReturnType;
+  uint32_t mFuncFlags;
+  uint16_t mVtableOffset; // In bytes, with the pointer size of the library
+  uint16_t mFuncDescSize;
+  uint32_t mKinds;
+  uint16_t mParamCount;
+  uint16_t mOptionalCount;
+
+  static constexpr uint32_t kHasDefaults = 0x1000; // In mKinds
+
+  uint32_t FuncKind() const { return mKinds & 0x7; }
+  uint32_t InvokeKind() const { return (mKinds >> 3) & 0xf; }
+  uint32_t CallConv() const { return (mKinds >> 8) & 0xf; }
+};
+static_assert(sizeof(TlbFuncRecord) == 0x18, "Must match the file");
+
+struct TlbParamRecord {
+  int32_t mType;
+  int32_t mNameOffset;
+  uint32_t mFlags;
+};
+
+struct TlbNameIntro {
+  int32_t mRefType;
+  int32_t mNextHash;
+  uint32_t mLength; // In the low byte.  The rest are flags and the hash.
+};
+
+constexpr int32_t kTlbNone = -1;
+constexpr uint16_t kSysWin64 = 3;
+constexpr uint16_t kVtPtr = 26;
+constexpr uint16_t kVtSafeArray = 27;
+constexpr uint16_t kVtCArray = 28;
+constexpr uint16_t kVtUserDefined = 29;
+constexpr uint16_t kVtTypeMask = 0xfff;
+
+static uint32_t FoldCase(uint32_t c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a, case-insensitive like Equals
+template <typename Char>
+static uint32_t HashName(const Char *chars, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    using Unit = typename std::make_unsigned<Char>::type;
+    hash = (hash ^ FoldCase(static_cast<Unit>(chars[i]))) * 16777619u;
+  }
+  return hash;
+}
+
+bool TypeLibName::Equals(const wchar_t *name) const {
+  for (uint32_t i = 0; i < mLength; ++i) {
+    if (!name[i] || FoldCase(static_cast<unsigned char>(mChars[i])) !=
+                        FoldCase(static_cast<uint32_t>(name[i]))) {
+      return false;
+    }
+  }
+  return !name[mLength];
+}
+
+static bool GuidLess(const GUID &a, const GUID &b) {
+  return memcmp(&a, &b, sizeof(GUID)) < 0;
+}
+
+TypeLibView::TypeLibView()
+    : mBase(nullptr), mSize(0), mHeader(), mSegments(), mLibIndex(nullptr) {}
+
+TypeLibView::~TypeLibView() { Detach(); }
+
+void TypeLibView::Detach() {
+  if (mMemberIndexes) {
+    for (uint32_t i = 0; i < mHeader.mTypeInfoCount; ++i) {
+      delete mMemberIndexes[i].load(std::memory_order_relaxed);
+    }
+    mMemberIndexes.reset();
+  }
+  delete mLibIndex.exchange(nullptr, std::memory_order_relaxed);
+  mBase = nullptr;
+  mSize = 0;
+}
+
+template <typename T> bool TypeLibView::Read(uint64_t offset, T &value) const {
+  if (offset > mSize || mSize - offset < sizeof(T)) {
+    return false;
+  }
+  memcpy(&value, mBase + offset, sizeof(T));
+  return true;
+}
+
+// Reads `size` bytes at `offset` in a segment, which must hold all of them
+bool TypeLibView::ReadIn(TlbSegmentIndex segment, int64_t offset, void *value,
+                         size_t size) const {
+  const TlbSegment &s = mSegments[segment];
+  if (offset < 0 || offset > s.mLength ||
+      static_cast<uint64_t>(s.mLength - offset) < size) {
+    return false;
+  }
+  memcpy(value, mBase + s.mOffset + offset, size);
+  return true;
+}
+
+bool TypeLibView::ReadName(int32_t offset, TypeLibName &name) const {
+  TlbNameIntro intro;
+  if (!ReadIn(kTlbNames, offset, &intro, sizeof(intro))) {
+    return false;
+  }
+  uint32_t length = intro.mLength & 0xff;
+  int64_t chars = int64_t(offset) + sizeof(intro);
+  if (chars + length > mSegments[kTlbNames].mLength) {
+    return false;
+  }
+  name.mChars =
+      reinterpret_cast<const char *>(mBase + mSegments[kTlbNames].mOffset) +
+      chars;
+  name.mLength = length;
+  return true;
+}
+
+bool TypeLibView::ReadString(int32_t offset, TypeLibName &name) const {
+  name = {"", 0};
+  if (offset == kTlbNone) {
+    return true;
+  }
+  uint16_t length;
+  if (!ReadIn(kTlbStrings, offset, &length, sizeof(length))) {
+    return false;
+  }
+  int64_t chars = int64_t(offset) + sizeof(length);
+  if (chars + length > mSegments[kTlbStrings].mLength) {
+    return false;
+  }
+  name.mChars =
+      reinterpret_cast<const char *>(mBase + mSegments[kTlbStrings].mOffset) +
+      chars;
+  name.mLength = length;
+  return true;
+}
+
+bool TypeLibView::ReadGuid(int32_t offset, GUID &guid) const {
+  return ReadIn(kTlbGuids, offset, &guid, sizeof(guid));
+}
+
+bool TypeLibView::ReadTypeInfo(uint32_t typeIndex, TlbTypeInfo &info) const {
+  return typeIndex < TypeInfoCount() &&
+         ReadIn(kTlbTypeInfos, int64_t(typeIndex) * sizeof(TlbTypeInfo), &info,
+                sizeof(info));
+}
+
+// The member records of a typeinfo are laid out as
+//   uint32_t  size of the records
+//   records   one per function, then one per variable
+//   int32_t   member IDs[memberCount]
+//   int32_t   name offsets[memberCount]
+//   int32_t   record offsets[memberCount], from the first record
+bool TypeLibView::ReadMembers(uint32_t typeIndex, uint64_t &records,
+                              uint32_t &recordsSize,
+                              uint32_t &memberCount) const {
+  TlbTypeInfo info;
+  if (!ReadTypeInfo(typeIndex, info)) {
+    return false;
+  }
+  memberCount = (info.mElementCount & 0xffff) + (info.mElementCount >> 16);
+  if (!memberCount) {
+    records = 0;
+    recordsSize = 0;
+    return true;
+  }
+
+  if (info.mMembersOffset < 0 || !Read(info.mMembersOffset, recordsSize)) {
+    return false;
+  }
+  records = uint64_t(info.mMembersOffset) + sizeof(uint32_t);
+  uint64_t end = records + recordsSize + uint64_t(memberCount) * 3 * 4;
+  return end <= mSize;
+}
+
+bool TypeLibView::Attach(const void *image, size_t size) {
+  Detach();
+
+  const uint8_t *base = reinterpret_cast<const uint8_t *>(image);
+  TlbHeader header;
+  if (!base || size < sizeof(header) || size > INT32_MAX) {
+    return false;
+  }
+  memcpy(&header, base, sizeof(header));
+  if (header.mMagic != TlbHeader::kMagic) {
+    return false;
+  }
+
+  uint64_t directory = sizeof(header) +
+                       (header.mVarFlags & TlbHeader::kHasHelpDll ? 4 : 0) +
+                       uint64_t(header.mTypeInfoCount) * 4;
+  if (directory + sizeof(mSegments) > size) {
+    return false;
+  }
+  TlbSegment segments[kTlbSegmentCount];
+  memcpy(segments, base + directory, sizeof(segments));
+  for (TlbSegment &segment : segments) {
+    if (segment.mLength <= 0) {
+      // An empty segment may have any offset, usually -1
+      segment.mOffset = 0;
+      segment.mLength = 0;
+    } else if (segment.mOffset < 0 ||
+               uint64_t(segment.mOffset) + segment.mLength > size) {
+      return false;
+    }
+  }
+  if (uint64_t(header.mTypeInfoCount) * sizeof(TlbTypeInfo) >
+      uint64_t(segments[kTlbTypeInfos].mLength)) {
+    return false;
+  }
+
+  mBase = base;
+  mSize = size;
+  mHeader = header;
+  memcpy(mSegments, segments, sizeof(segments));
+  mMemberIndexes.reset(new std::atomic<MemberIndex *>[header.mTypeInfoCount]);
+  for (uint32_t i = 0; i < header.mTypeInfoCount; ++i) {
+    mMemberIndexes[i].store(nullptr, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool TypeLibView::GetLibAttr(TypeLibAttr &attr) const {
+  if (!mBase || !ReadGuid(mHeader.mLibIdOffset, attr.mLibId)) {
+    return false;
+  }
+  attr.mLcid = mHeader.mLibLcid;
+  attr.mSysKind = static_cast<uint16_t>(mHeader.mVarFlags & 0xf);
+  attr.mMajorVersion = static_cast<uint16_t>(mHeader.mVersion);
+  attr.mMinorVersion = static_cast<uint16_t>(mHeader.mVersion >> 16);
+  attr.mLibFlags = static_cast<uint16_t>(mHeader.mLibFlags);
+  return ReadName(mHeader.mNameOffset, attr.mName);
+}
+
+bool TypeLibView::GetTypeInfoAttr(uint32_t typeIndex,
+                                  TypeInfoAttr &attr) const {
+  TlbTypeInfo info;
+  if (!ReadTypeInfo(typeIndex, info) ||
+      !ReadGuid(info.mGuidOffset, attr.mGuid) ||
+      !ReadName(info.mNameOffset, attr.mName) ||
+      !ReadString(info.mDocString, attr.mDocString)) {
+    return false;
+  }
+
+  uint32_t pointerSize = (mHeader.mVarFlags & 0xf) == kSysWin64 ? 8 : 4;
+  attr.mTypeKind = static_cast<uint16_t>(info.mTypeKind & 0xf);
+  attr.mTypeFlags = static_cast<uint16_t>(info.mTypeFlags);
+  attr.mFuncCount = static_cast<uint16_t>(info.mElementCount);
+  attr.mVarCount = static_cast<uint16_t>(info.mElementCount >> 16);
+  attr.mImplTypeCount = info.mImplTypeCount;
+  attr.mVtableSlots = static_cast<uint16_t>(info.mVtableSize / pointerSize);
+  attr.mMajorVersion = static_cast<uint16_t>(info.mVersion);
+  attr.mMinorVersion = static_cast<uint16_t>(info.mVersion >> 16);
+  return true;
+}
+
+bool TypeLibView::GetFunc(uint32_t typeIndex, uint32_t funcIndex,
+                          TypeLibFunc &func) const {
+  TlbTypeInfo info;
+  uint64_t records;
+  uint32_t recordsSize;
+  uint32_t memberCount;
+  if (!ReadTypeInfo(typeIndex, info) ||
+      funcIndex >= (info.mElementCount & 0xffff) ||
+      !ReadMembers(typeIndex, records, recordsSize, memberCount)) {
+    return false;
+  }
+
+  uint64_t arrays = records + recordsSize;
+  int32_t nameOffset;
+  int32_t recordOffset;
+  if (!Read(arrays + funcIndex * 4ull, func.mMemberId) ||
+      !Read(arrays + (memberCount + funcIndex) * 4ull, nameOffset) ||
+      !Read(arrays + (memberCount * 2ull + funcIndex) * 4, recordOffset) ||
+      !ReadName(nameOffset, func.mName)) {
+    return false;
+  }
+
+  TlbFuncRecord record;
+  if (recordOffset < 0 ||
+      uint64_t(recordOffset) + sizeof(record) > recordsSize ||
+      !Read(records + recordOffset, record)) {
+    return false;
+  }
+  uint32_t recordSize = record.mInfo & 0xffff;
+  uint64_t paramsSize = uint64_t(record.mParamCount) * sizeof(TlbParamRecord);
+  uint64_t defaultsSize = record.mKinds & TlbFuncRecord::kHasDefaults
+                              ? uint64_t(record.mParamCount) * 4
+                              : 0;
+  if (recordSize < sizeof(record) + paramsSize + defaultsSize ||
+      uint64_t(recordOffset) + recordSize > recordsSize) {
+    return false;
+  }
+
+  uint32_t pointerSize = (mHeader.mVarFlags & 0xf) == kSysWin64 ? 8 : 4;
+  func.mReturnType = record.mReturnType;
+  func.mVtableSlot =
+      static_cast<uint16_t>((record.mVtableOffset & ~1u) / pointerSize);
+  func.mFuncKind = static_cast<uint16_t>(record.FuncKind());
+  func.mInvokeKind = static_cast<uint16_t>(record.InvokeKind());
+  func.mCallConv = static_cast<uint16_t>(record.CallConv());
+  func.mFuncFlags = static_cast<uint16_t>(record.mFuncFlags);
+  func.mParamCount = record.mParamCount;
+  func.mOptionalCount = record.mOptionalCount;
+  func.mParamsOffset =
+      static_cast<uint32_t>(records + recordOffset + recordSize - paramsSize);
+  return true;
+}
+
+bool TypeLibView::GetParam(const TypeLibFunc &func, uint32_t paramIndex,
+                           TypeLibParam &param) const {
+  TlbParamRecord record;
+  if (paramIndex >= func.mParamCount ||
+      !Read(func.mParamsOffset + uint64_t(paramIndex) * sizeof(record),
+            record)) {
+    return false;
+  }
+
+  param.mType = record.mType;
+  param.mFlags = static_cast<uint16_t>(record.mFlags);
+  if (record.mNameOffset == kTlbNone) {
+    param.mName = {"", 0};
+    return true;
+  }
+  return ReadName(record.mNameOffset, param.mName);
+}
+
+// A type description is two int32_t: the VARTYPE in the low word of the
+// first, and the handle of the element type or the HREFTYPE in the second.
+// A built-in type is encoded in the handle itself.
+bool TypeLibView::ResolveType(int32_t handle, TypeLibType &type) const {
+  if (handle < 0) {
+    type.mVarType = static_cast<uint16_t>(handle & kVtTypeMask);
+    type.mInner = 0;
+    return true;
+  }
+
+  int32_t desc[2];
+  if (!mBase || !ReadIn(kTlbTypeDescs, handle, desc, sizeof(desc))) {
+    return false;
+  }
+  type.mVarType = static_cast<uint16_t>(desc[0] & kVtTypeMask);
+  switch (type.mVarType) {
+  case kVtPtr:
+  case kVtSafeArray:
+  case kVtCArray:
+  case kVtUserDefined:
+    type.mInner = desc[1];
+    break;
+  default:
+    type.mInner = 0;
+    break;
+  }
+  return true;
+}
+
+// A local HREFTYPE is the offset of the typeinfo in its segment.  Imported
+// ones have one of the low bits set.
+int TypeLibView::RefTypeInfo(int32_t refType) const {
+  if (refType < 0 || refType & 3 || refType % sizeof(TlbTypeInfo)) {
+    return -1;
+  }
+  uint32_t index = static_cast<uint32_t>(refType / sizeof(TlbTypeInfo));
+  return index < TypeInfoCount() ? static_cast<int>(index) : -1;
+}
+
+const TypeLibView::LibIndex *TypeLibView::GetLibIndex() const {
+  LibIndex *index = mLibIndex.load(std::memory_order_acquire);
+  if (index || !mBase) {
+    return index;
+  }
+
+  std::unique_ptr<LibIndex> built(new LibIndex);
+  std::vector<std::pair<GUID, uint32_t>> guids;
+  for (uint32_t i = 0; i < mHeader.mTypeInfoCount; ++i) {
+    TlbTypeInfo info;
+    GUID guid;
+    TypeLibName name;
+    if (!ReadTypeInfo(i, info)) {
+      continue;
+    }
+    if (ReadGuid(info.mGuidOffset, guid)) {
+      guids.emplace_back(guid, i);
+    }
+    if (ReadName(info.mNameOffset, name)) {
+      built->mByName.emplace_back(HashName(name.mChars, name.mLength), i);
+    }
+  }
+
+  std::stable_sort(guids.begin(), guids.end(),
+                   [](const std::pair<GUID, uint32_t> &a,
+                      const std::pair<GUID, uint32_t> &b) {
+                     return GuidLess(a.first, b.first);
+                   });
+  built->mByGuid.reserve(guids.size());
+  for (const auto &guid : guids) {
+    built->mByGuid.push_back(guid.second);
+  }
+  std::sort(built->mByName.begin(), built->mByName.end());
+
+  LibIndex *expected = nullptr;
+  if (mLibIndex.compare_exchange_strong(expected, built.get(),
+                                        std::memory_order_acq_rel)) {
+    return built.release();
+  }
+  // Another thread won
+  return expected;
+}
+
+const TypeLibView::MemberIndex *
+TypeLibView::GetMemberIndex(uint32_t typeIndex) const {
+  if (typeIndex >= TypeInfoCount()) {
+    return nullptr;
+  }
+  std::atomic<MemberIndex *> &slot = mMemberIndexes[typeIndex];
+  MemberIndex *index = slot.load(std::memory_order_acquire);
+  if (index) {
+    return index;
+  }
+
+  std::unique_ptr<MemberIndex> built(new MemberIndex);
+  TlbTypeInfo info;
+  if (ReadTypeInfo(typeIndex, info)) {
+    uint32_t funcCount = info.mElementCount & 0xffff;
+    for (uint32_t i = 0; i < funcCount; ++i) {
+      TypeLibFunc func;
+      if (GetFunc(typeIndex, i, func)) {
+        built->mByName.emplace_back(
+            HashName(func.mName.mChars, func.mName.mLength), i);
+        built->mByMemberId.emplace_back(func.mMemberId, i);
+      }
+    }
+  }
+  std::sort(built->mByName.begin(), built->mByName.end());
+  std::sort(built->mByMemberId.begin(), built->mByMemberId.end());
+
+  MemberIndex *expected = nullptr;
+  if (slot.compare_exchange_strong(expected, built.get(),
+                                   std::memory_order_acq_rel)) {
+    return built.release();
+  }
+  return expected;
+}
+
+int TypeLibView::FindTypeInfo(const GUID &guid) const {
+  const LibIndex *index = GetLibIndex();
+  if (!index) {
+    return -1;
+  }
+
+  auto guidOf = [this](uint32_t typeIndex) {
+    TlbTypeInfo info;
+    GUID found = {};
+    if (ReadTypeInfo(typeIndex, info)) {
+      ReadGuid(info.mGuidOffset, found);
+    }
+    return found;
+  };
+  auto it = std::lower_bound(
+      index->mByGuid.begin(), index->mByGuid.end(), guid,
+      [&](uint32_t typeIndex, const GUID &key) {
+        return GuidLess(guidOf(typeIndex), key);
+      });
+  if (it == index->mByGuid.end()) {
+    return -1;
+  }
+  GUID found = guidOf(*it);
+  return memcmp(&found, &guid, sizeof(GUID)) ? -1 : static_cast<int>(*it);
+}
+
+int TypeLibView::FindTypeInfo(const wchar_t *name) const {
+  const LibIndex *index = GetLibIndex();
+  if (!index || !name) {
+    return -1;
+  }
+
+  uint32_t hash = HashName(name, wcslen(name));
+  for (auto it = std::lower_bound(index->mByName.begin(),
+                                  index->mByName.end(),
+                                  std::make_pair(hash, 0u));
+       it != index->mByName.end() && it->first == hash; ++it) {
+    TypeInfoAttr attr;
+    if (GetTypeInfoAttr(it->second, attr) && attr.mName.Equals(name)) {
+      return static_cast<int>(it->second);
+    }
+  }
+  return -1;
+}
+
+int TypeLibView::FindFunc(uint32_t typeIndex, const wchar_t *name) const {
+  const MemberIndex *index = GetMemberIndex(typeIndex);
+  if (!index || !name) {
+    return -1;
+  }
+
+  uint32_t hash = HashName(name, wcslen(name));
+  for (auto it = std::lower_bound(index->mByName.begin(),
+                                  index->mByName.end(),
+                                  std::make_pair(hash, 0u));
+       it != index->mByName.end() && it->first == hash; ++it) {
+    TypeLibFunc func;
+    if (GetFunc(typeIndex, it->second, func) && func.mName.Equals(name)) {
+      return static_cast<int>(it->second);
+    }
+  }
+  return -1;
+}
+
+int TypeLibView::FindFuncByMemberId(uint32_t typeIndex,
+                                    int32_t memberId) const {
+  const MemberIndex *index = GetMemberIndex(typeIndex);
+  if (!index) {
+    return -1;
+  }
+
+  auto it = std::lower_bound(index->mByMemberId.begin(),
+                             index->mByMemberId.end(),
+                             std::make_pair(memberId, 0u));
+  return it != index->mByMemberId.end() && it->first == memberId
+             ? static_cast<int>(it->second)
+             : -1;
+}
+
+#ifdef _WIN32
+
+MappedTypeLib::MappedTypeLib()
+    : mMapping(nullptr), mModule(nullptr), mView(nullptr), mViewSize(0) {}
+
+MappedTypeLib::~MappedTypeLib() {
+  Attach(nullptr, 0);
+  if (mMapping) {
+    ::UnmapViewOfFile(mView);
+    ::CloseHandle(mMapping);
+  }
+  if (mModule) {
+    ::FreeLibrary(mModule);
+  }
+}
+
+bool MappedTypeLib::Open(LPCWSTR path) {
+  if (mView) {
+    return false;
+  }
+
+  std::unique_ptr<void, HandleCloser> file(::CreateFileW(
+      path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file.get(), &size) || size.QuadPart == 0 ||
+      size.QuadPart > MAXLONG) {
+    return false;
+  }
+
+  std::unique_ptr<void, HandleCloser> mapping(::CreateFileMappingW(
+      file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+  if (!mapping) {
+    Log(L"CreateFileMappingW failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  const void *view = ::MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    Log(L"MapViewOfFile failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  if (!Attach(view, static_cast<size_t>(size.QuadPart))) {
+    ::UnmapViewOfFile(view);
+    return false;
+  }
+
+  mMapping = mapping.release();
+  mView = view;
+  mViewSize = static_cast<size_t>(size.QuadPart);
+  return true;
+}
+
+bool MappedTypeLib::OpenModule(LPCWSTR path, UINT id) {
+  if (mView) {
+    return false;
+  }
+
+  // As an image resource, the module is mapped without running any of its
+  // code and the resource is read in place
+  HMODULE module = ::LoadLibraryExW(
+      path, nullptr,
+      LOAD_LIBRARY_AS_DATAFILE | LOAD_LIBRARY_AS_IMAGE_RESOURCE);
+  if (!module) {
+    Log(L"LoadLibraryExW failed - %08x\n", ::GetLastError());
+    return false;
+  }
+
+  HRSRC resource = ::FindResourceW(module, MAKEINTRESOURCEW(id), L"TYPELIB");
+  HGLOBAL loaded = resource ? ::LoadResource(module, resource) : nullptr;
+  const void *view = loaded ? ::LockResource(loaded) : nullptr;
+  DWORD size = resource ? ::SizeofResource(module, resource) : 0;
+  if (!view || !Attach(view, size)) {
+    ::FreeLibrary(module);
+    return false;
+  }
+
+  mModule = module;
+  mView = view;
+  mViewSize = size;
+  return true;
+}
+
+#else
+
+MappedTypeLib::MappedTypeLib() : mView(nullptr), mViewSize(0) {}
+
+MappedTypeLib::~MappedTypeLib() {
+  Attach(nullptr, 0);
+  if (mView) {
+    munmap(const_cast<void *>(mView), mViewSize);
+  }
+}
+
+bool MappedTypeLib::Open(const char *path) {
+  if (mView) {
+    return false;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *view = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT32_MAX) {
+    view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+
+  if (!Attach(view, static_cast<size_t>(st.st_size))) {
+    munmap(view, static_cast<size_t>(st.st_size));
+    return false;
+  }
+  mView = view;
+  mViewSize = static_cast<size_t>(st.st_size);
+  return true;
+}
+
+#endif
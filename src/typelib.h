@@ -0,0 +1,245 @@
+#pragma once
+
+#include "guid.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Read-only reader of a binary type library in the MSFT format, which is what
+// MIDL writes to a .tlb and what a module embeds as its TYPELIB resource:
+//
+//   TlbHeader
+//   int32_t      help DLL             if the header has one
+//   int32_t      typeinfo offsets[mTypeInfoCount]
+//   TlbSegment   segments[kTlbSegmentCount]
+//   the segments: typeinfos, imports, type descriptions, GUIDs, names, ...
+//   the member records of each typeinfo
+//
+// Attach only validates the header and the segment directory.  Everything
+// else is read in place when asked for, and nothing is copied out of the
+// image except small fixed-size records.  The lookup indexes are built the
+// first time they are used: one for the typeinfos of the library and one per
+// typeinfo for its members, so a process that looks up a single interface
+// doesn't pay for the rest.  The hash tables in the file aren't used because
+// their hash depends on the locale tables of oleaut32.
+//
+// Every offset is checked against the image, so a corrupt or hostile image
+// makes the accessors fail instead of reading out of bounds.  The reader is
+// plain C++ and builds anywhere; see typelib_fuzz.cpp.
+
+struct TlbHeader {
+  static constexpr uint32_t kMagic = 0x5446534d; // 'MSFT'
+  static constexpr uint32_t kHasHelpDll = 0x100; // In mVarFlags
+
+  uint32_t mMagic;
+  uint32_t mFormatVersion;
+  int32_t mLibIdOffset; // In the GUID segment
+  uint32_t mLcid;
+  uint32_t mLibLcid;
+  uint32_t mVarFlags; // SYSKIND in the low nibble
+  uint32_t mVersion;  // Major in the low word
+  uint32_t mLibFlags;
+  uint32_t mTypeInfoCount;
+  int32_t mHelpString;
+  uint32_t mHelpStringContext;
+  uint32_t mHelpContext;
+  uint32_t mNameCount;
+  uint32_t mNameChars;
+  int32_t mNameOffset;
+  int32_t mHelpFile;
+  int32_t mCustomDataOffset;
+  uint32_t mGuidHashSize;
+  uint32_t mNameHashSize;
+  int32_t mDispatchRef;
+  uint32_t mImportCount;
+};
+
+struct TlbSegment {
+  int32_t mOffset;
+  int32_t mLength;
+  int32_t mReserved1;
+  int32_t mReserved2;
+};
+
+enum TlbSegmentIndex {
+  kTlbTypeInfos,
+  kTlbImports,
+  kTlbImportFiles,
+  kTlbReferences,
+  kTlbGuidHash,
+  kTlbGuids,
+  kTlbNameHash,
+  kTlbNames,
+  kTlbStrings,
+  kTlbTypeDescs,
+  kTlbArrayDescs,
+  kTlbCustomData,
+  kTlbCustomDataGuids,
+  kTlbReserved1,
+  kTlbReserved2,
+  kTlbSegmentCount,
+};
+
+// A name or a string in the image.  It isn't terminated with a null, and it's
+// in the code page of the library, which is ASCII for anything MIDL accepts.
+struct TypeLibName {
+  const char *mChars;
+  uint32_t mLength;
+
+  // Case-insensitive like IDispatch, for ASCII letters
+  bool Equals(const wchar_t *name) const;
+};
+
+struct TypeLibAttr {
+  GUID mLibId;
+  uint32_t mLcid;
+  uint16_t mSysKind;
+  uint16_t mMajorVersion;
+  uint16_t mMinorVersion;
+  uint16_t mLibFlags;
+  TypeLibName mName;
+};
+
+struct TypeInfoAttr {
+  GUID mGuid;
+  TypeLibName mName;
+  TypeLibName mDocString; // Empty if there is none
+  uint16_t mTypeKind;     // TYPEKIND
+  uint16_t mTypeFlags;    // TYPEFLAGS
+  uint16_t mFuncCount;
+  uint16_t mVarCount;
+  uint16_t mImplTypeCount;
+  uint16_t mVtableSlots; // Including the inherited ones
+  uint16_t mMajorVersion;
+  uint16_t mMinorVersion;
+};
+
+// A type handle is either a built-in VARTYPE (negative) or the offset of a
+// type description in the image.  ResolveType tells them apart.
+struct TypeLibFunc {
+  int32_t mMemberId;
+  TypeLibName mName;
+  int32_t mReturnType; // Type handle
+  uint16_t mVtableSlot;
+  uint16_t mFuncKind;   // FUNCKIND
+  uint16_t mInvokeKind; // INVOKEKIND
+  uint16_t mCallConv;   // CALLCONV
+  uint16_t mFuncFlags;  // FUNCFLAGS
+  uint16_t mParamCount;
+  uint16_t mOptionalCount;
+  uint32_t mParamsOffset; // Of the first parameter record, for GetParam
+};
+
+struct TypeLibParam {
+  TypeLibName mName; // Empty if there is none
+  int32_t mType;     // Type handle
+  uint16_t mFlags;   // PARAMFLAG_*
+};
+
+struct TypeLibType {
+  uint16_t mVarType;
+  // VT_PTR and VT_SAFEARRAY: handle of the element type.
+  // VT_USERDEFINED: HREFTYPE, see RefTypeInfo.
+  int32_t mInner;
+};
+
+struct TlbTypeInfo;
+
+class TypeLibView {
+  // Typeinfos of the library, sorted by GUID and by name hash
+  struct LibIndex {
+    std::vector<uint32_t> mByGuid;
+    std::vector<std::pair<uint32_t, uint32_t>> mByName;
+  };
+
+  // Members of one typeinfo, sorted by name hash and by member ID
+  struct MemberIndex {
+    std::vector<std::pair<uint32_t, uint32_t>> mByName;
+    std::vector<std::pair<int32_t, uint32_t>> mByMemberId;
+  };
+
+  const uint8_t *mBase;
+  size_t mSize;
+  TlbHeader mHeader;
+  TlbSegment mSegments[kTlbSegmentCount];
+
+  mutable std::atomic<LibIndex *> mLibIndex;
+  mutable std::unique_ptr<std::atomic<MemberIndex *>[]> mMemberIndexes;
+
+  template <typename T> bool Read(uint64_t offset, T &value) const;
+  bool ReadIn(TlbSegmentIndex segment, int64_t offset, void *value,
+              size_t size) const;
+  bool ReadName(int32_t offset, TypeLibName &name) const;
+  bool ReadString(int32_t offset, TypeLibName &name) const;
+  bool ReadGuid(int32_t offset, GUID &guid) const;
+  bool ReadTypeInfo(uint32_t typeIndex, TlbTypeInfo &info) const;
+  bool ReadMembers(uint32_t typeIndex, uint64_t &records,
+                   uint32_t &recordsSize, uint32_t &memberCount) const;
+
+  const LibIndex *GetLibIndex() const;
+  const MemberIndex *GetMemberIndex(uint32_t typeIndex) const;
+
+  void Detach();
+
+public:
+  TypeLibView();
+  ~TypeLibView();
+
+  TypeLibView(const TypeLibView &) = delete;
+  TypeLibView &operator=(const TypeLibView &) = delete;
+
+  // Validates the header and returns false if it's not a type library
+  bool Attach(const void *image, size_t size);
+
+  explicit operator bool() const { return !!mBase; }
+
+  bool GetLibAttr(TypeLibAttr &attr) const;
+  uint32_t TypeInfoCount() const { return mBase ? mHeader.mTypeInfoCount : 0; }
+  bool GetTypeInfoAttr(uint32_t typeIndex, TypeInfoAttr &attr) const;
+
+  // Return the index of a typeinfo or a function, or -1 if there is none
+  int FindTypeInfo(const GUID &guid) const;
+  int FindTypeInfo(const wchar_t *name) const;
+  int FindFunc(uint32_t typeIndex, const wchar_t *name) const;
+  int FindFuncByMemberId(uint32_t typeIndex, int32_t memberId) const;
+
+  bool GetFunc(uint32_t typeIndex, uint32_t funcIndex,
+               TypeLibFunc &func) const;
+  bool GetParam(const TypeLibFunc &func, uint32_t paramIndex,
+                TypeLibParam &param) const;
+  bool ResolveType(int32_t handle, TypeLibType &type) const;
+
+  // Index of the typeinfo that an HREFTYPE refers to, or -1 if it's imported
+  // from another library or invalid
+  int RefTypeInfo(int32_t refType) const;
+};
+
+// A type library mapped from a file, or from the TYPELIB resource of a module
+// loaded as an image resource.  Either way the pages are shared with other
+// processes and are only read in as they're touched.
+class MappedTypeLib : public TypeLibView {
+#ifdef _WIN32
+  HANDLE mMapping;
+  HMODULE mModule;
+#endif
+  const void *mView;
+  size_t mViewSize;
+
+public:
+  MappedTypeLib();
+  ~MappedTypeLib();
+
+  MappedTypeLib(const MappedTypeLib &) = delete;
+  MappedTypeLib &operator=(const MappedTypeLib &) = delete;
+
+#ifdef _WIN32
+  bool Open(LPCWSTR path);
+  // Resource `id` of type TYPELIB, as LoadTypeLib finds it
+  bool OpenModule(LPCWSTR path, UINT id = 1);
+#else
+  bool Open(const char *path);
+#endif
+};
@@ -0,0 +1,432 @@
+#include "utf16.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTF16_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define UTF16_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <oleauto.h>
+#endif
+
+// Scanning for a terminator reads whole aligned blocks, which may extend past
+// the end of the string.  That's safe, but AddressSanitizer would report it,
+// so neither the aligned loads nor the functions that scan are instrumented.
+// The loads are marked too because they aren't always inlined.
+#if defined(__clang__) || defined(__GNUC__)
+#define UTF16_NO_SANITIZE __attribute__((no_sanitize_address))
+#elif defined(_MSC_VER)
+#define UTF16_NO_SANITIZE __declspec(no_sanitize_address)
+#else
+#define UTF16_NO_SANITIZE
+#endif
+
+static bool IsSurrogate(uint32_t c) { return (c & 0xf800) == 0xd800; }
+static bool IsHighSurrogate(uint32_t c) { return (c & 0xfc00) == 0xd800; }
+static bool IsLowSurrogate(uint32_t c) { return (c & 0xfc00) == 0xdc00; }
+
+// Encodes the character at `i`, or the pair starting there, and returns the
+// index of the next one
+static size_t EncodeUtf8(const char16_t *src, size_t length, size_t i,
+                         char *&out) {
+  uint32_t c = src[i];
+  if (c < 0x80) {
+    *out++ = static_cast<char>(c);
+    return i + 1;
+  }
+  if (c < 0x800) {
+    *out++ = static_cast<char>(0xc0 | (c >> 6));
+    *out++ = static_cast<char>(0x80 | (c & 0x3f));
+    return i + 1;
+  }
+  if (IsHighSurrogate(c) && i + 1 < length && IsLowSurrogate(src[i + 1])) {
+    c = 0x10000 + ((c - 0xd800) << 10) + (src[i + 1] - 0xdc00);
+    *out++ = static_cast<char>(0xf0 | (c >> 18));
+    *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+    *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+    *out++ = static_cast<char>(0x80 | (c & 0x3f));
+    return i + 2;
+  }
+  if (IsSurrogate(c)) {
+    c = 0xfffd;
+  }
+  *out++ = static_cast<char>(0xe0 | (c >> 12));
+  *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+  *out++ = static_cast<char>(0x80 | (c & 0x3f));
+  return i + 1;
+}
+
+size_t Utf16LengthScalar(const char16_t *str) {
+  const char16_t *end = str;
+  while (*end) {
+    ++end;
+  }
+  return end - str;
+}
+
+bool Utf16ValidateScalar(const char16_t *str, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    if (IsHighSurrogate(str[i]) && i + 1 < length &&
+        IsLowSurrogate(str[i + 1])) {
+      ++i;
+    } else if (IsSurrogate(str[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t Utf16CopyStringScalar(char16_t *dst, size_t capacity,
+                             const char16_t *src) {
+  if (!capacity) {
+    return 0;
+  }
+  size_t i = 0;
+  for (; i + 1 < capacity && src[i]; ++i) {
+    dst[i] = src[i];
+  }
+  dst[i] = 0;
+  return i;
+}
+
+size_t Utf16ToUtf8Scalar(const char16_t *src, size_t length, char *dst) {
+  char *out = dst;
+  for (size_t i = 0; i < length;) {
+    i = EncodeUtf8(src, length, i, out);
+  }
+  return out - dst;
+}
+
+// Blocks of 8 characters.  A lane mask has kBitsPerLane bits set for each
+// lane that matches.
+#if defined(UTF16_SSE2)
+#define UTF16_SIMD
+using Block = __m128i;
+constexpr int kBitsPerLane = 2;
+
+UTF16_NO_SANITIZE static Block LoadAligned(const char16_t *p) {
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(p));
+}
+static Block Load(const char16_t *p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+static void Store(char16_t *p, Block block) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p), block);
+}
+static uint64_t ZeroMask(Block block) {
+  return static_cast<uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi16(block, _mm_setzero_si128())));
+}
+static bool AnySurrogate(Block block) {
+  Block masked = _mm_and_si128(block, _mm_set1_epi16(-0x800)); // 0xf800
+  return _mm_movemask_epi8(
+             _mm_cmpeq_epi16(masked, _mm_set1_epi16(-0x2800))) != 0; // 0xd800
+}
+static bool AllAscii(Block block) {
+  Block masked = _mm_and_si128(block, _mm_set1_epi16(-0x80)); // 0xff80
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(masked, _mm_setzero_si128())) ==
+         0xffff;
+}
+// The low bytes of the lanes, which must all be ASCII
+static void StoreNarrow(char *p, Block block) {
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(p),
+                   _mm_packus_epi16(block, block));
+}
+#elif defined(UTF16_NEON)
+#define UTF16_SIMD
+using Block = uint16x8_t;
+constexpr int kBitsPerLane = 8;
+
+UTF16_NO_SANITIZE static Block LoadAligned(const char16_t *p) {
+  return vld1q_u16(reinterpret_cast<const uint16_t *>(p));
+}
+static Block Load(const char16_t *p) {
+  return vld1q_u16(reinterpret_cast<const uint16_t *>(p));
+}
+static void Store(char16_t *p, Block block) {
+  vst1q_u16(reinterpret_cast<uint16_t *>(p), block);
+}
+static uint64_t ZeroMask(Block block) {
+  uint8x8_t narrowed = vshrn_n_u16(vceqq_u16(block, vdupq_n_u16(0)), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+static bool AnySurrogate(Block block) {
+  Block masked = vandq_u16(block, vdupq_n_u16(0xf800));
+  return vmaxvq_u16(vceqq_u16(masked, vdupq_n_u16(0xd800))) != 0;
+}
+static bool AllAscii(Block block) { return vmaxvq_u16(block) < 0x80; }
+static void StoreNarrow(char *p, Block block) {
+  vst1_u8(reinterpret_cast<uint8_t *>(p), vmovn_u16(block));
+}
+#endif
+
+#ifdef UTF16_SIMD
+constexpr size_t kLanes = 8;
+constexpr uintptr_t kBlockMask = sizeof(Block) - 1;
+
+static int TrailingZeros(uint64_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  if (static_cast<uint32_t>(mask)) {
+    _BitScanForward(&index, static_cast<uint32_t>(mask));
+    return index;
+  }
+  _BitScanForward(&index, static_cast<uint32_t>(mask >> 32));
+  return 32 + index;
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+static size_t FirstLane(uint64_t mask) {
+  return TrailingZeros(mask) / kBitsPerLane;
+}
+
+// The aligned block that `p` is in
+static const char16_t *BlockOf(const char16_t *p) {
+  return reinterpret_cast<const char16_t *>(reinterpret_cast<uintptr_t>(p) &
+                                            ~kBlockMask);
+}
+
+static bool Misaligned(const char16_t *p) {
+  return reinterpret_cast<uintptr_t>(p) % sizeof(char16_t) != 0;
+}
+#endif
+
+UTF16_NO_SANITIZE size_t Utf16Length(const char16_t *str) {
+#ifdef UTF16_SIMD
+  if (Misaligned(str)) {
+    return Utf16LengthScalar(str);
+  }
+  // The lanes of the first block before the string are shifted out
+  const char16_t *block = BlockOf(str);
+  uint64_t mask =
+      ZeroMask(LoadAligned(block)) >> ((str - block) * kBitsPerLane);
+  if (mask) {
+    return FirstLane(mask);
+  }
+  for (block += kLanes;; block += kLanes) {
+    if ((mask = ZeroMask(LoadAligned(block)))) {
+      return (block - str) + FirstLane(mask);
+    }
+  }
+#else
+  return Utf16LengthScalar(str);
+#endif
+}
+
+UTF16_NO_SANITIZE size_t Utf16LengthBounded(const char16_t *str,
+                                            size_t maxLength) {
+  if (!maxLength) {
+    return 0;
+  }
+#ifdef UTF16_SIMD
+  if (!Misaligned(str)) {
+    // Only blocks that start within the bound are read
+    const char16_t *block = BlockOf(str);
+    uint64_t mask =
+        ZeroMask(LoadAligned(block)) >> ((str - block) * kBitsPerLane);
+    if (mask) {
+      return std::min(FirstLane(mask), maxLength);
+    }
+    for (block += kLanes; static_cast<size_t>(block - str) < maxLength;
+         block += kLanes) {
+      if ((mask = ZeroMask(LoadAligned(block)))) {
+        return std::min((block - str) + FirstLane(mask), maxLength);
+      }
+    }
+    return maxLength;
+  }
+#endif
+  size_t length = 0;
+  while (length < maxLength && str[length]) {
+    ++length;
+  }
+  return length;
+}
+
+bool Utf16Validate(const char16_t *str, size_t length) {
+#ifdef UTF16_SIMD
+  size_t i = 0;
+  while (i + kLanes <= length) {
+    if (!AnySurrogate(Load(str + i))) {
+      i += kLanes;
+      continue;
+    }
+    // A pair may straddle the end of the block, so the scalar check carries
+    // on to its low half
+    size_t end = i + kLanes;
+    for (; i < end; ++i) {
+      if (IsHighSurrogate(str[i]) && i + 1 < length &&
+          IsLowSurrogate(str[i + 1])) {
+        ++i;
+      } else if (IsSurrogate(str[i])) {
+        return false;
+      }
+    }
+  }
+  return Utf16ValidateScalar(str + i, length - i);
+#else
+  return Utf16ValidateScalar(str, length);
+#endif
+}
+
+UTF16_NO_SANITIZE size_t Utf16CopyString(char16_t *dst, size_t capacity,
+                                         const char16_t *src) {
+#ifdef UTF16_SIMD
+  if (!capacity) {
+    return 0;
+  }
+  if (Misaligned(src)) {
+    return Utf16CopyStringScalar(dst, capacity, src);
+  }
+  // Up to the first aligned block of the source, then a block at a time
+  // while the block has no terminator and fits with room for one
+  size_t i = 0;
+  for (; (reinterpret_cast<uintptr_t>(src + i) & kBlockMask) != 0; ++i) {
+    if (i + 1 == capacity || !src[i]) {
+      dst[i] = 0;
+      return i;
+    }
+    dst[i] = src[i];
+  }
+  for (; i + kLanes < capacity; i += kLanes) {
+    Block block = LoadAligned(src + i);
+    if (ZeroMask(block)) {
+      break;
+    }
+    Store(dst + i, block);
+  }
+  for (; i + 1 < capacity && src[i]; ++i) {
+    dst[i] = src[i];
+  }
+  dst[i] = 0;
+  return i;
+#else
+  return Utf16CopyStringScalar(dst, capacity, src);
+#endif
+}
+
+size_t Utf16ToUtf8(const char16_t *src, size_t length, char *dst) {
+#ifdef UTF16_SIMD
+  char *out = dst;
+  size_t i = 0;
+  while (i + kLanes <= length) {
+    Block block = Load(src + i);
+    if (AllAscii(block)) {
+      StoreNarrow(out, block);
+      out += kLanes;
+      i += kLanes;
+      continue;
+    }
+    // Past the end of the block if it ends with a pair
+    for (size_t end = i + kLanes; i < end;) {
+      i = EncodeUtf8(src, length, i, out);
+    }
+  }
+  return (out - dst) + Utf16ToUtf8Scalar(src + i, length - i, out);
+#else
+  return Utf16ToUtf8Scalar(src, length, dst);
+#endif
+}
+
+void AppendUtf8(std::string &out, const char16_t *str, size_t length) {
+  size_t start = out.size();
+  out.resize(start + length * kMaxUtf8PerUtf16);
+  out.resize(start + Utf16ToUtf8(str, length, &out[start]));
+}
+
+void AppendUtf8(std::string &out, const wchar_t *str, size_t length) {
+  if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+    AppendUtf8(out, reinterpret_cast<const char16_t *>(str), length);
+    return;
+  }
+
+  // A UTF-32 character takes at most 4 bytes of UTF-8
+  size_t start = out.size();
+  out.resize(start + length * 4);
+  char *dst = &out[start];
+  for (size_t i = 0; i < length; ++i) {
+    uint32_t c = static_cast<uint32_t>(str[i]);
+    if (c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) {
+      c = 0xfffd;
+    }
+    if (c < 0x80) {
+      *dst++ = static_cast<char>(c);
+    } else if (c < 0x800) {
+      *dst++ = static_cast<char>(0xc0 | (c >> 6));
+      *dst++ = static_cast<char>(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      *dst++ = static_cast<char>(0xe0 | (c >> 12));
+      *dst++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      *dst++ = static_cast<char>(0x80 | (c & 0x3f));
+    } else {
+      *dst++ = static_cast<char>(0xf0 | (c >> 18));
+      *dst++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+      *dst++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      *dst++ = static_cast<char>(0x80 | (c & 0x3f));
+    }
+  }
+  out.resize(dst - out.data());
+}
+
+#ifdef _WIN32
+static_assert(sizeof(wchar_t) == sizeof(char16_t),
+              "BSTR is made of 16-bit characters");
+
+Utf16Bstr Utf16BstrAlloc(const char16_t *chars, uint32_t length) {
+  return reinterpret_cast<Utf16Bstr>(
+      ::SysAllocStringLen(reinterpret_cast<const OLECHAR *>(chars), length));
+}
+
+void Utf16BstrFree(Utf16Bstr str) {
+  ::SysFreeString(reinterpret_cast<BSTR>(str));
+}
+
+uint32_t Utf16BstrLength(const char16_t *str) {
+  return ::SysStringLen(
+      reinterpret_cast<BSTR>(const_cast<char16_t *>(str)));
+}
+#else
+// The same layout as a BSTR: the length in bytes, then the characters and a
+// terminator
+Utf16Bstr Utf16BstrAlloc(const char16_t *chars, uint32_t length) {
+  if (length > (UINT32_MAX - sizeof(uint32_t)) / sizeof(char16_t) - 1) {
+    return nullptr;
+  }
+  auto *prefix = static_cast<uint32_t *>(
+      std::malloc(sizeof(uint32_t) + (length + 1) * sizeof(char16_t)));
+  if (!prefix) {
+    return nullptr;
+  }
+  *prefix = length * sizeof(char16_t);
+  auto str = reinterpret_cast<Utf16Bstr>(prefix + 1);
+  if (chars) {
+    std::memcpy(str, chars, length * sizeof(char16_t));
+  }
+  str[length] = 0;
+  return str;
+}
+
+void Utf16BstrFree(Utf16Bstr str) {
+  if (str) {
+    std::free(reinterpret_cast<uint32_t *>(str) - 1);
+  }
+}
+
+uint32_t Utf16BstrLength(const char16_t *str) {
+  return str ? reinterpret_cast<const uint32_t *>(str)[-1] / sizeof(char16_t)
+             : 0;
+}
+#endif
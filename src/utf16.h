@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <string>
+
+// UTF-16 strings that work the same on every platform.  wchar_t is UTF-16 on
+// Windows but UTF-32 on Linux, so these take char16_t, and WideLength and
+// the other wchar_t helpers below only use them where wchar_t is UTF-16.
+//
+// Length, validation, copy and transcoding to UTF-8 process 8 characters at
+// a time with SSE2 on x86 and x64 and NEON on ARM64, and fall back to the
+// *Scalar versions elsewhere.  The scalar versions are exported as the
+// reference for tests and benchmarks.  Scanning for a terminator reads whole
+// aligned blocks, which may extend past the terminator but never into the
+// next page.
+
+// Characters before the terminator
+size_t Utf16Length(const char16_t *str);
+size_t Utf16LengthScalar(const char16_t *str);
+
+// Like Utf16Length, but stops at `maxLength`, so `str` needn't be terminated
+size_t Utf16LengthBounded(const char16_t *str, size_t maxLength);
+
+// True if every surrogate in `length` characters is part of a pair
+bool Utf16Validate(const char16_t *str, size_t length);
+bool Utf16ValidateScalar(const char16_t *str, size_t length);
+
+// Copies `src` with its terminator into `dst`, which holds `capacity`
+// characters, in a single pass.  A longer string is truncated.  Returns the
+// length copied, without the terminator.
+size_t Utf16CopyString(char16_t *dst, size_t capacity, const char16_t *src);
+size_t Utf16CopyStringScalar(char16_t *dst, size_t capacity,
+                             const char16_t *src);
+
+// A UTF-16 character takes at most 3 bytes of UTF-8, and a surrogate pair 4
+constexpr size_t kMaxUtf8PerUtf16 = 3;
+
+// Writes the UTF-8 of `length` characters to `dst`, which has room for
+// kMaxUtf8PerUtf16 * length bytes, and returns the bytes written.  Unpaired
+// surrogates become U+FFFD, so the output is always valid.
+size_t Utf16ToUtf8(const char16_t *src, size_t length, char *dst);
+size_t Utf16ToUtf8Scalar(const char16_t *src, size_t length, char *dst);
+
+void AppendUtf8(std::string &out, const char16_t *src, size_t length);
+// The same for wchar_t, which is UTF-16 on Windows and UTF-32 elsewhere.
+// Code points that aren't Unicode scalar values become U+FFFD.
+void AppendUtf8(std::string &out, const wchar_t *src, size_t length);
+
+// Strings laid out like BSTR: a 32-bit byte count, then the characters and a
+// terminator.  The pointer is to the characters, so one passes for a
+// terminated string, but may also contain nulls.  On Windows they're real
+// BSTRs from SysAllocStringLen, and elsewhere they're allocated the same way
+// on the heap.
+using Utf16Bstr = char16_t *;
+
+// Copies `length` characters, or leaves them uninitialized if `chars` is null
+Utf16Bstr Utf16BstrAlloc(const char16_t *chars, uint32_t length);
+void Utf16BstrFree(Utf16Bstr str);
+// Zero for null, like SysStringLen
+uint32_t Utf16BstrLength(const char16_t *str);
+
+// wcslen through Utf16Length where wchar_t is UTF-16
+inline size_t WideLength(const wchar_t *str) {
+  if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+    return Utf16Length(reinterpret_cast<const char16_t *>(str));
+  } else {
+    return wcslen(str);
+  }
+}
+
+inline size_t WideLengthBounded(const wchar_t *str, size_t maxLength) {
+  if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+    return Utf16LengthBounded(reinterpret_cast<const char16_t *>(str),
+                              maxLength);
+  } else {
+    return wcsnlen(str, maxLength);
+  }
+}
@@ -0,0 +1,87 @@
+#include "waitengine.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+void CpuRelax() {
+#if defined(_WIN32)
+  ::YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Sleeps while `*address` is `value`, for up to `timeoutMs`.  May return
+// early for no reason, like the system calls behind it.
+static void FutexWait(std::atomic<uint32_t> *address, uint32_t value,
+                      uint32_t timeoutMs) {
+#ifdef _WIN32
+  ::WaitOnAddress(address, &value, sizeof(value),
+                  timeoutMs == Doorbell::kInfinite ? INFINITE : timeoutMs);
+#else
+  timespec timeout = {static_cast<time_t>(timeoutMs / 1000),
+                      static_cast<long>(timeoutMs % 1000) * 1000000};
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(address),
+            FUTEX_WAIT_PRIVATE, value,
+            timeoutMs == Doorbell::kInfinite ? nullptr : &timeout, nullptr, 0);
+#endif
+}
+
+static void FutexWakeOne(std::atomic<uint32_t> *address) {
+#ifdef _WIN32
+  ::WakeByAddressSingle(address);
+#else
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(address),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+void Doorbell::Ring() {
+  if (mState.exchange(kRung, std::memory_order_acq_rel) == kSleeping) {
+    FutexWakeOne(&mState);
+  }
+}
+
+bool Doorbell::Wait(uint32_t timeoutMs) {
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(timeoutMs);
+  for (;;) {
+    uint32_t state = kRung;
+    if (mState.compare_exchange_strong(state, kIdle,
+                                       std::memory_order_acquire)) {
+      return true;
+    }
+
+    uint32_t remainingMs = kInfinite;
+    if (timeoutMs != kInfinite) {
+      auto remaining = deadline - std::chrono::steady_clock::now();
+      if (remaining <= remaining.zero()) {
+        // Back to idle, unless a ring came in meanwhile, which is taken
+        state = kSleeping;
+        mState.compare_exchange_strong(state, kIdle,
+                                       std::memory_order_relaxed);
+        state = kRung;
+        return mState.compare_exchange_strong(state, kIdle,
+                                              std::memory_order_acquire);
+      }
+      remainingMs = static_cast<uint32_t>(
+          std::chrono::ceil<std::chrono::milliseconds>(remaining).count());
+    }
+
+    if (state == kIdle &&
+        !mState.compare_exchange_strong(state, kSleeping,
+                                        std::memory_order_relaxed)) {
+      continue; // Rung just now
+    }
+    FutexWait(&mState, kSleeping, remainingMs);
+  }
+}
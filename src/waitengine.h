@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Waiting without paying for a kernel transition on every wakeup.  A thread
+// that runs out of work spins for a while before it blocks, as long as
+// spinning has been finding work, and drains everything there is after each
+// wakeup.  ThreadMsgWaitForSingleObject does this around its window
+// messages, and WaitEngine for a thread that waits for nothing else.
+// Nothing here depends on Windows except the futex behind Doorbell, which is
+// WaitOnAddress there.
+
+// Hint to the processor that the thread is spinning
+void CpuRelax();
+
+// Counters of one waiting thread.  Only that thread updates them, so they
+// need no atomic read-modify-write, and any thread may read them.
+struct WaitCounters {
+  std::atomic<uint64_t> mWakes;      // Returns from blocking
+  std::atomic<uint64_t> mSpinWakes;  // Work found by spinning instead
+  std::atomic<uint64_t> mDispatched; // Units of work run
+  std::atomic<uint64_t> mIdleNs;     // Time spent blocked
+
+  WaitCounters() : mWakes(0), mSpinWakes(0), mDispatched(0), mIdleNs(0) {}
+
+  static void Add(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+};
+
+// Decides how long an idle thread spins before it blocks.  The budget moves
+// toward twice the spins it took to find work, and halves every time it
+// runs out, so it settles where spinning pays off and shrinks to the minimum
+// when work comes too far apart.  A maximum of zero never spins.
+class AdaptiveSpinner {
+  uint32_t mMaxSpins;
+  uint32_t mBudget;
+
+public:
+  static constexpr uint32_t kMinSpins = 64;
+  static constexpr uint32_t kDefaultMaxSpins = 1 << 14;
+
+  explicit AdaptiveSpinner(uint32_t maxSpins = kDefaultMaxSpins)
+      : mMaxSpins(maxSpins),
+        mBudget(maxSpins < kMinSpins ? maxSpins : kMinSpins) {}
+
+  uint32_t Budget() const { return mBudget; }
+
+  // Spins until `ready` returns true or the budget runs out.  Returns
+  // whether `ready` did.
+  template <typename F> bool SpinUntil(F ready) {
+    for (uint32_t i = 0; i < mBudget; ++i) {
+      if (ready()) {
+        Found(i);
+        return true;
+      }
+      CpuRelax();
+    }
+    RanOut();
+    return false;
+  }
+
+private:
+  void Found(uint32_t spins) {
+    int64_t target = int64_t(spins) * 2;
+    target = target < kMinSpins ? kMinSpins : target;
+    target = target > mMaxSpins ? mMaxSpins : target;
+    mBudget = static_cast<uint32_t>(mBudget + (target - int64_t(mBudget)) / 8);
+  }
+
+  void RanOut() {
+    const uint32_t floor = mMaxSpins < kMinSpins ? mMaxSpins : kMinSpins;
+    mBudget = mBudget / 2 > floor ? mBudget / 2 : floor;
+  }
+};
+
+// Wakes one waiting thread, like an auto-reset event, on a futex.  Ringing
+// costs a system call only when the waiter is asleep, and a ring while
+// nobody waits is kept for the next Wait.  Any thread may ring, but only one
+// may wait.
+class Doorbell {
+  enum : uint32_t { kIdle, kRung, kSleeping };
+  std::atomic<uint32_t> mState;
+
+public:
+  static constexpr uint32_t kInfinite = UINT32_MAX;
+
+  Doorbell() : mState(kIdle) {}
+
+  Doorbell(const Doorbell &) = delete;
+  Doorbell &operator=(const Doorbell &) = delete;
+
+  void Ring();
+
+  // True if a ring is waiting to be taken.  Doesn't take it.
+  bool Rung() const { return mState.load(std::memory_order_acquire) == kRung; }
+
+  // Takes a ring, waiting for up to `timeoutMs` for one.  False on timeout.
+  bool Wait(uint32_t timeoutMs = kInfinite);
+};
+
+// Runs the work that other threads make available, and waits for more in
+// between.  Producers make their work visible to `drain`, or change what
+// `done` returns, and then call Wake.
+class WaitEngine {
+  Doorbell mDoorbell;
+  AdaptiveSpinner mSpinner;
+  WaitCounters mCounters;
+
+public:
+  explicit WaitEngine(uint32_t maxSpins = AdaptiveSpinner::kDefaultMaxSpins)
+      : mSpinner(maxSpins) {}
+
+  WaitEngine(const WaitEngine &) = delete;
+  WaitEngine &operator=(const WaitEngine &) = delete;
+
+  void Wake() { mDoorbell.Ring(); }
+
+  const WaitCounters &Counters() const { return mCounters; }
+  uint32_t SpinBudget() const { return mSpinner.Budget(); }
+
+  // Calls `drain`, which runs whatever work there is and returns how much it
+  // ran, until `done` returns true.  Must be called from one thread at a
+  // time.
+  template <typename Drain, typename Done> void Run(Drain drain, Done done) {
+    while (!done()) {
+      size_t dispatched = drain();
+      if (dispatched) {
+        WaitCounters::Add(mCounters.mDispatched, dispatched);
+        continue;
+      }
+      if (mSpinner.SpinUntil([this]() { return mDoorbell.Rung(); })) {
+        WaitCounters::Add(mCounters.mSpinWakes, 1);
+        mDoorbell.Wait(0);
+        continue;
+      }
+      auto start = std::chrono::steady_clock::now();
+      mDoorbell.Wait();
+      WaitCounters::Add(mCounters.mWakes, 1);
+      WaitCounters::Add(
+          mCounters.mIdleNs,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count());
+    }
+  }
+};